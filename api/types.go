@@ -77,6 +77,14 @@ type GenerateRequest struct {
 	// request, for multimodal models.
 	Images []ImageData `json:"images,omitempty"`
 
+	// Logprobs specifies whether to return the log-probability of each
+	// generated token.
+	Logprobs bool `json:"logprobs,omitempty"`
+
+	// TopLogprobs is the number of most likely tokens to return, with their
+	// log-probabilities, at each position of the response. Requires Logprobs.
+	TopLogprobs int `json:"top_logprobs,omitempty"`
+
 	// Options lists model-specific options. For example, temperature can be
 	// set through this field, if the model supports it.
 	Options map[string]interface{} `json:"options"`
@@ -103,6 +111,10 @@ type ChatRequest struct {
 	// Tools is an optional list of tools the model has access to.
 	Tools `json:"tools,omitempty"`
 
+	// Logprobs and TopLogprobs are the same as in [GenerateRequest].
+	Logprobs    bool `json:"logprobs,omitempty"`
+	TopLogprobs int  `json:"top_logprobs,omitempty"`
+
 	// Options lists model-specific options.
 	Options map[string]interface{} `json:"options"`
 }
@@ -190,11 +202,33 @@ type ChatResponse struct {
 	Message    Message   `json:"message"`
 	DoneReason string    `json:"done_reason,omitempty"`
 
+	// Logprobs holds the log-probabilities of the tokens of this part of the
+	// message, if requested.
+	Logprobs []Logprob `json:"logprobs,omitempty"`
+
 	Done bool `json:"done"`
 
 	Metrics
 }
 
+// Logprob is the log-probability of a generated token, with the most likely
+// tokens at its position if they were requested.
+type Logprob struct {
+	TokenLogprob
+	TopLogprobs []TokenLogprob `json:"top_logprobs,omitempty"`
+}
+
+// TokenLogprob is the log-probability of a token under the model, before
+// sampling options such as the temperature are applied.
+type TokenLogprob struct {
+	Token   string  `json:"token"`
+	Logprob float64 `json:"logprob"`
+
+	// Bytes is the UTF-8 encoding of the token. A token that holds only part
+	// of a character has its invalid bytes replaced in Token, but not here.
+	Bytes []int `json:"bytes,omitempty"`
+}
+
 type Metrics struct {
 	TotalDuration      time.Duration `json:"total_duration,omitempty"`
 	LoadDuration       time.Duration `json:"load_duration,omitempty"`
@@ -449,6 +483,10 @@ type GenerateResponse struct {
 	// can be sent in the next request to keep a conversational memory.
 	Context []int `json:"context,omitempty"`
 
+	// Logprobs holds the log-probabilities of the tokens of Response, if
+	// requested.
+	Logprobs []Logprob `json:"logprobs,omitempty"`
+
 	Metrics
 }
 
@@ -133,6 +133,19 @@ func LoadTimeout() (loadTimeout time.Duration) {
 	return loadTimeout
 }
 
+// NumaStrategy returns how the CPU backend places threads and weights on NUMA nodes. NumaStrategy can be configured via the OLLAMA_NUMA environment variable.
+// Unknown strategies are ignored.
+func NumaStrategy() string {
+	s := Var("OLLAMA_NUMA")
+	switch s {
+	case "", "distribute", "isolate", "numactl", "interleave":
+		return s
+	}
+
+	slog.Warn("invalid environment variable, ignoring", "key", "OLLAMA_NUMA", "value", s)
+	return ""
+}
+
 func Bool(k string) func() bool {
 	return func() bool {
 		if s := Var(k); s != "" {
@@ -165,6 +178,10 @@ var (
 	IntelGPU = Bool("OLLAMA_INTEL_GPU")
 	// MultiUserCache optimizes prompt caching for multi-user scenarios
 	MultiUserCache = Bool("OLLAMA_MULTIUSER_CACHE")
+	// PrefixCache is the directory in which the K/V cache of evicted prompt prefixes is stored.
+	PrefixCache = String("OLLAMA_PREFIX_CACHE")
+	// DirectIO reads model weights past the page cache when they are not memory-mapped.
+	DirectIO = Bool("OLLAMA_DIRECT_IO")
 )
 
 func String(s string) func() string {
@@ -207,6 +224,10 @@ var (
 	MaxQueue = Uint("OLLAMA_MAX_QUEUE", 512)
 	// MaxVRAM sets a maximum VRAM override in bytes. MaxVRAM can be configured via the OLLAMA_MAX_VRAM environment variable.
 	MaxVRAM = Uint("OLLAMA_MAX_VRAM", 0)
+	// KvCacheBlockSize enables a K/V cache shared between parallel requests, allocated in blocks of this many cells.
+	KvCacheBlockSize = Uint("OLLAMA_KV_CACHE_BLOCK_SIZE", 0)
+	// LoadThreads sets the number of threads that read the weights of a model while it loads, 0 for up to 8.
+	LoadThreads = Uint("OLLAMA_LOAD_THREADS", 0)
 )
 
 func Uint64(key string, defaultValue uint64) func() uint64 {
@@ -226,6 +247,13 @@ func Uint64(key string, defaultValue uint64) func() uint64 {
 // Set aside VRAM per GPU
 var GpuOverhead = Uint64("OLLAMA_GPU_OVERHEAD", 0)
 
+// PrefixCacheSize limits the disk space used by the prompt prefixes of each model (bytes).
+var PrefixCacheSize = Uint64("OLLAMA_PREFIX_CACHE_SIZE", 10<<30)
+
+// LayerCacheSize limits the memory used by the layers of a model that runs on the CPU (bytes). The layers are read
+// from the model file on demand, so models larger than the system memory can run, slowly.
+var LayerCacheSize = Uint64("OLLAMA_LAYER_CACHE_SIZE", 0)
+
 type EnvVar struct {
 	Name        string
 	Value       any
@@ -234,23 +262,30 @@ type EnvVar struct {
 
 func AsMap() map[string]EnvVar {
 	ret := map[string]EnvVar{
-		"OLLAMA_DEBUG":             {"OLLAMA_DEBUG", Debug(), "Show additional debug information (e.g. OLLAMA_DEBUG=1)"},
-		"OLLAMA_FLASH_ATTENTION":   {"OLLAMA_FLASH_ATTENTION", FlashAttention(), "Enabled flash attention"},
-		"OLLAMA_KV_CACHE_TYPE":     {"OLLAMA_KV_CACHE_TYPE", KvCacheType(), "Quantization type for the K/V cache (default: f16)"},
-		"OLLAMA_GPU_OVERHEAD":      {"OLLAMA_GPU_OVERHEAD", GpuOverhead(), "Reserve a portion of VRAM per GPU (bytes)"},
-		"OLLAMA_HOST":              {"OLLAMA_HOST", Host(), "IP Address for the ollama server (default 127.0.0.1:11434)"},
-		"OLLAMA_KEEP_ALIVE":        {"OLLAMA_KEEP_ALIVE", KeepAlive(), "The duration that models stay loaded in memory (default \"5m\")"},
-		"OLLAMA_LLM_LIBRARY":       {"OLLAMA_LLM_LIBRARY", LLMLibrary(), "Set LLM library to bypass autodetection"},
-		"OLLAMA_LOAD_TIMEOUT":      {"OLLAMA_LOAD_TIMEOUT", LoadTimeout(), "How long to allow model loads to stall before giving up (default \"5m\")"},
-		"OLLAMA_MAX_LOADED_MODELS": {"OLLAMA_MAX_LOADED_MODELS", MaxRunners(), "Maximum number of loaded models per GPU"},
-		"OLLAMA_MAX_QUEUE":         {"OLLAMA_MAX_QUEUE", MaxQueue(), "Maximum number of queued requests"},
-		"OLLAMA_MODELS":            {"OLLAMA_MODELS", Models(), "The path to the models directory"},
-		"OLLAMA_NOHISTORY":         {"OLLAMA_NOHISTORY", NoHistory(), "Do not preserve readline history"},
-		"OLLAMA_NOPRUNE":           {"OLLAMA_NOPRUNE", NoPrune(), "Do not prune model blobs on startup"},
-		"OLLAMA_NUM_PARALLEL":      {"OLLAMA_NUM_PARALLEL", NumParallel(), "Maximum number of parallel requests"},
-		"OLLAMA_ORIGINS":           {"OLLAMA_ORIGINS", Origins(), "A comma separated list of allowed origins"},
-		"OLLAMA_SCHED_SPREAD":      {"OLLAMA_SCHED_SPREAD", SchedSpread(), "Always schedule model across all GPUs"},
-		"OLLAMA_MULTIUSER_CACHE":   {"OLLAMA_MULTIUSER_CACHE", MultiUserCache(), "Optimize prompt caching for multi-user scenarios"},
+		"OLLAMA_DEBUG":               {"OLLAMA_DEBUG", Debug(), "Show additional debug information (e.g. OLLAMA_DEBUG=1)"},
+		"OLLAMA_FLASH_ATTENTION":     {"OLLAMA_FLASH_ATTENTION", FlashAttention(), "Enabled flash attention"},
+		"OLLAMA_KV_CACHE_TYPE":       {"OLLAMA_KV_CACHE_TYPE", KvCacheType(), "Quantization type for the K/V cache (default: f16)"},
+		"OLLAMA_KV_CACHE_BLOCK_SIZE": {"OLLAMA_KV_CACHE_BLOCK_SIZE", KvCacheBlockSize(), "Share the K/V cache between parallel requests in blocks of this many cells (default: 0, disabled)"},
+		"OLLAMA_GPU_OVERHEAD":        {"OLLAMA_GPU_OVERHEAD", GpuOverhead(), "Reserve a portion of VRAM per GPU (bytes)"},
+		"OLLAMA_HOST":                {"OLLAMA_HOST", Host(), "IP Address for the ollama server (default 127.0.0.1:11434)"},
+		"OLLAMA_KEEP_ALIVE":          {"OLLAMA_KEEP_ALIVE", KeepAlive(), "The duration that models stay loaded in memory (default \"5m\")"},
+		"OLLAMA_LLM_LIBRARY":         {"OLLAMA_LLM_LIBRARY", LLMLibrary(), "Set LLM library to bypass autodetection"},
+		"OLLAMA_LOAD_TIMEOUT":        {"OLLAMA_LOAD_TIMEOUT", LoadTimeout(), "How long to allow model loads to stall before giving up (default \"5m\")"},
+		"OLLAMA_MAX_LOADED_MODELS":   {"OLLAMA_MAX_LOADED_MODELS", MaxRunners(), "Maximum number of loaded models per GPU"},
+		"OLLAMA_MAX_QUEUE":           {"OLLAMA_MAX_QUEUE", MaxQueue(), "Maximum number of queued requests"},
+		"OLLAMA_MODELS":              {"OLLAMA_MODELS", Models(), "The path to the models directory"},
+		"OLLAMA_NOHISTORY":           {"OLLAMA_NOHISTORY", NoHistory(), "Do not preserve readline history"},
+		"OLLAMA_NOPRUNE":             {"OLLAMA_NOPRUNE", NoPrune(), "Do not prune model blobs on startup"},
+		"OLLAMA_NUM_PARALLEL":        {"OLLAMA_NUM_PARALLEL", NumParallel(), "Maximum number of parallel requests"},
+		"OLLAMA_NUMA":                {"OLLAMA_NUMA", NumaStrategy(), "NUMA strategy for CPU inference: distribute, isolate, numactl or interleave"},
+		"OLLAMA_ORIGINS":             {"OLLAMA_ORIGINS", Origins(), "A comma separated list of allowed origins"},
+		"OLLAMA_PREFIX_CACHE":        {"OLLAMA_PREFIX_CACHE", PrefixCache(), "Directory to keep the K/V cache of long prompt prefixes in (default: disabled)"},
+		"OLLAMA_PREFIX_CACHE_SIZE":   {"OLLAMA_PREFIX_CACHE_SIZE", PrefixCacheSize(), "Maximum disk space for the prompt prefixes of each model (bytes, default 10GiB)"},
+		"OLLAMA_LAYER_CACHE_SIZE":    {"OLLAMA_LAYER_CACHE_SIZE", LayerCacheSize(), "Read the layers of models on the CPU on demand, keeping at most this much of them in memory (bytes, default: 0, disabled)"},
+		"OLLAMA_LOAD_THREADS":        {"OLLAMA_LOAD_THREADS", LoadThreads(), "Number of threads to read model weights with (default: 0, up to 8)"},
+		"OLLAMA_DIRECT_IO":           {"OLLAMA_DIRECT_IO", DirectIO(), "Read model weights past the page cache when mmap is disabled"},
+		"OLLAMA_SCHED_SPREAD":        {"OLLAMA_SCHED_SPREAD", SchedSpread(), "Always schedule model across all GPUs"},
+		"OLLAMA_MULTIUSER_CACHE":     {"OLLAMA_MULTIUSER_CACHE", MultiUserCache(), "Optimize prompt caching for multi-user scenarios"},
 
 		// Informational
 		"HTTP_PROXY":  {"HTTP_PROXY", String("HTTP_PROXY")(), "HTTP proxy"},
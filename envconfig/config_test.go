@@ -186,6 +186,28 @@ func TestUint(t *testing.T) {
 	}
 }
 
+func TestNumaStrategy(t *testing.T) {
+	cases := map[string]string{
+		"":           "",
+		"distribute": "distribute",
+		"isolate":    "isolate",
+		"numactl":    "numactl",
+		"interleave": "interleave",
+		// invalid values
+		"Interleave": "",
+		"none":       "",
+	}
+
+	for k, v := range cases {
+		t.Run(k, func(t *testing.T) {
+			t.Setenv("OLLAMA_NUMA", k)
+			if s := NumaStrategy(); s != v {
+				t.Errorf("%s: expected %q, got %q", k, v, s)
+			}
+		})
+	}
+}
+
 func TestKeepAlive(t *testing.T) {
 	cases := map[string]time.Duration{
 		"":       5 * time.Minute,
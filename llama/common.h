@@ -176,6 +176,8 @@ struct common_params_sampling {
 
     std::string grammar; // optional BNF-like grammar to constrain sampling
 
+    const struct llama_sampler * grammar_compiled = nullptr; // optional, cloned instead of parsing grammar
+
     std::vector<llama_logit_bias> logit_bias; // logit biases to apply
 
     // print the parameters into a string
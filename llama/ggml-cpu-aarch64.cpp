@@ -78,6 +78,38 @@ struct block_iq4_nlx4 {
 
 static_assert(sizeof(block_iq4_nlx4) == 4 * sizeof(ggml_half) + QK4_NL * 2, "wrong iq4_nlx4 block size/padding");
 
+// K-quant super-blocks of 8 rows. The quants are interleaved 4 bytes at a time,
+// so that 32 bytes hold 4 consecutive quants of each of the 8 rows.
+// The 6-bit scales and mins of Q4_K and Q5_K are kept as 64 bytes with their
+// low 4 bits, scale in the low nibble, followed by 32 bytes with the high
+// 2 bits of both, entries 0-31 in the low nibble and 32-63 in the high nibble.
+// Entries are ordered by sub-block, then row.
+struct block_q4_Kx8 {
+    ggml_half d[8];        // super-block scales
+    ggml_half dmin[8];     // super-block scales for the mins
+    uint8_t   scales[96];  // scales and mins, quantized with 6 bits
+    uint8_t   qs[QK_K * 4];  // 4-bit quants
+};
+
+struct block_q5_Kx8 {
+    ggml_half d[8];        // super-block scales
+    ggml_half dmin[8];     // super-block scales for the mins
+    uint8_t   scales[96];  // scales and mins, quantized with 6 bits
+    uint8_t   qh[QK_K];    // high bits of the quants, a byte per 8 quants of a row
+    uint8_t   qs[QK_K * 4];  // low 4 bits of the quants
+};
+
+struct block_q6_Kx8 {
+    ggml_half d[8];        // super-block scales
+    int8_t    scales[128]; // 8-bit scales of the 16 sub-blocks
+    uint8_t   ql[QK_K * 4];  // low 4 bits of the quants
+    uint8_t   qh[QK_K * 2];  // high 2 bits of the quants
+};
+
+static_assert(sizeof(block_q4_Kx8) == 8 * sizeof(block_q4_K), "wrong q4_Kx8 block size/padding");
+static_assert(sizeof(block_q5_Kx8) == 8 * sizeof(block_q5_K), "wrong q5_Kx8 block size/padding");
+static_assert(sizeof(block_q6_Kx8) == 8 * sizeof(block_q6_K), "wrong q6_Kx8 block size/padding");
+
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
 #elif defined(_MSC_VER)
@@ -3633,6 +3665,500 @@ static void ggml_gemm_iq4_nl_4x4_q8_0(int n, float * GGML_RESTRICT s, size_t bs,
         }
     }
 }
+// K-quants: a super-block of 8 interleaved rows against rows of block_q8_K.
+// The same kernels compute gemv (nr == 1) and gemm (nr a multiple of 4),
+// in the latter case the weights of a super-block are unpacked once for
+// 4 rows of activations.
+
+#if defined(__AVX2__)
+// unpacks the 6-bit scales and mins of a block_q4_Kx8 or block_q5_Kx8
+static inline void unpack_scales_Kx8(const uint8_t * GGML_RESTRICT scales, uint8_t * GGML_RESTRICT sc, uint8_t * GGML_RESTRICT mn) {
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+    const __m256i m2b = _mm256_set1_epi8(0x03);
+    const __m256i hi  = _mm256_loadu_si256((const __m256i *)(scales + 64));
+
+    for (int i = 0; i < 2; i++) {
+        const __m256i lo = _mm256_loadu_si256((const __m256i *)(scales + 32 * i));
+        const __m256i h  = _mm256_and_si256(i == 0 ? hi : _mm256_srli_epi16(hi, 4), m4b);
+
+        const __m256i s = _mm256_or_si256(_mm256_and_si256(lo, m4b),
+                                          _mm256_slli_epi16(_mm256_and_si256(h, m2b), 4));
+        const __m256i m = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(lo, 4), m4b),
+                                          _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(h, 2), m2b), 4));
+        _mm256_store_si256((__m256i *)(sc + 32 * i), s);
+        _mm256_store_si256((__m256i *)(mn + 32 * i), m);
+    }
+}
+
+// the 8 values at x as pairs of int16, a pair per row
+static inline __m256i load_u8x8_pairs(const uint8_t * x) {
+    const __m128i v = _mm_loadl_epi64((const __m128i *) x);
+    return _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v, v));
+}
+
+static inline __m256i load_i8x8_pairs(const int8_t * x) {
+    const __m128i v = _mm_loadl_epi64((const __m128i *) x);
+    return _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(v, v));
+}
+
+// the 2x8 values at x as pairs of int16, rows of the first and second 8 values
+static inline __m256i load_i8x8x2_pairs(const int8_t * x) {
+    const __m128i v0 = _mm_loadl_epi64((const __m128i *) x);
+    const __m128i v1 = _mm_loadl_epi64((const __m128i *)(x + 8));
+    return _mm256_cvtepi8_epi16(_mm_unpacklo_epi8(v0, v1));
+}
+
+// 4 bytes at x in each 32-bit lane
+static inline __m256i broadcast_x4(const void * x) {
+    int32_t v;
+    memcpy(&v, x, sizeof(v));
+    return _mm256_set1_epi32(v);
+}
+
+// adds the dot products of the groups of 4 unsigned q and signed a, multiplied by
+// the int16 pairs sc
+static inline __m256i mul_add_scaled(const __m256i acc, const __m256i q, const __m256i a, const __m256i sc) {
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(q, a), sc));
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx2(const block_q4_Kx8 & x, const block_q8_K * const * y, __m256 * acc) {
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+
+    alignas(32) uint8_t sc[64];
+    alignas(32) uint8_t mn[64];
+    unpack_scales_Kx8(x.scales, sc, mn);
+
+    __m256i sumi[nrows];
+    __m256i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm256_setzero_si256();
+        summ[i] = _mm256_setzero_si256();
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const __m256i sc_lo = load_u8x8_pairs(sc + 16 * j);
+        const __m256i sc_hi = load_u8x8_pairs(sc + 16 * j + 8);
+        for (int g = 0; g < 8; g++) {
+            const __m256i raw  = _mm256_loadu_si256((const __m256i *)(x.qs + 32 * (8 * j + g)));
+            const __m256i q_lo = _mm256_and_si256(raw, m4b);
+            const __m256i q_hi = _mm256_and_si256(_mm256_srli_epi16(raw, 4), m4b);
+            for (int i = 0; i < nrows; i++) {
+                sumi[i] = mul_add_scaled(sumi[i], q_lo, broadcast_x4(y[i]->qs + 64 * j + 4 * g), sc_lo);
+                sumi[i] = mul_add_scaled(sumi[i], q_hi, broadcast_x4(y[i]->qs + 64 * j + 32 + 4 * g), sc_hi);
+            }
+        }
+    }
+
+    // the mins multiply the sums of the activations of each sub-block
+    for (int k = 0; k < 8; k++) {
+        const __m256i m = load_u8x8_pairs(mn + 8 * k);
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm256_add_epi32(summ[i], _mm256_madd_epi16(m, broadcast_x4(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m256 d    = GGML_F32Cx8_LOAD(x.d);
+    const __m256 dmin = GGML_F32Cx8_LOAD(x.dmin);
+    for (int i = 0; i < nrows; i++) {
+        const __m256 da = _mm256_set1_ps(y[i]->d);
+        acc[i] = _mm256_fmadd_ps(_mm256_mul_ps(d, da), _mm256_cvtepi32_ps(sumi[i]), acc[i]);
+        acc[i] = _mm256_fnmadd_ps(_mm256_mul_ps(dmin, da), _mm256_cvtepi32_ps(summ[i]), acc[i]);
+    }
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx2(const block_q5_Kx8 & x, const block_q8_K * const * y, __m256 * acc) {
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+    const __m256i mh  = _mm256_set1_epi8(0x10);
+
+    alignas(32) uint8_t sc[64];
+    alignas(32) uint8_t mn[64];
+    unpack_scales_Kx8(x.scales, sc, mn);
+
+    __m256i sumi[nrows];
+    __m256i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm256_setzero_si256();
+        summ[i] = _mm256_setzero_si256();
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const __m256i sc_lo = load_u8x8_pairs(sc + 16 * j);
+        const __m256i sc_hi = load_u8x8_pairs(sc + 16 * j + 8);
+        // bit g of each byte is the high bit of the quant in the g-th group of 4
+        __m256i h_lo = _mm256_loadu_si256((const __m256i *)(x.qh + 64 * j));
+        __m256i h_hi = _mm256_loadu_si256((const __m256i *)(x.qh + 64 * j + 32));
+        for (int g = 0; g < 8; g++) {
+            const __m256i raw  = _mm256_loadu_si256((const __m256i *)(x.qs + 32 * (8 * j + g)));
+            const __m256i q_lo = _mm256_or_si256(_mm256_and_si256(raw, m4b),
+                                                 _mm256_and_si256(_mm256_slli_epi16(h_lo, 4), mh));
+            const __m256i q_hi = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(raw, 4), m4b),
+                                                 _mm256_and_si256(_mm256_slli_epi16(h_hi, 4), mh));
+            h_lo = _mm256_srli_epi16(h_lo, 1);
+            h_hi = _mm256_srli_epi16(h_hi, 1);
+            for (int i = 0; i < nrows; i++) {
+                sumi[i] = mul_add_scaled(sumi[i], q_lo, broadcast_x4(y[i]->qs + 64 * j + 4 * g), sc_lo);
+                sumi[i] = mul_add_scaled(sumi[i], q_hi, broadcast_x4(y[i]->qs + 64 * j + 32 + 4 * g), sc_hi);
+            }
+        }
+    }
+
+    for (int k = 0; k < 8; k++) {
+        const __m256i m = load_u8x8_pairs(mn + 8 * k);
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm256_add_epi32(summ[i], _mm256_madd_epi16(m, broadcast_x4(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m256 d    = GGML_F32Cx8_LOAD(x.d);
+    const __m256 dmin = GGML_F32Cx8_LOAD(x.dmin);
+    for (int i = 0; i < nrows; i++) {
+        const __m256 da = _mm256_set1_ps(y[i]->d);
+        acc[i] = _mm256_fmadd_ps(_mm256_mul_ps(d, da), _mm256_cvtepi32_ps(sumi[i]), acc[i]);
+        acc[i] = _mm256_fnmadd_ps(_mm256_mul_ps(dmin, da), _mm256_cvtepi32_ps(summ[i]), acc[i]);
+    }
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx2(const block_q6_Kx8 & x, const block_q8_K * const * y, __m256 * acc) {
+    const __m256i m4b = _mm256_set1_epi8(0x0F);
+    const __m256i mh  = _mm256_set1_epi8(0x30);
+
+    __m256i sumi[nrows];
+    __m256i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm256_setzero_si256();
+        summ[i] = _mm256_setzero_si256();
+    }
+
+    for (int h = 0; h < 2; h++) {
+        for (int k = 0; k < 2; k++) {
+            // the low and high nibbles of both halves of ql are in 4 sub-blocks of 16
+            __m256i sc[4];
+            for (int t = 0; t < 4; t++) {
+                sc[t] = load_i8x8_pairs(x.scales + 8 * (8 * h + 2 * t + k));
+            }
+            for (int g = 4 * k; g < 4 * k + 4; g++) {
+                const __m256i qh    = _mm256_loadu_si256((const __m256i *)(x.qh + 32 * (8 * h + g)));
+                const __m256i raw_0 = _mm256_loadu_si256((const __m256i *)(x.ql + 32 * (16 * h + g)));
+                const __m256i raw_1 = _mm256_loadu_si256((const __m256i *)(x.ql + 32 * (16 * h + 8 + g)));
+
+                const __m256i q_0 = _mm256_or_si256(_mm256_and_si256(raw_0, m4b), _mm256_and_si256(_mm256_slli_epi16(qh, 4), mh));
+                const __m256i q_1 = _mm256_or_si256(_mm256_and_si256(raw_1, m4b), _mm256_and_si256(_mm256_slli_epi16(qh, 2), mh));
+                const __m256i q_2 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(raw_0, 4), m4b), _mm256_and_si256(qh, mh));
+                const __m256i q_3 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(raw_1, 4), m4b), _mm256_and_si256(_mm256_srli_epi16(qh, 2), mh));
+
+                for (int i = 0; i < nrows; i++) {
+                    const int8_t * a = y[i]->qs + 128 * h + 4 * g;
+                    sumi[i] = mul_add_scaled(sumi[i], q_0, broadcast_x4(a),      sc[0]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_1, broadcast_x4(a + 32), sc[1]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_2, broadcast_x4(a + 64), sc[2]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_3, broadcast_x4(a + 96), sc[3]);
+                }
+            }
+        }
+    }
+
+    // the quants are stored with an offset of 32
+    for (int k = 0; k < 8; k++) {
+        const __m256i sc = load_i8x8x2_pairs(x.scales + 16 * k);
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm256_add_epi32(summ[i], _mm256_madd_epi16(sc, broadcast_x4(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m256 d = GGML_F32Cx8_LOAD(x.d);
+    for (int i = 0; i < nrows; i++) {
+        const __m256 da = _mm256_set1_ps(y[i]->d);
+        acc[i] = _mm256_fmadd_ps(_mm256_mul_ps(d, da), _mm256_cvtepi32_ps(_mm256_sub_epi32(sumi[i], _mm256_slli_epi32(summ[i], 5))), acc[i]);
+    }
+}
+
+template <typename BLOC_TYPE, int nrows>
+static void gemm_Kx8_avx2(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int nb = n / QK_K;
+
+    for (int y = 0; y < nr; y += nrows) {
+        const block_q8_K * a_ptr = (const block_q8_K *) vy + (y * nb);
+        for (int x = 0; x < nc / 8; x++) {
+            const BLOC_TYPE * b_ptr = (const BLOC_TYPE *) vx + (x * nb);
+
+            __m256 acc[nrows];
+            for (int i = 0; i < nrows; i++) {
+                acc[i] = _mm256_setzero_ps();
+            }
+            for (int l = 0; l < nb; l++) {
+                const block_q8_K * a_blocks[nrows];
+                for (int i = 0; i < nrows; i++) {
+                    a_blocks[i] = a_ptr + i * nb + l;
+                }
+                dot_Kx8_avx2<nrows>(b_ptr[l], a_blocks, acc);
+            }
+            for (int i = 0; i < nrows; i++) {
+                _mm256_storeu_ps(s + (y + i) * bs + x * 8, acc[i]);
+            }
+        }
+    }
+}
+#endif // defined(__AVX2__)
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+// the 512-bit kernels take the super-blocks of two groups of 8 rows, the first
+// group in the low 256 bits
+
+static inline __m512i load_x2(const void * x0, const void * x1) {
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) x0)),
+                              _mm256_loadu_si256((const __m256i *) x1), 1);
+}
+
+static inline __m512i join_x2(const __m256i x0, const __m256i x1) {
+    return _mm512_inserti64x4(_mm512_castsi256_si512(x0), x1, 1);
+}
+
+static inline __m512i broadcast_x4_512(const void * x) {
+    int32_t v;
+    memcpy(&v, x, sizeof(v));
+    return _mm512_set1_epi32(v);
+}
+
+static inline __m512i mul_add_scaled(const __m512i acc, const __m512i q, const __m512i a, const __m512i sc) {
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(q, a), sc));
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx512(const block_q4_Kx8 & x0, const block_q4_Kx8 & x1, const block_q8_K * const * y, __m512 * acc) {
+    const __m512i m4b = _mm512_set1_epi8(0x0F);
+
+    alignas(32) uint8_t sc[2][64];
+    alignas(32) uint8_t mn[2][64];
+    unpack_scales_Kx8(x0.scales, sc[0], mn[0]);
+    unpack_scales_Kx8(x1.scales, sc[1], mn[1]);
+
+    __m512i sumi[nrows];
+    __m512i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm512_setzero_si512();
+        summ[i] = _mm512_setzero_si512();
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const __m512i sc_lo = join_x2(load_u8x8_pairs(sc[0] + 16 * j),     load_u8x8_pairs(sc[1] + 16 * j));
+        const __m512i sc_hi = join_x2(load_u8x8_pairs(sc[0] + 16 * j + 8), load_u8x8_pairs(sc[1] + 16 * j + 8));
+        for (int g = 0; g < 8; g++) {
+            const __m512i raw  = load_x2(x0.qs + 32 * (8 * j + g), x1.qs + 32 * (8 * j + g));
+            const __m512i q_lo = _mm512_and_si512(raw, m4b);
+            const __m512i q_hi = _mm512_and_si512(_mm512_srli_epi16(raw, 4), m4b);
+            for (int i = 0; i < nrows; i++) {
+                sumi[i] = mul_add_scaled(sumi[i], q_lo, broadcast_x4_512(y[i]->qs + 64 * j + 4 * g), sc_lo);
+                sumi[i] = mul_add_scaled(sumi[i], q_hi, broadcast_x4_512(y[i]->qs + 64 * j + 32 + 4 * g), sc_hi);
+            }
+        }
+    }
+
+    for (int k = 0; k < 8; k++) {
+        const __m512i m = join_x2(load_u8x8_pairs(mn[0] + 8 * k), load_u8x8_pairs(mn[1] + 8 * k));
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm512_add_epi32(summ[i], _mm512_madd_epi16(m, broadcast_x4_512(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m512 d    = GGML_F32Cx8x2_LOAD(x0.d, x1.d);
+    const __m512 dmin = GGML_F32Cx8x2_LOAD(x0.dmin, x1.dmin);
+    for (int i = 0; i < nrows; i++) {
+        const __m512 da = _mm512_set1_ps(y[i]->d);
+        acc[i] = _mm512_fmadd_ps(_mm512_mul_ps(d, da), _mm512_cvtepi32_ps(sumi[i]), acc[i]);
+        acc[i] = _mm512_fnmadd_ps(_mm512_mul_ps(dmin, da), _mm512_cvtepi32_ps(summ[i]), acc[i]);
+    }
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx512(const block_q5_Kx8 & x0, const block_q5_Kx8 & x1, const block_q8_K * const * y, __m512 * acc) {
+    const __m512i m4b = _mm512_set1_epi8(0x0F);
+    const __m512i mh  = _mm512_set1_epi8(0x10);
+
+    alignas(32) uint8_t sc[2][64];
+    alignas(32) uint8_t mn[2][64];
+    unpack_scales_Kx8(x0.scales, sc[0], mn[0]);
+    unpack_scales_Kx8(x1.scales, sc[1], mn[1]);
+
+    __m512i sumi[nrows];
+    __m512i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm512_setzero_si512();
+        summ[i] = _mm512_setzero_si512();
+    }
+
+    for (int j = 0; j < 4; j++) {
+        const __m512i sc_lo = join_x2(load_u8x8_pairs(sc[0] + 16 * j),     load_u8x8_pairs(sc[1] + 16 * j));
+        const __m512i sc_hi = join_x2(load_u8x8_pairs(sc[0] + 16 * j + 8), load_u8x8_pairs(sc[1] + 16 * j + 8));
+        __m512i h_lo = load_x2(x0.qh + 64 * j,      x1.qh + 64 * j);
+        __m512i h_hi = load_x2(x0.qh + 64 * j + 32, x1.qh + 64 * j + 32);
+        for (int g = 0; g < 8; g++) {
+            const __m512i raw  = load_x2(x0.qs + 32 * (8 * j + g), x1.qs + 32 * (8 * j + g));
+            const __m512i q_lo = _mm512_or_si512(_mm512_and_si512(raw, m4b),
+                                                 _mm512_and_si512(_mm512_slli_epi16(h_lo, 4), mh));
+            const __m512i q_hi = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi16(raw, 4), m4b),
+                                                 _mm512_and_si512(_mm512_slli_epi16(h_hi, 4), mh));
+            h_lo = _mm512_srli_epi16(h_lo, 1);
+            h_hi = _mm512_srli_epi16(h_hi, 1);
+            for (int i = 0; i < nrows; i++) {
+                sumi[i] = mul_add_scaled(sumi[i], q_lo, broadcast_x4_512(y[i]->qs + 64 * j + 4 * g), sc_lo);
+                sumi[i] = mul_add_scaled(sumi[i], q_hi, broadcast_x4_512(y[i]->qs + 64 * j + 32 + 4 * g), sc_hi);
+            }
+        }
+    }
+
+    for (int k = 0; k < 8; k++) {
+        const __m512i m = join_x2(load_u8x8_pairs(mn[0] + 8 * k), load_u8x8_pairs(mn[1] + 8 * k));
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm512_add_epi32(summ[i], _mm512_madd_epi16(m, broadcast_x4_512(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m512 d    = GGML_F32Cx8x2_LOAD(x0.d, x1.d);
+    const __m512 dmin = GGML_F32Cx8x2_LOAD(x0.dmin, x1.dmin);
+    for (int i = 0; i < nrows; i++) {
+        const __m512 da = _mm512_set1_ps(y[i]->d);
+        acc[i] = _mm512_fmadd_ps(_mm512_mul_ps(d, da), _mm512_cvtepi32_ps(sumi[i]), acc[i]);
+        acc[i] = _mm512_fnmadd_ps(_mm512_mul_ps(dmin, da), _mm512_cvtepi32_ps(summ[i]), acc[i]);
+    }
+}
+
+template <int nrows>
+static inline void dot_Kx8_avx512(const block_q6_Kx8 & x0, const block_q6_Kx8 & x1, const block_q8_K * const * y, __m512 * acc) {
+    const __m512i m4b = _mm512_set1_epi8(0x0F);
+    const __m512i mh  = _mm512_set1_epi8(0x30);
+
+    __m512i sumi[nrows];
+    __m512i summ[nrows];
+    for (int i = 0; i < nrows; i++) {
+        sumi[i] = _mm512_setzero_si512();
+        summ[i] = _mm512_setzero_si512();
+    }
+
+    for (int h = 0; h < 2; h++) {
+        for (int k = 0; k < 2; k++) {
+            __m512i sc[4];
+            for (int t = 0; t < 4; t++) {
+                const int sb = 8 * h + 2 * t + k;
+                sc[t] = join_x2(load_i8x8_pairs(x0.scales + 8 * sb), load_i8x8_pairs(x1.scales + 8 * sb));
+            }
+            for (int g = 4 * k; g < 4 * k + 4; g++) {
+                const __m512i qh    = load_x2(x0.qh + 32 * (8 * h + g),      x1.qh + 32 * (8 * h + g));
+                const __m512i raw_0 = load_x2(x0.ql + 32 * (16 * h + g),     x1.ql + 32 * (16 * h + g));
+                const __m512i raw_1 = load_x2(x0.ql + 32 * (16 * h + 8 + g), x1.ql + 32 * (16 * h + 8 + g));
+
+                const __m512i q_0 = _mm512_or_si512(_mm512_and_si512(raw_0, m4b), _mm512_and_si512(_mm512_slli_epi16(qh, 4), mh));
+                const __m512i q_1 = _mm512_or_si512(_mm512_and_si512(raw_1, m4b), _mm512_and_si512(_mm512_slli_epi16(qh, 2), mh));
+                const __m512i q_2 = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi16(raw_0, 4), m4b), _mm512_and_si512(qh, mh));
+                const __m512i q_3 = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi16(raw_1, 4), m4b), _mm512_and_si512(_mm512_srli_epi16(qh, 2), mh));
+
+                for (int i = 0; i < nrows; i++) {
+                    const int8_t * a = y[i]->qs + 128 * h + 4 * g;
+                    sumi[i] = mul_add_scaled(sumi[i], q_0, broadcast_x4_512(a),      sc[0]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_1, broadcast_x4_512(a + 32), sc[1]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_2, broadcast_x4_512(a + 64), sc[2]);
+                    sumi[i] = mul_add_scaled(sumi[i], q_3, broadcast_x4_512(a + 96), sc[3]);
+                }
+            }
+        }
+    }
+
+    for (int k = 0; k < 8; k++) {
+        const __m512i sc = join_x2(load_i8x8x2_pairs(x0.scales + 16 * k), load_i8x8x2_pairs(x1.scales + 16 * k));
+        for (int i = 0; i < nrows; i++) {
+            summ[i] = _mm512_add_epi32(summ[i], _mm512_madd_epi16(sc, broadcast_x4_512(y[i]->bsums + 2 * k)));
+        }
+    }
+
+    const __m512 d = GGML_F32Cx8x2_LOAD(x0.d, x1.d);
+    for (int i = 0; i < nrows; i++) {
+        const __m512 da = _mm512_set1_ps(y[i]->d);
+        acc[i] = _mm512_fmadd_ps(_mm512_mul_ps(d, da), _mm512_cvtepi32_ps(_mm512_sub_epi32(sumi[i], _mm512_slli_epi32(summ[i], 5))), acc[i]);
+    }
+}
+
+template <typename BLOC_TYPE, int nrows>
+static void gemm_Kx8_avx512(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    const int nb = n / QK_K;
+
+    for (int y = 0; y < nr; y += nrows) {
+        const block_q8_K * a_ptr = (const block_q8_K *) vy + (y * nb);
+        for (int x = 0; x < nc / 8; x += 2) {
+            const BLOC_TYPE * b_ptr_0 = (const BLOC_TYPE *) vx + (x * nb);
+            const BLOC_TYPE * b_ptr_1 = b_ptr_0 + nb;
+
+            __m512 acc[nrows];
+            for (int i = 0; i < nrows; i++) {
+                acc[i] = _mm512_setzero_ps();
+            }
+            for (int l = 0; l < nb; l++) {
+                const block_q8_K * a_blocks[nrows];
+                for (int i = 0; i < nrows; i++) {
+                    a_blocks[i] = a_ptr + i * nb + l;
+                }
+                dot_Kx8_avx512<nrows>(b_ptr_0[l], b_ptr_1[l], a_blocks, acc);
+            }
+            for (int i = 0; i < nrows; i++) {
+                _mm512_storeu_ps(s + (y + i) * bs + x * 8, acc[i]);
+            }
+        }
+    }
+}
+#endif // defined(__AVX512F__) && defined(__AVX512BW__)
+
+template <typename BLOC_TYPE, int nrows>
+static void gemm_Kx8(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    assert(n % QK_K == 0);
+    assert(nr % nrows == 0);
+    assert(nc % 8 == 0);
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+    // pairs of 8 rows, then the remaining 8 rows if any
+    const int anc = nc - nc % 16;
+    gemm_Kx8_avx512<BLOC_TYPE, nrows>(n, s, bs, vx, vy, nr, anc);
+    if (anc < nc) {
+        gemm_Kx8_avx2<BLOC_TYPE, nrows>(n, s + anc, bs, (const BLOC_TYPE *) vx + (anc / 8) * (n / QK_K), vy, nr, nc - anc);
+    }
+#elif defined(__AVX2__)
+    gemm_Kx8_avx2<BLOC_TYPE, nrows>(n, s, bs, vx, vy, nr, nc);
+#else
+    // ggml_aarch64_get_optimal_repack_type only repacks K-quants with AVX2
+    UNUSED(n);
+    UNUSED(s);
+    UNUSED(bs);
+    UNUSED(vx);
+    UNUSED(vy);
+    UNUSED(nr);
+    UNUSED(nc);
+    GGML_ABORT("K-quant repack requires AVX2");
+#endif
+}
+
+static void ggml_gemv_q4_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q4_Kx8, 1>(n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemv_q5_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q5_Kx8, 1>(n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemv_q6_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q6_Kx8, 1>(n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q4_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q4_Kx8, 4>(n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q5_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q5_Kx8, 4>(n, s, bs, vx, vy, nr, nc);
+}
+
+static void ggml_gemm_q6_K_8x4_q8_K(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, const void * GGML_RESTRICT vy, int nr, int nc) {
+    gemm_Kx8<block_q6_Kx8, 4>(n, s, bs, vx, vy, nr, nc);
+}
 
 static block_q4_0x4 make_block_q4_0x4(block_q4_0 * in, unsigned int blck_size_interleave) {
     block_q4_0x4 out;
@@ -3832,6 +4358,139 @@ static int repack_iq4_nl_to_iq4_nl_4_bl(struct ggml_tensor * t, int interleave_b
     GGML_UNUSED(data_size);
 }
 
+static inline void get_scale_min_k4(int j, const uint8_t * GGML_RESTRICT q, uint8_t * GGML_RESTRICT d, uint8_t * GGML_RESTRICT m) {
+    if (j < 4) {
+        *d = q[j] & 63; *m = q[j + 4] & 63;
+    } else {
+        *d = (q[j+4] & 0xF) | ((q[j-4] >> 6) << 4);
+        *m = (q[j+4] >>  4) | ((q[j-0] >> 6) << 4);
+    }
+}
+
+// the scales and mins of 8 block_q4_Ks or block_q5_Ks in the layout of block_q4_Kx8
+static void make_scales_Kx8(const uint8_t * const * in, uint8_t * out) {
+    memset(out, 0, 96);
+    for (int sb = 0; sb < 8; sb++) {
+        for (int r = 0; r < 8; r++) {
+            uint8_t sc;
+            uint8_t m;
+            get_scale_min_k4(sb, in[r], &sc, &m);
+
+            const int i = sb * 8 + r;
+            out[i] = (sc & 0xF) | ((m & 0xF) << 4);
+            out[64 + i % 32] |= ((sc >> 4) | ((m >> 4) << 2)) << (4 * (i / 32));
+        }
+    }
+}
+
+// interleave 8 block_q4_Ks, 4 quant bytes of each at a time
+static block_q4_Kx8 make_block_q4_Kx8(const block_q4_K * in) {
+    block_q4_Kx8 out;
+
+    const uint8_t * scales[8];
+    for (int r = 0; r < 8; r++) {
+        out.d[r]    = in[r].data.data.d;
+        out.dmin[r] = in[r].data.data.dmin;
+        scales[r]   = in[r].scales;
+    }
+    make_scales_Kx8(scales, out.scales);
+
+    for (int i = 0; i < QK_K / 8; i++) {
+        for (int r = 0; r < 8; r++) {
+            memcpy(&out.qs[(i * 8 + r) * 4], &in[r].qs[i * 4], 4);
+        }
+    }
+
+    return out;
+}
+
+// as make_block_q4_Kx8, with bit g of a byte of qh the high bit of the quant
+// in the g-th group of 4 of each 32
+static block_q5_Kx8 make_block_q5_Kx8(const block_q5_K * in) {
+    block_q5_Kx8 out;
+
+    const uint8_t * scales[8];
+    for (int r = 0; r < 8; r++) {
+        out.d[r]    = in[r].data.data.d;
+        out.dmin[r] = in[r].data.data.dmin;
+        scales[r]   = in[r].scales;
+    }
+    make_scales_Kx8(scales, out.scales);
+
+    for (int i = 0; i < QK_K / 8; i++) {
+        for (int r = 0; r < 8; r++) {
+            memcpy(&out.qs[(i * 8 + r) * 4], &in[r].qs[i * 4], 4);
+        }
+    }
+
+    memset(out.qh, 0, sizeof(out.qh));
+    for (int j = 0; j < QK_K / 32; j++) {
+        for (int r = 0; r < 8; r++) {
+            for (int l = 0; l < 32; l++) {
+                const int bit = (in[r].qh[l] >> j) & 1;
+                out.qh[(j / 2) * 64 + (j % 2) * 32 + r * 4 + l % 4] |= bit << (l / 4);
+            }
+        }
+    }
+
+    return out;
+}
+
+// interleave 8 block_q6_Ks, 4 bytes of ql and qh of each at a time
+static block_q6_Kx8 make_block_q6_Kx8(const block_q6_K * in) {
+    block_q6_Kx8 out;
+
+    for (int r = 0; r < 8; r++) {
+        out.d[r] = in[r].d;
+        for (int sb = 0; sb < QK_K / 16; sb++) {
+            out.scales[sb * 8 + r] = in[r].scales[sb];
+        }
+    }
+
+    for (int i = 0; i < QK_K / 8; i++) {
+        for (int r = 0; r < 8; r++) {
+            memcpy(&out.ql[(i * 8 + r) * 4], &in[r].ql[i * 4], 4);
+        }
+    }
+    for (int i = 0; i < QK_K / 16; i++) {
+        for (int r = 0; r < 8; r++) {
+            memcpy(&out.qh[(i * 8 + r) * 4], &in[r].qh[i * 4], 4);
+        }
+    }
+
+    return out;
+}
+
+template <typename BLOC_TYPE, typename BLOC_TYPE_X8>
+static int repack_K_to_Kx8(struct ggml_tensor * t, BLOC_TYPE_X8 (*make_block)(const BLOC_TYPE *), const void * GGML_RESTRICT data, size_t data_size) {
+    constexpr int nrows_interleaved = 8;
+
+    BLOC_TYPE_X8 * dst = (BLOC_TYPE_X8 *) t->data;
+    const BLOC_TYPE * src = (const BLOC_TYPE *) data;
+    BLOC_TYPE dst_tmp[8];
+    int nrow = ggml_nrows(t);
+    int nblocks = t->ne[0] / QK_K;
+
+    GGML_ASSERT(data_size == nrow * nblocks * sizeof(BLOC_TYPE));
+
+    if (t->ne[1] % nrows_interleaved != 0 || t->ne[0] % QK_K != 0) {
+        return -1;
+    }
+
+    for (int b = 0; b < nrow; b += nrows_interleaved) {
+        for (int64_t x = 0; x < nblocks; x++) {
+            for (int i = 0; i < nrows_interleaved; i++) {
+                dst_tmp[i] = src[x + i * nblocks];
+            }
+            *dst++ = make_block(dst_tmp);
+        }
+        src += nrows_interleaved * nblocks;
+    }
+    return 0;
+
+    GGML_UNUSED(data_size);
+}
+
 namespace ggml::cpu::aarch64 {
 // repack
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
@@ -3854,6 +4513,18 @@ template <> int repack<block_iq4_nl, 4, 4>(struct ggml_tensor * t, const void *
     return repack_iq4_nl_to_iq4_nl_4_bl(t, 4, data, data_size);
 }
 
+template <> int repack<block_q4_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_K_to_Kx8<block_q4_K, block_q4_Kx8>(t, make_block_q4_Kx8, data, data_size);
+}
+
+template <> int repack<block_q5_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_K_to_Kx8<block_q5_K, block_q5_Kx8>(t, make_block_q5_Kx8, data, data_size);
+}
+
+template <> int repack<block_q6_K, 4, 8>(struct ggml_tensor * t, const void * data, size_t data_size) {
+    return repack_K_to_Kx8<block_q6_K, block_q6_Kx8>(t, make_block_q6_Kx8, data, data_size);
+}
+
 // TODO: needs to be revisited
 //template <> int repack<block_iq4_nl, 8, 4>(struct ggml_tensor * t, const void * data, size_t data_size) {
 //    return repack_iq4_nl_to_iq4_nl_4_bl(t, 8, data, data_size);
@@ -3880,6 +4551,18 @@ void gemv<block_iq4_nl, 4, 4>(int n, float * s, size_t bs, const void * vx, cons
     ggml_gemv_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemv<block_q4_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q4_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q5_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q5_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemv<block_q6_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemv_q6_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
 // gemm
 template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS>
 void gemm(int, float *, size_t, const void *, const void *, int, int);
@@ -3901,21 +4584,54 @@ void gemm<block_iq4_nl, 4, 4>(int n, float * s, size_t bs, const void * vx, cons
     ggml_gemm_iq4_nl_4x4_q8_0(n, s, bs, vx, vy, nr, nc);
 }
 
+template <> void gemm<block_q4_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q4_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q5_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q5_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+template <> void gemm<block_q6_K, 4, 8>(int n, float * s, size_t bs, const void * vx, const void * vy, int nr, int nc) {
+    ggml_gemm_q6_K_8x4_q8_K(n, s, bs, vx, vy, nr, nc);
+}
+
+// quantize 4 rows of activations for gemm
+template <int64_t INTER_SIZE, ggml_type PARAM_TYPE>
+void quantize_mat(const float * x, void * vy, int64_t nrow, int64_t n_per_row);
+
+template <> void quantize_mat<4, GGML_TYPE_Q8_0>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    quantize_mat_q8_0(x, vy, nrow, n_per_row, 4);
+}
+
+template <> void quantize_mat<8, GGML_TYPE_Q8_0>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    quantize_mat_q8_0(x, vy, nrow, n_per_row, 8);
+}
+
+// the K-quant kernels take rows of block_q8_K as they are
+template <> void quantize_mat<4, GGML_TYPE_Q8_K>(const float * x, void * vy, int64_t nrow, int64_t n_per_row) {
+    const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_K)->from_float;
+    for (int64_t i = 0; i < nrow; i++) {
+        from_float(x + i * n_per_row, (char *) vy + i * ggml_row_size(GGML_TYPE_Q8_K, n_per_row), n_per_row);
+    }
+}
+
 class tensor_traits_base : public ggml::cpu::tensor_traits {
   public:
     virtual int repack(struct ggml_tensor * t, const void * data, size_t data_size) = 0;
 };
 
-template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_traits : public tensor_traits_base {
+template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS, ggml_type PARAM_TYPE = GGML_TYPE_Q8_0>
+class tensor_traits : public tensor_traits_base {
 
     bool work_size(int /* n_threads */, const struct ggml_tensor * op, size_t & size) override {
-        // not realy a GGML_TYPE_Q8_0 but same size.
+        // not realy a PARAM_TYPE but same size.
         switch (op->op) {
         case GGML_OP_MUL_MAT:
-            size = ggml_row_size(GGML_TYPE_Q8_0, ggml_nelements(op->src[1]));
+            size = ggml_row_size(PARAM_TYPE, ggml_nelements(op->src[1]));
             return true;
         case GGML_OP_MUL_MAT_ID:
-            size = ggml_row_size(GGML_TYPE_Q8_0, ggml_nelements(op->src[1]));
+            size = ggml_row_size(PARAM_TYPE, ggml_nelements(op->src[1]));
             size = GGML_PAD(size, sizeof(int64_t));  // + padding for next bloc.
             size += sizeof(int64_t) * (1+op->src[0]->ne[2]) * op->src[1]->ne[2];
             return true;
@@ -3968,16 +4684,15 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         // GGML_ASSERT(ggml_n_dims(op->src[1]) == 2);
 
         char *       wdata = static_cast<char *>(params->wdata);
-        const size_t nbw1  = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t nbw1  = ggml_row_size(PARAM_TYPE, ne10);
 
         assert(params->wsize >= nbw1 * ne11);
 
-        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->from_float;
+        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
         int64_t i11_processed = 0;
         for (int64_t i11 = ith * 4; i11 < ne11 - ne11 % 4; i11 += nth * 4) {
-            quantize_mat_q8_0((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10,
-                              INTER_SIZE);
+            quantize_mat<INTER_SIZE, PARAM_TYPE>((float *) ((char *) src1->data + i11 * nb11), (void *) (wdata + i11 * nbw1), 4, ne10);
         }
         i11_processed = ne11 - ne11 % 4;
         for (int64_t i11 = i11_processed + ith; i11 < ne11; i11 += nth) {
@@ -3987,7 +4702,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         ggml_barrier(params->threadpool);
 
         const void * src1_wdata      = params->wdata;
-        const size_t src1_col_stride = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t src1_col_stride = ggml_row_size(PARAM_TYPE, ne10);
         int64_t      src0_start      = (ith * ne01) / nth;
         int64_t      src0_end        = ((ith + 1) * ne01) / nth;
         src0_start = (src0_start % NB_COLS) ? src0_start + NB_COLS - (src0_start % NB_COLS) : src0_start;
@@ -4021,7 +4736,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         const int ith = params->ith;
         const int nth = params->nth;
 
-        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(GGML_TYPE_Q8_0)->from_float;
+        const ggml_from_float_t from_float = ggml_get_type_traits_cpu(PARAM_TYPE)->from_float;
 
         // we don't support permuted src0 or src1
         GGML_ASSERT(nb00 == ggml_type_size(src0->type));
@@ -4043,7 +4758,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         const int n_ids = ids->ne[0]; // n_expert_used
         const int n_as  = ne02;       // n_expert
 
-        const size_t nbw1 = ggml_row_size(GGML_TYPE_Q8_0, ne10);
+        const size_t nbw1 = ggml_row_size(PARAM_TYPE, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
@@ -4060,7 +4775,7 @@ template <typename BLOC_TYPE, int64_t INTER_SIZE, int64_t NB_COLS> class tensor_
         int64_t *                 matrix_row_counts = (int64_t *) (wdata_src1_end);                      // [n_as]
         struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *) (matrix_row_counts + n_as);  // [n_as][ne12]
 
-        // src1: float32 => block_q8_0
+        // src1: float32 => block_q8_0 or block_q8_K
         for (int64_t i12 = 0; i12 < ne12; ++i12) {
             for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
                 from_float((float *)((char *) src1->data + i12 * nb12 + i11 * nb11),
@@ -4148,6 +4863,11 @@ static const tensor_traits<block_q4_0, 8, 8> q4_0_8x8_q8_0;
 // instance for IQ4
 static const tensor_traits<block_iq4_nl, 4, 4> iq4_nl_4x4_q8_0;
 
+// instance for K-quants
+static const tensor_traits<block_q4_K, 4, 8, GGML_TYPE_Q8_K> q4_K_8x4_q8_K;
+static const tensor_traits<block_q5_K, 4, 8, GGML_TYPE_Q8_K> q5_K_8x4_q8_K;
+static const tensor_traits<block_q6_K, 4, 8, GGML_TYPE_Q8_K> q6_K_8x4_q8_K;
+
 }  // namespace ggml::cpu::aarch64
 
 static const ggml::cpu::tensor_traits * ggml_aarch64_get_optimal_repack_type(const struct ggml_tensor * cur) {
@@ -4173,6 +4893,24 @@ static const ggml::cpu::tensor_traits * ggml_aarch64_get_optimal_repack_type(con
                 return &ggml::cpu::aarch64::iq4_nl_4x4_q8_0;
             }
         }
+    } else if (cur->type == GGML_TYPE_Q4_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q4_K_8x4_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q5_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q5_K_8x4_q8_K;
+            }
+        }
+    } else if (cur->type == GGML_TYPE_Q6_K) {
+        if (ggml_cpu_has_avx2()) {
+            if (cur->ne[1] % 8 == 0) {
+                return &ggml::cpu::aarch64::q6_K_8x4_q8_K;
+            }
+        }
     }
 
     return nullptr;
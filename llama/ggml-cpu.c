@@ -123,6 +123,10 @@ typedef double ggml_float;
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
+// flash attention tiles: up to GGML_FA_TILE_Q q rows against GGML_FA_TILE_KV K/V rows at a time
+#define GGML_FA_TILE_Q  32
+#define GGML_FA_TILE_KV 64
+
 //
 // global data
 //
@@ -2403,6 +2407,66 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// with the interleave strategy the rows of every weight matrix are split into one
+// contiguous range per node, thread ith runs on node ith % n_nodes and mul_mat has
+// the threads of each node work only on the rows in that node's memory
+static bool ggml_numa_interleaved(int nth) {
+    return g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_INTERLEAVE &&
+        ggml_is_numa() && nth >= (int) g_state.numa.n_nodes;
+}
+
+// rows [*ir0, *ir1) of nr placed on node, out of n_nodes
+static void ggml_numa_node_rows(int64_t nr, int node, int n_nodes, int64_t * ir0, int64_t * ir1) {
+    *ir0 = nr*node/n_nodes;
+    *ir1 = nr*(node + 1)/n_nodes;
+}
+
+void ggml_numa_place_tensor(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__) && defined(SYS_mbind)
+    if (g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_INTERLEAVE || !ggml_is_numa() ||
+            tensor->data == NULL || !ggml_is_contiguous(tensor)) {
+        return;
+    }
+
+    const int n_nodes = g_state.numa.n_nodes;
+
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const int64_t   nr        = tensor->ne[1];
+
+    if (nr < n_nodes) {
+        return;
+    }
+
+    // MPOL_PREFERRED and MPOL_MF_MOVE from <numaif.h>, which is not available without libnuma
+    const int      mpol_preferred = 1;
+    const unsigned mpol_mf_move   = 1 << 1;
+
+    for (int64_t i = 0; i < ggml_nrows(tensor)/nr; i++) {
+        const uintptr_t base = (uintptr_t) tensor->data + i*tensor->nb[2];
+
+        for (int node = 0; node < n_nodes; node++) {
+            int64_t ir0, ir1;
+            ggml_numa_node_rows(nr, node, n_nodes, &ir0, &ir1);
+
+            // pages are rounded down, so a page shared by two nodes goes to the second one
+            const uintptr_t first = (base + ir0*tensor->nb[1]) & ~(page_size - 1);
+            const uintptr_t last  = (base + ir1*tensor->nb[1]) & ~(page_size - 1);
+            if (first >= last) {
+                continue;
+            }
+
+            unsigned long nodemask = 1ul << node;
+            if (syscall(SYS_mbind, (void *) first, last - first, mpol_preferred, &nodemask, sizeof(nodemask)*8, mpol_mf_move) != 0) {
+                GGML_LOG_DEBUG("%s: mbind failed for %s: %s\n", __func__, tensor->name, strerror(errno));
+                return;
+            }
+        }
+    }
+#else
+    UNUSED(tensor);
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -2904,8 +2968,8 @@ static void ggml_compute_forward_dup_same_cont(
     const int ith = params->ith; // thread index
     const int nth = params->nth; // number of threads
 
-    // parallelize by elements
-    const int ne = ggml_nelements(dst);
+    // parallelize by blocks (elements for non-quantized types)
+    const int ne = ggml_nelements(dst)/ggml_blck_size(dst->type);
     const int dr = (ne + nth - 1) / nth;
     const int ie0 = dr * ith;
     const int ie1 = MIN(ie0 + dr, ne);
@@ -3993,6 +4057,50 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const enum ggml_type type = src0->type;
+    ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(type)->to_float;
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+
+    // we don't support permuted src0 dim0
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+
+    // dst dim0 cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+
+    const int ith = params->ith; // thread index
+    const int nth = params->nth; // number of threads
+
+    // parallelize by rows
+    const int64_t nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        dequantize_row_q(
+                (const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03,
+                (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3), ne00);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -4019,6 +4127,10 @@ static void ggml_compute_forward_dup(
             } break;
         default:
             {
+                if (ggml_is_quantized(src0->type) && dst->type == GGML_TYPE_F32) {
+                    ggml_compute_forward_dup_q(params, dst);
+                    break;
+                }
                 GGML_ABORT("fatal error");
             }
     }
@@ -7434,6 +7546,23 @@ static void ggml_compute_forward_mul_mat(
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
+    // rows of src0 in the memory of the NUMA node of this thread, and the index of
+    // this thread among the threads of that node
+    int64_t ir0_node = 0;
+    int64_t ir1_node = ne01;
+    int     ith_node = ith;
+    int     nth_node = nth;
+
+    const bool numa_local = ggml_numa_interleaved(nth) && ggml_is_contiguous(src0) && ne01 >= nth;
+    if (numa_local) {
+        const int n_nodes = g_state.numa.n_nodes;
+        const int node    = ith % n_nodes;
+
+        ggml_numa_node_rows(ne01, node, n_nodes, &ir0_node, &ir1_node);
+        ith_node = ith / n_nodes;
+        nth_node = (nth - node + n_nodes - 1) / n_nodes;
+    }
+
     // TODO: extract to "extra_op"
 #if GGML_USE_LLAMAFILE
     // broadcast factors
@@ -7445,14 +7574,14 @@ static void ggml_compute_forward_mul_mat(
     if (src1_cont) {
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir1_node - ir0_node, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_node*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)src1->data + i12*nb12 + i13*nb13,
                                      nb11/ggml_type_size(src1->type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_node*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_node, nth_node,
                                      src0->type,
                                      src1->type,
                                      dst->type))
@@ -7497,14 +7626,14 @@ UseGgmlGemm1:;
 
         for (int64_t i13 = 0; i13 < ne13; i13++)
             for (int64_t i12 = 0; i12 < ne12; i12++)
-                if (!llamafile_sgemm(ne01, ne11, ne00/ggml_blck_size(src0->type),
-                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03,
+                if (!llamafile_sgemm(ir1_node - ir0_node, ne11, ne00/ggml_blck_size(src0->type),
+                                     (const char *)src0->data + i12/r2*nb02 + i13/r3*nb03 + ir0_node*nb01,
                                      nb01/ggml_type_size(src0->type),
                                      (const char *)wdata + (i12*ne11 + i13*ne12*ne11)*row_size,
                                      row_size/ggml_type_size(vec_dot_type),
-                                     (char *)dst->data + i12*nb2 + i13*nb3,
+                                     (char *)dst->data + i12*nb2 + i13*nb3 + ir0_node*nb0,
                                      nb1/ggml_type_size(dst->type),
-                                     ith, nth,
+                                     ith_node, nth_node,
                                      src0->type,
                                      vec_dot_type,
                                      dst->type))
@@ -7520,6 +7649,22 @@ UseGgmlGemm2:;
     // This is the size of the rest of the dimensions of the result
     const int64_t nr1 = ne1 * ne2 * ne3;
 
+    if (numa_local) {
+        // no chunks are handed out between nodes, the other nodes' rows are in remote memory
+        const int64_t ir0_start = ir0_node + (ir1_node - ir0_node)*ith_node/nth_node;
+        const int64_t ir0_end   = ir0_node + (ir1_node - ir0_node)*(ith_node + 1)/nth_node;
+
+        int64_t num_rows_per_vec_dot = vec_dot_num_rows;
+        if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || (nr1 % 2 != 0)) {
+            num_rows_per_vec_dot = 1;
+        }
+
+        if (ir0_start < ir0_end) {
+            ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, 0, nr1);
+        }
+        return;
+    }
+
     // Now select a reasonable chunk size.
     int chunk_size = 16;
 
@@ -7891,8 +8036,9 @@ static void ggml_compute_forward_out_prod_q_f32(
     const enum ggml_type type = src0->type;
     ggml_to_float_t const dequantize_row_q = ggml_get_type_traits(type)->to_float;
 
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne03 == ne13);
+    // src0 is broadcast over dims 2 and 3 (e.g. the heads of a GQA V cache)
+    GGML_ASSERT(ne12 % ne02 == 0);
+    GGML_ASSERT(ne13 % ne03 == 0);
     GGML_ASSERT(ne2  == ne12);
     GGML_ASSERT(ne3  == ne13);
 
@@ -7907,8 +8053,7 @@ static void ggml_compute_forward_out_prod_q_f32(
 
     GGML_ASSERT(ne0 == ne00);
     GGML_ASSERT(ne1 == ne10);
-    GGML_ASSERT(ne2 == ne02);
-    GGML_ASSERT(ne3 == ne03);
+    GGML_ASSERT(ne01 == ne11);
 
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
@@ -7918,49 +8063,70 @@ static void ggml_compute_forward_out_prod_q_f32(
     }
     ggml_barrier(params->threadpool);
 
-    // parallelize by last three dimensions
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
 
-    // total rows in dst
-    const int64_t nr = ne1*ne2*ne3;
+    // each row of src0 is dequantized once for a tile of blck_1 dst rows,
+    // and skipped if the matching src1 values of the tile are all zero
+    // (e.g. the KV cells masked out of the attention)
+    const int64_t blck_1 = 16;
 
-    // rows per thread
-    const int64_t dr = (nr + nth - 1)/nth;
+    // parallelize by tiles of dst rows
+    const int64_t nb1t = (ne1 + blck_1 - 1)/blck_1;
+    const int64_t nt   = nb1t*ne2*ne3;
 
-    // row range for this thread
-    const int64_t ir0 = dr*ith;
-    const int64_t ir1 = MIN(ir0 + dr, nr);
+    // tiles per thread
+    const int64_t dt = (nt + nth - 1)/nth;
+
+    // tile range for this thread
+    const int64_t it0 = dt*ith;
+    const int64_t it1 = MIN(it0 + dt, nt);
 
     // dst[:,:,:,:] = 0
     // for i2,i3:
     //   for i1:
     //     for i01:
     //       for i0:
-    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
+    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2/r2,i3/r3] * src1[i1,i01,i2,i3]
 
     float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
 
-    for (int64_t ir = ir0; ir < ir1; ++ir) {
+    for (int64_t it = it0; it < it1; ++it) {
         // dst indices
-        const int64_t i3 = ir/(ne2*ne1);
-        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
-        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+        const int64_t i3  = it/(ne2*nb1t);
+        const int64_t i2  = (it - i3*ne2*nb1t)/nb1t;
+        const int64_t i10 = (it - i3*ne2*nb1t - i2*nb1t)*blck_1;
+        const int64_t i11 = MIN(i10 + blck_1, ne1);
 
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+        const int64_t i02 = i2/r2;
+        const int64_t i03 = i3/r3;
 
-        //const int64_t i10 = i1;
         const int64_t i12 = i2;
         const int64_t i13 = i3;
 
         for (int64_t i01 = 0; i01 < ne01; ++i01) {
-            const int64_t i11 = i01;
+            const char * s1 = (const char *) src1->data + (i01*nb11 + i12*nb12 + i13*nb13);
+
+            int64_t i1 = i10;
+            while (i1 < i11 && *(const float *) (s1 + i1*nb10) == 0.0f) {
+                i1++;
+            }
+            if (i1 == i11) {
+                continue;
+            }
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+            const char * s0 = (const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03);
 
             dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+
+            for (; i1 < i11; ++i1) {
+                const float v = *(const float *) (s1 + i1*nb10);
+                if (v != 0.0f) {
+                    float * d = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+                    ggml_vec_mad_f32(ne0, d, wdata, v);
+                }
+            }
         }
     }
 }
@@ -10819,6 +10985,31 @@ static void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
+// size in floats of the work buffer of a flash attention thread, for tiles of up to R rows of size D
+static size_t ggml_flash_attn_ext_wsize(int64_t D, int64_t R) {
+    return 3*R*D + R*GGML_FA_TILE_KV + D + 3*R + CACHE_LINE_SIZE_F32;
+}
+
+// picks the number of heads (out of the n_group heads sharing a K/V head) and of tokens of the
+// flash attention tiles, the tiles are made smaller while there are fewer tiles than threads
+static void ggml_flash_attn_ext_tile(int64_t N, int64_t n_group, int64_t n_kv_head, int nth, int64_t * hg, int64_t * bq) {
+    int64_t HG = n_group;
+    int64_t BQ = MIN(N, MAX(1, GGML_FA_TILE_Q/n_group));
+
+    while (n_kv_head*((n_group + HG - 1)/HG)*((N + BQ - 1)/BQ) < nth) {
+        if (BQ > 1) {
+            BQ = (BQ + 1)/2;
+        } else if (HG > 1) {
+            HG = (HG + 1)/2;
+        } else {
+            break;
+        }
+    }
+
+    *hg = HG;
+    *bq = BQ;
+}
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -10870,17 +11061,28 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by tiles of q rows: a tile holds the rows of a group of heads sharing the same
+    // K/V head for a block of tokens, so that each K and V row loaded from memory is applied to
+    // all the rows of the tile
 
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
+    const int64_t n_group = rk2; // q heads per K head
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+    int64_t HG; // heads per tile
+    int64_t BQ; // tokens per tile
+    ggml_flash_attn_ext_tile(N, n_group, nek2*neq3, nth, &HG, &BQ);
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+    const int64_t nhg = (n_group + HG - 1)/HG; // head groups per K head
+    const int64_t nqb = (N + BQ - 1)/BQ;       // token blocks
+
+    // total tiles
+    const int64_t nt = neq3*nek2*nhg*nqb;
+
+    // tiles per thread
+    const int64_t dt = (nt + nth - 1)/nth;
+
+    // tile range for this thread
+    const int64_t it0 = dt*ith;
+    const int64_t it1 = MIN(it0 + dt, nt);
 
     float scale         = 1.0f;
     float max_bias      = 0.0f;
@@ -10908,129 +11110,211 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(q_to_vec_dot && "fattn: unsupported K-type");
     GGML_ASSERT(v_to_float   && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    const int64_t R  = MAX(GGML_FA_TILE_Q, n_group); // max rows per tile, see ggml_flash_attn_ext_wsize
+    const int64_t BK = GGML_FA_TILE_KV;
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, D);
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    float * VKQ32 = (float *) params->wdata + ith*ggml_flash_attn_ext_wsize(D, R); // FP32 VKQ accumulators [R][D]
+    float * Q32   = VKQ32 + R*D;              // FP32 Q rows [R][D]
+    char  * Q_q   = (char  *) (Q32 + R*D);    // Q rows converted to quantized/FP16 [R][D]
+    float * KQ    = VKQ32 + 3*R*D;            // KQ values, then softmax numerators [R][BK]
+    float * V32   = KQ + R*BK;                // FP32 V row [D]
+    float * M     = V32 + D;                  // maximum KQ value per row [R]
+    float * S     = M + R;                    // sum per row [R]
+    float * slope = S + R;                    // ALiBi slope per row [R]
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
-
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
-        } else {
-            memset(VKQ32, 0, D*sizeof(float));
-        }
-
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+    for (int64_t it = it0; it < it1; ++it) {
+        // tile indices
+        const int64_t iqb = it % nqb;
+        const int64_t ihg = (it/nqb) % nhg;
+        const int64_t ik2 = (it/(nqb*nhg)) % nek2;
+        const int64_t iq3 = it/(nqb*nhg*nek2);
 
         // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+        const int64_t ik3 = iq3 / rk3;
 
         // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+        const int64_t iv3 = iq3 / rv3;
+
+        // heads [h0, h1) and tokens [i10, i11) of the tile
+        const int64_t h0  = ik2*n_group + ihg*HG;
+        const int64_t h1  = MIN(h0 + HG, (ik2 + 1)*n_group);
+        const int64_t i10 = iqb*BQ;
+        const int64_t i11 = MIN(i10 + BQ, N);
+
+        const int64_t nq = i11 - i10;
+        const int64_t nr = (h1 - h0)*nq;
+
+        for (int64_t r = 0; r < nr; ++r) {
+            const int64_t iq2 = h0 + r/nq;
+            const int64_t iq1 = i10 + r%nq;
+
+            const uint32_t h = iq2; // head index
+            slope[r] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+            M[r] = -INFINITY;
+            S[r] = 0.0f;
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
+            const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+            memcpy(Q32 + r*D, pq, D*sizeof(float));
+            q_to_vec_dot(pq, Q_q + r*q_row_size, D);
+        }
+
+        memset(VKQ32, 0, nr*D*sizeof(float));
 
         // online softmax / attention
-        // loop over n_kv and n_head_kv
+        // loop over chunks of n_kv, each K and V row is used for all the rows of the tile
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += BK) {
+            const int64_t nc = MIN(BK, nek1 - ic0);
+
+            // skip the chunk if it is masked for all the tokens of the tile
+            if (mask) {
+                bool visible = false;
+                for (int64_t iq1 = i10; iq1 < i11 && !visible; ++iq1) {
+                    const ggml_fp16_t * mp = (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) + ic0;
+                    for (int64_t c = 0; c < nc; ++c) {
+                        if (GGML_FP16_TO_FP32(mp[c]) != -INFINITY) {
+                            visible = true;
+                            break;
+                        }
+                    }
+                }
+                if (!visible) {
+                    continue;
+                }
             }
 
-            float s; // KQ value
+            // KQ values of the chunk, as a single matrix multiplication if possible
+            bool kq_gemm = false;
+#if GGML_USE_LLAMAFILE
+            kq_gemm = llamafile_sgemm(nc, nr, D/ggml_blck_size(k->type),
+                                      (const char *) k->data + (ic0*nbk1 + ik2*nbk2 + ik3*nbk3),
+                                      nbk1/ggml_type_size(k->type),
+                                      Q32,
+                                      D,
+                                      KQ,
+                                      BK,
+                                      0, 1,
+                                      k->type,
+                                      GGML_TYPE_F32,
+                                      GGML_TYPE_F32) ||
+                      llamafile_sgemm(nc, nr, D/ggml_blck_size(k->type),
+                                      (const char *) k->data + (ic0*nbk1 + ik2*nbk2 + ik3*nbk3),
+                                      nbk1/ggml_type_size(k->type),
+                                      Q_q,
+                                      q_row_size/ggml_type_size(k_vec_dot_type),
+                                      KQ,
+                                      BK,
+                                      0, 1,
+                                      k->type,
+                                      k_vec_dot_type,
+                                      GGML_TYPE_F32);
+#endif
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+            for (int64_t r = 0; r < nr; ++r) {
+                const int64_t iq1 = i10 + r%nq;
 
-            s = s*scale; // scale KQ value
+                const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+                for (int64_t c = 0; c < nc; ++c) {
+                    const int64_t ic = ic0 + c;
 
-            s += mv; // apply mask
+                    const float mv = mp ? slope[r]*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+                    if (mv == -INFINITY) {
+                        KQ[r*BK + c] = -INFINITY;
+                        continue;
+                    }
 
-            const float Mold = M;
+                    float s; // KQ value
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                    if (kq_gemm) {
+                        s = KQ[r*BK + c];
+                    } else {
+                        const char * k_data = (const char *) k->data + (ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+                        kq_vec_dot(D, &s, 0, k_data, 0, Q_q + r*q_row_size, 0, 1);
+                    }
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                    s = s*scale; // scale KQ value
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                    KQ[r*BK + c] = s + mv; // apply mask
                 }
+            }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+            for (int64_t r = 0; r < nr; ++r) {
+                float * kq = KQ + r*BK;
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                float max = -INFINITY;
+                ggml_vec_max_f32(nc, &max, kq);
+
+                if (max == -INFINITY) {
+                    // no visible cell in this chunk
+                    memset(kq, 0, nc*sizeof(float));
+                    continue;
                 }
 
-                v_to_float(v_data, V32, D);
+                const float Mold = M[r];
+
+                M[r] = MAX(Mold, max);
+
+                // upon new higher max val, scale VKQ and KQ sum with this value
+                const float ms = expf(Mold - M[r]);
+
+                // kq = expf(kq - M)
+                const ggml_float sum = ggml_vec_soft_max_f32(nc, kq, kq, M[r]);
+
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(D, VKQ32 + r*D, ms);
+                }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                S[r] = S[r]*ms + sum; // scale and increment sum with partial sum
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
-        }
+            for (int64_t c = 0; c < nc; ++c) {
+                const int64_t ic = ic0 + c;
+
+                int64_t iv2_cur = -1;
+
+                for (int64_t r = 0; r < nr; ++r) {
+                    const float vs = KQ[r*BK + c];
+                    if (vs == 0.0f) {
+                        continue;
+                    }
+
+                    const int64_t iv2 = (h0 + r/nq) / rv2;
+                    if (iv2 != iv2_cur) {
+                        const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                        v_to_float(v_data, V32, D);
+                        iv2_cur = iv2;
+                    }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < D; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f32(D, VKQ32 + r*D, V32, vs);
+                }
             }
         }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(D, VKQ32, S_inv);
+        for (int64_t r = 0; r < nr; ++r) {
+            // V /= S
+            const float S_inv = S[r] == 0.0f ? 0.0f : 1.0f/S[r];
+            ggml_vec_scale_f32(D, VKQ32 + r*D, S_inv);
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+            // dst indices
+            const int64_t i1 = i10 + r%nq;
+            const int64_t i2 = h0 + r/nq;
+            const int64_t i3 = iq3;
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32 + r*D, nb1);
+        }
     }
 }
 
@@ -12921,6 +13205,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_INTERLEAVE:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -13601,8 +13886,10 @@ struct ggml_cplan ggml_graph_plan(
                 case GGML_OP_FLASH_ATTN_EXT:
                     {
                         const int64_t ne00 = node->src[0]->ne[0]; // D
+                        const int64_t ne02 = node->src[0]->ne[2]; // q heads
+                        const int64_t ne12 = node->src[1]->ne[2]; // K heads
 
-                        cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+                        cur = sizeof(float)*ggml_flash_attn_ext_wsize(ne00, MAX(GGML_FA_TILE_Q, ne02/ne12))*n_tasks;
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -13649,6 +13936,125 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// barrier elision
+//
+// consecutive nodes that do not touch each other's data form a segment and
+// run without a barrier in between, so that a thread that finishes its part of
+// one node moves on to the next instead of waiting for the slowest thread
+
+#define GGML_MAX_SEGMENT_NODES 16
+
+enum ggml_sched_class {
+    GGML_SCHED_EMPTY,     // computes nothing
+    GGML_SCHED_PRIVATE,   // only works on its own rows of src and dst
+    GGML_SCHED_SHARED,    // writes only dst, but uses the work buffer or the threadpool state
+    GGML_SCHED_EXCLUSIVE, // anything else, always runs between two barriers
+};
+
+struct ggml_compute_segment {
+    const struct ggml_tensor * nodes[GGML_MAX_SEGMENT_NODES];
+    int  n_nodes;
+    bool shared; // at most one shared node per segment
+    bool closed;
+};
+
+static enum ggml_sched_class ggml_node_sched_class(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return GGML_SCHED_EMPTY;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            // the quantized variants dequantize through the work buffer
+            return ggml_is_quantized(node->src[0]->type) ? GGML_SCHED_SHARED : GGML_SCHED_PRIVATE;
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+            // F16 and BF16 sources are converted through the work buffer
+            return node->src[0]->type == GGML_TYPE_F16 || node->src[0]->type == GGML_TYPE_BF16 ?
+                GGML_SCHED_SHARED : GGML_SCHED_PRIVATE;
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SCALE:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_CONCAT:
+            return GGML_SCHED_PRIVATE;
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_OUT_PROD:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_FLASH_ATTN_EXT:
+            return GGML_SCHED_SHARED;
+        default:
+            return GGML_SCHED_EXCLUSIVE;
+    }
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_nelements(a) == 0 || ggml_nelements(b) == 0) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// node reads data written by s, or writes data that s reads or writes
+static bool ggml_node_depends(const struct ggml_tensor * node, const struct ggml_tensor * s) {
+    if (ggml_tensors_overlap(node, s)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; i++) {
+        if (node->src[i] && ggml_tensors_overlap(node->src[i], s)) {
+            return true;
+        }
+        if (s->src[i] && ggml_tensors_overlap(node, s->src[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// adds node to the segment, returns false if a barrier is needed before it
+static bool ggml_compute_segment_add(struct ggml_compute_segment * seg, const struct ggml_tensor * node) {
+    const enum ggml_sched_class sc = ggml_node_sched_class(node);
+
+    if (sc == GGML_SCHED_EMPTY) {
+        return true;
+    }
+
+    if (seg->n_nodes > 0) {
+        if (seg->closed || seg->n_nodes == GGML_MAX_SEGMENT_NODES || sc == GGML_SCHED_EXCLUSIVE ||
+                (sc == GGML_SCHED_SHARED && seg->shared)) {
+            return false;
+        }
+
+        for (int i = 0; i < seg->n_nodes; i++) {
+            if (ggml_node_depends(node, seg->nodes[i])) {
+                return false;
+            }
+        }
+    }
+
+    seg->nodes[seg->n_nodes++] = node;
+    seg->shared = seg->shared || sc == GGML_SCHED_SHARED;
+    seg->closed = sc == GGML_SCHED_EXCLUSIVE;
+
+    return true;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -13666,20 +14072,45 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
+    struct ggml_compute_segment seg = { /*.nodes =*/ { NULL }, /*.n_nodes =*/ 0, /*.shared =*/ false, /*.closed =*/ false };
+
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        // every thread makes the same decision, so they all reach the same barriers
+        const bool barrier = params.nth == 1 ? node_n > 0 : !ggml_compute_segment_add(&seg, node);
 
-        if (state->ith == 0 && cplan->abort_callback &&
-                cplan->abort_callback(cplan->abort_callback_data)) {
-            tp->abort = true;
-            tp->ec    = GGML_STATUS_ABORTED;
+        if (barrier) {
+            // abort is only checked between segments, where all threads agree on it
+            if (state->ith == 0 && cplan->abort_callback &&
+                    cplan->abort_callback(cplan->abort_callback_data)) {
+                tp->abort = true;
+                tp->ec    = GGML_STATUS_ABORTED;
+            }
+
+            ggml_barrier(state->threadpool);
+
+            if (tp->abort) {
+                return 0;
+            }
+
+            seg.n_nodes = 0;
+            seg.shared  = false;
+            seg.closed  = false;
+            ggml_compute_segment_add(&seg, node);
         }
 
-        ggml_barrier(state->threadpool);
+        ggml_compute_forward(&params, node);
+    }
+
+    if (state->ith == 0 && cplan->abort_callback &&
+            cplan->abort_callback(cplan->abort_callback_data)) {
+        tp->abort = true;
+        tp->ec    = GGML_STATUS_ABORTED;
     }
 
+    ggml_barrier(state->threadpool);
+
     return 0;
 }
 
@@ -13979,6 +14410,17 @@ enum ggml_status ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct g
     return ggml_graph_compute(cgraph, &cplan);
 }
 
+double ggml_cpu_sum_exp_f32(int n, const float * x, float max) {
+    // the exponentials go through a small buffer that stays in cache
+    float buf[1024];
+
+    ggml_float sum = 0;
+    for (int i = 0; i < n; i += 1024) {
+        sum += ggml_vec_soft_max_f32(MIN(1024, n - i), buf, x + i, max);
+    }
+
+    return sum;
+}
 
 int ggml_cpu_has_avx(void) {
 #if defined(__AVX__)
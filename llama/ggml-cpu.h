@@ -54,11 +54,13 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_INTERLEAVE = 5,
         GGML_NUMA_STRATEGY_COUNT
     };
 
     GGML_BACKEND_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_BACKEND_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_BACKEND_API void    ggml_numa_place_tensor(const struct ggml_tensor * tensor); // interleave strategy: move the rows of a weight to the nodes that use them
 
     GGML_BACKEND_API struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value);
     GGML_BACKEND_API struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value);
@@ -96,6 +98,9 @@ extern "C" {
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_BACKEND_API enum ggml_status  ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
 
+    // sum of expf(x[i] - max) over n values, vectorized like the softmax of the graph, e.g. for the log-sum-exp of logits
+    GGML_BACKEND_API double ggml_cpu_sum_exp_f32(int n, const float * x, float max);
+
     //
     // system info
     //
@@ -28,11 +28,26 @@
 
 #include "llama-vocab.h"
 #include "llama-sampling.h"
+#include "unicode.h"
 
 #include <cmath>
 #include <algorithm>
+#include <deque>
+#include <set>
 #include <stdexcept>
 
+// below this many candidates, llama_grammar_apply_impl checks each one instead of computing the mask of the vocab
+#define LLAMA_GRAMMAR_MASK_MIN_CANDIDATES 64
+
+// at most this many masks are kept per compiled grammar, about 16 KiB each for a vocab of 128k tokens
+#define LLAMA_GRAMMAR_MASK_CACHE_SIZE 256
+
+// llama_grammar_precompute_impl follows the states with at most this many possible next characters
+#define LLAMA_GRAMMAR_PRECOMPUTE_MAX_CHARS 8
+
+// llama_grammar_forced_tokens_impl looks at most this many characters ahead
+#define LLAMA_GRAMMAR_FORCED_MAX_CHARS 256
+
 //
 // helpers
 //
@@ -985,9 +1000,11 @@ struct llama_grammar * llama_grammar_init_impl(
     } while (true);
 
     // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
+    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar_compiled
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    std::shared_ptr<llama_grammar_compiled> compiled(new llama_grammar_compiled { std::move(vec_rules), std::move(stacks), {}, {}, });
+
+    return new llama_grammar { vocab, compiled, compiled->rules, compiled->stacks, {}, };
 }
 
 struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab, const char * grammar_str, const char * grammar_root) {
@@ -1063,9 +1080,11 @@ struct llama_grammar * llama_grammar_init_impl(const struct llama_vocab * vocab,
     } while (true);
 
     // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
+    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar_compiled
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar { vocab, std::move(vec_rules), std::move(stacks), {}, };
+    std::shared_ptr<llama_grammar_compiled> compiled(new llama_grammar_compiled { std::move(vec_rules), std::move(stacks), {}, {}, });
+
+    return new llama_grammar { vocab, compiled, compiled->rules, compiled->stacks, {}, };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -1077,19 +1096,314 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
+    // the stacks point into the shared rules, so they can be copied as they are
+    return new llama_grammar { grammar.vocab, grammar.compiled, grammar.rules, grammar.stacks, grammar.partial_utf8, };
+}
+
+void llama_grammar_reset_impl(struct llama_grammar & grammar) {
+    grammar.stacks       = grammar.compiled->stacks;
+    grammar.partial_utf8 = {};
+}
+
+// state of the walk over the piece trie after some bytes of a token
+struct llama_grammar_trie_state {
+    size_t               stacks_at;    // depth of the state holding the current stacks
+    llama_grammar_stacks stacks;       // stacks after the last complete code point, if it ended at this depth
+    llama_partial_utf8   partial_utf8;
+    bool                 continued;    // completing the partial sequence of the accepted tokens
+};
+
+// marks the tokens that the grammar accepts next, by walking the piece trie of the vocab with the stacks after each
+// prefix, so that the prefixes shared by many tokens are matched once and a rejected prefix rejects its whole subtree.
+// gives the same result as decode_utf8 and llama_grammar_reject_candidates for each token. end of generation tokens
+// are not marked
+static void llama_grammar_token_mask(const struct llama_grammar & grammar, std::vector<bool> & mask) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+    const auto & vocab = *grammar.vocab;
+    const auto & trie  = vocab.piece_trie;
+
+    mask.assign(vocab.cache_token_to_piece.size(), false);
+
+    std::vector<llama_grammar_trie_state> states(1);
+    states[0].stacks_at    = 0;
+    states[0].stacks       = grammar.stacks;
+    states[0].partial_utf8 = grammar.partial_utf8.n_remain > 0 ? grammar.partial_utf8 : llama_partial_utf8{ 0, 0 };
+    states[0].continued    = grammar.partial_utf8.n_remain > 0;
+
+    for (uint32_t i = 1; i < trie.size(); ) {
+        const auto & node = trie[i];
+        if (states.size() <= node.depth) {
+            states.resize(node.depth + 1);
+        }
+
+        const auto & parent = states[node.depth - 1];
+              auto & cur    = states[node.depth];
+
+        const uint8_t b = node.byte;
+
+        uint32_t value    = parent.partial_utf8.value;
+        int      n_remain = parent.partial_utf8.n_remain;
+        bool     complete;
+
+        if (n_remain > 0) {
+            if (parent.continued && (b >> 6) != 2) {
+                // invalid sequence
+                i = node.end;
+                continue;
+            }
+            value    = (value << 6) + (b & 0x3F);
+            n_remain = n_remain - 1;
+            complete = n_remain == 0;
+
+            cur.continued = parent.continued && !complete;
+        } else {
+            n_remain = lookup[b >> 4] - 1;
+            if (n_remain < 0) {
+                // invalid sequence
+                i = node.end;
+                continue;
+            }
+            value    = b & ((1 << (7 - n_remain)) - 1);
+            complete = n_remain == 0;
+
+            cur.continued = false;
+        }
+
+        cur.stacks_at    = parent.stacks_at;
+        cur.partial_utf8 = { value, n_remain };
+
+        if (complete) {
+            if (value == 0) {
+                // a null code point ends the decoded token early, never accept it
+                i = node.end;
+                continue;
+            }
+            llama_grammar_accept(grammar.rules, states[parent.stacks_at].stacks, value, cur.stacks);
+            if (cur.stacks.empty()) {
+                i = node.end;
+                continue;
+            }
+            cur.stacks_at = node.depth;
+        }
+
+        const uint32_t tok_end = i + 1 < trie.size() ? trie[i + 1].tok_begin : vocab.piece_trie_tokens.size();
+        if (node.tok_begin < tok_end) {
+            // a token ending in a partial sequence needs a stack that some continuation of it could satisfy
+            bool accept = n_remain == 0;
+            for (const auto & stack : states[cur.stacks_at].stacks) {
+                if (accept) {
+                    break;
+                }
+                accept = !stack.empty() && llama_grammar_match_partial_char(stack.back(), cur.partial_utf8);
+            }
+
+            if (accept) {
+                for (uint32_t j = node.tok_begin; j < tok_end; ++j) {
+                    const llama_token id = vocab.piece_trie_tokens[j];
+                    if (!llama_token_is_eog_impl(vocab, id)) {
+                        mask[id] = true;
                     }
                 }
             }
         }
+
+        i++;
+    }
+}
+
+static llama_grammar_mask_key llama_grammar_get_mask_key(const struct llama_grammar & grammar) {
+    llama_grammar_mask_key key;
+    key.first = grammar.stacks;
+    std::sort(key.first.begin(), key.first.end());
+    // the value of a complete sequence does not matter
+    if (grammar.partial_utf8.n_remain > 0) {
+        key.second = { grammar.partial_utf8.value, grammar.partial_utf8.n_remain };
+    } else {
+        key.second = { 0, 0 };
+    }
+    return key;
+}
+
+// returns the mask of the current state, computing it if it is not cached and compute is set, or nullptr
+static std::shared_ptr<const std::vector<bool>> llama_grammar_get_mask(const struct llama_grammar & grammar, bool compute) {
+    auto & compiled = *grammar.compiled;
+
+    auto key = llama_grammar_get_mask_key(grammar);
+    {
+        std::lock_guard<std::mutex> lock(compiled.mask_mutex);
+        auto it = compiled.masks.find(key);
+        if (it != compiled.masks.end()) {
+            return it->second;
+        }
+    }
+
+    if (!compute || grammar.vocab->piece_trie.empty()) {
+        return nullptr;
+    }
+
+    auto mask = std::make_shared<std::vector<bool>>();
+    llama_grammar_token_mask(grammar, *mask);
+
+    std::lock_guard<std::mutex> lock(compiled.mask_mutex);
+    if (compiled.masks.size() >= LLAMA_GRAMMAR_MASK_CACHE_SIZE) {
+        compiled.masks.clear();
+    }
+    compiled.masks.emplace(std::move(key), mask);
+    return mask;
+}
+
+// collects the characters that the stacks accept next, returns false if there are more than max_chars
+static bool llama_grammar_next_chars(const llama_grammar_stacks & stacks, size_t max_chars, std::vector<uint32_t> & chars) {
+    chars.clear();
+
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+
+        const llama_grammar_element * pos = stack.back();
+        if (pos->type != LLAMA_GRETYPE_CHAR) {
+            return false;
+        }
+
+        do {
+            const uint32_t first = pos->value;
+            const uint32_t last  = pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? pos[1].value : first;
+            if (last >= first + max_chars) {
+                return false;
+            }
+            for (uint32_t chr = first; chr <= last; ++chr) {
+                if (std::find(chars.begin(), chars.end(), chr) == chars.end()) {
+                    chars.push_back(chr);
+                }
+            }
+            if (chars.size() > max_chars) {
+                return false;
+            }
+            pos += pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER ? 2 : 1;
+        } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+    }
+
+    return true;
+}
+
+void llama_grammar_precompute_impl(const struct llama_grammar & grammar, int32_t n_states) {
+    if (grammar.vocab == nullptr || grammar.vocab->piece_trie.empty() || grammar.partial_utf8.n_remain > 0) {
+        return;
+    }
+
+    std::set<llama_grammar_stacks> seen;
+    std::deque<llama_grammar_stacks> queue = { grammar.stacks };
+
+    std::vector<uint32_t> chars;
+    llama_grammar_stacks  stacks_new;
+
+    // breadth first, one character at a time, as tokens can end after any of them
+    while (!queue.empty() && (int32_t) seen.size() < n_states) {
+        llama_grammar state { grammar.vocab, grammar.compiled, grammar.rules, std::move(queue.front()), {}, };
+        queue.pop_front();
+
+        std::sort(state.stacks.begin(), state.stacks.end());
+        if (!seen.insert(state.stacks).second) {
+            continue;
+        }
+
+        llama_grammar_get_mask(state, true);
+
+        if (!llama_grammar_next_chars(state.stacks, LLAMA_GRAMMAR_PRECOMPUTE_MAX_CHARS, chars)) {
+            continue;
+        }
+
+        for (const uint32_t chr : chars) {
+            if (chr == 0) {
+                continue;
+            }
+            llama_grammar_accept(grammar.rules, state.stacks, chr, stacks_new);
+            if (!stacks_new.empty()) {
+                queue.push_back(std::move(stacks_new));
+            }
+        }
+    }
+}
+
+std::vector<llama_token> llama_grammar_forced_tokens_impl(const struct llama_grammar & grammar, int32_t n_max) {
+    std::vector<llama_token> result;
+
+    if (grammar.vocab == nullptr || grammar.vocab->piece_trie.empty() || grammar.partial_utf8.n_remain > 0 || n_max <= 0) {
+        return result;
+    }
+
+    const auto & vocab = *grammar.vocab;
+    const auto & trie  = vocab.piece_trie;
+
+    // the text that follows while every stack expects the same character and the grammar cannot end
+    std::string text;
+    {
+        llama_grammar_stacks stacks = grammar.stacks;
+        llama_grammar_stacks stacks_new;
+        std::vector<uint32_t> chars;
+
+        for (int i = 0; i < LLAMA_GRAMMAR_FORCED_MAX_CHARS; ++i) {
+            if (std::any_of(stacks.begin(), stacks.end(), [](const llama_grammar_stack & stack) { return stack.empty(); })) {
+                break;
+            }
+            if (!llama_grammar_next_chars(stacks, 1, chars) || chars.size() != 1 || chars[0] == 0) {
+                break;
+            }
+            llama_grammar_accept(grammar.rules, stacks, chars[0], stacks_new);
+            if (stacks_new.empty()) {
+                break;
+            }
+            stacks = std::move(stacks_new);
+            text += unicode_cpt_to_utf8(chars[0]);
+        }
+    }
+
+    // split it into the longest tokens from the start, skipping the control tokens whose text would match
+    size_t   pos       = 0;
+    uint32_t last_node = 0;
+    while (pos < text.size() && (int32_t) result.size() < n_max) {
+        llama_token best     = LLAMA_TOKEN_NULL;
+        size_t      best_len = 0;
+
+        for (uint32_t node = 0, len = 0; pos + len < text.size(); ) {
+            const uint8_t b = text[pos + len];
+
+            uint32_t child = node + 1;
+            while (child < trie[node].end && trie[child].byte != b) {
+                child = trie[child].end;
+            }
+            if (child >= trie[node].end) {
+                break;
+            }
+            node = child;
+            len++;
+
+            const uint32_t tok_end = node + 1 < trie.size() ? trie[node + 1].tok_begin : vocab.piece_trie_tokens.size();
+            for (uint32_t j = trie[node].tok_begin; j < tok_end; ++j) {
+                const llama_token id = vocab.piece_trie_tokens[j];
+                if (!llama_token_is_control_impl(vocab, id) && !llama_token_is_eog_impl(vocab, id)) {
+                    best      = id;
+                    best_len  = len;
+                    last_node = node;
+                    break;
+                }
+            }
+        }
+
+        if (best == LLAMA_TOKEN_NULL) {
+            break;
+        }
+
+        result.push_back(best);
+        pos += best_len;
+    }
+
+    // a token that ends the forced text and is the prefix of longer tokens may be merged by the model with what comes
+    // next, leave it to be sampled
+    if (!result.empty() && pos == text.size() && trie[last_node].end > last_node + 1) {
+        result.pop_back();
     }
 
     return result;
@@ -1106,6 +1420,26 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
+    // computing the mask costs more than checking a few candidates, such as the single token checked by
+    // common_sampler_sample before the grammar is applied to the whole vocab
+    const auto mask = llama_grammar_get_mask(grammar, cur_p->size > LLAMA_GRAMMAR_MASK_MIN_CANDIDATES);
+
+    if (mask) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+
+            if (llama_token_is_eog_impl(*grammar.vocab, id)) {
+                if (!allow_eog) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            } else if (!(*mask)[id]) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+
+        return;
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(cur_p->size);
 
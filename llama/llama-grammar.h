@@ -29,6 +29,8 @@
 #include "llama-impl.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
 
 struct llama_vocab;
 
@@ -84,6 +86,9 @@ using llama_grammar_rules      = std::vector<llama_grammar_rule>;
 using llama_grammar_stacks     = std::vector<llama_grammar_stack>;
 using llama_grammar_candidates = std::vector<llama_grammar_candidate>;
 
+// sorted stacks and the partial UTF-8 sequence, which together decide the tokens the grammar accepts next
+using llama_grammar_mask_key = std::pair<llama_grammar_stacks, std::pair<uint32_t, int>>;
+
 const llama_grammar_rules  & llama_grammar_get_rules (const struct llama_grammar * grammar);
       llama_grammar_stacks & llama_grammar_get_stacks(      struct llama_grammar * grammar);
 
@@ -132,12 +137,25 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// the parsed and checked form of a grammar, shared by a grammar and its clones
+struct llama_grammar_compiled {
+    const llama_grammar_rules  rules;
+    const llama_grammar_stacks stacks; // initial stacks
+
+    // tokens accepted in each state seen so far by any of the grammars sharing this, the same states come back often
+    // (e.g. inside JSON strings). the stacks in the keys point into rules
+    std::mutex mask_mutex;
+    std::map<llama_grammar_mask_key, std::shared_ptr<const std::vector<bool>>> masks;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    std::shared_ptr<llama_grammar_compiled> compiled;
+
+    const llama_grammar_rules  & rules;  // compiled->rules
+          llama_grammar_stacks   stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
@@ -160,6 +178,17 @@ void llama_grammar_free_impl(struct llama_grammar * grammar);
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar);
 
+// computes the masks of the states reachable from the current one by accepting characters, as long as there are at
+// most a few possible next characters (literals, keys, punctuation), up to n_states states
+void llama_grammar_precompute_impl(const struct llama_grammar & grammar, int32_t n_states);
+
+// back to the initial stacks
+void llama_grammar_reset_impl(struct llama_grammar & grammar);
+
+// tokens that the grammar forces next, the text is split into the longest tokens of the vocab. a last token that
+// could be extended by the text after the forced one is left out. returns at most n_max tokens
+std::vector<llama_token> llama_grammar_forced_tokens_impl(const struct llama_grammar & grammar, int32_t n_max);
+
 // TODO: move the API below as member functions of llama_grammar
 void llama_grammar_apply_impl(
         const struct llama_grammar & grammar,
@@ -1349,10 +1349,7 @@ static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
         return;
     }
 
-    auto * grammar_new = llama_grammar_init_impl(ctx->grammar->vocab, ctx->grammar_str.c_str(), ctx->grammar_root.c_str());
-
-    llama_grammar_free_impl(ctx->grammar);
-    ctx->grammar = grammar_new;
+    llama_grammar_reset_impl(*ctx->grammar);
 }
 
 static struct llama_sampler * llama_sampler_grammar_clone(const struct llama_sampler * smpl) {
@@ -1419,6 +1416,7 @@ struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab
     };
 }
 
+
 // penalties
 
 struct llama_sampler_penalties {
@@ -2338,6 +2336,36 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
     return LLAMA_DEFAULT_SEED;
 }
 
+int32_t llama_sampler_grammar_forced_tokens(const struct llama_sampler * smpl, llama_token * tokens, int32_t n_tokens_max) {
+    if (smpl->iface != &llama_sampler_grammar_i) {
+        return 0;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (!ctx->grammar) {
+        return 0;
+    }
+
+    const auto result = llama_grammar_forced_tokens_impl(*ctx->grammar, n_tokens_max);
+    std::copy(result.begin(), result.end(), tokens);
+
+    return result.size();
+}
+
+// most states worth computing ahead of time are on the way to the first value of a schema
+#define LLAMA_GRAMMAR_PRECOMPUTE_STATES 128
+
+void llama_sampler_grammar_precompute(const struct llama_sampler * smpl) {
+    if (smpl->iface != &llama_sampler_grammar_i) {
+        return;
+    }
+
+    const auto * ctx = (const llama_sampler_grammar *) smpl->ctx;
+    if (ctx->grammar) {
+        llama_grammar_precompute_impl(*ctx->grammar, LLAMA_GRAMMAR_PRECOMPUTE_STATES);
+    }
+}
+
 // perf
 
 struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * chain) {
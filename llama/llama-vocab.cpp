@@ -35,8 +35,11 @@
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <map>
 #include <queue>
 #include <sstream>
+#include <string_view>
+#include <thread>
 
 //
 // helpers
@@ -114,20 +117,6 @@ llama_vocab::~llama_vocab() {
     delete tokenizer;
 }
 
-int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string & token_right) const {
-    GGML_ASSERT(token_left.find(' ')   == std::string::npos);
-    GGML_ASSERT(token_left.find('\n')  == std::string::npos);
-    GGML_ASSERT(token_right.find(' ')  == std::string::npos);
-    GGML_ASSERT(token_right.find('\n') == std::string::npos);
-
-    auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-    if (it == bpe_ranks.end()) {
-        return -1;
-    }
-
-    return it->second;
-}
-
 static enum llama_vocab_type llama_vocab_get_type(const llama_vocab & vocab) {
     return vocab.type;
 }
@@ -387,11 +376,20 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_vocab::id id; // id of the merged piece
     int rank;
     size_t size;
 };
 
+// a BPE merge in the hash table of llm_tokenizer_bpe
+struct llm_bpe_merge {
+    static constexpr uint64_t EMPTY = UINT64_MAX;
+
+    uint64_t key;  // ids of the left and right pieces, EMPTY if the slot is unused
+    int32_t  rank;
+    int32_t  id;   // id of the merged piece
+};
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) : llm_tokenizer() {
         GGML_ASSERT(vocab.type == LLAMA_VOCAB_TYPE_BPE);
@@ -515,9 +513,80 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        init_merges(vocab);
+    }
+
+    const llm_bpe_merge * find_merge(llama_vocab::id left, llama_vocab::id right) const {
+        if (left < 0 || right < 0) {
+            return nullptr;
+        }
+        const uint64_t key = (uint64_t) left << 32 | (uint32_t) right;
+        for (size_t i = merge_slot(key); ; i = (i + 1) & (merges.size() - 1)) {
+            if (merges[i].key == key) {
+                return &merges[i];
+            }
+            if (merges[i].key == llm_bpe_merge::EMPTY) {
+                return nullptr;
+            }
+        }
     }
 
     std::vector<std::string> regex_exprs;
+
+    int32_t n_vocab = 0;
+
+    // ids after the vocab for the pieces of merges that are not in it
+    std::unordered_map<std::string, llama_vocab::id> extra_ids;
+
+private:
+    size_t merge_slot(uint64_t key) const {
+        return (key * 0x9E3779B97F4A7C15ull) >> (64 - merge_bits);
+    }
+
+    // indexes the merges by the ids of their pieces in an open addressing table
+    // with linear probing, kept at most half full
+    void init_merges(const llama_vocab & vocab) {
+        n_vocab = vocab.id_to_token.size();
+
+        merge_bits = 4;
+        while (((size_t) 1 << merge_bits) < 2*vocab.bpe_merges.size()) {
+            merge_bits++;
+        }
+        merges.assign((size_t) 1 << merge_bits, {llm_bpe_merge::EMPTY, 0, 0});
+
+        const auto get_id = [&](const std::string & piece) {
+            const auto it = vocab.token_to_id.find(piece);
+            if (it != vocab.token_to_id.end()) {
+                return it->second;
+            }
+            return extra_ids.emplace(piece, n_vocab + (int32_t) extra_ids.size()).first->second;
+        };
+
+        for (size_t rank = 0; rank < vocab.bpe_merges.size(); ++rank) {
+            const auto & merge = vocab.bpe_merges[rank];
+            if (merge.first.empty() || merge.second.empty()) {
+                continue;
+            }
+
+            const int32_t left  = get_id(merge.first);
+            const int32_t right = get_id(merge.second);
+            const int32_t id    = get_id(merge.first + merge.second);
+
+            const uint64_t key = (uint64_t) left << 32 | (uint32_t) right;
+            size_t i = merge_slot(key);
+            while (merges[i].key != llm_bpe_merge::EMPTY && merges[i].key != key) {
+                i = (i + 1) & (merges.size() - 1);
+            }
+            // the first of duplicate merges has the lowest rank
+            if (merges[i].key == llm_bpe_merge::EMPTY) {
+                merges[i] = {key, (int32_t) rank, id};
+            }
+        }
+    }
+
+    std::vector<llm_bpe_merge> merges;
+    int merge_bits = 0;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -562,122 +631,183 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
 
-        symbols_final.clear();
+        tokenize(word_collection.data(), word_collection.data() + word_collection.size(), output);
+    }
 
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+    // same as tokenize, with the words of long texts merged on up to n_threads threads. the pre-tokenizer splits the
+    // whole text at once, and its words are cut into chunks of about the same size that are merged by sessions of
+    // their own. words are merged independently of each other, so the tokens are the same as with a single thread
+    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output, int32_t n_threads) {
+        const size_t n_chunks = std::min<size_t>(std::max(n_threads, 1), text.size() / min_chunk_size);
+        if (n_chunks <= 1) {
+            tokenize(text, output);
+            return;
+        }
 
-            int index = 0;
-            size_t offset = 0;
+        const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
+        const std::string * words = word_collection.data();
+
+        size_t n_bytes = 0;
+        for (const auto & word : word_collection) {
+            n_bytes += word.size();
+        }
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        // first word of each chunk
+        std::vector<size_t> bounds = { 0 };
+        size_t n_chunk_bytes = 0;
+        for (size_t i = 0; i < word_collection.size() && bounds.size() < n_chunks; ++i) {
+            n_chunk_bytes += word_collection[i].size();
+            if (n_chunk_bytes * n_chunks >= n_bytes * bounds.size()) {
+                bounds.push_back(i + 1);
             }
+        }
+        bounds.push_back(word_collection.size());
+
+        std::vector<std::vector<llama_vocab::id>> outputs(bounds.size() - 1);
+        std::vector<std::thread> workers;
+        workers.reserve(outputs.size() - 1);
+        for (size_t c = 1; c < outputs.size(); ++c) {
+            workers.emplace_back([&, c]() {
+                llm_tokenizer_bpe_session session(vocab);
+                session.tokenize(words + bounds[c], words + bounds[c + 1], outputs[c]);
+            });
+        }
+
+        tokenize(words + bounds[0], words + bounds[1], output);
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        for (size_t c = 1; c < outputs.size(); ++c) {
+            output.insert(output.end(), outputs[c].begin(), outputs[c].end());
+        }
+    }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+private:
+    static constexpr size_t max_cached_words = 65536;
+
+    // smallest text worth giving a thread of its own
+    static constexpr size_t min_chunk_size = 32*1024;
+
+    // merges the words [begin, end) of the pre-tokenizer
+    void tokenize(const std::string * begin, const std::string * end, std::vector<llama_vocab::id> & output) {
+        for (const std::string * it = begin; it != end; ++it) {
+            const std::string & word = *it;
+
+            // frequent words are only merged once per session
+            const auto cached = cache.find(word);
+            if (cached != cache.end()) {
+                output.insert(output.end(), cached->second.begin(), cached->second.end());
+                continue;
             }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+
+            const size_t n_output = output.size();
+            tokenize_word(word, output);
+
+            if (cache.size() < max_cached_words) {
+                cache.emplace(word, std::vector<llama_vocab::id>(output.begin() + n_output, output.end()));
             }
+        }
+    }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+    // id of a piece in the vocab or among the extra pieces of the merges, -1 if neither
+    llama_vocab::id piece_id(const std::string & piece) const {
+        const auto it = vocab.token_to_id.find(piece);
+        if (it != vocab.token_to_id.end()) {
+            return it->second;
+        }
+        const auto extra = bpe_tokenizer->extra_ids.find(piece);
+        return extra != bpe_tokenizer->extra_ids.end() ? extra->second : -1;
+    }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_ids.clear();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        int index = 0;
+        size_t offset = 0;
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            symbol_ids.push_back(vocab.token_to_id.at(word));
+            offset = word.size();
+        }
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_ids.push_back(piece_id(std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
+
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
+
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // symbols only grow, so the bigram is outdated if either side changed size
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_ids[bigram.left] = bigram.id;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            const llama_vocab::id id = symbol_ids[i];
+            if (id >= 0 && id < bpe_tokenizer->n_vocab) {
+                output.push_back(id);
+                continue;
+            }
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
-                    }
-                } else {
-                    output.push_back((*token).second);
+            for (size_t j = 0; j < symbol.n; ++j) {
+                std::string byte_str(1, symbol.text[j]);
+                auto token_multibyte = vocab.token_to_id.find(byte_str);
+                if (token_multibyte != vocab.token_to_id.end()) {
+                    output.push_back(token_multibyte->second);
                 }
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
 
-        int rank_found = -1;
-
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
+        const llm_bpe_merge * merge = bpe_tokenizer->find_merge(symbol_ids[left], symbol_ids[right]);
+        if (merge == nullptr) {
             return;
         }
 
@@ -685,9 +815,9 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.id    = merge->id;
+        bigram.size  = symbols[left].n + symbols[right].n;
+        bigram.rank  = merge->rank;
 
         work_queue.push(bigram);
     }
@@ -696,8 +826,11 @@ private:
     const llm_tokenizer_bpe * bpe_tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llama_vocab::id> symbol_ids; // id of each symbol, see piece_id
     llm_bigram_bpe::queue work_queue;
+
+    // tokens of the words seen in this session
+    std::unordered_map<std::string, std::vector<llama_vocab::id>> cache;
 };
 
 //
@@ -1301,6 +1434,137 @@ void llama_vocab::init_tokenizer() {
     }
 }
 
+void llama_vocab::init_piece_trie() {
+    // the pieces as the grammar decodes them, up to the first null byte
+    auto piece = [&](id token) {
+        return std::string_view(cache_token_to_piece[token].c_str());
+    };
+
+    std::vector<id> tokens;
+    tokens.reserve(cache_token_to_piece.size());
+    for (id token = 0; token < (id) cache_token_to_piece.size(); ++token) {
+        if (!piece(token).empty()) {
+            tokens.push_back(token);
+        }
+    }
+
+    // in sorted order, a piece follows all of its prefixes and the pieces sharing a prefix are adjacent
+    std::sort(tokens.begin(), tokens.end(), [&](id a, id b) {
+        const auto pa = piece(a);
+        const auto pb = piece(b);
+        return pa != pb ? pa < pb : a < b;
+    });
+
+    piece_trie.clear();
+    piece_trie_tokens.clear();
+    piece_trie_tokens.reserve(tokens.size());
+
+    piece_trie.push_back({ 0, 0, 0, 0 });
+
+    // nodes from the root to the current one
+    std::vector<uint32_t> path = { 0 };
+    std::string_view prev;
+
+    for (const id token : tokens) {
+        const auto cur = piece(token);
+
+        size_t n_shared = 0;
+        while (n_shared < cur.size() && n_shared < prev.size() && cur[n_shared] == prev[n_shared]) {
+            n_shared++;
+        }
+
+        while (path.size() > n_shared + 1) {
+            piece_trie[path.back()].end = piece_trie.size();
+            path.pop_back();
+        }
+
+        for (size_t i = n_shared; i < cur.size(); ++i) {
+            path.push_back(piece_trie.size());
+            piece_trie.push_back({ 0, (uint32_t) piece_trie_tokens.size(), (uint32_t) i + 1, (uint8_t) cur[i] });
+        }
+
+        piece_trie_tokens.push_back(token);
+        prev = cur;
+    }
+
+    while (!path.empty()) {
+        piece_trie[path.back()].end = piece_trie.size();
+        path.pop_back();
+    }
+}
+
+void llama_vocab::init_special_ac() {
+    // trie of the special tokens. all the tokens with the same text end at the same node, as which of them matches
+    // depends on their type and on whether special tokens are parsed
+    std::vector<std::map<uint8_t, uint32_t>> children(1);
+    std::vector<std::vector<int32_t>> specials(1);
+    special_ac.assign(1, { 0, 0, 0, -1, 0, 0 });
+
+    for (size_t i = 0; i < cache_special_tokens.size(); ++i) {
+        const auto & text = id_to_token[cache_special_tokens[i]].text;
+        if (text.empty()) {
+            continue;
+        }
+
+        uint32_t node = 0;
+        for (const char c : text) {
+            const auto it = children[node].find((uint8_t) c);
+            if (it != children[node].end()) {
+                node = it->second;
+                continue;
+            }
+            children[node][(uint8_t) c] = special_ac.size();
+            node = special_ac.size();
+            children.emplace_back();
+            specials.emplace_back();
+            special_ac.push_back({ 0, 0, 0, -1, 0, 0 });
+        }
+
+        specials[node].push_back(i);
+    }
+
+    // fail and dictionary links, in breadth-first order so that the links of the shorter prefixes are set first
+    special_ac_edges.clear();
+    special_ac_specials.clear();
+
+    std::vector<uint32_t> queue = { 0 };
+    for (size_t q = 0; q < queue.size(); ++q) {
+        const uint32_t node = queue[q];
+
+        special_ac[node].edges   = special_ac_edges.size();
+        special_ac[node].n_edges = children[node].size();
+
+        special_ac[node].specials   = special_ac_specials.size();
+        special_ac[node].n_specials = specials[node].size();
+        special_ac_specials.insert(special_ac_specials.end(), specials[node].begin(), specials[node].end());
+
+        for (const auto & [c, child] : children[node]) {
+            special_ac_edges.emplace_back(c, child);
+
+            uint32_t fail = 0;
+            if (node != 0) {
+                uint32_t f = special_ac[node].fail;
+                while (true) {
+                    const auto it = children[f].find(c);
+                    if (it != children[f].end()) {
+                        fail = it->second;
+                        break;
+                    }
+                    if (f == 0) {
+                        break;
+                    }
+                    f = special_ac[f].fail;
+                }
+            }
+
+            special_ac[child].fail = fail;
+            special_ac[child].dict = !specials[fail].empty() ? (int32_t) fail : special_ac[fail].dict;
+
+            queue.push_back(child);
+        }
+    }
+}
+
 //
 // (de-) tokenize
 //
@@ -1341,122 +1605,148 @@ struct fragment_buffer_variant {
 
 // #define PRETOKENIZERDEBUG
 
-static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) {
-    // for each special token
-    for (const llama_vocab::id special_id : vocab.cache_special_tokens) {
-        const auto & data = vocab.id_to_token[special_id];
-        const auto & special_token = data.text;
-
-        if (!parse_special && (data.attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN))) {
-            // Ignore control and unknown tokens when parse_special == false
-            continue;
-            // User-defined tokens are still pre-tokenized before everything else
-            // ref: https://github.com/huggingface/tokenizers/blob/fdd26ba9a3f0c133427aab0423888cbde91362d7/tokenizers/src/tokenizer/mod.rs#L726
-            // This is mostly relevant for neox-style tokenizers (mpt, olmo, stablelm, etc.)
+// appends the occurrences of the special tokens in raw_text[offset, offset + length), as the index of the token in
+// cache_special_tokens and the position of the occurrence
+static void tokenizer_st_find(
+        const llama_vocab & vocab,
+        const std::string & raw_text,
+        uint64_t offset,
+        uint64_t length,
+        std::vector<std::pair<int32_t, uint64_t>> & matches) {
+    const auto & ac       = vocab.special_ac;
+    const auto & edges    = vocab.special_ac_edges;
+    const auto & specials = vocab.special_ac_specials;
+
+    uint32_t node = 0;
+    for (uint64_t pos = offset; pos < offset + length; ++pos) {
+        const uint8_t c = raw_text[pos];
+
+        while (true) {
+            const auto begin = edges.begin() + ac[node].edges;
+            const auto end   = begin + ac[node].n_edges;
+            const auto it = std::lower_bound(begin, end, c, [](const std::pair<uint8_t, uint32_t> & edge, uint8_t value) {
+                return edge.first < value;
+            });
+            if (it != end && it->first == c) {
+                node = it->second;
+                break;
+            }
+            if (node == 0) {
+                break;
+            }
+            node = ac[node].fail;
         }
 
-        // for each text fragment
-        std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
-        while (it != buffer.end()) {
-            auto & fragment = (*it);
+        for (int32_t n = ac[node].n_specials > 0 ? (int32_t) node : ac[node].dict; n >= 0; n = ac[n].dict) {
+            for (uint32_t i = ac[n].specials; i < ac[n].specials + ac[n].n_specials; ++i) {
+                const int32_t special = specials[i];
+                const uint64_t len = vocab.id_to_token[vocab.cache_special_tokens[special]].text.size();
+                matches.emplace_back(special, pos + 1 - len);
+            }
+        }
+    }
+}
 
-            // if a fragment is text ( not yet processed )
-            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                const auto & raw_text = fragment.raw_text;
+static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) {
+    // the special tokens are split out in the order of cache_special_tokens: each one takes all its leftmost
+    // non-overlapping occurrences in the text left by the ones before it. the occurrences of all of them are found in
+    // one pass, and then resolved in that order
+    std::vector<std::pair<int32_t, uint64_t>> matches;
+
+    // the automaton is built with the special tokens cache, there is nothing to split out before
+    if (vocab.special_ac.empty()) {
+        return;
+    }
 
-                auto raw_text_base_offset = fragment.offset;
-                auto raw_text_base_length = fragment.length;
+    auto prev = buffer.before_begin();
+    for (auto it = buffer.begin(); it != buffer.end(); prev = it, ++it) {
+        if (it->type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+            continue;
+        }
 
-                // loop over the text
-                while (true) {
-                    // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
-                    //  are still relative to the source full raw_text
-                    auto match = raw_text.find(special_token, raw_text_base_offset);
+        const auto & raw_text = it->raw_text;
 
-                    // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+        matches.clear();
+        tokenizer_st_find(vocab, raw_text, it->offset, it->length, matches);
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+        if (!parse_special) {
+            // Ignore control and unknown tokens when parse_special == false
+            // User-defined tokens are still pre-tokenized before everything else
+            // ref: https://github.com/huggingface/tokenizers/blob/fdd26ba9a3f0c133427aab0423888cbde91362d7/tokenizers/src/tokenizer/mod.rs#L726
+            // This is mostly relevant for neox-style tokenizers (mpt, olmo, stablelm, etc.)
+            matches.erase(std::remove_if(matches.begin(), matches.end(), [&](const std::pair<int32_t, uint64_t> & match) {
+                const auto attr = vocab.id_to_token[vocab.cache_special_tokens[match.first]].attr;
+                return attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN);
+            }), matches.end());
+        }
 
-#ifdef PRETOKENIZERDEBUG
-                    LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    auto source = std::distance(buffer.begin(), it);
-
-                    // if match is further than base offset
-                    //  then we have some text to the left of it
-                    if (match > raw_text_base_offset) {
-                        // left
-                        const int64_t left_reminder_offset = raw_text_base_offset + 0;
-                        int64_t left_reminder_length = match - raw_text_base_offset;
-
-                        if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
-                            while (left_reminder_length > 0 && isspace(raw_text[left_reminder_offset + left_reminder_length - 1])) {
-                                left_reminder_length--;
-                            }
-                        }
+        if (matches.empty()) {
+            continue;
+        }
 
-                        if (left_reminder_length > 0) {
-                            buffer.emplace_after(it, raw_text, left_reminder_offset, left_reminder_length);
-                            it++;
-                        }
+        std::sort(matches.begin(), matches.end());
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FL: (%ld %ld) '%s'\n", left_reminder_offset, left_reminder_length, raw_text->substr(left_reminder_offset, left_reminder_length).c_str());
-#endif
-                    }
+        // the text not taken by a special token yet, as the end of each part by its start, and the special tokens
+        // by position
+        std::map<uint64_t, uint64_t> texts = { { it->offset, it->offset + it->length } };
+        std::map<uint64_t, llama_vocab::id> specials;
 
-                    // special token
-                    buffer.emplace_after(it, special_id);
-                    it++;
+        for (const auto & [special, match] : matches) {
+            const llama_vocab::id special_id = vocab.cache_special_tokens[special];
+            const auto & data = vocab.id_to_token[special_id];
+            const uint64_t match_end = match + data.text.size();
 
-                    // right
-                    if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
-                        int64_t right_reminder_offset = match + special_token.length();
-                        int64_t right_reminder_length = raw_text_base_length - ((match - raw_text_base_offset) + special_token.length());
+            // the occurrence must be within a part of the text
+            auto text = texts.upper_bound(match);
+            if (text == texts.begin()) {
+                continue;
+            }
+            --text;
+            if (match_end > text->second) {
+                continue;
+            }
 
-                        if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
-                            while (right_reminder_length > 0 && isspace(raw_text[right_reminder_offset])) {
-                                right_reminder_offset++;
-                                right_reminder_length--;
-                            }
-                        }
+            uint64_t left_offset  = text->first;
+            uint64_t right_offset = match_end;
+            uint64_t right_end    = text->second;
+            texts.erase(text);
 
-                        if (right_reminder_length > 0) {
-                            buffer.emplace_after(it, raw_text, right_reminder_offset, right_reminder_length);
-                            it++;
-                        }
+            int64_t left_length = match - left_offset;
+            if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
+                while (left_length > 0 && isspace(raw_text[left_offset + left_length - 1])) {
+                    left_length--;
+                }
+            }
+            if (left_length > 0) {
+                texts.emplace(left_offset, left_offset + left_length);
+            }
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
-#endif
+            if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
+                while (right_offset < right_end && isspace(raw_text[right_offset])) {
+                    right_offset++;
+                }
+            }
+            if (right_offset < right_end) {
+                texts.emplace(right_offset, right_end);
+            }
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
+            specials.emplace(match, special_id);
+        }
 
-                        // repeat for the right side
-                        raw_text_base_offset = right_reminder_offset;
-                        raw_text_base_length = right_reminder_length;
+        // replace the fragment with the parts of the text and the special tokens, in order
+        buffer.erase_after(prev);
+        it = prev;
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
-#endif
-                    } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
-                        break;
-                    }
-                }
+        auto text    = texts.begin();
+        auto special = specials.begin();
+        while (text != texts.end() || special != specials.end()) {
+            if (special == specials.end() || (text != texts.end() && text->first < special->first)) {
+                it = buffer.emplace_after(it, raw_text, text->first, text->second - text->first);
+                ++text;
+            } else {
+                it = buffer.emplace_after(it, special->second);
+                ++special;
             }
-            it++;
         }
     }
 }
@@ -1465,7 +1755,8 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
         const llama_vocab & vocab,
         std::string raw_text,
         bool add_special,
-        bool parse_special) {
+        bool parse_special,
+        int32_t n_threads) {
     GGML_ASSERT(vocab.tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
     std::vector<llama_vocab::id> output;
@@ -1541,7 +1832,7 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 #ifdef PRETOKENIZERDEBUG
                         LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", raw_text.length(), fragment.offset, fragment.length, raw_text.c_str());
 #endif
-                        session.tokenize(raw_text, output);
+                        session.tokenize(raw_text, output, n_threads);
                     } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
                         session.append(fragment.token, output);
                     }
@@ -1765,8 +2056,9 @@ int32_t llama_tokenize_impl(
                      llama_token * tokens,
                          int32_t   n_tokens_max,
                             bool   add_special,
-                            bool   parse_special) {
-    auto res = llama_tokenize_internal(vocab, std::string(text, text_len), add_special, parse_special);
+                            bool   parse_special,
+                         int32_t   n_threads) {
+    auto res = llama_tokenize_internal(vocab, std::string(text, text_len), add_special, parse_special, n_threads);
     if (n_tokens_max < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
         return -((int) res.size());
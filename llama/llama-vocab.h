@@ -60,7 +60,35 @@ struct llama_vocab {
     std::vector<id>    cache_special_tokens;
     std::vector<token> cache_token_to_piece; // llama_token_to_piece(special = true);
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // byte trie of cache_token_to_piece in preorder, so that the grammar can reject all the tokens starting with a
+    // rejected prefix at once. pieces are cut at the first null byte, empty pieces are left out
+    struct piece_trie_node {
+        uint32_t end;       // index of the first node after the subtree of this node
+        uint32_t tok_begin; // tokens whose piece ends at this node start here in piece_trie_tokens
+        uint32_t depth;     // length of the prefix
+        uint8_t  byte;      // last byte of the prefix
+    };
+
+    std::vector<piece_trie_node> piece_trie;
+    std::vector<id>              piece_trie_tokens;
+
+    // Aho-Corasick automaton of the texts of cache_special_tokens, so that all their occurrences in a text are found
+    // in one pass. node 0 is the root
+    struct special_ac_node {
+        uint32_t edges;    // the children of the node are special_ac_edges[edges, edges + n_edges), sorted by byte
+        uint32_t n_edges;
+        int32_t  fail;     // node of the longest proper suffix of the prefix of this node
+        int32_t  dict;     // nearest node on the chain of fail links where a special token ends, -1 if none
+        uint32_t specials; // the special tokens ending at this node are special_ac_specials[specials, specials + n_specials)
+        uint32_t n_specials;
+    };
+
+    std::vector<special_ac_node>                special_ac;
+    std::vector<std::pair<uint8_t, uint32_t>>   special_ac_edges;    // byte, child
+    std::vector<int32_t>                        special_ac_specials; // indices in cache_special_tokens, in order
+
+    // BPE merges in order of rank, indexed by llm_tokenizer_bpe
+    std::vector<std::pair<std::string, std::string>> bpe_merges;
 
     // default LLaMA special tokens
     // TODO: should we set all of these to LLAMA_TOKEN_NULL?
@@ -104,9 +132,9 @@ struct llama_vocab {
     llama_vocab() = default;
     ~llama_vocab();
 
-    int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
-
     void init_tokenizer();
+    void init_piece_trie();
+    void init_special_ac();
 };
 
 //
@@ -119,7 +147,8 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
         const llama_vocab & vocab,
         std::string raw_text,
         bool add_special,
-        bool parse_special = false);
+        bool parse_special = false,
+        int32_t n_threads = 1);
 
 // TODO: move the API below as member functions of llama_vocab
 llama_token llama_byte_to_token_impl(const llama_vocab & vocab, uint8_t ch);
@@ -164,7 +193,8 @@ int32_t llama_tokenize_impl(
                      llama_token * tokens,
                          int32_t   n_tokens_max,
                             bool   add_special,
-                            bool   parse_special);
+                            bool   parse_special,
+                         int32_t   n_threads = 1);
 
 // does not write null-terminator to buf
 int32_t llama_token_to_piece_impl(
@@ -77,12 +77,14 @@
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <future>
@@ -99,12 +101,14 @@
 #include <unordered_map>
 
 #if defined(_MSC_VER)
+#include <intrin.h>
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
 // bump if necessary
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 160  // DeepSeekV2
+#define LLAMA_MAX_SEQ     64   // width of the KV cell sequence bitmask
 
 //
 // helpers
@@ -1981,6 +1985,40 @@ public:
         } ;
     }
 
+    // reads len bytes at offset, so that several threads can read the file at once
+    // note: the handle is synchronous, so this also moves the file pointer
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            overlapped.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
+    bool open_direct() {
+        // not supported
+        return false;
+    }
+
+    void read_direct_at(void * ptr, size_t len, size_t offset, uint8_t * buf) const {
+        GGML_UNUSED(buf);
+        read_raw_at(ptr, len, offset);
+    }
+
+    static constexpr size_t direct_alignment = 4096;
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -2068,6 +2106,34 @@ public:
         }
     }
 
+    // reads len bytes at offset without moving the file position, so that several threads can read the file at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        read_at(fileno(fp), (uint8_t *) ptr, len, len, offset);
+    }
+
+    // opens a second descriptor of the file with O_DIRECT, for reads that bypass the page cache
+    bool open_direct() {
+#if defined(__linux__) && defined(O_DIRECT)
+        if (fd_direct < 0) {
+            fd_direct = open(format("/proc/self/fd/%d", fileno(fp)).c_str(), O_RDONLY | O_DIRECT);
+        }
+        return fd_direct >= 0;
+#else
+        return false;
+#endif
+    }
+
+    // reads len bytes at offset through the O_DIRECT descriptor. the read is widened to whole blocks of
+    // direct_alignment bytes, so buf must be aligned to it and hold len + 2*direct_alignment bytes
+    void read_direct_at(void * ptr, size_t len, size_t offset, uint8_t * buf) const {
+        const size_t first = offset & ~(direct_alignment - 1);
+        const size_t last  = (offset + len + direct_alignment - 1) & ~(direct_alignment - 1);
+
+        // the last block may be cut short by the end of the file
+        read_at(fd_direct, buf, offset + len - first, last - first, first);
+        memcpy(ptr, buf + (offset - first), len);
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -2090,10 +2156,36 @@ public:
     }
 
     ~llama_file() {
+        if (fd_direct >= 0) {
+            close(fd_direct);
+        }
         if (fp) {
             std::fclose(fp);
         }
     }
+
+    static constexpr size_t direct_alignment = 4096;
+
+private:
+    int fd_direct = -1;
+
+    // reads at least len and at most size bytes at offset
+    static void read_at(int fd, uint8_t * ptr, size_t len, size_t size, size_t offset) {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, ptr + bytes_read, size - bytes_read, offset + bytes_read);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
 #endif
 };
 using llama_files = std::vector<std::unique_ptr<llama_file>>;
@@ -2149,6 +2241,79 @@ struct llama_mmap {
         mapped_fragments.emplace_back(0, file->size);
     }
 
+    // advise the kernel to start reading the range [first, first + len) in the background
+    void prefetch_range(size_t first, size_t len) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t last = std::min(first + len, size);
+        first &= ~(page_size - 1);
+
+        if (last <= first) {
+            return;
+        }
+
+        if (posix_madvise((uint8_t *) addr + first, last - first, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
+    // reads the range [first, first + len) into memory and maps it, returning when it is resident
+    void populate_range(size_t first, size_t len) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t last = std::min(first + len, size);
+        first &= ~(page_size - 1);
+
+        if (last <= first) {
+            return;
+        }
+
+        uint8_t * start = (uint8_t *) addr + first;
+
+        // have the whole range read ahead in large requests before faulting it in
+        posix_madvise(start, last - first, POSIX_MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+        if (madvise(start, last - first, MADV_POPULATE_READ) == 0) {
+            return;
+        }
+#endif
+        // MADV_POPULATE_READ needs Linux 5.14, fault the pages in one by one otherwise
+        uint8_t sum = 0;
+        for (size_t i = 0; i < last - first; i += page_size) {
+            sum += ((volatile const uint8_t *) start)[i];
+        }
+        GGML_UNUSED(sum);
+    }
+
+    // asks for the range to be backed by huge pages, which the kernel only does for file mappings with
+    // CONFIG_READ_ONLY_THP_FOR_FS, so failures are not reported
+    void advise_hugepage(size_t first, size_t len) const {
+#ifdef MADV_HUGEPAGE
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        const size_t last = std::min(first + len, size);
+        first &= ~(page_size - 1);
+
+        if (last > first) {
+            madvise((uint8_t *) addr + first, last - first, MADV_HUGEPAGE);
+        }
+#else
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+#endif
+    }
+
+    // drops the pages of the range from the process, they are read from the file again when next accessed.
+    // only whole pages inside the range are dropped, as the pages at the ends may hold data of other ranges
+    void release_range(size_t first, size_t len) const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t last = std::min(first + len, size);
+        align_range(&first, &last, page_size);
+
+        if (last > first && madvise((uint8_t *) addr + first, last - first, MADV_DONTNEED)) {
+            LLAMA_LOG_WARN("warning: madvise(.., MADV_DONTNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
     static void align_range(size_t * first, size_t * last, size_t page_size) {
         // align first to the next page
         size_t offset_in_page = *first & (page_size - 1);
@@ -2266,6 +2431,35 @@ struct llama_mmap {
         }
     }
 
+    void prefetch_range(size_t first, size_t len) const {
+        // not supported
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+    }
+
+    void populate_range(size_t first, size_t len) const {
+        const size_t last = std::min(first + len, size);
+
+        // fault the pages in
+        uint8_t sum = 0;
+        for (size_t i = first; i < last; i += 4096) {
+            sum += ((volatile const uint8_t *) addr)[i];
+        }
+        GGML_UNUSED(sum);
+    }
+
+    void advise_hugepage(size_t first, size_t len) const {
+        // not supported
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+    }
+
+    void release_range(size_t first, size_t len) const {
+        // not supported, the pages are left to the working set manager
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+    }
+
     void unmap_fragment(size_t first, size_t last) {
         // not supported
         GGML_UNUSED(first);
@@ -2289,6 +2483,34 @@ struct llama_mmap {
         throw std::runtime_error("mmap not supported");
     }
 
+    void prefetch_range(size_t first, size_t len) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+
+        throw std::runtime_error("mmap not supported");
+    }
+
+    void populate_range(size_t first, size_t len) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+
+        throw std::runtime_error("mmap not supported");
+    }
+
+    void advise_hugepage(size_t first, size_t len) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+
+        throw std::runtime_error("mmap not supported");
+    }
+
+    void release_range(size_t first, size_t len) const {
+        GGML_UNUSED(first);
+        GGML_UNUSED(len);
+
+        throw std::runtime_error("mmap not supported");
+    }
+
     void unmap_fragment(size_t first, size_t last) {
         GGML_UNUSED(first);
         GGML_UNUSED(last);
@@ -2449,6 +2671,237 @@ struct llama_mlock {
 };
 using llama_mlocks = std::vector<std::unique_ptr<llama_mlock>>;
 
+// Pages the weights of the repeating layers that stay in the mapped model files in on demand, for models larger than
+// the memory. The graph is computed up to the first node of each layer, which is made resident first, while the next
+// layer is read ahead on a thread. The least recently used layers are dropped from memory while the resident layers
+// take more than the budget, except for the ones in use.
+struct llama_layer_pager {
+    struct range {
+        const llama_mmap * mapping;
+        size_t first;
+        size_t last;
+    };
+
+    enum layer_state : uint8_t {
+        LAYER_RELEASED,
+        LAYER_READING,
+        LAYER_RESIDENT,
+    };
+
+    explicit llama_layer_pager(size_t budget) : budget(budget) {}
+
+    ~llama_layer_pager() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+
+    // records that the weight w of layer il is stored in the range [first, first + size) of mapping
+    void add(int il, const ggml_tensor * w, const llama_mmap * mapping, size_t first, size_t size) {
+        if (il >= (int) ranges.size()) {
+            ranges.resize(il + 1);
+        }
+        ranges[il].push_back({ mapping, first, first + size });
+        layer_of[w] = il;
+    }
+
+    // drops all the layers from memory and starts the read-ahead thread, returns false if there are no layers to page
+    bool start() {
+        const size_t page_size = 4096;
+
+        state.assign(ranges.size(), LAYER_RELEASED);
+        sizes.assign(ranges.size(), 0);
+        for (size_t il = 0; il < ranges.size(); ++il) {
+            auto & rs = ranges[il];
+            if (rs.empty()) {
+                continue;
+            }
+            order.push_back(il);
+
+            // merge the ranges of the weights that are less than a page apart
+            std::sort(rs.begin(), rs.end(), [](const range & a, const range & b) {
+                return a.mapping != b.mapping ? a.mapping < b.mapping : a.first < b.first;
+            });
+            std::vector<range> merged;
+            for (const auto & r : rs) {
+                if (!merged.empty() && merged.back().mapping == r.mapping && r.first <= merged.back().last + page_size) {
+                    merged.back().last = std::max(merged.back().last, r.last);
+                } else {
+                    merged.push_back(r);
+                }
+            }
+            rs = std::move(merged);
+
+            for (const auto & r : rs) {
+                sizes[il] += r.last - r.first;
+                r.mapping->release_range(r.first, r.last - r.first);
+            }
+        }
+
+        if (order.empty()) {
+            return false;
+        }
+
+        reader = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this] { return stop || !queue.empty(); });
+                if (stop) {
+                    return;
+                }
+                const int il = queue.front();
+                queue.erase(queue.begin());
+
+                lock.unlock();
+                populate(il);
+                lock.lock();
+
+                state[il] = LAYER_RESIDENT;
+                cv.notify_all();
+            }
+        });
+
+        return true;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t s : sizes) {
+            total += s;
+        }
+        return total;
+    }
+
+    // called with each node of the graph before it is computed, returns true if the node is the first one of a layer,
+    // so that the graph is computed up to it before the following nodes are looked at
+    bool use(const ggml_tensor * t) {
+        int il = -1;
+        for (int i = 0; i < GGML_MAX_SRC && il < 0; ++i) {
+            const ggml_tensor * src = t->src[i];
+            if (src == nullptr) {
+                continue;
+            }
+            auto it = layer_of.find(src->view_src ? src->view_src : src);
+            if (it != layer_of.end()) {
+                il = it->second;
+            }
+        }
+
+        if (il < 0 || il == il_cur) {
+            return false;
+        }
+
+        il_prev = il_cur;
+        il_cur  = il;
+
+        // read ahead the next layer, or the first one for the next graph
+        auto next = std::upper_bound(order.begin(), order.end(), il);
+        il_next = next == order.end() ? order.front() : *next;
+
+        make_resident(il);
+        read_ahead(il_next);
+        evict();
+
+        return true;
+    }
+
+private:
+    void populate(int il) const {
+        for (const auto & r : ranges[il]) {
+            r.mapping->populate_range(r.first, r.last - r.first);
+        }
+    }
+
+    // moves il to the front of the recently used layers
+    void touch(int il) {
+        auto it = std::find(lru.begin(), lru.end(), il);
+        if (it != lru.end()) {
+            lru.erase(it);
+        } else {
+            resident += sizes[il];
+        }
+        lru.insert(lru.begin(), il);
+    }
+
+    void make_resident(int il) {
+        touch(il);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (state[il] == LAYER_RELEASED) {
+            state[il] = LAYER_READING;
+            lock.unlock();
+            populate(il);
+            lock.lock();
+            state[il] = LAYER_RESIDENT;
+        } else {
+            // being read ahead
+            cv.wait(lock, [&] { return state[il] == LAYER_RESIDENT; });
+        }
+    }
+
+    void read_ahead(int il) {
+        touch(il);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (state[il] != LAYER_RELEASED) {
+                return;
+            }
+            state[il] = LAYER_READING;
+            queue.push_back(il);
+        }
+        cv.notify_all();
+    }
+
+    void evict() {
+        for (size_t i = lru.size(); i > 0 && resident > budget; --i) {
+            const int il = lru[i - 1];
+            if (il == il_cur || il == il_prev || il == il_next) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (state[il] != LAYER_RESIDENT) {
+                    continue;
+                }
+                state[il] = LAYER_RELEASED;
+            }
+            for (const auto & r : ranges[il]) {
+                r.mapping->release_range(r.first, r.last - r.first);
+            }
+            resident -= sizes[il];
+            lru.erase(lru.begin() + (i - 1));
+        }
+    }
+
+    const size_t budget;
+
+    std::vector<std::vector<range>> ranges; // by layer
+    std::vector<size_t> sizes;              // by layer
+    std::vector<int> order;                 // the paged layers
+    std::unordered_map<const ggml_tensor *, int> layer_of;
+
+    // used by the compute thread only
+    std::vector<int> lru; // the resident layers, most recently used first
+    size_t resident = 0;
+    int il_prev = -1;
+    int il_cur  = -1;
+    int il_next = -1;
+
+    // shared with the read-ahead thread
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<layer_state> state; // by layer
+    std::vector<int> queue;
+    bool stop = false;
+    std::thread reader;
+};
+
 // NOTE: avoid ever using this except for building the token_to_piece caches
 static std::string llama_token_to_piece(const struct llama_model * model, llama_token token, bool special) {
     std::string piece;
@@ -2796,6 +3249,8 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
@@ -2993,16 +3448,74 @@ struct llama_ubatch {
     int8_t       *  output;   // [n_tokens]
 };
 
+static inline int llama_ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int) i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+static inline int llama_popcount64(uint64_t x) {
+#if defined(_MSC_VER)
+    return (int) __popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// position of a KV cell that is not visible to the sequence being masked
+#define LLAMA_KV_POS_HIDDEN INT32_MAX
+
+// set of sequence ids stored as a bitmask, ids must be in [0, LLAMA_MAX_SEQ)
+struct llama_kv_seq_set {
+    uint64_t bits = 0;
+
+    struct iterator {
+        uint64_t bits;
+
+        llama_seq_id operator*() const { return llama_ctz64(bits); }
+        iterator & operator++() { bits &= bits - 1; return *this; }
+        bool operator!=(const iterator & other) const { return bits != other.bits; }
+    };
+
+    iterator begin() const { return { bits }; }
+    iterator end()   const { return { 0 }; }
+
+    bool contains(llama_seq_id id) const {
+        return (uint32_t) id < LLAMA_MAX_SEQ && (bits >> id) & 1;
+    }
+
+    void insert(llama_seq_id id) {
+        GGML_ASSERT((uint32_t) id < LLAMA_MAX_SEQ);
+        bits |= uint64_t(1) << id;
+    }
+
+    void erase(llama_seq_id id) {
+        if ((uint32_t) id < LLAMA_MAX_SEQ) {
+            bits &= ~(uint64_t(1) << id);
+        }
+    }
+
+    void   clear()       { bits = 0; }
+    bool   empty() const { return bits == 0; }
+    size_t size()  const { return llama_popcount64(bits); }
+
+    bool operator==(const llama_kv_seq_set & other) const { return bits == other.bits; }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    llama_kv_seq_set seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.contains(id);
     }
 
     bool is_empty() const {
@@ -3014,6 +3527,20 @@ struct llama_kv_cell {
     }
 };
 
+// fixed-size group of KV cells used by the paged allocator
+struct llama_kv_block {
+    int32_t  owner = -1; // sequence that appends to the block, -1 if the block is free
+    uint32_t used  = 0;  // number of non-empty cells
+    uint32_t fill  = 0;  // offset of the next cell to hand out to the owner
+};
+
+// consecutive tokens of a ubatch stored in consecutive KV cells
+struct llama_kv_cell_run {
+    uint32_t token; // index of the first token in the ubatch
+    uint32_t cell;  // index of the first cell
+    uint32_t len;
+};
+
 // ring-buffer of cached KV data
 struct llama_kv_cache {
     bool has_shift = false;
@@ -3036,6 +3563,27 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // paged allocation, enabled when block_size > 0
+    // the cells are split into blocks and each sequence appends its tokens to the blocks it owns,
+    // so that a sequence does not need a contiguous range of cells (see llama_kv_cache_find_slot)
+    uint32_t block_size = 0;
+    uint32_t max_runs   = 0; // max number of cell runs per ubatch, bounded by the graph size
+
+    std::vector<llama_kv_block> blocks;
+    std::vector<int32_t> seq_tail; // per sequence: block being appended to, -1 if none
+
+    // per sequence: sorted list of the blocks holding at least one of its cells
+    std::vector<std::vector<uint32_t>> seq_blocks;
+
+    // cells assigned to the ubatch being processed, empty if the ubatch is contiguous at head
+    std::vector<llama_kv_cell_run> runs;
+
+    // per sequence: position of each cell of the sequence, LLAMA_KV_POS_HIDDEN for the other cells
+    // kept across ubatches and patched from seq_pos_dirty so that the KQ mask does not rescan the
+    // cells, empty until a mask needs it or after an operation that moved or shifted cells
+    std::vector<std::vector<llama_pos>> seq_pos;
+    std::vector<uint32_t> seq_pos_dirty; // cells changed since seq_pos was last updated
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -3128,6 +3676,7 @@ struct llama_model {
     // lists of buffer types used for each layer
     using buft_list_t = std::vector<std::pair<ggml_backend_dev_t, ggml_backend_buffer_type_t>>;
     buft_list_t cpu_buft_list;
+    buft_list_t cpu_paged_buft_list; // for the repeating layers on the CPU that are paged in on demand
     std::map<ggml_backend_dev_t, buft_list_t> gpu_buft_list;
 
     struct layer_dev {
@@ -3147,6 +3696,9 @@ struct llama_model {
     // model memory mapped files
     llama_mmaps mappings;
 
+    // pages the layers in from mappings on demand, if the model is larger than the memory it may use
+    std::unique_ptr<llama_layer_pager> pager;
+
     // objects representing data potentially being locked in memory
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
@@ -3555,6 +4107,9 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    // whether cparams.cb_eval asked to observe the last node seen by llama_eval_callback
+    bool cb_eval_need = false;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -3674,7 +4229,8 @@ static bool llama_kv_cache_init(
     cache.has_shift = false;
 
     cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+    // a quantized V cache is not transposed, its rows cannot be written one element per block
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn && !ggml_is_quantized(type_v);
 
     cache.head = 0;
     cache.size = kv_size;
@@ -3686,6 +4242,15 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.block_size = cache.recurrent ? 0 : std::min(cparams.kv_block_size, kv_size);
+    cache.blocks.clear();
+    cache.seq_tail.clear();
+    cache.seq_blocks.clear();
+    cache.runs.clear();
+    if (cache.block_size > 0) {
+        cache.blocks.resize((kv_size + cache.block_size - 1)/cache.block_size);
+    }
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     auto ctx_for_buft = [&](ggml_backend_buffer_type_t buft) -> ggml_context * {
@@ -3792,6 +4357,8 @@ struct llama_kv_cache_slot_info {
     std::pair<uint32_t, uint32_t> boundaries; // slot boundaries [begin, end)
     bool found = false;                       // the slot was found
 
+    std::vector<llama_kv_cell_run> runs;      // cells of the slot when it is not contiguous
+
     explicit llama_kv_cache_slot_info(bool found_) : found{found_} {}
     llama_kv_cache_slot_info(uint32_t begin, uint32_t end) : boundaries{begin, end}, found{true} {}
 
@@ -3799,6 +4366,247 @@ struct llama_kv_cache_slot_info {
 };
 static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
 
+static std::vector<uint32_t> & llama_kv_cache_seq_blocks(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    if ((size_t) seq_id >= cache.seq_blocks.size()) {
+        cache.seq_blocks.resize(seq_id + 1);
+        cache.seq_tail.resize(seq_id + 1, -1);
+    }
+    return cache.seq_blocks[seq_id];
+}
+
+// rebuild the block metadata and the per-sequence block tables from the cells
+// must be called after any operation that frees cells or changes their sequences
+static void llama_kv_cache_blocks_refresh(struct llama_kv_cache & cache) {
+    if (cache.block_size == 0) {
+        return;
+    }
+
+    for (auto & blocks : cache.seq_blocks) {
+        blocks.clear();
+    }
+
+    for (uint32_t b = 0; b < cache.blocks.size(); ++b) {
+        llama_kv_block & block = cache.blocks[b];
+
+        const uint32_t i0 = b*cache.block_size;
+        const uint32_t i1 = std::min(cache.size, i0 + cache.block_size);
+
+        block.used = 0;
+        block.fill = 0;
+
+        for (uint32_t i = i0; i < i1; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+            if (cell.pos < 0 || cell.is_empty()) {
+                continue;
+            }
+
+            block.used++;
+            // appending never fills holes, they are only reused once the whole block is free
+            block.fill = i - i0 + 1;
+
+            for (const llama_seq_id seq_id : cell.seq_id) {
+                auto & blocks = llama_kv_cache_seq_blocks(cache, seq_id);
+                if (blocks.empty() || blocks.back() != b) {
+                    blocks.push_back(b);
+                }
+            }
+        }
+
+        if (block.used == 0) {
+            block.owner = -1;
+        }
+    }
+
+    for (size_t s = 0; s < cache.seq_tail.size(); ++s) {
+        const int32_t b = cache.seq_tail[s];
+        if (b >= 0 && cache.blocks[b].owner != (int32_t) s) {
+            cache.seq_tail[s] = -1;
+        }
+    }
+}
+
+// drop the cached sequence positions, they are rebuilt from the cells when needed
+static void llama_kv_cache_seq_pos_reset(struct llama_kv_cache & cache) {
+    for (auto & kpos : cache.seq_pos) {
+        kpos.clear();
+    }
+    cache.seq_pos_dirty.clear();
+}
+
+// must be called when the sequences or the position of a cell change
+static void llama_kv_cache_cell_changed(struct llama_kv_cache & cache, uint32_t i) {
+    if (cache.seq_pos_dirty.size() < cache.size) {
+        cache.seq_pos_dirty.push_back(i);
+    } else {
+        // cheaper to rebuild than to patch
+        llama_kv_cache_seq_pos_reset(cache);
+    }
+}
+
+// positions of the cells as seen by seq_id, see llama_kv_cache::seq_pos
+static const std::vector<llama_pos> & llama_kv_cache_seq_pos(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    if (!cache.seq_pos_dirty.empty()) {
+        for (size_t s = 0; s < cache.seq_pos.size(); ++s) {
+            auto & kpos = cache.seq_pos[s];
+            if (kpos.empty()) {
+                continue;
+            }
+            for (const uint32_t i : cache.seq_pos_dirty) {
+                const llama_kv_cell & cell = cache.cells[i];
+                kpos[i] = cell.has_seq_id(s) ? cell.pos : LLAMA_KV_POS_HIDDEN;
+            }
+        }
+        cache.seq_pos_dirty.clear();
+    }
+
+    if ((size_t) seq_id >= cache.seq_pos.size()) {
+        cache.seq_pos.resize(seq_id + 1);
+    }
+
+    auto & kpos = cache.seq_pos[seq_id];
+    if (kpos.empty()) {
+        kpos.resize(cache.size, LLAMA_KV_POS_HIDDEN);
+
+        const auto gather = [&](uint32_t i0, uint32_t i1) {
+            for (uint32_t i = i0; i < i1; ++i) {
+                const llama_kv_cell & cell = cache.cells[i];
+                if (cell.has_seq_id(seq_id)) {
+                    kpos[i] = cell.pos;
+                }
+            }
+        };
+
+        // with a paged cache, only the blocks of the sequence can hold its cells
+        if (cache.block_size > 0) {
+            if ((size_t) seq_id < cache.seq_blocks.size()) {
+                for (const uint32_t b : cache.seq_blocks[seq_id]) {
+                    gather(b*cache.block_size, std::min(cache.size, (b + 1)*cache.block_size));
+                }
+            }
+        } else {
+            gather(0, cache.size);
+        }
+    }
+
+    return kpos;
+}
+
+// pick a free cell for the next token of seq_id, -1 if the cache is full
+static int32_t llama_kv_cache_find_cell_paged(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    const uint32_t block_size = cache.block_size;
+
+    llama_kv_cache_seq_blocks(cache, seq_id);
+    int32_t & tail = cache.seq_tail[seq_id];
+
+    // continue in the block the sequence is appending to
+    if (tail >= 0) {
+        const llama_kv_block & block = cache.blocks[tail];
+        const uint32_t i = tail*block_size + block.fill;
+        if (block.fill < block_size && i < cache.size && cache.cells[i].pos < 0) {
+            return i;
+        }
+        tail = -1;
+    }
+
+    // take the first free block
+    for (uint32_t b = 0; b < cache.blocks.size(); ++b) {
+        llama_kv_block & block = cache.blocks[b];
+        if (block.owner < 0 && block.used == 0) {
+            block.owner = seq_id;
+            block.fill  = 0;
+            tail = b;
+            return b*block_size;
+        }
+    }
+
+    // no free block left, use any empty cell
+    for (uint32_t n = 0; n < cache.size; ++n) {
+        const uint32_t i = (cache.head + n) % cache.size;
+        if (cache.cells[i].pos < 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// paged variant of llama_kv_cache_find_slot for non-recurrent models
+// each token is placed in a block owned by its (first) sequence and the resulting runs of cells
+// are recorded in cache.runs so that the graph can scatter the new K and V rows
+// fails without modifying the cache if there is no room, or if the ubatch would be split in
+// more runs than the graph can hold
+static struct llama_kv_cache_slot_info llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seqs       = batch.n_seqs;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+
+    if (cache.used + n_tokens > cache.size) {
+        return llama_kv_cache_slot_info_failed;
+    }
+
+    std::vector<llama_kv_cell_run> runs;
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            const int32_t cell_id = llama_kv_cache_find_cell_paged(cache, batch.seq_id[s][0]);
+            GGML_ASSERT(cell_id >= 0); // there is room for all the tokens
+
+            llama_kv_cell & cell = cache.cells[cell_id];
+            cell.pos = batch.pos[k];
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                cell.seq_id.insert(batch.seq_id[s][j]);
+            }
+            llama_kv_cache_cell_changed(cache, cell_id);
+
+            const uint32_t b = cell_id / cache.block_size;
+            llama_kv_block & block = cache.blocks[b];
+            block.used++;
+            block.fill = std::max(block.fill, cell_id - b*cache.block_size + 1);
+
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                auto & blocks = llama_kv_cache_seq_blocks(cache, batch.seq_id[s][j]);
+                auto it = std::lower_bound(blocks.begin(), blocks.end(), b);
+                if (it == blocks.end() || *it != b) {
+                    blocks.insert(it, b);
+                }
+            }
+
+            if (!runs.empty() && runs.back().cell + runs.back().len == (uint32_t) cell_id) {
+                runs.back().len++;
+            } else {
+                runs.push_back({ k, (uint32_t) cell_id, 1 });
+            }
+        }
+    }
+
+    if (runs.size() > cache.max_runs) {
+        // too fragmented for a single graph, undo and let the caller use a contiguous slot
+        for (const auto & run : runs) {
+            for (uint32_t i = run.cell; i < run.cell + run.len; ++i) {
+                cache.cells[i].pos = -1;
+                cache.cells[i].seq_id.clear();
+                llama_kv_cache_cell_changed(cache, i);
+            }
+        }
+        llama_kv_cache_blocks_refresh(cache);
+
+        return llama_kv_cache_slot_info_failed;
+    }
+
+    cache.used += n_tokens;
+    cache.head  = runs[0].cell;
+    cache.runs  = runs;
+
+    llama_kv_cache_slot_info res(runs[0].cell, runs[0].cell + runs[0].len);
+    res.runs = std::move(runs);
+
+    return res;
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // returns a structure holding information about the slot found
@@ -3980,6 +4788,16 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
         return llama_kv_cache_slot_info_failed;
     }
 
+    cache.runs.clear();
+
+    if (cache.block_size > 0) {
+        auto slot = llama_kv_cache_find_slot_paged(cache, batch);
+        if (slot) {
+            return slot;
+        }
+        // fall back to a contiguous slot
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -4017,11 +4835,14 @@ static struct llama_kv_cache_slot_info llama_kv_cache_find_slot(
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
                 cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
             }
+            llama_kv_cache_cell_changed(cache, cache.head + k);
         }
     }
 
     cache.used += n_tokens;
 
+    llama_kv_cache_blocks_refresh(cache);
+
     return llama_kv_cache_slot_info(cache.head, cache.head + n_tokens);
 }
 
@@ -4048,6 +4869,9 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    llama_kv_cache_blocks_refresh(cache);
+    llama_kv_cache_seq_pos_reset(cache);
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -4099,6 +4923,7 @@ static bool llama_kv_cache_seq_rm(
             } else {
                 continue;
             }
+            llama_kv_cache_cell_changed(cache, i);
             if (cache.cells[i].is_empty()) {
                 // keep count of the number of used cells
                 if (cache.cells[i].pos >= 0) cache.used--;
@@ -4113,6 +4938,8 @@ static bool llama_kv_cache_seq_rm(
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
 
+    llama_kv_cache_blocks_refresh(cache);
+
     return true;
 }
 
@@ -4159,8 +4986,11 @@ static void llama_kv_cache_seq_cp(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.cells[i].seq_id.insert(seq_id_dst);
+            llama_kv_cache_cell_changed(cache, i);
         }
     }
+
+    llama_kv_cache_blocks_refresh(cache);
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
@@ -4184,6 +5014,9 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size && new_head < cache.head) cache.head = new_head;
+
+    llama_kv_cache_blocks_refresh(cache);
+    llama_kv_cache_seq_pos_reset(cache);
 }
 
 static void llama_kv_cache_seq_add(
@@ -4235,6 +5068,14 @@ static void llama_kv_cache_seq_add(
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
+
+    if (cache.has_shift) {
+        llama_kv_cache_seq_pos_reset(cache);
+    }
+
+    if (new_head != cache.size) {
+        llama_kv_cache_blocks_refresh(cache);
+    }
 }
 
 static void llama_kv_cache_seq_div(
@@ -4273,6 +5114,10 @@ static void llama_kv_cache_seq_div(
             }
         }
     }
+
+    if (cache.has_shift) {
+        llama_kv_cache_seq_pos_reset(cache);
+    }
 }
 
 static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama_seq_id seq_id) {
@@ -4310,6 +5155,9 @@ struct llama_kv_slot_restorer {
     // list of slots to restore
     std::vector<std::pair<uint32_t, uint32_t>> slot_boundaries;
 
+    // cells of the slots found by the paged allocator
+    std::vector<llama_kv_cell_run> slot_runs;
+
     bool do_restore = false;
 
     explicit llama_kv_slot_restorer(const struct llama_kv_cache & cache) {
@@ -4321,7 +5169,9 @@ struct llama_kv_slot_restorer {
     void save(const struct llama_kv_cache_slot_info & slot) {
         if (slot) {
             do_restore = true;
-            if (slot.boundaries.first != slot.boundaries.second) {
+            if (!slot.runs.empty()) {
+                slot_runs.insert(slot_runs.end(), slot.runs.begin(), slot.runs.end());
+            } else if (slot.boundaries.first != slot.boundaries.second) {
                 slot_boundaries.push_back(slot.boundaries);
             }
         }
@@ -4340,6 +5190,15 @@ struct llama_kv_slot_restorer {
                 for (auto & slot : slot_boundaries) {
                     llama_kv_cache_seq_rm(cache, -1, slot.first, slot.second);
                 }
+                for (auto & run : slot_runs) {
+                    for (uint32_t i = run.cell; i < run.cell + run.len; ++i) {
+                        if (cache.cells[i].pos >= 0) cache.used--;
+                        cache.cells[i].pos = -1;
+                        cache.cells[i].seq_id.clear();
+                        llama_kv_cache_cell_changed(cache, i);
+                    }
+                }
+                llama_kv_cache_blocks_refresh(cache);
             }
         }
     }
@@ -4565,6 +5424,10 @@ struct llama_model_loader {
 
     bool use_mmap = false;
     bool check_tensors;
+    bool use_direct_io = false;
+    bool populate_mmap = false; // read the mapped tensors into memory on the threads of load_all_data
+
+    int n_threads_load = 0; // 0 = min(8, hardware concurrency)
 
     llama_files files;
     llama_ftype ftype;
@@ -5131,7 +5994,13 @@ struct llama_model_loader {
             for (const auto & file : files) {
                 auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
                 auto * is_numa_fn = (decltype(ggml_is_numa) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_is_numa");
-                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, is_numa_fn()));
+                const bool numa = is_numa_fn();
+                // the mappings are not prefetched as a whole, load_all_data reads the used tensors in the order of first use
+                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), 0, numa));
+                populate_mmap = prefetch && !numa;
+                if (populate_mmap) {
+                    mapping->advise_hugepage(0, mapping->size);
+                }
                 mmaps_used.emplace_back(mapping->size, 0);
                 if (mlock_mmaps) {
                     std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -5193,6 +6062,29 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // a range of the data of a tensor that the threads of load_all_data read or populate and validate
+    struct llama_load_chunk {
+        ggml_tensor * tensor;
+        const llama_tensor_weight * weight;
+        size_t offs; // offset in the tensor data
+        size_t size;
+        bool read;     // read from the file into the tensor, otherwise already in a mapping
+        bool populate; // read the range of the mapping into memory
+        bool progress; // counts towards size_done
+    };
+
+    // the order in which a forward pass first uses a weight: the input layers, the repeating layers, then the output
+    static int weight_first_use(const char * name) {
+        int layer = -1;
+        if (sscanf(name, "blk.%d.", &layer) == 1) {
+            return layer;
+        }
+        if (strncmp(name, "output", 6) == 0 || strncmp(name, "cls", 3) == 0) {
+            return INT_MAX;
+        }
+        return -1;
+    }
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -5203,7 +6095,6 @@ struct llama_model_loader {
         GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
         std::vector<no_init<uint8_t>> read_buf;
-        std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
         // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
         // NVMe raid configurations might require more / larger buffers.
@@ -5294,19 +6185,40 @@ struct llama_model_loader {
                 ggml_backend_name(upload_backend));
         }
 
+        std::vector<std::pair<ggml_tensor *, const llama_tensor_weight *>> tensors;
         for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
                 // this can happen with split experts models
                 continue;
             }
+            tensors.emplace_back(cur, weight);
+        }
+        std::stable_sort(tensors.begin(), tensors.end(), [](const auto & a, const auto & b) {
+            return weight_first_use(ggml_get_name(a.first)) < weight_first_use(ggml_get_name(b.first));
+        });
 
-            if (progress_callback) {
-                if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                    return false;
-                }
+        // The tensors that are read into host memory or stay in a mapping are read, prefetched and validated by a pool
+        // of threads, in chunks taken in the order of first use. The tensors that are copied into other buffers are
+        // uploaded one by one on this thread in the meantime.
+        constexpr size_t chunk_size = 16 * 1024 * 1024; // 16MB
+
+        std::vector<llama_load_chunk> chunks;
+        std::vector<std::pair<ggml_tensor *, const llama_tensor_weight *>> uploads;
+
+        auto add_chunks = [&](ggml_tensor * cur, const llama_tensor_weight * weight, bool read, bool populate, bool progress) {
+            // whole blocks, so that each chunk can be validated on its own
+            const size_t n_size = ggml_nbytes(cur);
+            const size_t block_size = ggml_type_size(cur->type);
+            const size_t step = std::max<size_t>(chunk_size / block_size, 1) * block_size;
+            for (size_t offs = 0; offs < n_size; offs += step) {
+                chunks.push_back({ cur, weight, offs, std::min(step, n_size - offs), read, populate, progress });
             }
+        };
 
+        for (const auto & it : tensors) {
+            ggml_tensor * cur = it.first;
+            const auto * weight = it.second;
             size_t n_size = ggml_nbytes(cur);
 
             if (use_mmap) {
@@ -5317,12 +6229,6 @@ struct llama_model_loader {
                 }
                 uint8_t * data = (uint8_t *) mapping->addr + weight->offs;
 
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                    }));
-                }
-
                 GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
                 if (buf_mmap && cur->data == nullptr) {
                     ggml_backend_tensor_alloc(buf_mmap, cur, data);
@@ -5334,31 +6240,154 @@ struct llama_model_loader {
                     auto & mmap_used = mmaps_used[weight->idx];
                     mmap_used.first  = std::min(mmap_used.first,  weight->offs);
                     mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
+
+                    if (populate_mmap || check_tensors) {
+                        add_chunks(cur, weight, false, populate_mmap, true);
+                    } else {
+                        size_done += n_size;
+                    }
                 } else {
-                    ggml_backend_tensor_set(cur, data, 0, n_size);
+                    if (populate_mmap || check_tensors) {
+                        add_chunks(cur, weight, false, populate_mmap, false);
+                    }
+                    uploads.push_back(it);
                 }
+            } else if (ggml_backend_buffer_is_host(cur->buffer)) {
+                add_chunks(cur, weight, true, false, true);
             } else {
-                const auto & file = files.at(weight->idx);
-                if (ggml_backend_buffer_is_host(cur->buffer)) {
-                    file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(cur->data, n_size);
+                uploads.push_back(it);
+            }
+        }
+
+        std::vector<bool> direct_io(files.size(), false);
+        if (use_direct_io && !use_mmap) {
+            for (size_t idx = 0; idx < files.size(); ++idx) {
+                direct_io[idx] = files[idx]->open_direct();
+                if (!direct_io[idx]) {
+                    LLAMA_LOG_WARN("%s: direct I/O is not supported for file %zu, reading through the page cache\n", __func__, idx);
+                }
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t next_chunk       = 0;
+        size_t n_chunks_done    = 0;
+        size_t size_chunks_done = 0;
+        bool   stop             = false;
+        std::exception_ptr error;
+        std::set<std::string> invalid_tensors;
+
+        auto worker = [&]() {
+            // bounce buffer for direct reads, aligned inside the vector
+            std::vector<uint8_t> direct_buf;
+
+            while (true) {
+                size_t i;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (stop || next_chunk == chunks.size()) {
+                        return;
+                    }
+                    i = next_chunk++;
+                }
+                const auto & chunk = chunks[i];
+
+                bool valid = true;
+                try {
+                    const uint8_t * data;
+                    if (chunk.read) {
+                        const auto & file = files.at(chunk.weight->idx);
+                        uint8_t * dst = (uint8_t *) chunk.tensor->data + chunk.offs;
+                        if (direct_io[chunk.weight->idx]) {
+                            constexpr size_t align = llama_file::direct_alignment;
+                            direct_buf.resize(chunk_size + 3*align);
+                            uint8_t * buf = (uint8_t *) GGML_PAD((uintptr_t) direct_buf.data(), align);
+                            file->read_direct_at(dst, chunk.size, chunk.weight->offs + chunk.offs, buf);
+                        } else {
+                            file->read_raw_at(dst, chunk.size, chunk.weight->offs + chunk.offs);
+                        }
+                        data = dst;
+                    } else {
+                        const auto & mapping = mappings.at(chunk.weight->idx);
+                        if (chunk.populate) {
+                            mapping->populate_range(chunk.weight->offs + chunk.offs, chunk.size);
+                        }
+                        data = (const uint8_t *) mapping->addr + chunk.weight->offs + chunk.offs;
+                    }
+
                     if (check_tensors) {
-                        validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                            return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                        }));
+                        valid = ggml_validate_row_data(chunk.tensor->type, data, chunk.size);
                     }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    stop = true;
+                    cv.notify_one();
+                    return;
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!valid) {
+                    invalid_tensors.insert(ggml_get_name(chunk.tensor));
+                }
+                n_chunks_done++;
+                if (chunk.progress) {
+                    size_chunks_done += chunk.size;
+                }
+                cv.notify_one();
+            }
+        };
+
+        const int n_threads = std::min<size_t>(n_threads_load > 0 ? n_threads_load : std::min(8u, std::max(1u, std::thread::hardware_concurrency())), chunks.size());
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads);
+        for (int i = 0; i < n_threads; ++i) {
+            workers.emplace_back(worker);
+        }
+
+        auto report_progress = [&]() {
+            if (!progress_callback) {
+                return true;
+            }
+            size_t size_pool;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                size_pool = size_chunks_done;
+            }
+            return progress_callback((float) (size_done + size_pool) / size_data, progress_callback_user_data);
+        };
+
+        bool cancelled = false;
+        try {
+            for (const auto & it : uploads) {
+                if (!report_progress()) {
+                    cancelled = true;
+                    break;
+                }
+
+                ggml_tensor * cur = it.first;
+                const auto * weight = it.second;
+                size_t n_size = ggml_nbytes(cur);
+
+                if (use_mmap) {
+                    const auto & mapping = mappings.at(weight->idx);
+                    ggml_backend_tensor_set(cur, (uint8_t *) mapping->addr + weight->offs, 0, n_size);
                 } else {
+                    const auto & file = files.at(weight->idx);
                     // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+                    // uploads read at their offsets too: the pool shares the file and may move its position
                     if (upload_backend) {
-                        file->seek(weight->offs, SEEK_SET);
-
                         size_t bytes_read = 0;
 
                         while (bytes_read < n_size) {
                             size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
 
                             ggml_backend_event_synchronize(events[buffer_idx]);
-                            file->read_raw(host_ptrs[buffer_idx], read_iteration);
+                            file->read_raw_at(host_ptrs[buffer_idx], read_iteration, weight->offs + bytes_read);
                             ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
                             ggml_backend_event_record(events[buffer_idx], upload_backend);
 
@@ -5368,18 +6397,41 @@ struct llama_model_loader {
                         }
                     } else {
                         read_buf.resize(n_size);
-                        file->seek(weight->offs, SEEK_SET);
-                        file->read_raw(read_buf.data(), n_size);
+                        file->read_raw_at(read_buf.data(), n_size, weight->offs);
                         ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
                         if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
                             throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
                         }
                     }
                 }
+
+                size_done += n_size;
+            }
+
+            // wait for the pool, reporting its progress
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!cancelled && !stop && n_chunks_done < chunks.size()) {
+                const size_t n_seen = n_chunks_done;
+                cv.wait(lock, [&] { return stop || n_chunks_done != n_seen; });
+                lock.unlock();
+                cancelled = !report_progress();
+                lock.lock();
             }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
 
-            size_done += n_size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        for (auto & worker : workers) {
+            worker.join();
         }
+        size_done += size_chunks_done;
 
         // free temporary resources used for async uploads
         for (auto * event : events) {
@@ -5391,16 +6443,18 @@ struct llama_model_loader {
         }
         ggml_backend_free(upload_backend);
 
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (cancelled) {
+            return false;
+        }
+
         // check validation results
-        bool validation_failed = false;
-        for (auto & future : validation_result) {
-            auto result = future.get();
-            if (!result.second) {
-                LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, ggml_get_name(result.first));
-                validation_failed = true;
+        if (!invalid_tensors.empty()) {
+            for (const auto & name : invalid_tensors) {
+                LLAMA_LOG_ERROR("%s: tensor '%s' has invalid data\n", __func__, name.c_str());
             }
-        }
-        if (validation_failed) {
             throw std::runtime_error("found tensors with invalid data");
         }
 
@@ -6541,7 +7595,7 @@ static void llm_load_vocab(
                     second = word.substr(pos + 1);
                 }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                vocab.bpe_merges.emplace_back(first, second);
             }
 
             // default special tokens
@@ -7083,6 +8137,8 @@ static void llm_load_vocab(
         );
 
         LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t)vocab.cache_special_tokens.size());
+
+        vocab.init_special_ac();
     }
 
     // build token to piece cache
@@ -7100,6 +8156,11 @@ static void llm_load_vocab(
         std::swap(vocab.cache_token_to_piece, cache_token_to_piece);
 
         LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
+
+        vocab.init_piece_trie();
+
+        LLAMA_LOG_INFO("%s: token piece trie size = %.4f MB\n", __func__,
+            (vocab.piece_trie.size()*sizeof(llama_vocab::piece_trie_node) + vocab.piece_trie_tokens.size()*sizeof(llama_vocab::id)) / 1024.0 / 1024.0);
     }
 
     // Handle per token attributes
@@ -7196,7 +8257,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch             = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch));
     LLAMA_LOG_INFO("%s: vocab type       = %s\n",     __func__, llama_model_vocab_type_name(vocab.type));
     LLAMA_LOG_INFO("%s: n_vocab          = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges         = %u\n",     __func__, (int) vocab.bpe_merges.size());
     LLAMA_LOG_INFO("%s: vocab_only       = %d\n",     __func__, hparams.vocab_only);
 
     if (!hparams.vocab_only) {
@@ -7672,6 +8733,7 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        size_t layer_cache_size,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     auto & hparams = model.hparams;
@@ -7685,6 +8747,14 @@ static bool llm_load_tensors(
 
     // build a list of buffer types for the CPU and GPU devices
     model.cpu_buft_list = make_cpu_buft_list(model);
+
+    // the weights of the layers paged in on demand are used from the mappings, so they can only be in the CPU buffer
+    // type: the extra buffer types, such as CPU_AARCH64, repack them and host buffer types copy them
+    const bool page_layers = layer_cache_size > 0 && ml.use_mmap && !use_mlock;
+    if (page_layers) {
+        auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        model.cpu_paged_buft_list = { { cpu_dev, ggml_backend_dev_buffer_type(cpu_dev) } };
+    }
     for (auto * dev : model.devices) {
         llama_model::buft_list_t buft_list = make_gpu_buft_list(dev, split_mode, tensor_split);
         // add CPU buffer types as a fallback
@@ -7724,7 +8794,7 @@ static bool llm_load_tensors(
     const int act_gpu_layers = model.devices.empty() ? 0 : std::min(n_gpu_layers, (int)n_layer + 1);
     auto get_layer_buft_list = [&](int il) -> llama_model::layer_dev {
         if (il < i_gpu_start || (il - i_gpu_start) >= act_gpu_layers) {
-            return {cpu_dev, &model.cpu_buft_list};
+            return {cpu_dev, page_layers && il < n_layer ? &model.cpu_paged_buft_list : &model.cpu_buft_list};
         }
         int layer_gpu = std::upper_bound(splits.begin(), splits.begin() + device_count, float(il - i_gpu_start)/act_gpu_layers) - splits.begin();
         auto * dev = model.devices.at(layer_gpu);
@@ -9554,7 +10624,13 @@ static bool llm_load_tensors(
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &model.mlock_mmaps : nullptr);
+    if (layer_cache_size > 0 && (!ml.use_mmap || use_mlock)) {
+        LLAMA_LOG_WARN("%s: paging layers in on demand needs mmap without mlock, loading the whole model\n", __func__);
+        layer_cache_size = 0;
+    }
+
+    // the layers paged in on demand are not read while loading
+    ml.init_mappings(layer_cache_size == 0, use_mlock ? &model.mlock_mmaps : nullptr);
     model.mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -9620,6 +10696,17 @@ static bool llm_load_tensors(
                 mlock_buf->init   (ggml_backend_buffer_get_base(buf));
                 mlock_buf->grow_to(ggml_backend_buffer_get_size(buf));
             }
+            if (ggml_backend_buffer_is_host(buf)) {
+                // with the interleave NUMA strategy the rows of each weight are bound to the
+                // nodes that use them, before the data is read and the pages are touched
+                auto * reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+                auto * place_fn = (decltype(ggml_numa_place_tensor) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_place_tensor");
+                if (place_fn) {
+                    for (auto * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                        place_fn(cur);
+                    }
+                }
+            }
             for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
                 bufs.emplace(idx, buf);
             }
@@ -9679,6 +10766,33 @@ static bool llm_load_tensors(
         }
     }
 
+    if (layer_cache_size > 0 && !model.mappings.empty()) {
+        model.pager.reset(new llama_layer_pager(layer_cache_size));
+
+        // the weights of the repeating layers that are used from the mappings, in host buffers
+        for (const auto & it : model.tensors_by_name) {
+            const ggml_tensor * cur = it.second;
+            int il = -1;
+            if (sscanf(it.first.c_str(), "blk.%d.", &il) != 1 || !cur->buffer || !ggml_backend_buffer_is_host(cur->buffer)) {
+                continue;
+            }
+            for (const auto & mapping : model.mappings) {
+                const uint8_t * addr = (const uint8_t *) mapping->addr;
+                if ((const uint8_t *) cur->data >= addr && (const uint8_t *) cur->data < addr + mapping->size) {
+                    model.pager->add(il, cur, mapping.get(), (const uint8_t *) cur->data - addr, ggml_nbytes(cur));
+                    break;
+                }
+            }
+        }
+
+        if (model.pager->start()) {
+            LLAMA_LOG_INFO("%s: paging %.2f MiB of layers in on demand, keeping up to %.2f MiB resident\n", __func__,
+                model.pager->size() / 1024.0 / 1024.0, layer_cache_size / 1024.0 / 1024.0);
+        } else {
+            model.pager.reset();
+        }
+    }
+
     return true;
 }
 
@@ -9688,6 +10802,8 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
     try {
         llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
+        ml.n_threads_load = params.n_threads_load;
+        ml.use_direct_io  = params.use_direct_io;
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -9722,7 +10838,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
-            params.progress_callback, params.progress_callback_user_data
+            params.layer_cache_size, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
@@ -9829,6 +10945,43 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (!kv.runs.empty()) {
+        // paged cache: the tokens of the ubatch are scattered over runs of cells
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cur = ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens);
+
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+        for (const auto & run : kv.runs) {
+            struct ggml_tensor * k_run = ggml_view_2d(ctx, k_cur, n_embd_k_gqa, run.len, k_cur->nb[1], k_cur->nb[1]*run.token);
+            struct ggml_tensor * v_run = ggml_view_2d(ctx, v_cur, n_embd_v_gqa, run.len, v_cur->nb[1], v_cur->nb[1]*run.token);
+
+            struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], run.len*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*run.cell);
+            cb(k_cache_view, "k_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, k_run, k_cache_view));
+
+            struct ggml_tensor * v_cache_view = nullptr;
+
+            if (!kv.v_trans) {
+                v_cache_view = ggml_view_1d(ctx, kv.v_l[il], run.len*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*run.cell);
+            } else {
+                v_cache_view = ggml_view_2d(ctx, kv.v_l[il], run.len, n_embd_v_gqa,
+                        ( n_ctx)*ggml_element_size(kv.v_l[il]),
+                        (run.cell)*ggml_element_size(kv.v_l[il]));
+
+                v_run = ggml_transpose(ctx, v_run);
+            }
+            cb(v_cache_view, "v_cache_view", il);
+
+            ggml_build_forward_expand(graph, ggml_cpy(ctx, v_run, v_cache_view));
+        }
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -9839,10 +10992,10 @@ static void llm_build_kv_store(
 
     struct ggml_tensor * v_cache_view = nullptr;
 
-    if (cparams.flash_attn) {
+    if (!kv.v_trans) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa)*kv_head);
     } else {
-        // note: the V cache is transposed when not using flash attention
+        // note: the V cache is transposed when not using flash attention, unless it is quantized
         v_cache_view = ggml_view_2d(ctx, kv.v_l[il], n_tokens, n_embd_v_gqa,
                 (  n_ctx)*ggml_element_size(kv.v_l[il]),
                 (kv_head)*ggml_element_size(kv.v_l[il]));
@@ -10254,16 +11407,32 @@ static struct ggml_tensor * llm_build_kqv(
 
         GGML_ASSERT(kv.size == n_ctx);
 
-        // split cached v into n_head heads
-        struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[il],
-                    n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[il])*n_ctx,
-                    ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
-                    0);
-        cb(v, "v", il);
+        struct ggml_tensor * kqv;
+
+        if (kv.v_trans) {
+            // split cached v into n_head heads
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[il],
+                        n_kv, n_embd_head_v, n_head_kv,
+                        ggml_element_size(kv.v_l[il])*n_ctx,
+                        ggml_element_size(kv.v_l[il])*n_ctx*n_embd_head_v,
+                        0);
+            cb(v, "v", il);
+
+            kqv = ggml_mul_mat(ctx, v, kq);
+        } else {
+            // quantized V cache: split cached v into n_head heads (not transposed) and accumulate
+            // its rows weighted by kq, dequantizing each row once per tile of tokens
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[il],
+                        n_embd_head_v, n_kv, n_head_kv,
+                        ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[il]->type, n_embd_head_v),
+                        0);
+            cb(v, "v", il);
 
-        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+            kqv = ggml_out_prod(ctx, v, ggml_transpose(ctx, kq));
+        }
         cb(kqv, "kqv", il);
 
         struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
@@ -10856,8 +12025,8 @@ struct llm_build_context {
                 ggml_tensor * view_v_src;
                 ggml_tensor * view_v_dst;
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
+                if (!kv_self.v_trans) {
+                    // NOTE: the V cache is not transposed when using flash attention or when it is quantized
                     view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
                             n_embd_v_gqa, move.len,
                             ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
@@ -16295,11 +17464,16 @@ struct llm_build_context {
                             0);
                 cb(k, "k", il);
 
-                struct ggml_tensor * v =
-                    ggml_view_3d(ctx0, kv_self.v_l[il],
+                struct ggml_tensor * v = kv_self.v_trans
+                    ? ggml_view_3d(ctx0, kv_self.v_l[il],
                             n_kv, n_embd_head_v, n_head_kv,
                             ggml_element_size(kv_self.v_l[il])*n_ctx,
                             ggml_element_size(kv_self.v_l[il])*n_ctx*n_embd_head_v,
+                            0)
+                    : ggml_view_3d(ctx0, kv_self.v_l[il],
+                            n_embd_head_v, n_kv, n_head_kv,
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                            ggml_row_size(kv_self.v_l[il]->type, n_embd_head_v),
                             0);
                 cb(v, "v", il);
 
@@ -16318,7 +17492,9 @@ struct llm_build_context {
                 kq = ggml_soft_max_ext(ctx0, kq_b, KQ_mask_dec, 1.0f, hparams.f_max_alibi_bias);
                 cb(kq, "kq_soft_max_ext", il);
 
-                struct ggml_tensor * kqv = ggml_mul_mat(ctx0, v, kq);
+                struct ggml_tensor * kqv = kv_self.v_trans
+                    ? ggml_mul_mat(ctx0, v, kq)
+                    : ggml_out_prod(ctx0, v, ggml_transpose(ctx0, kq));
                 cb(kqv, "kqv", il);
 
                 struct ggml_tensor * kqv_merged = ggml_permute(ctx0, kqv, 0, 2, 1, 3);
@@ -17683,6 +18859,21 @@ static int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t
     return relative_bucket;
 }
 
+// fills a row of the KQ mask for a token at position pos, kpos holds the
+// positions of the KV cells (LLAMA_KV_POS_HIDDEN for cells of other sequences)
+// the loops are branch-free so that they are vectorized
+static void llama_fill_kq_mask_row(float * row, const llama_pos * kpos, int64_t n_kv, llama_pos pos, int32_t n_swa, bool alibi) {
+    if (alibi) {
+        for (int64_t i = 0; i < n_kv; ++i) {
+            row[i] = kpos[i] <= pos && pos - kpos[i] < n_swa ? (float) (kpos[i] - pos) : -INFINITY;
+        }
+    } else {
+        for (int64_t i = 0; i < n_kv; ++i) {
+            row[i] = kpos[i] <= pos && pos - kpos[i] < n_swa ? 0.0f : -INFINITY;
+        }
+    }
+}
+
 static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch) {
     //
     // set input data
@@ -17780,36 +18971,26 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & ubatch)
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the ubatch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+            // The positions of the cells visible to each sequence are cached in the KV cache and only
+            // patched for the cells that changed since the previous ubatch.
             for (int h = 0; h < 1; ++h) {
                 for (int s = 0; s < n_seqs; ++s) {
                     const llama_seq_id seq_id = ubatch.seq_id[s][0];
 
+                    const std::vector<llama_pos> & kpos = llama_kv_cache_seq_pos(lctx.kv_self, seq_id);
+
                     for (int j = 0; j < n_seq_tokens; ++j) {
                         const llama_pos pos = ubatch.pos[s*n_seq_tokens + j];
 
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
+                        if (data) {
+                            llama_fill_kq_mask_row(data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv,
+                                    kpos.data(), n_kv, pos, INT32_MAX, hparams.use_alibi);
+                        }
 
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
+                        // may need to cut off old tokens for sliding window
+                        if (data_swa) {
+                            llama_fill_kq_mask_row(data_swa + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv,
+                                    kpos.data(), n_kv, pos, hparams.n_swa, hparams.use_alibi);
                         }
                     }
                 }
@@ -18205,6 +19386,32 @@ static void llama_output_reorder(struct llama_context * ctx) {
     }
 }
 
+// gives the nodes to the layer pager of the model before they are computed, then to the user callback
+static bool llama_eval_callback(struct ggml_tensor * t, bool ask, void * user_data) {
+    auto & lctx = *(llama_context *) user_data;
+    const auto & cparams = lctx.cparams;
+
+    if (ask) {
+        const bool need = lctx.model.pager->use(t);
+        lctx.cb_eval_need = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+        return need || lctx.cb_eval_need;
+    }
+
+    if (lctx.cb_eval_need) {
+        return cparams.cb_eval(t, false, cparams.cb_eval_user_data);
+    }
+
+    return true;
+}
+
+static void llama_set_eval_callback(llama_context & lctx) {
+    if (lctx.model.pager) {
+        ggml_backend_sched_set_eval_callback(lctx.sched.get(), llama_eval_callback, &lctx);
+    } else {
+        ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+    }
+}
+
 // returns the result of ggml_backend_sched_graph_compute_async execution
 static enum ggml_status llama_graph_compute(
           llama_context & lctx,
@@ -18275,6 +19482,15 @@ static int llama_decode_internal(
         }
     }
 
+    for (uint32_t i = 0; i < n_tokens_all; ++i) {
+        for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
+            if (batch.seq_id[i][s] < 0 || batch.seq_id[i][s] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d >= %d\n", __func__, i, s, batch.seq_id[i][s], LLAMA_MAX_SEQ);
+                return -1;
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -18394,10 +19610,13 @@ static int llama_decode_internal(
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
         ggml_backend_sched_reset(lctx.sched.get());
-        ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        llama_set_eval_callback(lctx);
 
         ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
+        // the cell runs of the ubatch are only valid for this graph
+        kv_self.runs.clear();
+
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
         struct ggml_tensor * embd = ggml_graph_node(gf, -2);
@@ -18650,7 +19869,7 @@ static int llama_encode_internal(
     GGML_ASSERT(n_threads > 0);
 
     ggml_backend_sched_reset(lctx.sched.get());
-    ggml_backend_sched_set_eval_callback(lctx.sched.get(), lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+    llama_set_eval_callback(lctx);
 
     ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
 
@@ -18887,6 +20106,10 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         return;
     }
 
+    // the moved cells keep their sequences, only the blocks they belong to change
+    llama_kv_cache_blocks_refresh(kv_self);
+    llama_kv_cache_seq_pos_reset(kv_self);
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n",  moves.size());
 
 #if 0
@@ -19073,78 +20296,6 @@ struct quantize_state_internal {
         {}
 };
 
-static void llama_tensor_dequantize_internal(
-    struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
-    const size_t nelements, const int nthread
-) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
-
-    const ggml_type_traits * qtype = ggml_get_type_traits(tensor->type);
-    if (ggml_is_quantized(tensor->type)) {
-        if (qtype->to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
-        }
-    } else if (tensor->type != GGML_TYPE_F16 &&
-               tensor->type != GGML_TYPE_BF16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
-    }
-
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (tensor->type == GGML_TYPE_BF16) {
-            ggml_bf16_to_fp32_row((ggml_bf16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype->to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ABORT("fatal error"); // unreachable
-        }
-        return;
-    }
-
-    size_t block_size;
-    if (tensor->type == GGML_TYPE_F16 ||
-        tensor->type == GGML_TYPE_BF16) {
-        block_size = 1;
-    } else {
-        block_size = (size_t)ggml_blck_size(tensor->type);
-    }
-
-    size_t block_size_bytes = ggml_type_size(tensor->type);
-
-    GGML_ASSERT(nelements % block_size == 0);
-    size_t nblocks = nelements / block_size;
-    size_t blocks_per_thread = nblocks / nthread;
-    size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
-
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
-
-    for (int tnum = 0; tnum < nthread; tnum++) {
-        size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
-
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else if (typ == GGML_TYPE_BF16) {
-                ggml_bf16_to_fp32_row((ggml_bf16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype->to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-}
-
 static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type new_type, const ggml_tensor * tensor, llama_ftype ftype) {
     const std::string name = ggml_get_name(tensor);
 
@@ -19434,58 +20585,69 @@ static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type n
     return new_type;
 }
 
-static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    if (nthread < 2) {
-        // single-thread
-        size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-        if (!ggml_validate_row_data(new_type, new_data, new_size)) {
-            throw std::runtime_error("quantized data validation failed");
+// a tensor on its way through the quantization pipeline of llama_model_quantize_internal
+struct quantize_tensor_job {
+    struct ggml_tensor * tensor = nullptr;
+
+    bool quantize = false;
+    enum ggml_type new_type = GGML_TYPE_COUNT;
+    const float * imatrix = nullptr;
+
+    std::vector<no_init<uint8_t>> read_data; // the tensor data, when it is not mmapped
+    std::vector<no_init<uint8_t>> new_data;
+
+    // the rows of each expert are quantized in chunks of chunk_rows rows
+    int64_t chunk_rows    = 0;
+    int64_t n_chunks      = 0;
+    int64_t n_chunks_done = 0;
+
+    size_t n_bytes = 0; // held against the memory budget of the pipeline
+};
+
+// converts a chunk of rows of a tensor to f32 and quantizes it into the job's new data, so that no more than a chunk
+// of the tensor is ever held in f32
+static void llama_tensor_quantize_chunk(const quantize_tensor_job & job, int64_t chunk, std::vector<no_init<float>> & f32_buf) {
+    const struct ggml_tensor * tensor = job.tensor;
+
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t nrows     = tensor->ne[1];
+    const int64_t nchunk_03 = (nrows + job.chunk_rows - 1) / job.chunk_rows;
+
+    const int64_t i03       = chunk / nchunk_03;
+    const int64_t first_row = (chunk % nchunk_03) * job.chunk_rows;
+    const int64_t this_nrow = std::min(nrows - first_row, job.chunk_rows);
+    const int64_t row       = i03 * nrows + first_row;
+    const int64_t nelements = this_nrow * n_per_row;
+
+    const void * data = (const char *) tensor->data + row * ggml_row_size(tensor->type, n_per_row);
+
+    const float * f32_data;
+    if (tensor->type == GGML_TYPE_F32) {
+        f32_data = (const float *) data;
+    } else {
+        if (f32_buf.size() < (size_t) nelements) {
+            f32_buf.resize(nelements);
         }
-        return new_size;
-    }
+        float * f32_output = (float *) f32_buf.data();
 
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    bool valid = true;
-    auto compute = [&mutex, &counter, &new_size, &valid, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
-        size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
-                }
-                break;
-            }
-            lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            size_t this_size = ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
-            local_size += this_size;
-
-            // validate the quantized data
-            const size_t row_size  = ggml_row_size(new_type, n_per_row);
-            void * this_data = (char *) new_data + first_row * row_size;
-            if (!ggml_validate_row_data(new_type, this_data, this_size)) {
-                std::unique_lock<std::mutex> lock(mutex);
-                valid = false;
-                break;
-            }
+        if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) data, f32_output, nelements);
+        } else if (tensor->type == GGML_TYPE_BF16) {
+            ggml_bf16_to_fp32_row((const ggml_bf16_t *) data, f32_output, nelements);
+        } else {
+            ggml_get_type_traits(tensor->type)->to_float(data, f32_output, nelements);
         }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
+        f32_data = f32_output;
     }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-    if (!valid) {
+
+    // quantize each expert separately since they have different importance matrices
+    void * new_data = (char *) job.new_data.data() + row * ggml_row_size(job.new_type, n_per_row);
+    const float * imatrix = job.imatrix ? job.imatrix + i03 * n_per_row : nullptr;
+
+    const size_t new_size = ggml_quantize_chunk(job.new_type, f32_data, new_data, 0, this_nrow, n_per_row, imatrix);
+    if (!ggml_validate_row_data(job.new_type, new_data, new_size)) {
         throw std::runtime_error("quantized data validation failed");
     }
-    return new_size;
 }
 
 static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
@@ -19661,15 +20823,8 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
     int idx = 0;
 
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
     uint16_t n_split = 1;
 
     // Assume split index is continuous
@@ -19730,182 +20885,311 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     };
 
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
-    for (const auto * it : tensors) {
-        const auto & weight = *it;
-        struct ggml_tensor * tensor = weight.tensor;
-        if (weight.idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight.idx);
-        }
 
-        const std::string name = ggml_get_name(tensor);
+    // The tensors go through a pipeline: a reader thread loads them and decides their new types in order, nthread
+    // workers quantize them in chunks of rows, taking the chunks of the next tensor as soon as those of the previous
+    // one are all taken, and this thread writes them in order. The data of the tensors in the pipeline is limited to
+    // max_inflight bytes, unless a single tensor needs more.
+    static const size_t max_inflight = 1024ull*1024*1024;
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
+    std::vector<quantize_tensor_job> jobs(tensors.size());
+
+    std::mutex mutex;
+    std::condition_variable cv_read;  // the reader waits for room in the budget
+    std::condition_variable cv_work;  // the workers wait for chunks
+    std::condition_variable cv_write; // the writer waits for the next tensor
+    size_t n_read     = 0; // jobs handed over by the reader
+    size_t inflight   = 0; // bytes held by the jobs read and not written yet
+    size_t next_job   = 0; // the job of the next chunk taken by a worker
+    int64_t next_chunk = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    auto fail = [&](std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+            error = e;
+        }
+        stop = true;
+        cv_read.notify_all();
+        cv_work.notify_all();
+        cv_write.notify_all();
+    };
 
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
+    // reads the tensors and decides their new types, in order
+    auto reader = [&]() {
+        try {
+            for (size_t i = 0; i < tensors.size(); ++i) {
+                quantize_tensor_job & job = jobs[i];
+                struct ggml_tensor * tensor = tensors[i]->tensor;
 
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
+                const std::string name = ggml_get_name(tensor);
 
-        // quantize only 2D and 3D tensors (experts)
-        quantize &= (ggml_n_dims(tensor) >= 2);
+                // This used to be a regex, but <regex> has an extreme cost to compile times.
+                bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
-        // do not quantize norm tensors
-        quantize &= name.find("_norm.weight") == std::string::npos;
+                // quantize only 2D and 3D tensors (experts)
+                quantize &= (ggml_n_dims(tensor) >= 2);
 
-        quantize &= params->quantize_output_tensor || name != "output.weight";
-        quantize &= !params->only_copy;
+                // do not quantize norm tensors
+                quantize &= name.find("_norm.weight") == std::string::npos;
 
-        // do not quantize expert gating tensors
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
+                quantize &= params->quantize_output_tensor || name != "output.weight";
+                quantize &= !params->only_copy;
 
-        // do not quantize positional embeddings and token types (BERT)
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_POS_EMBD,    "weight");
-        quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
+                // do not quantize expert gating tensors
+                // NOTE: can't use LLM_TN here because the layer number is not known
+                quantize &= name.find("ffn_gate_inp.weight") == std::string::npos;
 
-        // do not quantize Mamba's small yet 2D weights
-        // NOTE: can't use LLM_TN here because the layer number is not known
-        quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
+                // do not quantize positional embeddings and token types (BERT)
+                quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_POS_EMBD,    "weight");
+                quantize &= name != LLM_TN(model.arch)(LLM_TENSOR_TOKEN_TYPES, "weight");
 
-        // do not quantize RWKV's time_mix_first tensors
-        quantize &= name.find("time_mix_first.weight") == std::string::npos;
-        quantize &= name.find("time_mix_w1.weight") == std::string::npos;
-        quantize &= name.find("time_mix_w2.weight") == std::string::npos;
-        quantize &= name.find("time_mix_decay_w1.weight") == std::string::npos;
-        quantize &= name.find("time_mix_decay_w2.weight") == std::string::npos;
+                // do not quantize Mamba's small yet 2D weights
+                // NOTE: can't use LLM_TN here because the layer number is not known
+                quantize &= name.find("ssm_conv1d.weight") == std::string::npos;
 
-        // do not quantize relative position bias (T5)
-        quantize &= name.find("attn_rel_b.weight") == std::string::npos;
+                // do not quantize RWKV's time_mix_first tensors
+                quantize &= name.find("time_mix_first.weight") == std::string::npos;
+                quantize &= name.find("time_mix_w1.weight") == std::string::npos;
+                quantize &= name.find("time_mix_w2.weight") == std::string::npos;
+                quantize &= name.find("time_mix_decay_w1.weight") == std::string::npos;
+                quantize &= name.find("time_mix_decay_w2.weight") == std::string::npos;
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+                // do not quantize relative position bias (T5)
+                quantize &= name.find("attn_rel_b.weight") == std::string::npos;
 
-        if (quantize) {
-            new_type = default_type;
+                enum ggml_type new_type = tensor->type;
 
-            // get more optimal quantization type based on the tensor shape, layer, etc.
-            if (!params->pure && ggml_is_quantized(default_type)) {
-                new_type = llama_tensor_get_type(qs, new_type, tensor, ftype);
-            }
-            if (params->token_embedding_type < GGML_TYPE_COUNT && strcmp(tensor->name, "token_embd.weight") == 0) {
-                new_type = params->token_embedding_type;
-            }
-            if (params->output_tensor_type < GGML_TYPE_COUNT && strcmp(tensor->name, "output.weight") == 0) {
-                new_type = params->output_tensor_type;
-            }
+                if (quantize) {
+                    new_type = default_type;
 
-            // If we've decided to quantize to the same type the tensor is already
-            // in then there's nothing to do.
-            quantize = tensor->type != new_type;
-        }
+                    // get more optimal quantization type based on the tensor shape, layer, etc.
+                    if (!params->pure && ggml_is_quantized(default_type)) {
+                        new_type = llama_tensor_get_type(qs, new_type, tensor, ftype);
+                    }
+                    if (params->token_embedding_type < GGML_TYPE_COUNT && strcmp(tensor->name, "token_embd.weight") == 0) {
+                        new_type = params->token_embedding_type;
+                    }
+                    if (params->output_tensor_type < GGML_TYPE_COUNT && strcmp(tensor->name, "output.weight") == 0) {
+                        new_type = params->output_tensor_type;
+                    }
 
-        if (!quantize) {
-            new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
-        } else {
-            const int64_t nelements = ggml_nelements(tensor);
+                    // If we've decided to quantize to the same type the tensor is already
+                    // in then there's nothing to do.
+                    quantize = tensor->type != new_type;
+                }
 
-            const float * imatrix = nullptr;
-            if (imatrix_data) {
-                auto it = imatrix_data->find(tensor->name);
-                if (it == imatrix_data->end()) {
-                    LLAMA_LOG_INFO("\n====== %s: did not find weights for %s\n", __func__, tensor->name);
-                } else {
-                    if (it->second.size() == (size_t)tensor->ne[0]*tensor->ne[2]) {
-                        imatrix = it->second.data();
-                    } else {
-                        LLAMA_LOG_INFO("\n====== %s: imatrix size %d is different from tensor size %d for %s\n", __func__,
-                                int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name);
-
-                        // this can happen when quantizing an old mixtral model with split tensors with a new incompatible imatrix
-                        // this is a significant error and it may be good idea to abort the process if this happens,
-                        // since many people will miss the error and not realize that most of the model is being quantized without an imatrix
-                        // tok_embd should be ignored in this case, since it always causes this warning
-                        if (name != tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
-                            throw std::runtime_error(format("imatrix size %d is different from tensor size %d for %s",
-                                    int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name));
+                const float * imatrix = nullptr;
+                if (quantize) {
+                    if (imatrix_data) {
+                        auto it = imatrix_data->find(tensor->name);
+                        if (it == imatrix_data->end()) {
+                            LLAMA_LOG_INFO("\n====== %s: did not find weights for %s\n", __func__, tensor->name);
+                        } else {
+                            if (it->second.size() == (size_t)tensor->ne[0]*tensor->ne[2]) {
+                                imatrix = it->second.data();
+                            } else {
+                                LLAMA_LOG_INFO("\n====== %s: imatrix size %d is different from tensor size %d for %s\n", __func__,
+                                        int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name);
+
+                                // this can happen when quantizing an old mixtral model with split tensors with a new incompatible imatrix
+                                // this is a significant error and it may be good idea to abort the process if this happens,
+                                // since many people will miss the error and not realize that most of the model is being quantized without an imatrix
+                                // tok_embd should be ignored in this case, since it always causes this warning
+                                if (name != tn(LLM_TENSOR_TOKEN_EMBD, "weight")) {
+                                    throw std::runtime_error(format("imatrix size %d is different from tensor size %d for %s",
+                                            int(it->second.size()), int(tensor->ne[0]*tensor->ne[2]), tensor->name));
+                                }
+                            }
                         }
                     }
+                    if ((new_type == GGML_TYPE_IQ2_XXS ||
+                         new_type == GGML_TYPE_IQ2_XS  ||
+                         new_type == GGML_TYPE_IQ2_S   ||
+                         new_type == GGML_TYPE_IQ1_S   ||
+                        (new_type == GGML_TYPE_IQ1_M && strcmp(tensor->name, "token_embd.weight") && strcmp(tensor->name, "output.weight"))  ||
+                        (new_type == GGML_TYPE_Q2_K && params->ftype == LLAMA_FTYPE_MOSTLY_Q2_K_S && strcmp(tensor->name, "token_embd.weight") != 0)) && !imatrix) {
+                        LLAMA_LOG_ERROR("\n\n============================================================\n");
+                        LLAMA_LOG_ERROR("Missing importance matrix for tensor %s in a very low-bit quantization\n", tensor->name);
+                        LLAMA_LOG_ERROR("The result will be garbage, so bailing out\n");
+                        LLAMA_LOG_ERROR("============================================================\n\n");
+                        throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
+                    }
+
+                    if (ggml_is_quantized(tensor->type)) {
+                        if (!params->allow_requantize) {
+                            throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+                        }
+                        if (ggml_get_type_traits(tensor->type)->to_float == NULL) {
+                            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+                        }
+                    } else if (tensor->type != GGML_TYPE_F32 &&
+                               tensor->type != GGML_TYPE_F16 &&
+                               tensor->type != GGML_TYPE_BF16) {
+                        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+                    }
+                }
+
+                const size_t new_size = quantize ? ggml_row_size(new_type, tensor->ne[0]) * ggml_nrows(tensor) : 0;
+                const size_t n_bytes  = ggml_nbytes(tensor) + new_size;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv_read.wait(lock, [&] { return stop || inflight == 0 || inflight + n_bytes <= max_inflight; });
+                    if (stop) {
+                        return;
+                    }
+                    inflight += n_bytes;
+                }
+
+                job.tensor   = tensor;
+                job.quantize = quantize;
+                job.new_type = new_type;
+                job.imatrix  = imatrix;
+                job.n_bytes  = n_bytes;
+
+                if (!ml.use_mmap) {
+                    job.read_data.resize(ggml_nbytes(tensor));
+                    tensor->data = job.read_data.data();
+                }
+                ml.load_data_for(tensor);
+
+                if (quantize) {
+                    static const int64_t min_chunk_size = 32 * 512;
+                    const int64_t n_per_row = tensor->ne[0];
+                    const int64_t nrows     = tensor->ne[1];
+
+                    job.new_data.resize(new_size);
+                    job.chunk_rows = (min_chunk_size + n_per_row - 1) / n_per_row;
+                    job.n_chunks   = tensor->ne[2] * ((nrows + job.chunk_rows - 1) / job.chunk_rows);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    n_read = i + 1;
                 }
+                cv_work.notify_all();
+                cv_write.notify_one();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+
+    auto worker = [&]() {
+        std::vector<no_init<float>> f32_buf;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            while (next_job < n_read && next_chunk == jobs[next_job].n_chunks) {
+                ++next_job;
+                next_chunk = 0;
+            }
+            if (stop || next_job == jobs.size()) {
+                break;
             }
-            if ((new_type == GGML_TYPE_IQ2_XXS ||
-                 new_type == GGML_TYPE_IQ2_XS  ||
-                 new_type == GGML_TYPE_IQ2_S   ||
-                 new_type == GGML_TYPE_IQ1_S   ||
-                (new_type == GGML_TYPE_IQ1_M && strcmp(tensor->name, "token_embd.weight") && strcmp(tensor->name, "output.weight"))  ||
-                (new_type == GGML_TYPE_Q2_K && params->ftype == LLAMA_FTYPE_MOSTLY_Q2_K_S && strcmp(tensor->name, "token_embd.weight") != 0)) && !imatrix) {
-                LLAMA_LOG_ERROR("\n\n============================================================\n");
-                LLAMA_LOG_ERROR("Missing importance matrix for tensor %s in a very low-bit quantization\n", tensor->name);
-                LLAMA_LOG_ERROR("The result will be garbage, so bailing out\n");
-                LLAMA_LOG_ERROR("============================================================\n\n");
-                throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
+            if (next_job == n_read) {
+                cv_work.wait(lock);
+                continue;
             }
 
-            float * f32_data;
+            quantize_tensor_job & job = jobs[next_job];
+            const int64_t chunk = next_chunk++;
+            lock.unlock();
+            try {
+                llama_tensor_quantize_chunk(job, chunk, f32_buf);
+            } catch (...) {
+                fail(std::current_exception());
+                return;
+            }
+            lock.lock();
 
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
+            if (++job.n_chunks_done == job.n_chunks) {
+                cv_write.notify_one();
             }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(nthread + 1);
+    workers.emplace_back(reader);
+    for (int i = 0; i < nthread; ++i) {
+        workers.emplace_back(worker);
+    }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+    try {
+        new_ofstream(0);
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            quantize_tensor_job & job = jobs[i];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_write.wait(lock, [&] { return stop || (i < n_read && job.n_chunks_done == job.n_chunks); });
+                if (stop) {
+                    break;
+                }
+            }
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+            const auto & weight = *tensors[i];
+            struct ggml_tensor * tensor = weight.tensor;
+            if (weight.idx != cur_split && params->keep_split) {
+                close_ofstream();
+                new_ofstream(weight.idx);
             }
-            new_data = work.data();
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+            const std::string name = ggml_get_name(tensor);
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
+            LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+                   ++idx, ml.n_tensors,
+                   ggml_get_name(tensor),
+                   llama_format_tensor_shape(tensor).c_str(),
+                   ggml_type_name(tensor->type));
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+            const void * new_data;
+            size_t new_size;
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+            if (!job.quantize) {
+                new_data = tensor->data;
+                new_size = ggml_nbytes(tensor);
+                LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+            } else {
+                new_data = job.new_data.data();
+                new_size = job.new_data.size();
+                LLAMA_LOG_INFO("converting to %s .. size = %8.2f MiB -> %8.2f MiB\n", ggml_type_name(job.new_type),
+                        ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+            }
+            total_size_org += ggml_nbytes(tensor);
+            total_size_new += new_size;
+
+            // update the gguf meta data as we go
+            gguf_set_tensor_type(ctx_outs[cur_split].get(), name.c_str(), job.new_type);
+            gguf_set_tensor_data(ctx_outs[cur_split].get(), name.c_str(), new_data, new_size);
+
+            // write tensor data + padding
+            fout.write((const char *) new_data, new_size);
+            zeros(fout, GGML_PAD(new_size, align) - new_size);
 
-                new_size += llama_tensor_quantize_internal(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+            // the pages of the source tensor are not needed anymore
+            if (ml.use_mmap) {
+                ml.mappings.at(weight.idx)->unmap_fragment(weight.offs, weight.offs + ggml_nbytes(tensor));
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
-        }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split].get(), name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_outs[cur_split].get(), name.c_str(), new_data, new_size);
+            // free the buffers of the tensor for the reader
+            std::vector<no_init<uint8_t>>().swap(job.read_data);
+            std::vector<no_init<uint8_t>>().swap(job.new_data);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inflight -= job.n_bytes;
+            }
+            cv_read.notify_one();
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    for (auto & w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
     }
     close_ofstream();
 
@@ -20129,10 +21413,13 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.n_threads_load              =*/ 0,
+        /*.layer_cache_size            =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_direct_io               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -20162,6 +21449,7 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -20420,8 +21708,12 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
-    if (ggml_is_quantized(params.type_v) && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+    if (ggml_is_quantized(params.type_v) && !params.flash_attn && params.offload_kqv && model->n_gpu_layers > 0 && !model->devices.empty()) {
+        LLAMA_LOG_WARN("%s: V cache quantization without flash_attn is only supported on the CPU, attention will not be offloaded\n", __func__);
+    }
+
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_SEQ);
         return nullptr;
     }
 
@@ -20438,6 +21730,7 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -20597,6 +21890,16 @@ struct llama_context * llama_new_context_with_model(
             return nullptr;
         }
 
+        if (ctx->kv_self.block_size > 0) {
+            // each run of cells adds up to 8 nodes per layer when storing K and V, keep half of the graph for the model
+            ctx->kv_self.max_runs = std::max<uint32_t>(1, (llama_model_max_nodes(*model)/2)/(8*hparams.n_layer));
+
+            LLAMA_LOG_INFO("%s: paged KV cache, %u blocks of %u cells, max %u runs per ubatch\n", __func__,
+                    (uint32_t) ctx->kv_self.blocks.size(), ctx->kv_self.block_size, ctx->kv_self.max_runs);
+        } else if (cparams.kv_block_size > 0) {
+            LLAMA_LOG_WARN("%s: paged KV cache is not supported by recurrent models - using a contiguous cache\n", __func__);
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
@@ -20922,6 +22225,10 @@ uint64_t llama_model_size(const struct llama_model * model) {
     return model->n_bytes;
 }
 
+uint64_t llama_model_paged_size(const struct llama_model * model) {
+    return model->pager ? model->pager->size() : 0;
+}
+
 uint64_t llama_model_n_params(const struct llama_model * model) {
     return model->n_elements;
 }
@@ -21273,6 +22580,11 @@ struct llama_data_write {
     virtual size_t get_size_written() = 0;
     virtual ~llama_data_write() = default;
 
+    // position relative to which the tensor data is aligned
+    virtual size_t get_offset() {
+        return get_size_written();
+    }
+
     void write_string(const std::string & str) {
         uint32_t str_size = str.size();
 
@@ -21280,6 +22592,17 @@ struct llama_data_write {
         write(str.data(), str_size);
     }
 
+    // pad with zeros up to the next multiple of LLAMA_STATE_ALIGNMENT, so that a reader can map the data that follows
+    void write_align() {
+        static const uint8_t zeros[LLAMA_STATE_ALIGNMENT] = {};
+
+        const size_t offset = get_offset();
+        const size_t pad    = GGML_PAD(offset, LLAMA_STATE_ALIGNMENT) - offset;
+        if (pad) {
+            write(zeros, pad);
+        }
+    }
+
     void write_model_info(const struct llama_context * ctx) {
         std::string arch_str = LLM_ARCH_NAMES.at(ctx->model.arch);
         write_string(arch_str);
@@ -21391,6 +22714,8 @@ struct llama_data_write {
             const uint64_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
             write(&k_size_row, sizeof(k_size_row));
 
+            write_align();
+
             // Read each range of cells of k_size length each into tmp_buf and write out
             for (const auto & range : cell_ranges) {
                 const size_t range_size = range.second - range.first;
@@ -21411,6 +22736,8 @@ struct llama_data_write {
                 const uint64_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
                 write(&v_size_row, sizeof(v_size_row));
 
+                write_align();
+
                 // Read each range of cells of v_size length each into tmp_buf and write out
                 for (const auto & range : cell_ranges) {
                     const size_t range_size = range.second - range.first;
@@ -21435,6 +22762,8 @@ struct llama_data_write {
                 // Write GQA embedding size
                 write(&n_embd_v_gqa, sizeof(n_embd_v_gqa));
 
+                write_align();
+
                 // For each row, we get the element values of each cell
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                     // Read each range of cells of v_size_el length each into tmp_buf and write out
@@ -21495,6 +22824,11 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // position relative to which the tensor data is aligned
+    virtual size_t get_offset() {
+        return get_size_read();
+    }
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -21502,6 +22836,15 @@ struct llama_data_read {
         str.assign((const char *) read(str_size), str_size);
     }
 
+    // skip the padding written by llama_data_write::write_align
+    void read_align() {
+        const size_t offset = get_offset();
+        const size_t pad    = GGML_PAD(offset, LLAMA_STATE_ALIGNMENT) - offset;
+        if (pad) {
+            read(pad);
+        }
+    }
+
     // validate model information
     void read_model_info(const struct llama_context * ctx) {
         std::string cur_arch_str = LLM_ARCH_NAMES.at(ctx->model.arch);
@@ -21612,12 +22955,17 @@ struct llama_data_read {
             }
 
             // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-            // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+            // Assume that this is one contiguous block of cells, unless the paged allocator scattered them
+            uint32_t cell_last = kv_self.head + cell_count - 1;
+            if (!kv_self.runs.empty()) {
+                cell_last = kv_self.runs.back().cell + kv_self.runs.back().len - 1;
+            } else {
+                GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
+            }
             GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+            GGML_ASSERT(kv_self.cells[cell_last].pos == batch.pos[cell_count - 1]);
             GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            GGML_ASSERT(kv_self.cells[cell_last].has_seq_id(dest_seq_id));
         } else {
             // whole KV cache restore
 
@@ -21663,6 +23011,9 @@ struct llama_data_read {
 
             kv_self.head = 0;
             kv_self.used = cell_count;
+
+            llama_kv_cache_blocks_refresh(kv_self);
+            llama_kv_cache_seq_pos_reset(kv_self);
         }
 
         if (kv_self.recurrent) {
@@ -21697,6 +23048,12 @@ struct llama_data_read {
             return false;
         }
 
+        // the cells of a restored sequence are contiguous at head, unless the paged allocator scattered them
+        std::vector<llama_kv_cell_run> runs = kv_self.runs;
+        if (runs.empty()) {
+            runs.push_back({ 0, kv_self.head, cell_count });
+        }
+
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
         for (uint32_t il = 0; il < n_layer; ++il) {
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
@@ -21719,9 +23076,13 @@ struct llama_data_read {
                 return false;
             }
 
+            read_align();
+
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                for (const auto & run : runs) {
+                    ggml_backend_tensor_set(kv_self.k_l[il], read(run.len * k_size_row), run.cell * k_size_row, run.len * k_size_row);
+                }
             }
         }
 
@@ -21747,9 +23108,13 @@ struct llama_data_read {
                     return false;
                 }
 
+                read_align();
+
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    for (const auto & run : runs) {
+                        ggml_backend_tensor_set(kv_self.v_l[il], read(run.len * v_size_row), run.cell * v_size_row, run.len * v_size_row);
+                    }
                 }
             }
         } else {
@@ -21783,11 +23148,15 @@ struct llama_data_read {
                     return false;
                 }
 
+                read_align();
+
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        for (const auto & run : runs) {
+                            const size_t dst_offset = (run.cell + j * kv_self.size) * v_size_el;
+                            ggml_backend_tensor_set(kv_self.v_l[il], read(run.len * v_size_el), dst_offset, run.len * v_size_el);
+                        }
                     }
                 }
             }
@@ -21801,6 +23170,8 @@ struct llama_data_read {
 
         bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
 
+        ctx->kv_self.runs.clear();
+
         if (!res) {
             if (seq_id == -1) {
                 llama_kv_cache_clear(ctx);
@@ -21910,6 +23281,10 @@ struct llama_data_write_file : llama_data_write {
     size_t get_size_written() override {
         return size_written;
     }
+
+    size_t get_offset() override {
+        return file->tell();
+    }
 };
 
 struct llama_data_read_file : llama_data_read {
@@ -21933,6 +23308,48 @@ struct llama_data_read_file : llama_data_read {
     size_t get_size_read() override {
         return size_read;
     }
+
+    size_t get_offset() override {
+        return file->tell();
+    }
+};
+
+// reads straight from a mapping of the file, so the K and V data is copied once, from the page cache into the KV cache
+struct llama_data_read_mmap : llama_data_read {
+    const llama_mmap * mapping;
+    size_t offset;
+    size_t size_read = 0;
+
+    llama_data_read_mmap(const llama_mmap * m, size_t off) : mapping(m), offset(off) {}
+
+    const uint8_t * read(size_t size) override {
+        if (size > mapping->size - offset) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+        const uint8_t * ptr = (const uint8_t *) mapping->addr + offset;
+
+        // let the kernel read this region and the next one, which usually has the same size, in large requests
+        // while the current one is being copied, instead of faulting in each page
+        if (size >= LLAMA_STATE_ALIGNMENT) {
+            mapping->prefetch_range(offset, 2*size);
+        }
+
+        offset    += size;
+        size_read += size;
+        return ptr;
+    }
+
+    void read_to(void * dst, size_t size) override {
+        memcpy(dst, read(size), size);
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+
+    size_t get_offset() override {
+        return offset;
+    }
 };
 
 /** copy state data into either a buffer or file depending on the passed in context
@@ -22042,8 +23459,15 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
     {
         const size_t n_state_size_cur = file.size - file.tell();
 
-        llama_data_read_file data_ctx(&file);
-        const size_t n_read = llama_state_set_data_internal(ctx, data_ctx);
+        size_t n_read;
+        if (llama_mmap::SUPPORTED) {
+            llama_mmap mapping(&file, /* prefetch */ 0);
+            llama_data_read_mmap data_ctx(&mapping, file.tell());
+            n_read = llama_state_set_data_internal(ctx, data_ctx);
+        } else {
+            llama_data_read_file data_ctx(&file);
+            n_read = llama_state_set_data_internal(ctx, data_ctx);
+        }
 
         if (n_read != n_state_size_cur) {
             LLAMA_LOG_ERROR("%s: did not read all of the session file data! size %zu, got %zu\n", __func__, n_state_size_cur, n_read);
@@ -22176,19 +23600,26 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
     }
 
     // restore the context state
-    {
-        const size_t state_size = file.size - file.tell();
+    const size_t state_offset = file.tell();
+    const size_t state_size   = file.size - state_offset;
+
+    size_t nread;
+    if (llama_mmap::SUPPORTED) {
+        llama_mmap mapping(&file, /* prefetch */ 0);
+        llama_data_read_mmap data_ctx(&mapping, state_offset);
+        nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+    } else {
         llama_data_read_file data_ctx(&file);
-        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
-        if (!nread) {
-            LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
-            return 0;
-        }
-        GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
+        nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+    }
+    if (!nread) {
+        LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+        return 0;
     }
+    GGML_ASSERT(nread <= state_size);
+    GGML_ASSERT(state_offset == sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out);
 
-    return file.tell();
+    return state_offset + nread;
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -22581,6 +24012,18 @@ int32_t llama_tokenize(
     return llama_tokenize_impl(model->vocab, text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_parallel(
+    const struct llama_model * model,
+                  const char * text,
+                     int32_t   text_len,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return llama_tokenize_impl(model->vocab, text, text_len, tokens, n_tokens_max, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_model * model,
                  llama_token   token,
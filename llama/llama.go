@@ -89,6 +89,7 @@ COMPILER inline get_compiler() {
 import "C"
 
 import (
+	"crypto/sha256"
 	_ "embed"
 	"errors"
 	"fmt"
@@ -99,12 +100,35 @@ import (
 	"strings"
 	"sync/atomic"
 	"unsafe"
+
+	"github.com/ollama/ollama/util/lru"
 )
 
 func BackendInit() {
 	C.llama_backend_init()
 }
 
+// NumaInit sets how the CPU backend places threads and weights on NUMA nodes.
+// It must be called before the model is loaded.
+func NumaInit(strategy string) error {
+	var numa C.enum_ggml_numa_strategy
+	switch strategy {
+	case "distribute":
+		numa = C.GGML_NUMA_STRATEGY_DISTRIBUTE
+	case "isolate":
+		numa = C.GGML_NUMA_STRATEGY_ISOLATE
+	case "numactl":
+		numa = C.GGML_NUMA_STRATEGY_NUMACTL
+	case "interleave":
+		numa = C.GGML_NUMA_STRATEGY_INTERLEAVE
+	default:
+		return fmt.Errorf("unknown NUMA strategy %q", strategy)
+	}
+
+	C.llama_numa_init(numa)
+	return nil
+}
+
 func PrintSystemInfo() string {
 	var compiler string
 	switch C.get_compiler() {
@@ -164,7 +188,7 @@ type ContextParams struct {
 	c C.struct_llama_context_params
 }
 
-func NewContextParams(numCtx int, batchSize int, numSeqMax int, threads int, flashAttention bool, kvCacheType string) ContextParams {
+func NewContextParams(numCtx int, batchSize int, numSeqMax int, threads int, flashAttention bool, kvCacheType string, kvBlockSize int) ContextParams {
 	params := C.llama_context_default_params()
 	params.n_ctx = C.uint(numCtx)
 	params.n_batch = C.uint(batchSize)
@@ -175,6 +199,7 @@ func NewContextParams(numCtx int, batchSize int, numSeqMax int, threads int, fla
 	params.flash_attn = C.bool(flashAttention)
 	params.type_k = kvCacheTypeFromStr(strings.ToLower(kvCacheType))
 	params.type_v = kvCacheTypeFromStr(strings.ToLower(kvCacheType))
+	params.kv_block_size = C.uint(kvBlockSize)
 
 	return ContextParams{c: params}
 }
@@ -244,6 +269,31 @@ func (c *Context) KvCacheDefrag() {
 	C.llama_kv_cache_defrag(c.c)
 }
 
+// StateSeqGetData returns the KV cache state of a sequence
+func (c *Context) StateSeqGetData(seqId int) []byte {
+	// apply pending shifts, the state holds the K cache as it is
+	C.llama_kv_cache_update(c.c)
+
+	size := C.llama_state_seq_get_size(c.c, C.llama_seq_id(seqId))
+	if size == 0 {
+		return nil
+	}
+
+	buf := make([]byte, size)
+	n := C.llama_state_seq_get_data(c.c, (*C.uint8_t)(unsafe.Pointer(&buf[0])), size, C.llama_seq_id(seqId))
+	return buf[:n]
+}
+
+// StateSeqSetData replaces the KV cache entries of a sequence with a state
+// returned by StateSeqGetData
+func (c *Context) StateSeqSetData(seqId int, state []byte) bool {
+	if len(state) == 0 {
+		return false
+	}
+
+	return C.llama_state_seq_set_data(c.c, (*C.uint8_t)(unsafe.Pointer(&state[0])), C.size_t(len(state)), C.llama_seq_id(seqId)) > 0
+}
+
 // Get the embeddings for a sequence id
 func (c *Context) GetEmbeddingsSeq(seqId int) []float32 {
 	embeddings := unsafe.Pointer(C.llama_get_embeddings_seq(c.c, C.int(seqId)))
@@ -264,13 +314,16 @@ func (c *Context) GetEmbeddingsIth(i int) []float32 {
 }
 
 type ModelParams struct {
-	NumGpuLayers int
-	MainGpu      int
-	UseMmap      bool
-	UseMlock     bool
-	TensorSplit  []float32
-	Progress     func(float32)
-	VocabOnly    bool
+	NumGpuLayers   int
+	MainGpu        int
+	UseMmap        bool
+	UseMlock       bool
+	TensorSplit    []float32
+	Progress       func(float32)
+	VocabOnly      bool
+	LayerCacheSize uint64
+	LoadThreads    int
+	DirectIO       bool
 }
 
 //export llamaProgressCallback
@@ -288,6 +341,9 @@ func LoadModelFromFile(modelPath string, params ModelParams) (*Model, error) {
 	cparams.use_mmap = C.bool(params.UseMmap)
 	cparams.use_mlock = C.bool(params.UseMlock)
 	cparams.vocab_only = C.bool(params.VocabOnly)
+	cparams.layer_cache_size = C.size_t(params.LayerCacheSize)
+	cparams.n_threads_load = C.int32_t(params.LoadThreads)
+	cparams.use_direct_io = C.bool(params.DirectIO)
 
 	if len(params.TensorSplit) > 0 {
 		tensorSplitData := &params.TensorSplit[0]
@@ -339,6 +395,11 @@ func (m *Model) NumVocab() int {
 	return int(C.llama_n_vocab(m.c))
 }
 
+// pagedSize returns the size in bytes of the layers paged in on demand with LayerCacheSize
+func (m *Model) pagedSize() uint64 {
+	return uint64(C.llama_model_paged_size(m.c))
+}
+
 func (m *Model) TokenIsEog(token int) bool {
 	return bool(C.llama_token_is_eog(m.c, C.llama_token(token)))
 }
@@ -480,13 +541,27 @@ func (m *Model) TokenToPiece(token int) string {
 	return strings.TrimRight(string(buf), "\x00")
 }
 
+// Texts of at least this many bytes are tokenized on several threads, as
+// llama.cpp gives each thread at least 32 KiB
+const tokenizeParallelSize = 64 << 10
+
+// Tokenize converts text into tokens. Long texts are tokenized on several CPUs.
 func (m *Model) Tokenize(text string, addSpecial bool, parseSpecial bool) ([]int, error) {
+	numThreads := 1
+	if len(text) >= tokenizeParallelSize {
+		numThreads = runtime.NumCPU()
+	}
+
+	return m.tokenize(text, addSpecial, parseSpecial, numThreads)
+}
+
+func (m *Model) tokenize(text string, addSpecial bool, parseSpecial bool, numThreads int) ([]int, error) {
 	maxTokens := len(text) + 2
 	cTokens := make([]C.llama_token, maxTokens)
 	cText := C.CString(text)
 	defer C.free(unsafe.Pointer(cText))
 
-	result := C.llama_tokenize(
+	result := C.llama_tokenize_parallel(
 		m.c,
 		cText,
 		C.int32_t(len(text)),
@@ -494,13 +569,14 @@ func (m *Model) Tokenize(text string, addSpecial bool, parseSpecial bool) ([]int
 		C.int32_t(maxTokens),
 		C.bool(addSpecial),
 		C.bool(parseSpecial),
+		C.int32_t(numThreads),
 	)
 
 	// if the result is negative, reallocate and retry with the correct buffer size
 	if result < 0 {
 		maxTokens = int(-result)
 		cTokens = make([]C.llama_token, maxTokens)
-		result = C.llama_tokenize(
+		result = C.llama_tokenize_parallel(
 			m.c,
 			cText,
 			C.int32_t(len(text)),
@@ -508,6 +584,7 @@ func (m *Model) Tokenize(text string, addSpecial bool, parseSpecial bool) ([]int
 			C.int32_t(maxTokens),
 			C.bool(addSpecial),
 			C.bool(parseSpecial),
+			C.int32_t(numThreads),
 		)
 		if result < 0 {
 			return nil, fmt.Errorf("tokenization failed, required %d tokens", -result)
@@ -522,6 +599,33 @@ func (m *Model) Tokenize(text string, addSpecial bool, parseSpecial bool) ([]int
 	return tokens, nil
 }
 
+// regexSplit returns the lengths of the words that text is split into by the
+// regexes of a pre-tokenizer, with the compiled DFA or with std::regex
+func regexSplit(text string, regexExprs []string, useDFA bool) ([]int, error) {
+	cText := C.CString(text)
+	defer C.free(unsafe.Pointer(cText))
+
+	cExprs := make([]*C.char, len(regexExprs))
+	for i, expr := range regexExprs {
+		cExprs[i] = C.CString(expr)
+		defer C.free(unsafe.Pointer(cExprs[i]))
+	}
+
+	// every word holds at least one byte of the text
+	cLens := make([]C.int, len(text)+1)
+	n := C.regex_split(cText, &cExprs[0], C.int(len(cExprs)), C.bool(useDFA), &cLens[0], C.int(len(cLens)))
+	if n < 0 {
+		return nil, errors.New("unable to split text")
+	}
+
+	lens := make([]int, n)
+	for i := range n {
+		lens[i] = int(cLens[i])
+	}
+
+	return lens, nil
+}
+
 func (m *Model) NEmbd() int {
 	return int(C.llama_n_embd(m.c))
 }
@@ -677,6 +781,9 @@ type SamplingParams struct {
 	PenalizeNl     bool
 	Seed           uint32
 	Grammar        string
+
+	// CompiledGrammar, if set, is used instead of parsing Grammar
+	CompiledGrammar *Grammar
 }
 
 func NewSamplingContext(model *Model, params SamplingParams) (*SamplingContext, error) {
@@ -700,7 +807,11 @@ func NewSamplingContext(model *Model, params SamplingParams) (*SamplingContext,
 	defer C.free(unsafe.Pointer(grammar))
 
 	cparams.grammar = grammar
+	if params.CompiledGrammar != nil {
+		cparams.grammar_compiled = params.CompiledGrammar.c
+	}
 	context := &SamplingContext{c: C.common_sampler_cinit(model.c, &cparams)}
+	runtime.KeepAlive(params.CompiledGrammar)
 	if context.c == nil {
 		return nil, errors.New("unable to create sampling context")
 	}
@@ -722,9 +833,144 @@ func (s *SamplingContext) Accept(id int, applyGrammar bool) {
 	C.common_sampler_caccept(s.c, C.llama_token(id), C.bool(applyGrammar))
 }
 
+// Logprobs is the log-probability of a sampled token under the model, along
+// with the most likely tokens at its position
+type Logprobs struct {
+	Logprob float32
+	Top     []TokenLogprob
+}
+
+type TokenLogprob struct {
+	Token   int
+	Logprob float32
+}
+
+// SampleBatch samples and accepts a token for each sampling context from the
+// output at the same position in idxs, in one call and in parallel across the
+// sequences. If numTop is not nil, the log-probabilities of the tokens, with
+// the numTop[i] most likely tokens, are returned for the sequences where
+// numTop[i] >= 0.
+func SampleBatch(llamaContext *Context, samplers []*SamplingContext, idxs []int, numTop []int) ([]int, []Logprobs) {
+	if len(samplers) == 0 {
+		return nil, nil
+	}
+
+	cSamplers := make([]*C.struct_common_sampler, len(samplers))
+	cIdxs := make([]C.int, len(samplers))
+	for i, s := range samplers {
+		cSamplers[i] = s.c
+		cIdxs[i] = C.int(idxs[i])
+	}
+
+	cTokens := make([]C.llama_token, len(samplers))
+
+	var cNumTop []C.int
+	var cLogprobs, cTopLogprobs []C.float
+	var cTopTokens []C.llama_token
+
+	var pNumTop *C.int
+	var pLogprobs, pTopLogprobs *C.float
+	var pTopTokens *C.llama_token
+
+	maxTop := 1
+	if numTop != nil {
+		cNumTop = make([]C.int, len(samplers))
+		for i, n := range numTop {
+			cNumTop[i] = C.int(n)
+			maxTop = max(maxTop, n)
+		}
+		cLogprobs = make([]C.float, len(samplers))
+		cTopTokens = make([]C.llama_token, len(samplers)*maxTop)
+		cTopLogprobs = make([]C.float, len(samplers)*maxTop)
+
+		pNumTop, pLogprobs, pTopTokens, pTopLogprobs = &cNumTop[0], &cLogprobs[0], &cTopTokens[0], &cTopLogprobs[0]
+	}
+
+	C.common_sampler_csample_batch(&cSamplers[0], llamaContext.c, &cIdxs[0], C.int(len(samplers)), C.int(llamaContext.numThreads), &cTokens[0],
+		pNumTop, C.int(maxTop), pLogprobs, pTopTokens, pTopLogprobs)
+
+	tokens := make([]int, len(samplers))
+	for i := range tokens {
+		tokens[i] = int(cTokens[i])
+	}
+
+	if numTop == nil {
+		return tokens, nil
+	}
+
+	logprobs := make([]Logprobs, len(samplers))
+	for i, n := range numTop {
+		if n < 0 {
+			continue
+		}
+
+		logprobs[i].Logprob = float32(cLogprobs[i])
+		logprobs[i].Top = make([]TokenLogprob, n)
+		for j := range logprobs[i].Top {
+			logprobs[i].Top[j] = TokenLogprob{
+				Token:   int(cTopTokens[i*maxTop+j]),
+				Logprob: float32(cTopLogprobs[i*maxTop+j]),
+			}
+		}
+	}
+
+	return tokens, logprobs
+}
+
+// ForcedTokens returns up to max tokens that the grammar allows as the only
+// continuation, to be accepted and evaluated without sampling them
+func (s *SamplingContext) ForcedTokens(max int) []int {
+	if max <= 0 {
+		return nil
+	}
+
+	cTokens := make([]C.llama_token, max)
+	n := int(C.common_sampler_cforced_tokens(s.c, &cTokens[0], C.int(max)))
+
+	tokens := make([]int, n)
+	for i := range tokens {
+		tokens[i] = int(cTokens[i])
+	}
+
+	return tokens
+}
+
+// Grammar is a grammar parsed once, along with the tokens it accepts in the
+// states that follow its start, to be shared by many sampling contexts
+type Grammar struct {
+	c *C.struct_llama_sampler
+}
+
+func NewGrammar(model *Model, grammar string) (*Grammar, error) {
+	cGrammar := C.CString(grammar)
+	defer C.free(unsafe.Pointer(cGrammar))
+
+	g := &Grammar{c: C.grammar_compile(model.c, cGrammar)}
+	if g.c == nil {
+		return nil, errors.New("unable to compile grammar")
+	}
+
+	runtime.SetFinalizer(g, func(g *Grammar) { C.llama_sampler_free(g.c) })
+
+	return g, nil
+}
+
+// Precompute computes the tokens the grammar accepts in the states that follow
+// its start. It may run while sampling contexts using the grammar sample.
+func (g *Grammar) Precompute() {
+	C.llama_sampler_grammar_precompute(g.c)
+	runtime.KeepAlive(g)
+}
+
 // SchemaToGrammar converts the provided JSON schema to a grammar. It returns
 // nil if the provided schema is invalid JSON or an invalid JSON schema.
 func SchemaToGrammar(schema []byte) []byte {
+	key := sha256.Sum256(schema)
+
+	if g, ok := schemaGrammars.Get(key); ok {
+		return slices.Clone(g)
+	}
+
 	cStr := C.CString(string(schema))
 	defer C.free(unsafe.Pointer(cStr))
 
@@ -736,7 +982,14 @@ func SchemaToGrammar(schema []byte) []byte {
 	n := C.schema_to_grammar(cStr, (*C.char)(unsafe.Pointer(&buf[0])), C.size_t(maxLen))
 	if n == 0 {
 		// preserve nil
-		return nil
+		buf = nil
+	} else {
+		buf = buf[:n:n]
 	}
-	return buf[:n]
+
+	return slices.Clone(schemaGrammars.Add(key, buf))
 }
+
+// schemaGrammars holds the grammars of recently converted schemas, as the same
+// schemas, such as those of tools, come with many requests
+var schemaGrammars = lru.New[[32]byte, []byte](64)
@@ -68,10 +68,13 @@
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 9
+#define LLAMA_SESSION_VERSION 10
 
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_VERSION 3
+
+// the K and V data of each layer in a state start at a multiple of this from the start of the file or buffer
+#define LLAMA_STATE_ALIGNMENT 4096
 
 #ifdef __cplusplus
 extern "C" {
@@ -329,11 +332,19 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // number of threads to read, prefetch and validate the model weights with (<= 0 = min(8, hardware concurrency))
+        int32_t n_threads_load;
+
+        // [EXPERIMENTAL] with mmap, read the layers on the CPU in on demand while computing and keep at most this many
+        // bytes of them in memory, for models larger than the memory (0 = load the whole model)
+        size_t layer_cache_size;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_direct_io; // read the weights with O_DIRECT if possible, when not using mmap
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -359,6 +370,7 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // KV cache cells per block for paged allocation, 0 = contiguous ring buffer (default)
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -510,6 +522,9 @@ extern "C" {
     // Returns the total size of all the tensors in the model in bytes
     LLAMA_API uint64_t llama_model_size(const struct llama_model * model);
 
+    // Returns the size in bytes of the layers paged in on demand with layer_cache_size, 0 if none are
+    LLAMA_API uint64_t llama_model_paged_size(const struct llama_model * model);
+
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
@@ -975,6 +990,18 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Same as llama_tokenize, but a long text is tokenized on up to n_threads threads.
+    /// The tokens are the same as the ones returned by llama_tokenize.
+    LLAMA_API int32_t llama_tokenize_parallel(
+        const struct llama_model * model,
+                      const char * text,
+                         int32_t   text_len,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1222,6 +1249,19 @@ extern "C" {
     // Returns the seed used by the sampler if applicable, LLAMA_DEFAULT_SEED otherwise
     LLAMA_API uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl);
 
+    /// @details Tokens that the grammar sampler smpl allows as the only continuation, such as the keys and punctuation of a JSON schema, so that they can be evaluated without sampling each of them.
+    /// The forced text is split into the longest tokens of the vocab and a last token that could merge with the text after it is left out. The tokens are not accepted.
+    /// Returns the number of tokens written to tokens, at most n_tokens_max, 0 if smpl is not a grammar sampler.
+    LLAMA_API int32_t llama_sampler_grammar_forced_tokens(
+            const struct llama_sampler * smpl,
+                           llama_token * tokens,
+                               int32_t   n_tokens_max);
+
+    /// @details Computes ahead of time the tokens accepted by the grammar sampler smpl in the states that follow its start through literals, keys and punctuation.
+    /// Clones of a grammar sampler share the parsed grammar and the tokens accepted in each state, so a grammar used by many requests can be built once and cloned for each.
+    /// This may run on another thread while clones of smpl are used, so that the first request using a grammar does not wait for it. Does nothing if smpl is not a grammar sampler.
+    LLAMA_API void llama_sampler_grammar_precompute(const struct llama_sampler * smpl);
+
     /// @details Sample and accept a token from the idx-th output of the last evaluation
     //
     // Shorthand for:
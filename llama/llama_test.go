@@ -1 +1,364 @@
 package llama
+
+import (
+	"encoding/binary"
+	"fmt"
+	"math"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"regexp"
+	"slices"
+	"strconv"
+	"strings"
+	"testing"
+)
+
+// pre-tokenizers known to llama.cpp
+var preTokenizers = []string{
+	"default", "llama3", "llama-v3", "llama-bpe", "deepseek-llm", "deepseek-coder", "falcon", "mpt", "starcoder",
+	"gpt-2", "phi-2", "jina-es", "jina-de", "jina-v1-en", "jina-v2-es", "jina-v2-de", "jina-v2-code", "refact",
+	"command-r", "qwen2", "stablelm2", "olmo", "dbrx", "smaug-bpe", "poro-chat", "chatglm-bpe", "viking", "jais",
+	"tekken", "smollm", "codeshell", "bloom", "gpt3-finnish", "exaone", "chameleon", "minerva-7b",
+}
+
+// ggufKV is a metadata key-value pair of a model file
+type ggufKV struct {
+	key   string
+	value any
+}
+
+// ggufTensor is a tensor of a model file, with its ggml type and data
+type ggufTensor struct {
+	name  string
+	shape []uint64
+	kind  uint32
+	data  []byte
+}
+
+// llamaKV returns the hyperparameters of a llama model with a single head
+func llamaKV(nEmbd, nFF, nLayer uint32) []ggufKV {
+	return []ggufKV{
+		{"general.architecture", "llama"},
+		{"llama.context_length", uint32(4096)},
+		{"llama.embedding_length", nEmbd},
+		{"llama.block_count", nLayer},
+		{"llama.feed_forward_length", nFF},
+		{"llama.attention.head_count", uint32(1)},
+		{"llama.attention.layer_norm_rms_epsilon", float32(1e-5)},
+	}
+}
+
+// vocabKV returns a byte-level BPE vocabulary with the given pre-tokenizer,
+// and its number of tokens
+func vocabKV(pre string) ([]ggufKV, int) {
+	// bytes are encoded as in GPT-2, printable ones as themselves
+	var tokens []string
+	n := 0
+	for b := range 256 {
+		if b >= '!' && b <= '~' || b >= 0xa1 && b <= 0xac || b >= 0xae {
+			tokens = append(tokens, string(rune(b)))
+		} else {
+			tokens = append(tokens, string(rune(256+n)))
+			n++
+		}
+	}
+
+	merges := []string{
+		"t h", "th e", "Ġ the", "i n", "in g", "e r", "Ġ a", "a n", "an d", "Ġ and", "o n", "Ġ t", "Ġt o",
+		"Ġ Ġ", "ĠĠ ĠĠ", "Ċ Ċ", "ĉ ĉ", "1 2", "12 3", "Ð ¸",
+	}
+	for _, m := range merges {
+		if merged := strings.ReplaceAll(m, " ", ""); !slices.Contains(tokens, merged) {
+			tokens = append(tokens, merged)
+		}
+	}
+
+	tokenTypes := make([]int32, len(tokens))
+	for i := range tokenTypes {
+		tokenTypes[i] = 1
+	}
+	// the jina-v2 pre-tokenizers set attributes of <mask>
+	endOfText := uint32(len(tokens))
+	for _, special := range []string{"<|endoftext|>", "<|im_start|>", "<|im_end|>", "<mask>"} {
+		tokens = append(tokens, special)
+		tokenTypes = append(tokenTypes, 3)
+	}
+
+	return []ggufKV{
+		{"tokenizer.ggml.model", "gpt2"},
+		{"tokenizer.ggml.pre", pre},
+		{"tokenizer.ggml.tokens", tokens},
+		{"tokenizer.ggml.token_type", tokenTypes},
+		{"tokenizer.ggml.merges", merges},
+		{"tokenizer.ggml.bos_token_id", endOfText},
+		{"tokenizer.ggml.eos_token_id", endOfText},
+	}, len(tokens)
+}
+
+// writeVocab writes a model file that only has a byte-level BPE vocabulary
+// with the given pre-tokenizer
+func writeVocab(t *testing.T, pre string) string {
+	t.Helper()
+
+	kv, _ := vocabKV(pre)
+	return writeGGUF(t, pre, append(llamaKV(64, 128, 1), kv...), nil)
+}
+
+// writeGGUF writes a model file with the given metadata and tensors
+func writeGGUF(t *testing.T, name string, kv []ggufKV, tensors []ggufTensor) string {
+	t.Helper()
+
+	const alignment = 32
+
+	var b []byte
+	putString := func(s string) {
+		b = binary.LittleEndian.AppendUint64(b, uint64(len(s)))
+		b = append(b, s...)
+	}
+	pad := func() {
+		for len(b)%alignment != 0 {
+			b = append(b, 0)
+		}
+	}
+
+	b = append(b, "GGUF"...)
+	b = binary.LittleEndian.AppendUint32(b, 3)
+	b = binary.LittleEndian.AppendUint64(b, uint64(len(tensors)))
+	b = binary.LittleEndian.AppendUint64(b, uint64(len(kv)))
+	for _, e := range kv {
+		putString(e.key)
+		switch v := e.value.(type) {
+		case uint32:
+			b = binary.LittleEndian.AppendUint32(b, 4)
+			b = binary.LittleEndian.AppendUint32(b, v)
+		case float32:
+			b = binary.LittleEndian.AppendUint32(b, 6)
+			b = binary.LittleEndian.AppendUint32(b, math.Float32bits(v))
+		case string:
+			b = binary.LittleEndian.AppendUint32(b, 8)
+			putString(v)
+		case []int32:
+			b = binary.LittleEndian.AppendUint32(b, 9)
+			b = binary.LittleEndian.AppendUint32(b, 5)
+			b = binary.LittleEndian.AppendUint64(b, uint64(len(v)))
+			for _, i := range v {
+				b = binary.LittleEndian.AppendUint32(b, uint32(i))
+			}
+		case []string:
+			b = binary.LittleEndian.AppendUint32(b, 9)
+			b = binary.LittleEndian.AppendUint32(b, 8)
+			b = binary.LittleEndian.AppendUint64(b, uint64(len(v)))
+			for _, s := range v {
+				putString(s)
+			}
+		}
+	}
+
+	// the data of each tensor starts at a multiple of the alignment
+	var offset uint64
+	for _, tensor := range tensors {
+		putString(tensor.name)
+		b = binary.LittleEndian.AppendUint32(b, uint32(len(tensor.shape)))
+		for _, d := range tensor.shape {
+			b = binary.LittleEndian.AppendUint64(b, d)
+		}
+		b = binary.LittleEndian.AppendUint32(b, tensor.kind)
+		b = binary.LittleEndian.AppendUint64(b, offset)
+		offset += (uint64(len(tensor.data)) + alignment - 1) / alignment * alignment
+	}
+
+	for _, tensor := range tensors {
+		pad()
+		b = append(b, tensor.data...)
+	}
+
+	path := filepath.Join(t.TempDir(), name+".gguf")
+	if err := os.WriteFile(path, b, 0o644); err != nil {
+		t.Fatal(err)
+	}
+
+	return path
+}
+
+// tokenizeText returns a text of at least size bytes that mixes prose, code,
+// whitespace runs, scripts other than latin and special tokens
+func tokenizeText(size int) string {
+	parts := []string{
+		"The quick brown fox jumps over the lazy dog. ", "don't we've I'm they'll IT'S ", "and then the other one ",
+		"func main() {\n\tfmt.Println(\"hello, world\")\n}\n", "    return x**2 + y // comment\n", "1234567890 3.14159 ",
+		"  \n\n   \t  ", "\n", "\r\n", "   ", "日本語のテキストです。", "Привет, мир! ", "naïve café ", "😀👍🏽 ",
+		"<|im_start|>user\n", "<|im_end|>\n", "<|endoftext|>", "...!!??", "\t\t\tindented\n",
+		"١٢٣ ½ Ⅻ ", "e\u0301 ❤\ufe0f © ", "\u00a0\u3000 \u2028", "ĲĳǅΣσς ",
+	}
+
+	r := rand.New(rand.NewSource(1))
+
+	var sb strings.Builder
+	for sb.Len() < size {
+		sb.WriteString(parts[r.Intn(len(parts))])
+	}
+
+	return sb.String()
+}
+
+func TestTokenizeParallel(t *testing.T) {
+	BackendInit()
+
+	text := tokenizeText(512 << 10)
+
+	for _, pre := range preTokenizers {
+		t.Run(pre, func(t *testing.T) {
+			m, err := LoadModelFromFile(writeVocab(t, pre), ModelParams{VocabOnly: true})
+			if err != nil {
+				t.Fatal(err)
+			}
+			defer FreeModel(m)
+
+			for _, parseSpecial := range []bool{false, true} {
+				want, err := m.tokenize(text, true, parseSpecial, 1)
+				if err != nil {
+					t.Fatal(err)
+				}
+
+				for _, numThreads := range []int{2, 3, 8} {
+					got, err := m.tokenize(text, true, parseSpecial, numThreads)
+					if err != nil {
+						t.Fatal(err)
+					}
+
+					if !slices.Equal(got, want) {
+						i := 0
+						for i < min(len(got), len(want)) && got[i] == want[i] {
+							i++
+						}
+						t.Errorf("parseSpecial %v numThreads %d: tokens differ at %d of (%d, %d)", parseSpecial, numThreads, i, len(got), len(want))
+					}
+				}
+			}
+		})
+	}
+}
+
+// regexExprs returns the regexes of each pre-tokenizer in llama-vocab.cpp
+func regexExprs(t *testing.T) [][]string {
+	t.Helper()
+
+	b, err := os.ReadFile("llama-vocab.cpp")
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	block := regexp.MustCompile(`(?s)regex_exprs = \{(.*?)\};`)
+	literal := regexp.MustCompile(`"(?:[^"\\]|\\.)*"`)
+
+	var groups [][]string
+	for _, m := range block.FindAllSubmatch(b, -1) {
+		var group []string
+		for _, line := range strings.Split(string(m[1]), "\n") {
+			if strings.HasPrefix(strings.TrimSpace(line), "//") {
+				continue
+			}
+
+			for _, l := range literal.FindAllString(line, -1) {
+				expr, err := strconv.Unquote(l)
+				if err != nil {
+					t.Fatalf("%s: %v", l, err)
+				}
+				group = append(group, expr)
+			}
+		}
+		groups = append(groups, group)
+	}
+
+	if len(groups) == 0 {
+		t.Fatal("no regexes found in llama-vocab.cpp")
+	}
+
+	return groups
+}
+
+func TestRegexSplitDFA(t *testing.T) {
+	text := tokenizeText(16 << 10)
+
+	for i, group := range regexExprs(t) {
+		t.Run(strconv.Itoa(i), func(t *testing.T) {
+			want, err := regexSplit(text, group, false)
+			if err != nil {
+				t.Fatal(err)
+			}
+
+			got, err := regexSplit(text, group, true)
+			if err != nil {
+				t.Fatal(err)
+			}
+
+			if !slices.Equal(got, want) {
+				i := 0
+				for i < min(len(got), len(want)) && got[i] == want[i] {
+					i++
+				}
+				t.Errorf("%q: words differ at %d of (%d, %d)", group, i, len(got), len(want))
+			}
+		})
+	}
+}
+
+func TestLoadModelLayerCache(t *testing.T) {
+	BackendInit()
+
+	const nEmbd, nFF, nLayer = 256, 512, 4
+
+	kv, nVocab := vocabKV("default")
+
+	f32 := func(name string, shape ...uint64) ggufTensor {
+		size := uint64(4)
+		for _, d := range shape {
+			size *= d
+		}
+		return ggufTensor{name, shape, 0, make([]byte, size)}
+	}
+	// Q4_K weights would be repacked into CPU_AARCH64 buffers on CPUs with AVX2
+	q4K := func(name string, ne0, ne1 uint64) ggufTensor {
+		return ggufTensor{name, []uint64{ne0, ne1}, 12, make([]byte, ne0/256*144*ne1)}
+	}
+
+	tensors := []ggufTensor{
+		f32("token_embd.weight", nEmbd, uint64(nVocab)),
+		f32("output_norm.weight", nEmbd),
+		f32("output.weight", nEmbd, uint64(nVocab)),
+	}
+
+	var layerSize uint64
+	for i := range nLayer {
+		blk := func(name string) string { return fmt.Sprintf("blk.%d.%s.weight", i, name) }
+		layer := []ggufTensor{
+			f32(blk("attn_norm"), nEmbd),
+			q4K(blk("attn_q"), nEmbd, nEmbd),
+			q4K(blk("attn_k"), nEmbd, nEmbd),
+			q4K(blk("attn_v"), nEmbd, nEmbd),
+			q4K(blk("attn_output"), nEmbd, nEmbd),
+			f32(blk("ffn_norm"), nEmbd),
+			q4K(blk("ffn_gate"), nEmbd, nFF),
+			q4K(blk("ffn_up"), nEmbd, nFF),
+			q4K(blk("ffn_down"), nFF, nEmbd),
+		}
+		for _, tensor := range layer {
+			layerSize += uint64(len(tensor.data))
+		}
+		tensors = append(tensors, layer...)
+	}
+
+	path := writeGGUF(t, "layers", append(llamaKV(nEmbd, nFF, nLayer), kv...), tensors)
+
+	m, err := LoadModelFromFile(path, ModelParams{UseMmap: true, LayerCacheSize: 1 << 20})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer FreeModel(m)
+
+	// all the repeating layers are paged from the mapping, none are in other buffers
+	if got := m.pagedSize(); got != layerSize {
+		t.Errorf("paged %d bytes, want %d", got, layerSize)
+	}
+}
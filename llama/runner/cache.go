@@ -5,6 +5,7 @@ import (
 	"fmt"
 	"log/slog"
 	"reflect"
+	"slices"
 	"time"
 
 	"github.com/ollama/ollama/llama"
@@ -14,16 +15,32 @@ type InputCache struct {
 	// context window size (per slot)
 	numCtx int
 
+	// total size of the KV cache
+	kvSize int
+
 	// individual KV caches
 	slots []InputCacheSlot
 
 	// optimize cache eviction for multiple users
 	multiUserCache bool
 
+	// slots share the whole KV cache (paged) instead of a fixed
+	// kvSize/numSlots partition each
+	pooled bool
+
+	// index of the inputs of all slots, updated lazily by syncIndex
+	index *prefixTree
+
+	// states of evicted prefixes, nil if disabled
+	disk *diskCache
+
+	// id of the next run of shared KV cache entries
+	nextRun int
+
 	lc *llama.Context
 }
 
-func NewInputCache(lc *llama.Context, kvSize int, numSlots int, multiUserCache bool) (*InputCache, error) {
+func NewInputCache(lc *llama.Context, kvSize int, numSlots int, multiUserCache bool, pooled bool, disk *diskCache) (*InputCache, error) {
 	if kvSize/numSlots < 1 {
 		return nil, fmt.Errorf("must have at least one kv cache entry per parallel sequence (kv: %v parallel: %v)", kvSize, numSlots)
 	}
@@ -37,10 +54,18 @@ func NewInputCache(lc *llama.Context, kvSize int, numSlots int, multiUserCache b
 		}
 	}
 
+	numCtx := kvSize / numSlots
+	if pooled {
+		numCtx = kvSize
+	}
+
 	return &InputCache{
-		numCtx:         kvSize / numSlots,
+		numCtx:         numCtx,
+		kvSize:         kvSize,
 		slots:          slots,
 		multiUserCache: multiUserCache,
+		pooled:         pooled,
+		disk:           disk,
 		lc:             lc,
 	}, nil
 }
@@ -61,6 +86,39 @@ type InputCacheSlot struct {
 
 	// last time this cache was used (as of start of processing)
 	lastUsed time.Time
+
+	// number of Inputs present in the prefix index
+	indexed int
+
+	// runs of Inputs whose KV cache entries may also belong to other slots,
+	// which forkPrefix shares them with, in order of position
+	shared []sharedRun
+}
+
+// A run of KV cache entries at positions [start, end) shared by forkPrefix.
+// Slots holding the same run at a position hold the same entry.
+type sharedRun struct {
+	id    int
+	start int
+	end   int
+}
+
+// Number of leading Inputs whose KV cache entries may belong to other slots
+func (s *InputCacheSlot) sharedLen() int {
+	if len(s.shared) == 0 {
+		return 0
+	}
+	return min(s.shared[len(s.shared)-1].end, len(s.Inputs))
+}
+
+// Drops the shared runs of the slot after its first n Inputs
+func (s *InputCacheSlot) truncateShared(n int) {
+	for len(s.shared) > 0 && s.shared[len(s.shared)-1].start >= n {
+		s.shared = s.shared[:len(s.shared)-1]
+	}
+	if len(s.shared) > 0 {
+		s.shared[len(s.shared)-1].end = min(s.shared[len(s.shared)-1].end, n)
+	}
 }
 
 func (c *InputCache) LoadCacheSlot(prompt []input, cachePrompt bool) (*InputCacheSlot, []input, error) {
@@ -87,9 +145,17 @@ func (c *InputCache) LoadCacheSlot(prompt []input, cachePrompt bool) (*InputCach
 		numPast = 0
 	}
 
+	// the inputs of the slot after numPast are dropped from here on
+	c.saveSlot(slot, numPast)
+
 	slot.InUse = true
 	slot.lastUsed = time.Now()
 
+	if cachePrompt {
+		numPast = c.attachPrefix(slot, prompt, numPast)
+		numPast = c.restorePrefix(slot, prompt, numPast)
+	}
+
 	if numPast == len(prompt) {
 		// Leave one input to sample so we can get a response
 		numPast--
@@ -106,55 +172,260 @@ func (c *InputCache) LoadCacheSlot(prompt []input, cachePrompt bool) (*InputCach
 
 	prompt = prompt[numPast:]
 	slot.Inputs = slot.Inputs[:numPast]
+	slot.truncateShared(numPast)
+	c.truncateIndex(slot, numPast)
 
 	return slot, prompt, nil
 }
 
-func (c *InputCache) findLongestCacheSlot(prompt []input) (*InputCacheSlot, int, error) {
-	longest := -1
-	var longestSlot *InputCacheSlot
+// Brings the prefix index up to date with the inputs of all slots. Slots
+// only grow between calls, except through the InputCache methods, which
+// update the index themselves, and when a sequence stops and drops its
+// last inputs.
+func (c *InputCache) syncIndex() {
+	if c.index == nil {
+		c.index = newPrefixTree()
+		for i := range c.slots {
+			c.slots[i].indexed = 0
+		}
+	}
 
-	for i, s := range c.slots {
-		if s.InUse {
+	for i := range c.slots {
+		s := &c.slots[i]
+		if s.indexed > len(s.Inputs) {
+			c.index.truncate(s.Id, len(s.Inputs))
+			s.indexed = len(s.Inputs)
+		}
+		if s.indexed < len(s.Inputs) {
+			c.index.insert(s.Id, s.Inputs[s.indexed:])
+			s.indexed = len(s.Inputs)
+		}
+	}
+}
+
+// Drops the inputs of slot after the first n from the prefix index
+func (c *InputCache) truncateIndex(slot *InputCacheSlot, n int) {
+	if c.index != nil && slot.indexed > n {
+		c.index.truncate(slot.Id, n)
+	}
+	slot.indexed = min(slot.indexed, n)
+}
+
+func (c *InputCache) slotById(id int) *InputCacheSlot {
+	for i := range c.slots {
+		if c.slots[i].Id == id {
+			return &c.slots[i]
+		}
+	}
+	return nil
+}
+
+// Shares the KV cache entries for inputs [from, to) of src with dst, which
+// already holds the first from inputs of the same prefix. The entries are
+// only referenced by dst, new inputs of either slot are stored separately.
+func (c *InputCache) forkPrefix(src *InputCacheSlot, dst *InputCacheSlot, from int, to int) bool {
+	// This is only nil for unit tests
+	if c.lc != nil {
+		if !c.lc.KvCacheSeqRm(dst.Id, from, -1) {
+			return false
+		}
+		c.lc.KvCacheSeqCp(src.Id, dst.Id, from, to)
+	}
+
+	inputs := make([]input, to)
+	copy(inputs, dst.Inputs[:from])
+	copy(inputs[from:], src.Inputs[from:to])
+	dst.Inputs = inputs
+
+	c.truncateIndex(dst, from)
+	c.index.insert(dst.Id, dst.Inputs[from:])
+	dst.indexed = to
+
+	runs := c.shareRuns(src, from, to)
+	dst.truncateShared(from)
+	dst.shared = append(dst.shared, runs...)
+
+	return true
+}
+
+// Marks the entries of src at positions [from, to) as shared, starting new
+// runs for those that are only held by src, and returns the runs covering them.
+func (c *InputCache) shareRuns(src *InputCacheSlot, from int, to int) []sharedRun {
+	pos := from
+	var own []sharedRun
+	for _, r := range src.shared {
+		if r.start >= to {
+			break
+		}
+		if r.end <= pos {
 			continue
 		}
+		if r.start > pos {
+			own = append(own, sharedRun{id: c.nextRun, start: pos, end: r.start})
+			c.nextRun++
+		}
+		pos = r.end
+	}
+	if pos < to {
+		own = append(own, sharedRun{id: c.nextRun, start: pos, end: to})
+		c.nextRun++
+	}
 
-		count := countCommonPrefix(s.Inputs, prompt)
-		if count > longest {
-			longest = count
-			longestSlot = &c.slots[i]
+	if len(own) > 0 {
+		src.shared = append(src.shared, own...)
+		slices.SortFunc(src.shared, func(a, b sharedRun) int { return a.start - b.start })
+	}
+
+	var runs []sharedRun
+	for _, r := range src.shared {
+		if r.end > from && r.start < to {
+			runs = append(runs, sharedRun{id: r.id, start: max(r.start, from), end: min(r.end, to)})
 		}
 	}
 
-	if longestSlot == nil {
-		return nil, 0, errors.New("no available cache slots")
+	return runs
+}
+
+// Attaches slot to the longest prefix of prompt held by any other slot, including
+// slots that are in use, if it is longer than the numPast inputs the slot
+// already shares with prompt. Returns the new number of shared inputs.
+func (c *InputCache) attachPrefix(slot *InputCacheSlot, prompt []input, numPast int) int {
+	c.syncIndex()
+
+	id, longest := c.index.longest(prompt, func(id int, n int) bool { return id != slot.Id })
+	if id < 0 || longest <= numPast {
+		return numPast
+	}
+
+	src := c.slotById(id)
+
+	slog.Debug("attaching to cache slot prefix", "src", src.Id, "dst", slot.Id, "inputs", longest, "own", numPast)
+	if !c.forkPrefix(src, slot, numPast, longest) {
+		return numPast
 	}
 
-	return longestSlot, longest, nil
+	return longest
 }
 
-func (c *InputCache) findBestCacheSlot(prompt []input) (*InputCacheSlot, int, error) {
-	oldest := time.Now()
-	var oldestSlot *InputCacheSlot
+// Saves the state of slot to the disk cache if at least a chunk of its inputs
+// after the first keep is about to be dropped and it is not stored yet. Only
+// the copy out of the KV cache happens here, the file is written in the
+// background.
+func (c *InputCache) saveSlot(slot *InputCacheSlot, keep int) {
+	if c.disk == nil || c.lc == nil || len(slot.Inputs)-keep < diskCacheChunk {
+		return
+	}
 
-	longest := -1
-	var longestSlot *InputCacheSlot
+	// the state would also hold the entries of the images, which are not part of
+	// the key
+	tokens := promptTokens(slot.Inputs)
+	if len(tokens) != len(slot.Inputs) || c.disk.has(tokens) || !c.disk.reserve(tokens) {
+		return
+	}
+
+	state := c.lc.StateSeqGetData(slot.Id)
+	if state == nil {
+		c.disk.release(tokens)
+		return
+	}
+
+	slog.Debug("saving cache slot to disk", "id", slot.Id, "inputs", len(tokens), "size", len(state))
+	go func() {
+		if err := c.disk.save(tokens, state); err != nil {
+			slog.Warn("failed to save cache slot to disk", "error", err)
+		}
+	}()
+}
+
+// Replaces the contents of slot with the longest prefix of prompt stored in the
+// disk cache if it is longer than the numPast inputs the slot already shares
+// with prompt. Returns the new number of shared inputs.
+func (c *InputCache) restorePrefix(slot *InputCacheSlot, prompt []input, numPast int) int {
+	if c.disk == nil || c.lc == nil {
+		return numPast
+	}
+
+	e, n := c.disk.lookup(prompt)
+	if e == nil || n < numPast+diskCacheChunk {
+		return numPast
+	}
+
+	// the whole entry is restored before it is cut to the shared prefix
+	if len(e.tokens) > c.numCtx {
+		return numPast
+	}
+	if c.pooled {
+		for c.used(slot)+len(e.tokens) > c.kvSize {
+			if !c.evictIdleSlot() {
+				return numPast
+			}
+		}
+	}
+
+	state, release, err := c.disk.open(e)
+	if err != nil {
+		slog.Warn("failed to open disk cache entry", "error", err)
+		return numPast
+	}
+	defer release()
+
+	slog.Debug("restoring cache slot from disk", "id", slot.Id, "inputs", n, "stored", len(e.tokens), "own", numPast)
+
+	c.truncateIndex(slot, 0)
+	slot.shared = nil
+	if !c.lc.StateSeqSetData(slot.Id, state) {
+		// the entries of the slot have been removed
+		slot.Inputs = []input{}
+		return 0
+	}
+
+	slot.Inputs = make([]input, len(e.tokens))
+	for i, t := range e.tokens {
+		slot.Inputs[i] = input{token: t}
+	}
+
+	return n
+}
+
+func (c *InputCache) findLongestCacheSlot(prompt []input) (*InputCacheSlot, int, error) {
+	c.syncIndex()
+
+	id, longest := c.index.longest(prompt, func(id int, n int) bool { return !c.slotById(id).InUse })
+	if id >= 0 {
+		return c.slotById(id), longest, nil
+	}
 
 	for i, s := range c.slots {
-		count := countCommonPrefix(s.Inputs, prompt)
-		if count > longest {
-			longest = count
-			longestSlot = &c.slots[i]
+		if !s.InUse {
+			return &c.slots[i], 0, nil
 		}
+	}
+
+	return nil, 0, errors.New("no available cache slots")
+}
+
+func (c *InputCache) findBestCacheSlot(prompt []input) (*InputCacheSlot, int, error) {
+	c.syncIndex()
 
+	oldest := time.Now()
+	var oldestSlot *InputCacheSlot
+
+	for i, s := range c.slots {
 		if s.lastUsed.Compare(oldest) < 0 && !s.InUse {
 			oldest = s.lastUsed
 			oldestSlot = &c.slots[i]
 		}
 	}
 
-	if longest == len(longestSlot.Inputs) && !longestSlot.InUse {
-		return longestSlot, longest, nil
+	id, longest := c.index.longest(prompt, func(id int, n int) bool { return true })
+
+	// an idle slot holding exactly the longest prefix can be extended as is
+	exact, exactLen := c.index.longest(prompt, func(id int, n int) bool {
+		s := c.slotById(id)
+		return !s.InUse && len(s.Inputs) == n
+	})
+	if exact >= 0 && exactLen == longest {
+		return c.slotById(exact), longest, nil
 	}
 
 	if oldestSlot.InUse {
@@ -166,15 +437,15 @@ func (c *InputCache) findBestCacheSlot(prompt []input) (*InputCacheSlot, int, er
 			"used", oldestSlot.lastUsed)
 	}
 
-	if longest > 0 && longestSlot != oldestSlot {
+	if id >= 0 && id != oldestSlot.Id {
+		c.saveSlot(oldestSlot, 0)
+
+		longestSlot := c.slotById(id)
 		slog.Debug("forking cache slot", "src", longestSlot.Id, "dst", oldestSlot.Id, "inputs", longest, "total",
 			len(longestSlot.Inputs))
-		oldestSlot.Inputs = make([]input, longest)
-		copy(oldestSlot.Inputs, longestSlot.Inputs[:longest])
-		// This is only nil for unit tests
-		if c.lc != nil {
-			c.lc.KvCacheSeqRm(oldestSlot.Id, 0, -1)
-			c.lc.KvCacheSeqCp(longestSlot.Id, oldestSlot.Id, 0, longest)
+		if !c.forkPrefix(longestSlot, oldestSlot, 0, longest) {
+			// the slot keeps its own inputs, which don't match the prompt
+			longest = 0
 		}
 	}
 
@@ -199,6 +470,94 @@ func countCommonPrefix(a []input, b []input) int {
 	return count
 }
 
+// Number of KV cache entries held by all slots other than skip, which may be
+// nil. Entries shared by forked slots are counted once.
+func (c *InputCache) used(skip *InputCacheSlot) int {
+	var used int
+	runs := make(map[int][]sharedRun)
+	for i := range c.slots {
+		s := &c.slots[i]
+		if s == skip {
+			continue
+		}
+
+		used += len(s.Inputs)
+		for _, r := range s.shared {
+			r.end = min(r.end, len(s.Inputs))
+			if r.start < r.end {
+				used -= r.end - r.start
+				runs[r.id] = append(runs[r.id], r)
+			}
+		}
+	}
+
+	// slots holding the same run share the entries at the positions they
+	// have in common
+	for _, rs := range runs {
+		slices.SortFunc(rs, func(a, b sharedRun) int { return a.start - b.start })
+		end := 0
+		for _, r := range rs {
+			used += max(r.end-max(r.start, end), 0)
+			end = max(end, r.end)
+		}
+	}
+
+	return used
+}
+
+// Frees the KV cache entries of the least recently used slot that is not
+// in use. Returns false if there is no such slot holding any entries.
+func (c *InputCache) evictIdleSlot() bool {
+	var oldestSlot *InputCacheSlot
+
+	for i, s := range c.slots {
+		if s.InUse || len(s.Inputs) == 0 {
+			continue
+		}
+
+		if oldestSlot == nil || s.lastUsed.Compare(oldestSlot.lastUsed) < 0 {
+			oldestSlot = &c.slots[i]
+		}
+	}
+
+	if oldestSlot == nil {
+		return false
+	}
+
+	slog.Debug("evicting cache slot from shared pool", "id", oldestSlot.Id, "inputs", len(oldestSlot.Inputs),
+		"used", oldestSlot.lastUsed)
+
+	c.saveSlot(oldestSlot, 0)
+
+	// This is only nil for unit tests
+	if c.lc != nil {
+		c.lc.KvCacheSeqRm(oldestSlot.Id, 0, -1)
+	}
+	oldestSlot.Inputs = []input{}
+	oldestSlot.shared = nil
+	c.truncateIndex(oldestSlot, 0)
+
+	return true
+}
+
+// EnsureRoom makes sure that a shared KV cache has room for one more input,
+// in addition to numPending inputs that are already queued for the next batch.
+// Idle slots are evicted as needed, and false is returned if the cache is still
+// full, in which case an active slot needs to be shifted.
+func (c *InputCache) EnsureRoom(numPending int) bool {
+	if !c.pooled {
+		return true
+	}
+
+	for c.used(nil)+numPending+1 > c.kvSize {
+		if !c.evictIdleSlot() {
+			return false
+		}
+	}
+
+	return true
+}
+
 func (c *InputCache) ShiftDiscard(inputLen int, numKeep int) int {
 	targetFree := (c.numCtx - numKeep) / 2
 	targetFree = max(targetFree, 1)
@@ -216,31 +575,66 @@ func (c *InputCache) ShiftDiscard(inputLen int, numKeep int) int {
 // Frees up space in the KV cache by deleting the oldest half of history and shifting
 // the newest half into that space (saving numKeep inputs at the beginning).
 //
+// Shifting moves the entries for all the slots that hold them, so if the newest half
+// includes entries shared with other slots, its inputs are removed instead and
+// returned to be evaluated again.
+//
 // Assumes that at least 1 entry can be freed up by shifting (i.e. numKeep < numCtx)
-func (c *InputCache) ShiftCacheSlot(slot *InputCacheSlot, numKeep int) error {
+func (c *InputCache) ShiftCacheSlot(slot *InputCacheSlot, numKeep int) ([]input, error) {
 	if numKeep >= c.numCtx {
-		return fmt.Errorf("unable to shift context - keep exceeds context (keep: %v context: %v)", numKeep, c.numCtx)
+		return nil, fmt.Errorf("unable to shift context - keep exceeds context (keep: %v context: %v)", numKeep, c.numCtx)
 	}
 
 	discard := c.ShiftDiscard(len(slot.Inputs), numKeep)
 
+	if discard <= 0 && c.pooled {
+		// the shared cache is full rather than the context of this slot,
+		// so discard half of its own history
+		if len(slot.Inputs) <= numKeep {
+			return nil, fmt.Errorf("unable to shift context - shared cache is full (keep: %v input: %v)", numKeep, len(slot.Inputs))
+		}
+		discard = max((len(slot.Inputs)-numKeep)/2, 1)
+	}
+
 	if discard <= 0 {
-		return nil
+		return nil, nil
+	}
+
+	if slot.sharedLen() > numKeep+discard {
+		slog.Debug("context limit hit - evaluating shared inputs again", "id", slot.Id, "limit", c.numCtx,
+			"input", len(slot.Inputs), "keep", numKeep, "discard", discard, "shared", slot.sharedLen())
+
+		// This is only nil for unit tests
+		if c.lc != nil && !c.lc.KvCacheSeqRm(slot.Id, numKeep, -1) {
+			return nil, fmt.Errorf("unable to remove old kv cache entries (id: %v, keep: %v)", slot.Id, numKeep)
+		}
+
+		inputs := slices.Clone(slot.Inputs[numKeep+discard:])
+		slot.Inputs = slot.Inputs[:numKeep]
+		slot.truncateShared(numKeep)
+		c.truncateIndex(slot, numKeep)
+
+		return inputs, nil
 	}
 
 	slog.Debug("context limit hit - shifting", "id", slot.Id, "limit", c.numCtx, "input", len(slot.Inputs),
 		"keep", numKeep, "discard", discard)
 
-	// TODO (jessegross): KV cache removal can fail for certain types of models
-	if !c.lc.KvCacheSeqRm(slot.Id, numKeep, numKeep+discard) {
-		return fmt.Errorf("unable to remove old kv cache entries (id: %v, keep: %v discard: %v)", slot.Id, numKeep, discard)
+	// This is only nil for unit tests
+	if c.lc != nil {
+		// TODO (jessegross): KV cache removal can fail for certain types of models
+		if !c.lc.KvCacheSeqRm(slot.Id, numKeep, numKeep+discard) {
+			return nil, fmt.Errorf("unable to remove old kv cache entries (id: %v, keep: %v discard: %v)", slot.Id, numKeep, discard)
+		}
+		c.lc.KvCacheSeqAdd(slot.Id, numKeep+discard, len(slot.Inputs), -discard)
 	}
-	c.lc.KvCacheSeqAdd(slot.Id, numKeep+discard, len(slot.Inputs), -discard)
 
 	for i := numKeep + discard; i < len(slot.Inputs); i++ {
 		slot.Inputs[i-discard] = slot.Inputs[i]
 	}
 	slot.Inputs = slot.Inputs[:len(slot.Inputs)-discard]
+	slot.truncateShared(numKeep)
+	c.truncateIndex(slot, numKeep)
 
-	return nil
+	return nil, nil
 }
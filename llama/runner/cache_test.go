@@ -1,6 +1,8 @@
 package runner
 
 import (
+	"reflect"
+	"slices"
 	"testing"
 	"time"
 )
@@ -290,3 +292,247 @@ func TestShiftDiscard(t *testing.T) {
 		})
 	}
 }
+
+func TestEnsureRoom(t *testing.T) {
+	now := time.Now()
+
+	tests := []struct {
+		name       string
+		pooled     bool
+		kvSize     int
+		numPending int
+		slots      []InputCacheSlot
+		expected   bool
+		evicted    []int
+	}{
+		{
+			name:     "Partitioned",
+			pooled:   false,
+			kvSize:   4,
+			slots:    []InputCacheSlot{{Id: 0, Inputs: make([]input, 4)}},
+			expected: true,
+		},
+		{
+			name:   "Room",
+			pooled: true,
+			kvSize: 8,
+			slots: []InputCacheSlot{
+				{Id: 0, Inputs: make([]input, 3), InUse: true},
+				{Id: 1, Inputs: make([]input, 3), lastUsed: now},
+			},
+			numPending: 1,
+			expected:   true,
+		},
+		{
+			name:   "Evict Oldest Idle",
+			pooled: true,
+			kvSize: 8,
+			slots: []InputCacheSlot{
+				{Id: 0, Inputs: make([]input, 4), InUse: true},
+				{Id: 1, Inputs: make([]input, 2), lastUsed: now},
+				{Id: 2, Inputs: make([]input, 2), lastUsed: now.Add(-time.Minute)},
+			},
+			expected: true,
+			evicted:  []int{2},
+		},
+		{
+			name:   "Evict Several",
+			pooled: true,
+			kvSize: 8,
+			slots: []InputCacheSlot{
+				{Id: 0, Inputs: make([]input, 6), InUse: true},
+				{Id: 1, Inputs: make([]input, 1), lastUsed: now},
+				{Id: 2, Inputs: make([]input, 1), lastUsed: now.Add(-time.Minute)},
+			},
+			numPending: 1,
+			expected:   true,
+			evicted:    []int{1, 2},
+		},
+		{
+			name:   "Full",
+			pooled: true,
+			kvSize: 8,
+			slots: []InputCacheSlot{
+				{Id: 0, Inputs: make([]input, 4), InUse: true},
+				{Id: 1, Inputs: make([]input, 3), InUse: true},
+			},
+			numPending: 1,
+			expected:   false,
+		},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			c := InputCache{kvSize: tt.kvSize, pooled: tt.pooled, slots: tt.slots}
+			result := c.EnsureRoom(tt.numPending)
+			if result != tt.expected {
+				t.Errorf("EnsureRoom: have %v; want %v", result, tt.expected)
+			}
+
+			for _, id := range tt.evicted {
+				if len(c.slots[id].Inputs) != 0 {
+					t.Errorf("EnsureRoom: slot %v not evicted", id)
+				}
+			}
+
+			for _, s := range c.slots {
+				if s.InUse && len(s.Inputs) == 0 {
+					t.Errorf("EnsureRoom: evicted slot %v in use", s.Id)
+				}
+			}
+		})
+	}
+}
+
+func TestAttachPrefix(t *testing.T) {
+	c := InputCache{slots: []InputCacheSlot{
+		{Id: 0, Inputs: []input{{token: 1}, {token: 2}, {token: 3}}, InUse: true},
+		{Id: 1, Inputs: []input{{token: 1}, {token: 4}}},
+		{Id: 2, Inputs: []input{}},
+	}}
+
+	prompt := []input{{token: 1}, {token: 2}, {token: 3}, {token: 5}}
+
+	slot, numPast, err := c.findLongestCacheSlot(prompt)
+	if err != nil {
+		t.Fatalf("findLongestCacheSlot: err %v", err)
+	}
+	if slot.Id != 1 || numPast != 1 {
+		t.Fatalf("findLongestCacheSlot: have (%v, %v); want (1, 1)", slot.Id, numPast)
+	}
+
+	numPast = c.attachPrefix(slot, prompt, numPast)
+	if numPast != 3 {
+		t.Errorf("attachPrefix: have %v; want 3", numPast)
+	}
+	if countCommonPrefix(slot.Inputs, prompt) != 3 || len(slot.Inputs) != 3 {
+		t.Errorf("attachPrefix: inputs %v", slot.Inputs)
+	}
+	if slot.sharedLen() != 3 || c.slots[0].sharedLen() != 3 {
+		t.Errorf("attachPrefix: shared (%v, %v); want (3, 3)", slot.sharedLen(), c.slots[0].sharedLen())
+	}
+
+	// the attached slot is now found through the index as well
+	c.slots[0].InUse = false
+	c.slots[0].Inputs = c.slots[0].Inputs[:1]
+	slot, numPast, err = c.findLongestCacheSlot(prompt)
+	if err != nil || slot.Id != 1 || numPast != 3 {
+		t.Errorf("findLongestCacheSlot: have (%v, %v, %v); want (1, 3)", slot.Id, numPast, err)
+	}
+
+	// nothing longer to attach to
+	if n := c.attachPrefix(slot, prompt, numPast); n != 3 {
+		t.Errorf("attachPrefix: have %v; want 3", n)
+	}
+}
+
+func TestShiftCacheSlot(t *testing.T) {
+	inputs := func(n int) []input {
+		in := make([]input, n)
+		for i := range in {
+			in[i] = input{token: i}
+		}
+		return in
+	}
+
+	tests := []struct {
+		name     string
+		numKeep  int
+		shared   int
+		expected []input
+		evaluate []input
+	}{
+		{
+			name:     "Own",
+			numKeep:  2,
+			expected: []input{{token: 0}, {token: 1}, {token: 5}, {token: 6}, {token: 7}},
+		},
+		{
+			name:     "Shared Kept",
+			numKeep:  2,
+			shared:   2,
+			expected: []input{{token: 0}, {token: 1}, {token: 5}, {token: 6}, {token: 7}},
+		},
+		{
+			name:     "Shared Discarded",
+			numKeep:  2,
+			shared:   5,
+			expected: []input{{token: 0}, {token: 1}, {token: 5}, {token: 6}, {token: 7}},
+		},
+		{
+			name:     "Shared Shifted",
+			numKeep:  2,
+			shared:   6,
+			expected: []input{{token: 0}, {token: 1}},
+			evaluate: []input{{token: 5}, {token: 6}, {token: 7}},
+		},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			c := InputCache{numCtx: 8, kvSize: 8, slots: []InputCacheSlot{{Id: 0, Inputs: inputs(8)}}}
+			slot := &c.slots[0]
+			if tt.shared > 0 {
+				slot.shared = []sharedRun{{start: 0, end: tt.shared}}
+			}
+
+			evaluate, err := c.ShiftCacheSlot(slot, tt.numKeep)
+			if err != nil {
+				t.Fatalf("ShiftCacheSlot: err %v", err)
+			}
+			if !reflect.DeepEqual(slot.Inputs, tt.expected) || !reflect.DeepEqual(evaluate, tt.evaluate) {
+				t.Errorf("ShiftCacheSlot: have (%v, %v); want (%v, %v)", slot.Inputs, evaluate, tt.expected, tt.evaluate)
+			}
+			if slot.sharedLen() > tt.numKeep {
+				t.Errorf("ShiftCacheSlot: shared %v after shifting", slot.sharedLen())
+			}
+		})
+	}
+}
+
+func TestEnsureRoomForked(t *testing.T) {
+	prompt := []input{{token: 1}, {token: 2}, {token: 3}, {token: 4}, {token: 5}}
+
+	c := InputCache{kvSize: 10, pooled: true, slots: []InputCacheSlot{
+		{Id: 0, Inputs: slices.Clone(prompt), InUse: true},
+		{Id: 1, Inputs: []input{}, InUse: true},
+		{Id: 2, Inputs: []input{{token: 9}, {token: 9}}, lastUsed: time.Now()},
+	}}
+
+	// slot 1 shares the prompt of slot 0 and generates 2 inputs of its own
+	if n := c.attachPrefix(&c.slots[1], prompt, 0); n != len(prompt) {
+		t.Fatalf("attachPrefix: have %v; want %v", n, len(prompt))
+	}
+	c.slots[1].Inputs = append(c.slots[1].Inputs, input{token: 6}, input{token: 7})
+
+	if used := c.used(nil); used != 9 {
+		t.Errorf("used: have %v; want 9", used)
+	}
+	if !c.EnsureRoom(0) || len(c.slots[2].Inputs) != 2 {
+		t.Errorf("EnsureRoom: evicted idle slot with room left")
+	}
+	if !c.EnsureRoom(1) || len(c.slots[2].Inputs) != 0 {
+		t.Errorf("EnsureRoom: idle slot not evicted")
+	}
+
+	// slot 2 forks slot 1, which holds entries of slot 0 and its own
+	c.slots[2].InUse = true
+	if n := c.attachPrefix(&c.slots[2], c.slots[1].Inputs, 0); n != 7 {
+		t.Fatalf("attachPrefix: have %v; want 7", n)
+	}
+	if used := c.used(nil); used != 7 {
+		t.Errorf("used: have %v; want 7", used)
+	}
+
+	// the shared entries stay in the cache while other slots hold them
+	c.slots[0].InUse = false
+	if !c.evictIdleSlot() || len(c.slots[0].Inputs) != 0 {
+		t.Fatalf("evictIdleSlot: slot 0 not evicted")
+	}
+	if used := c.used(nil); used != 7 {
+		t.Errorf("used: have %v; want 7", used)
+	}
+	if used := c.used(&c.slots[1]); used != 7 {
+		t.Errorf("used without slot 1: have %v; want 7", used)
+	}
+}
@@ -0,0 +1,452 @@
+package runner
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/binary"
+	"encoding/hex"
+	"errors"
+	"fmt"
+	"io"
+	"log/slog"
+	"os"
+	"path/filepath"
+	"slices"
+	"strings"
+	"sync"
+	"time"
+)
+
+// Number of tokens hashed together when looking up a prompt in the disk cache.
+// Only prefixes of at least this many tokens are stored.
+const diskCacheChunk = 64
+
+const (
+	diskCacheMagic   = 0x766b6c6f // "olkv"
+	diskCacheVersion = 2
+)
+
+// The state is stored at a multiple of LLAMA_STATE_ALIGNMENT so that the K and V
+// data of each layer, which is aligned within the state, is page aligned in the
+// file.
+const diskCacheAlign = 4096
+
+// stateOffset returns the offset of the state in a file holding n tokens
+func stateOffset(n int) int {
+	return (12 + 4*n + diskCacheAlign - 1) &^ (diskCacheAlign - 1)
+}
+
+// diskCache is a content-addressed store of KV cache states on disk. The state
+// of a slot is saved when its inputs are about to be dropped from the KV cache,
+// and restored when a later prompt, possibly after a restart, starts with the
+// same tokens, so that a long shared prompt is read from disk instead of being
+// processed again.
+//
+// Prompts are hashed in chunks of diskCacheChunk tokens, where the hash of each
+// chunk also covers all the chunks before it. A hash therefore identifies a whole
+// prefix, and the longest stored prefix of a prompt is found by following the
+// hashes of its chunks until one is unknown.
+//
+// Each file holds the tokens of a sequence followed by its state, as returned by
+// llama_state_seq_get_data, and is named after the hash of its last full chunk.
+// The state starts at a page boundary.
+type diskCache struct {
+	dir     string
+	maxSize int64
+
+	mu sync.Mutex
+
+	// stored entries, by file key
+	entries map[[32]byte]*diskEntry
+
+	// entry with the longest tokens for the hash of each chunk of every entry
+	index map[[32]byte]*diskEntry
+
+	// keys of entries that are being written
+	pending map[[32]byte]struct{}
+
+	// total size of the files
+	size int64
+}
+
+type diskEntry struct {
+	key    [32]byte
+	tokens []int
+	size   int64
+
+	lastUsed time.Time
+}
+
+// chunkHashes returns the hash of each full chunk of tokens
+func chunkHashes(tokens []int) [][32]byte {
+	hashes := make([][32]byte, 0, len(tokens)/diskCacheChunk)
+
+	var prev [32]byte
+	b := make([]byte, 4*diskCacheChunk)
+	for i := 0; i+diskCacheChunk <= len(tokens); i += diskCacheChunk {
+		for j, t := range tokens[i : i+diskCacheChunk] {
+			binary.LittleEndian.PutUint32(b[4*j:], uint32(t))
+		}
+
+		h := sha256.New()
+		h.Write(prev[:])
+		h.Write(b)
+		h.Sum(prev[:0])
+
+		hashes = append(hashes, prev)
+	}
+
+	return hashes
+}
+
+// promptTokens returns the tokens at the start of inputs, up to the first image
+// embedding
+func promptTokens(inputs []input) []int {
+	tokens := make([]int, 0, len(inputs))
+	for _, i := range inputs {
+		if i.embed != nil {
+			break
+		}
+		tokens = append(tokens, i.token)
+	}
+	return tokens
+}
+
+func newDiskCache(dir string, maxSize int64) (*diskCache, error) {
+	if err := os.MkdirAll(dir, 0o755); err != nil {
+		return nil, err
+	}
+
+	d := &diskCache{
+		dir:     dir,
+		maxSize: maxSize,
+		entries: make(map[[32]byte]*diskEntry),
+		index:   make(map[[32]byte]*diskEntry),
+		pending: make(map[[32]byte]struct{}),
+	}
+
+	// files of saves that did not finish, for example because the runner was
+	// killed while writing them
+	temps, err := filepath.Glob(filepath.Join(dir, "tmp-*"))
+	if err != nil {
+		return nil, err
+	}
+
+	for _, path := range temps {
+		slog.Debug("removing incomplete disk cache entry", "path", path)
+		os.Remove(path)
+	}
+
+	files, err := filepath.Glob(filepath.Join(dir, "*.kv"))
+	if err != nil {
+		return nil, err
+	}
+
+	for _, path := range files {
+		e, err := readDiskEntry(path)
+		if err != nil {
+			slog.Warn("removing invalid disk cache entry", "path", path, "error", err)
+			os.Remove(path)
+			continue
+		}
+
+		d.entries[e.key] = e
+		d.size += e.size
+	}
+
+	d.reindex()
+	d.evict()
+
+	slog.Info("disk cache", "dir", dir, "entries", len(d.entries), "size", d.size)
+
+	return d, nil
+}
+
+func (d *diskCache) path(key [32]byte) string {
+	return filepath.Join(d.dir, hex.EncodeToString(key[:])+".kv")
+}
+
+// reads the header of a cache file
+func readDiskEntry(path string) (*diskEntry, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	fi, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+
+	var header [3]uint32
+	r := bufio.NewReader(f)
+	if err := binary.Read(r, binary.LittleEndian, &header); err != nil {
+		return nil, err
+	}
+	if header[0] != diskCacheMagic || header[1] != diskCacheVersion {
+		return nil, fmt.Errorf("unsupported format %x version %d", header[0], header[1])
+	}
+
+	raw := make([]int32, header[2])
+	if err := binary.Read(r, binary.LittleEndian, raw); err != nil {
+		return nil, err
+	}
+
+	tokens := make([]int, len(raw))
+	for i, t := range raw {
+		tokens[i] = int(t)
+	}
+
+	hashes := chunkHashes(tokens)
+	if len(hashes) == 0 || hex.EncodeToString(hashes[len(hashes)-1][:])+".kv" != filepath.Base(path) {
+		return nil, errors.New("tokens do not match file name")
+	}
+
+	return &diskEntry{
+		key:      hashes[len(hashes)-1],
+		tokens:   tokens,
+		size:     fi.Size(),
+		lastUsed: fi.ModTime(),
+	}, nil
+}
+
+func (d *diskCache) reindex() {
+	clear(d.index)
+	for _, e := range d.entries {
+		for _, h := range chunkHashes(e.tokens) {
+			if cur, ok := d.index[h]; !ok || len(cur.tokens) < len(e.tokens) {
+				d.index[h] = e
+			}
+		}
+	}
+}
+
+// removes the least recently used entries until the cache fits in maxSize
+func (d *diskCache) evict() {
+	if d.size <= d.maxSize {
+		return
+	}
+
+	entries := make([]*diskEntry, 0, len(d.entries))
+	for _, e := range d.entries {
+		entries = append(entries, e)
+	}
+	slices.SortFunc(entries, func(a, b *diskEntry) int { return a.lastUsed.Compare(b.lastUsed) })
+
+	for _, e := range entries {
+		if d.size <= d.maxSize {
+			break
+		}
+
+		slog.Debug("evicting disk cache entry", "tokens", len(e.tokens), "size", e.size, "used", e.lastUsed)
+		if err := os.Remove(d.path(e.key)); err != nil && !errors.Is(err, os.ErrNotExist) {
+			slog.Warn("failed to remove disk cache entry", "error", err)
+		}
+		delete(d.entries, e.key)
+		d.size -= e.size
+	}
+
+	d.reindex()
+}
+
+// lookup returns the entry sharing the longest prefix with prompt, and the
+// length of that prefix
+func (d *diskCache) lookup(prompt []input) (*diskEntry, int) {
+	tokens := promptTokens(prompt)
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	var e *diskEntry
+	for _, h := range chunkHashes(tokens) {
+		next, ok := d.index[h]
+		if !ok {
+			break
+		}
+		e = next
+	}
+
+	if e == nil {
+		return nil, 0
+	}
+
+	n := 0
+	for n < len(e.tokens) && n < len(tokens) && e.tokens[n] == tokens[n] {
+		n++
+	}
+
+	return e, n
+}
+
+// has reports whether tokens are already stored, or being stored, as part of
+// an entry
+func (d *diskCache) has(tokens []int) bool {
+	hashes := chunkHashes(tokens)
+	if len(hashes) == 0 {
+		return false
+	}
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	last := hashes[len(hashes)-1]
+	if _, ok := d.pending[last]; ok {
+		return true
+	}
+
+	e, ok := d.index[last]
+	return ok && len(e.tokens) >= len(tokens) && slices.Equal(e.tokens[:len(tokens)], tokens)
+}
+
+// reserve marks the entry for tokens as being written, returns false if it
+// already is
+func (d *diskCache) reserve(tokens []int) bool {
+	hashes := chunkHashes(tokens)
+	if len(hashes) == 0 {
+		return false
+	}
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	key := hashes[len(hashes)-1]
+	if _, ok := d.pending[key]; ok {
+		return false
+	}
+	d.pending[key] = struct{}{}
+
+	return true
+}
+
+// release undoes reserve
+func (d *diskCache) release(tokens []int) {
+	hashes := chunkHashes(tokens)
+	if len(hashes) == 0 {
+		return
+	}
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	delete(d.pending, hashes[len(hashes)-1])
+}
+
+// save stores state as the entry for tokens, replacing any entry with the same
+// key. tokens must have been reserved.
+func (d *diskCache) save(tokens []int, state []byte) error {
+	defer d.release(tokens)
+
+	hashes := chunkHashes(tokens)
+	key := hashes[len(hashes)-1]
+
+	f, err := os.CreateTemp(d.dir, "tmp-*")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(f.Name())
+
+	w := bufio.NewWriter(f)
+	header := [3]uint32{diskCacheMagic, diskCacheVersion, uint32(len(tokens))}
+	if err := binary.Write(w, binary.LittleEndian, header); err != nil {
+		f.Close()
+		return err
+	}
+
+	raw := make([]int32, len(tokens))
+	for i, t := range tokens {
+		raw[i] = int32(t)
+	}
+	if err := binary.Write(w, binary.LittleEndian, raw); err != nil {
+		f.Close()
+		return err
+	}
+
+	if _, err := w.Write(make([]byte, stateOffset(len(tokens))-12-4*len(tokens))); err != nil {
+		f.Close()
+		return err
+	}
+
+	if _, err := w.Write(state); err != nil {
+		f.Close()
+		return err
+	}
+
+	if err := w.Flush(); err != nil {
+		f.Close()
+		return err
+	}
+
+	if err := f.Close(); err != nil {
+		return err
+	}
+
+	if err := os.Rename(f.Name(), d.path(key)); err != nil {
+		return err
+	}
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	if old, ok := d.entries[key]; ok {
+		d.size -= old.size
+	}
+
+	e := &diskEntry{
+		key:      key,
+		tokens:   tokens,
+		size:     int64(stateOffset(len(tokens)) + len(state)),
+		lastUsed: time.Now(),
+	}
+	d.entries[key] = e
+	d.size += e.size
+
+	d.reindex()
+	d.evict()
+
+	return nil
+}
+
+// open maps the state of e into memory. The returned function releases it.
+func (d *diskCache) open(e *diskEntry) ([]byte, func(), error) {
+	f, err := os.Open(d.path(e.key))
+	if err != nil {
+		return nil, nil, err
+	}
+	defer f.Close()
+
+	fi, err := f.Stat()
+	if err != nil {
+		return nil, nil, err
+	}
+
+	data, unmap, err := mapFile(f, int(fi.Size()))
+	if err != nil {
+		return nil, nil, err
+	}
+
+	offset := stateOffset(len(e.tokens))
+	if len(data) < offset {
+		unmap()
+		return nil, nil, io.ErrUnexpectedEOF
+	}
+
+	d.mu.Lock()
+	e.lastUsed = time.Now()
+	d.mu.Unlock()
+
+	// the modification time keeps the order of use across restarts
+	if err := os.Chtimes(d.path(e.key), time.Time{}, e.lastUsed); err != nil {
+		slog.Debug("failed to update disk cache entry time", "error", err)
+	}
+
+	return data[offset:], unmap, nil
+}
+
+// diskCacheDir returns the directory under dir for the KV cache states of a
+// model, which depend on the model, its adapters and the format of the cache
+func diskCacheDir(dir string, mpath string, lpaths []string, kvCacheType string, flashAttention bool) string {
+	h := sha256.New()
+	fmt.Fprintf(h, "%s\x00%s\x00%s\x00%v", filepath.Base(mpath), strings.Join(lpaths, "\x00"), kvCacheType, flashAttention)
+	return filepath.Join(dir, hex.EncodeToString(h.Sum(nil))[:16])
+}
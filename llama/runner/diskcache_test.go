@@ -0,0 +1,166 @@
+package runner
+
+import (
+	"bytes"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func seqTokens(start, n int) []int {
+	tokens := make([]int, n)
+	for i := range tokens {
+		tokens[i] = start + i
+	}
+	return tokens
+}
+
+func seqInputs(tokens []int) []input {
+	inputs := make([]input, len(tokens))
+	for i, t := range tokens {
+		inputs[i] = input{token: t}
+	}
+	return inputs
+}
+
+func TestDiskCache(t *testing.T) {
+	dir := t.TempDir()
+
+	d, err := newDiskCache(dir, 1<<20)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	long := seqTokens(0, 3*diskCacheChunk+10)
+	short := append(seqTokens(0, diskCacheChunk), seqTokens(1000, diskCacheChunk+5)...)
+
+	for _, tokens := range [][]int{long, short} {
+		if d.has(tokens) {
+			t.Fatalf("has: stored before save")
+		}
+		if !d.reserve(tokens) {
+			t.Fatalf("reserve: failed")
+		}
+		if d.reserve(tokens) {
+			t.Fatalf("reserve: reserved twice")
+		}
+		if err := d.save(tokens, []byte{byte(len(tokens)), 1, 2, 3}); err != nil {
+			t.Fatal(err)
+		}
+		if !d.has(tokens) {
+			t.Fatalf("has: not stored after save")
+		}
+	}
+
+	if !d.has(long[:2*diskCacheChunk+1]) {
+		t.Errorf("has: prefix of stored entry not found")
+	}
+
+	tests := []struct {
+		name   string
+		prompt []input
+		tokens int
+		len    int
+	}{
+		{"Full", seqInputs(seqTokens(0, 4*diskCacheChunk)), len(long), len(long)},
+		{"Partial Chunk", seqInputs(seqTokens(0, 2*diskCacheChunk+7)), len(long), 2*diskCacheChunk + 7},
+		{"Branch", seqInputs(append(seqTokens(0, diskCacheChunk), seqTokens(1000, 2*diskCacheChunk)...)), len(short), 2*diskCacheChunk + 5},
+		{"Diverge In Chunk", seqInputs(append(seqTokens(0, diskCacheChunk+3), seqTokens(5000, diskCacheChunk)...)), len(long), diskCacheChunk + 3},
+		{"Too Short", seqInputs(seqTokens(0, diskCacheChunk-1)), 0, 0},
+		{"Miss", seqInputs(seqTokens(1, 2*diskCacheChunk)), 0, 0},
+		{"Image", append(seqInputs(seqTokens(0, diskCacheChunk+1)), input{embed: []float32{0.1}}), len(long), diskCacheChunk + 1},
+	}
+
+	check := func(d *diskCache) {
+		for _, tt := range tests {
+			t.Run(tt.name, func(t *testing.T) {
+				e, n := d.lookup(tt.prompt)
+				tokens := 0
+				if e != nil {
+					tokens = len(e.tokens)
+				}
+				if tokens != tt.tokens || n != tt.len {
+					t.Errorf("lookup: have (%v, %v); want (%v, %v)", tokens, n, tt.tokens, tt.len)
+				}
+			})
+		}
+	}
+
+	check(d)
+
+	// entries are found again after a restart
+	d, err = newDiskCache(dir, 1<<20)
+	if err != nil {
+		t.Fatal(err)
+	}
+	check(d)
+
+	e, _ := d.lookup(seqInputs(long))
+	state, release, err := d.open(e)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Equal(state, []byte{byte(len(long)), 1, 2, 3}) {
+		t.Errorf("open: have %v", state)
+	}
+	release()
+
+	// foreign files and incomplete saves are removed
+	if err := os.WriteFile(filepath.Join(dir, "0000.kv"), []byte("junk"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	if err := os.WriteFile(filepath.Join(dir, "tmp-1234"), []byte("junk"), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	d, err = newDiskCache(dir, 1<<20)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(d.entries) != 2 {
+		t.Errorf("entries: have %v; want 2", len(d.entries))
+	}
+	if _, err := os.Stat(filepath.Join(dir, "0000.kv")); !os.IsNotExist(err) {
+		t.Errorf("invalid entry not removed: %v", err)
+	}
+	if _, err := os.Stat(filepath.Join(dir, "tmp-1234")); !os.IsNotExist(err) {
+		t.Errorf("incomplete entry not removed: %v", err)
+	}
+}
+
+func TestDiskCacheEvict(t *testing.T) {
+	state := make([]byte, 1000)
+	entrySize := int64(stateOffset(diskCacheChunk) + len(state))
+
+	d, err := newDiskCache(t.TempDir(), 2*entrySize)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	a, b, c := seqTokens(0, diskCacheChunk), seqTokens(100, diskCacheChunk), seqTokens(200, diskCacheChunk)
+	for _, tokens := range [][]int{a, b} {
+		d.reserve(tokens)
+		if err := d.save(tokens, state); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	// using a makes b the least recently used entry
+	e, _ := d.lookup(seqInputs(a))
+	_, release, err := d.open(e)
+	if err != nil {
+		t.Fatal(err)
+	}
+	release()
+
+	d.reserve(c)
+	if err := d.save(c, state); err != nil {
+		t.Fatal(err)
+	}
+
+	if !d.has(a) || d.has(b) || !d.has(c) {
+		t.Errorf("has: have (%v, %v, %v); want (true, false, true)", d.has(a), d.has(b), d.has(c))
+	}
+	if d.size != 2*entrySize {
+		t.Errorf("size: have %v; want %v", d.size, 2*entrySize)
+	}
+}
@@ -0,0 +1,45 @@
+package runner
+
+import (
+	"crypto/sha256"
+
+	"github.com/ollama/ollama/llama"
+	"github.com/ollama/ollama/util/lru"
+)
+
+// Number of compiled grammars kept by the runner
+const grammarCacheSize = 16
+
+// grammarCache keeps the compiled form of recently used grammars. Requests that
+// send the same grammar, such as the one for a tool call schema, then share the
+// parsed grammar and the tokens it accepts in each state instead of building
+// them again.
+type grammarCache struct {
+	compile func(string) (*llama.Grammar, error)
+
+	entries *lru.Cache[[32]byte, *llama.Grammar]
+}
+
+func newGrammarCache(size int, compile func(string) (*llama.Grammar, error)) *grammarCache {
+	return &grammarCache{
+		compile: compile,
+		entries: lru.New[[32]byte, *llama.Grammar](size),
+	}
+}
+
+// get returns the compiled form of grammar, compiling it if it is not cached
+func (c *grammarCache) get(grammar string) (*llama.Grammar, error) {
+	key := sha256.Sum256([]byte(grammar))
+
+	if g, ok := c.entries.Get(key); ok {
+		return g, nil
+	}
+
+	g, err := c.compile(grammar)
+	if err != nil {
+		return nil, err
+	}
+
+	// another request may have compiled the same grammar in the meantime
+	return c.entries.Add(key, g), nil
+}
@@ -0,0 +1,48 @@
+package runner
+
+import (
+	"testing"
+
+	"github.com/ollama/ollama/llama"
+)
+
+func TestGrammarCache(t *testing.T) {
+	compiled := 0
+	c := newGrammarCache(2, func(grammar string) (*llama.Grammar, error) {
+		compiled++
+		return &llama.Grammar{}, nil
+	})
+
+	get := func(grammar string) *llama.Grammar {
+		t.Helper()
+		g, err := c.get(grammar)
+		if err != nil {
+			t.Fatal(err)
+		}
+		return g
+	}
+
+	a := get("root ::= \"a\"")
+	if get("root ::= \"a\"") != a || compiled != 1 {
+		t.Errorf("get: grammar compiled again (compiled %v times)", compiled)
+	}
+
+	b := get("root ::= \"b\"")
+	if b == a || compiled != 2 {
+		t.Errorf("get: different grammars share an entry (compiled %v times)", compiled)
+	}
+
+	// using a makes b the least recently used grammar
+	get("root ::= \"a\"")
+	get("root ::= \"c\"")
+	if c.entries.Len() != 2 {
+		t.Errorf("entries: have %v; want 2", c.entries.Len())
+	}
+
+	if get("root ::= \"a\"") != a || compiled != 3 {
+		t.Errorf("evict: a evicted (compiled %v times)", compiled)
+	}
+	if get("root ::= \"b\"") == b || compiled != 4 {
+		t.Errorf("evict: b not evicted (compiled %v times)", compiled)
+	}
+}
@@ -0,0 +1,26 @@
+//go:build !windows
+
+package runner
+
+import (
+	"os"
+
+	"golang.org/x/sys/unix"
+)
+
+// mapFile maps the first size bytes of f read-only into memory
+func mapFile(f *os.File, size int) ([]byte, func(), error) {
+	if size == 0 {
+		return nil, func() {}, nil
+	}
+
+	data, err := unix.Mmap(int(f.Fd()), 0, size, unix.PROT_READ, unix.MAP_SHARED)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	// the data is read once from start to end
+	_ = unix.Madvise(data, unix.MADV_SEQUENTIAL)
+
+	return data, func() { unix.Munmap(data) }, nil
+}
@@ -0,0 +1,16 @@
+package runner
+
+import (
+	"io"
+	"os"
+)
+
+// mapFile reads the first size bytes of f into memory
+func mapFile(f *os.File, size int) ([]byte, func(), error) {
+	data := make([]byte, size)
+	if _, err := io.ReadFull(f, data); err != nil {
+		return nil, nil, err
+	}
+
+	return data, func() {}, nil
+}
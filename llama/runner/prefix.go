@@ -0,0 +1,209 @@
+package runner
+
+import (
+	"hash/fnv"
+	"math"
+)
+
+// prefixTree is a radix tree over the inputs stored in the KV cache slots. It
+// finds the slot sharing the longest prefix with a prompt in a single walk,
+// instead of comparing the prompt against the inputs of every slot.
+//
+// Each node covers a run of inputs and records the slots whose inputs contain
+// the whole run. The inputs of a slot always end on a node boundary.
+type prefixTree struct {
+	root *prefixNode
+
+	// last node of each slot, by slot id
+	leaves map[int]*prefixNode
+}
+
+type prefixNode struct {
+	inputs []input
+
+	// number of inputs from the root to the end of this node
+	depth int
+
+	parent   *prefixNode
+	children map[inputKey]*prefixNode
+	slots    map[int]struct{}
+}
+
+type inputKey struct {
+	token int
+	embed uint64
+}
+
+func newPrefixTree() *prefixTree {
+	return &prefixTree{
+		root:   &prefixNode{children: make(map[inputKey]*prefixNode), slots: make(map[int]struct{})},
+		leaves: make(map[int]*prefixNode),
+	}
+}
+
+func keyOf(i input) inputKey {
+	if i.embed == nil {
+		return inputKey{token: i.token}
+	}
+
+	h := fnv.New64a()
+	var b [4]byte
+	for _, f := range i.embed {
+		bits := math.Float32bits(f)
+		b[0], b[1], b[2], b[3] = byte(bits), byte(bits>>8), byte(bits>>16), byte(bits>>24)
+		h.Write(b[:])
+	}
+
+	return inputKey{token: i.token, embed: h.Sum64() | 1}
+}
+
+// splits node after n of its inputs and returns the new upper node
+func (t *prefixTree) split(node *prefixNode, n int) *prefixNode {
+	upper := &prefixNode{
+		inputs:   node.inputs[:n:n],
+		depth:    node.depth - len(node.inputs) + n,
+		parent:   node.parent,
+		children: make(map[inputKey]*prefixNode),
+		slots:    make(map[int]struct{}, len(node.slots)),
+	}
+	for id := range node.slots {
+		upper.slots[id] = struct{}{}
+	}
+
+	node.parent.children[keyOf(node.inputs[0])] = upper
+
+	node.inputs = node.inputs[n:]
+	node.parent = upper
+	upper.children[keyOf(node.inputs[0])] = node
+
+	return upper
+}
+
+// removes slot id from node, dropping the node once no slot uses it
+func (t *prefixTree) release(node *prefixNode, id int) {
+	delete(node.slots, id)
+	if len(node.slots) == 0 {
+		delete(node.parent.children, keyOf(node.inputs[0]))
+	}
+}
+
+// insert appends inputs to the indexed inputs of slot id
+func (t *prefixTree) insert(id int, inputs []input) {
+	node := t.leaves[id]
+	if node == nil {
+		node = t.root
+	}
+
+	for len(inputs) > 0 {
+		// extend the node in place if it only belongs to this slot, which
+		// is the common case while generating
+		if node != t.root && len(node.children) == 0 && len(node.slots) == 1 {
+			node.inputs = append(node.inputs, inputs...)
+			node.depth += len(inputs)
+			break
+		}
+
+		key := keyOf(inputs[0])
+		child := node.children[key]
+		if child == nil {
+			child = &prefixNode{
+				inputs:   append([]input(nil), inputs...),
+				depth:    node.depth + len(inputs),
+				parent:   node,
+				children: make(map[inputKey]*prefixNode),
+				slots:    map[int]struct{}{id: {}},
+			}
+			node.children[key] = child
+			node = child
+			break
+		}
+
+		n := countCommonPrefix(child.inputs, inputs)
+		if n == 0 {
+			// hash collision between different embeddings, leave the rest unindexed
+			break
+		}
+
+		if n < len(child.inputs) {
+			child = t.split(child, n)
+		}
+
+		child.slots[id] = struct{}{}
+		node = child
+		inputs = inputs[n:]
+	}
+
+	if node != t.root {
+		t.leaves[id] = node
+	}
+}
+
+// truncate keeps only the first n indexed inputs of slot id
+func (t *prefixTree) truncate(id int, n int) {
+	node := t.leaves[id]
+	if node == nil {
+		return
+	}
+
+	for node != t.root && node.depth-len(node.inputs) >= n {
+		parent := node.parent
+		t.release(node, id)
+		node = parent
+	}
+
+	if node != t.root && node.depth > n {
+		upper := t.split(node, n-(node.depth-len(node.inputs)))
+		t.release(node, id)
+		node = upper
+	}
+
+	if node == t.root {
+		delete(t.leaves, id)
+	} else {
+		t.leaves[id] = node
+	}
+}
+
+// remove drops all indexed inputs of slot id
+func (t *prefixTree) remove(id int) {
+	t.truncate(id, 0)
+}
+
+// longest returns the slot that has the longest common prefix with prompt
+// among the slots accepted by ok, and the length of that prefix. ok is given
+// the length of the prefix shared by the slot. When several slots qualify, the
+// lowest id is returned. It returns -1 if no accepted slot shares any input
+// with prompt.
+func (t *prefixTree) longest(prompt []input, ok func(id int, n int) bool) (int, int) {
+	best, bestLen := -1, 0
+
+	node := t.root
+	for node.depth < len(prompt) {
+		child := node.children[keyOf(prompt[node.depth])]
+		if child == nil {
+			break
+		}
+
+		n := countCommonPrefix(child.inputs, prompt[node.depth:])
+		if n == 0 {
+			break
+		}
+
+		found := -1
+		for id := range child.slots {
+			if (found < 0 || id < found) && ok(id, node.depth+n) {
+				found = id
+			}
+		}
+		if found >= 0 {
+			best, bestLen = found, node.depth+n
+		}
+
+		if n < len(child.inputs) {
+			break
+		}
+		node = child
+	}
+
+	return best, bestLen
+}
@@ -0,0 +1,88 @@
+package runner
+
+import (
+	"testing"
+)
+
+func tokens(t ...int) []input {
+	inputs := make([]input, len(t))
+	for i := range t {
+		inputs[i] = input{token: t[i]}
+	}
+	return inputs
+}
+
+func TestPrefixTree(t *testing.T) {
+	all := func(id int, n int) bool { return true }
+
+	tree := newPrefixTree()
+	tree.insert(0, tokens(1, 2, 3, 4))
+	tree.insert(1, tokens(1, 2, 5))
+	tree.insert(2, tokens(7))
+
+	tests := []struct {
+		name   string
+		prompt []input
+		ok     func(id int, n int) bool
+		id     int
+		len    int
+	}{
+		{"Full", tokens(1, 2, 3, 4, 5), all, 0, 4},
+		{"Shared", tokens(1, 2, 6), all, 0, 2},
+		{"Branch", tokens(1, 2, 5, 6), all, 1, 3},
+		{"Partial Edge", tokens(1, 2, 3, 9), all, 0, 3},
+		{"Miss", tokens(8), all, -1, 0},
+		{"Filter", tokens(1, 2, 3, 4), func(id int, n int) bool { return id != 0 }, 1, 2},
+		{"Exact", tokens(1, 2, 3, 4), func(id int, n int) bool { return id == 1 && n == 3 }, -1, 0},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			id, n := tree.longest(tt.prompt, tt.ok)
+			if id != tt.id || n != tt.len {
+				t.Errorf("longest: have (%v, %v); want (%v, %v)", id, n, tt.id, tt.len)
+			}
+		})
+	}
+
+	// extend in place, then truncate into the shared part
+	tree.insert(0, tokens(6, 7))
+	if id, n := tree.longest(tokens(1, 2, 3, 4, 6, 7), all); id != 0 || n != 6 {
+		t.Errorf("extend: have (%v, %v); want (0, 6)", id, n)
+	}
+
+	tree.truncate(0, 1)
+	if id, n := tree.longest(tokens(1, 2, 3), all); id != 1 || n != 2 {
+		t.Errorf("truncate: have (%v, %v); want (1, 2)", id, n)
+	}
+	if id, n := tree.longest(tokens(1, 9), func(id int, n int) bool { return n == 1 }); id != 0 || n != 1 {
+		t.Errorf("truncate: have (%v, %v); want (0, 1)", id, n)
+	}
+
+	tree.insert(0, tokens(2, 5, 8))
+	if id, n := tree.longest(tokens(1, 2, 5, 8), all); id != 0 || n != 4 {
+		t.Errorf("reinsert: have (%v, %v); want (0, 4)", id, n)
+	}
+
+	tree.remove(0)
+	tree.remove(1)
+	tree.remove(2)
+	if len(tree.root.children) != 0 || len(tree.leaves) != 0 {
+		t.Errorf("remove: tree not empty (children: %v, leaves: %v)", len(tree.root.children), len(tree.leaves))
+	}
+}
+
+func TestPrefixTreeEmbeddings(t *testing.T) {
+	tree := newPrefixTree()
+	tree.insert(0, []input{{token: 1}, {embed: []float32{0.1, 0.2}}, {token: 2}})
+
+	id, n := tree.longest([]input{{token: 1}, {embed: []float32{0.1, 0.2}}, {token: 3}}, func(id int, n int) bool { return true })
+	if id != 0 || n != 2 {
+		t.Errorf("longest: have (%v, %v); want (0, 2)", id, n)
+	}
+
+	id, n = tree.longest([]input{{token: 1}, {embed: []float32{0.1, 0.3}}}, func(id int, n int) bool { return true })
+	if id != 0 || n != 1 {
+		t.Errorf("longest: have (%v, %v); want (0, 1)", id, n)
+	}
+}
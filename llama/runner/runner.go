@@ -51,6 +51,9 @@ type Sequence struct {
 	// tokens that have been generated but not returned yet (e.g. for stop sequences)
 	pendingResponses []string
 
+	// log-probabilities of the pending tokens, if requested
+	pendingLogprobs []api.Logprob
+
 	// input cache being used by this sequence
 	cache *InputCacheSlot
 
@@ -59,7 +62,7 @@ type Sequence struct {
 	crossAttention bool
 
 	// channel to send responses over
-	responses chan string
+	responses chan CompletionResponse
 
 	// channel to stop decoding (such as if the remote connection is closed)
 	quit chan bool
@@ -69,6 +72,15 @@ type Sequence struct {
 
 	samplingCtx *llama.SamplingContext
 
+	// true if the output is constrained by a grammar, whose forced tokens are
+	// evaluated without sampling
+	grammar bool
+
+	// return the log-probability of each token, with the topLogprobs most
+	// likely tokens at its position
+	logprobs    bool
+	topLogprobs int
+
 	// channel to send back the embedding if embedding only
 	embedding chan []float32
 
@@ -96,6 +108,8 @@ type NewSequenceParams struct {
 	numKeep        int
 	samplingParams *llama.SamplingParams
 	embedding      bool
+	logprobs       bool
+	topLogprobs    int
 }
 
 func (s *Server) NewSequence(prompt string, images []ImageData, params NewSequenceParams) (*Sequence, error) {
@@ -132,6 +146,14 @@ func (s *Server) NewSequence(prompt string, images []ImageData, params NewSequen
 
 	var sc *llama.SamplingContext
 	if params.samplingParams != nil {
+		if params.samplingParams.Grammar != "" {
+			g, err := s.grammars.get(params.samplingParams.Grammar)
+			if err != nil {
+				return nil, err
+			}
+			params.samplingParams.CompiledGrammar = g
+		}
+
 		sc, err = llama.NewSamplingContext(s.model, *params.samplingParams)
 		if err != nil {
 			return nil, err
@@ -149,10 +171,13 @@ func (s *Server) NewSequence(prompt string, images []ImageData, params NewSequen
 		startProcessingTime: startTime,
 		numPredict:          params.numPredict,
 		pendingResponses:    make([]string, 0),
-		responses:           make(chan string, 100),
+		responses:           make(chan CompletionResponse, 100),
 		quit:                make(chan bool, 1),
 		embedding:           make(chan []float32, 1),
 		samplingCtx:         sc,
+		grammar:             params.samplingParams != nil && params.samplingParams.Grammar != "",
+		logprobs:            params.logprobs,
+		topLogprobs:         params.topLogprobs,
 		embeddingOnly:       params.embedding,
 		stop:                params.stop,
 		numKeep:             params.numKeep,
@@ -227,6 +252,9 @@ type Server struct {
 	// image model context for multi-modal models
 	image *ImageContext
 
+	// compiled grammars of recent requests
+	grammars *grammarCache
+
 	// status for external health reporting - loading, ready to serve, etc.
 	status ServerStatus
 
@@ -275,7 +303,9 @@ func (s *Server) allNil() bool {
 
 func flushPending(seq *Sequence) bool {
 	joined := strings.Join(seq.pendingResponses, "")
+	logprobs := seq.pendingLogprobs
 	seq.pendingResponses = []string{}
+	seq.pendingLogprobs = nil
 
 	// Check if there are any partial UTF-8 characters remaining.
 	// We already check and queue as we are generating but some may
@@ -287,18 +317,33 @@ func flushPending(seq *Sequence) bool {
 		joined = joined[:len(joined)-1]
 	}
 
-	if len(joined) == 0 {
+	if len(joined) == 0 && len(logprobs) == 0 {
 		return true
 	}
 
 	select {
-	case seq.responses <- joined:
+	case seq.responses <- CompletionResponse{Content: joined, Logprobs: logprobs}:
 		return true
 	case <-seq.quit:
 		return false
 	}
 }
 
+// tokenLogprob returns the log-probability of a token's piece, which may be
+// only part of a UTF-8 character and so is also returned as bytes
+func tokenLogprob(piece string, logprob float32) api.TokenLogprob {
+	b := make([]int, len(piece))
+	for i := range len(piece) {
+		b[i] = int(piece[i])
+	}
+
+	return api.TokenLogprob{
+		Token:   strings.ToValidUTF8(piece, "\uFFFD"),
+		Logprob: float64(logprob),
+		Bytes:   b,
+	}
+}
+
 func (s *Server) removeSequence(seqIndex int, reason string) {
 	seq := s.seqs[seqIndex]
 
@@ -367,6 +412,9 @@ func (s *Server) processBatch(tokenBatch *llama.Batch, embedBatch *llama.Batch)
 	var batch *llama.Batch
 	crossAttention := false
 
+	// inputs added to the batch but not yet in the KV cache
+	numPending := 0
+
 	seqIdx := s.nextSeq - 1
 	for range s.seqs {
 		seqIdx = (seqIdx + 1) % len(s.seqs)
@@ -383,12 +431,18 @@ func (s *Server) processBatch(tokenBatch *llama.Batch, embedBatch *llama.Batch)
 		}
 
 		for i, input := range seq.inputs {
-			if len(seq.cache.Inputs)+len(seq.pendingInputs)+1 > s.cache.numCtx {
+			if len(seq.cache.Inputs)+len(seq.pendingInputs)+1 > s.cache.numCtx || !s.cache.EnsureRoom(numPending) {
 				if len(seq.pendingInputs) == 0 {
-					err := s.cache.ShiftCacheSlot(seq.cache, seq.numKeep)
+					inputs, err := s.cache.ShiftCacheSlot(seq.cache, seq.numKeep)
 					if err != nil {
 						return err
 					}
+					if len(inputs) > 0 {
+						// shared inputs that could not be shifted, they are
+						// evaluated again from the next batch on
+						seq.inputs = append(inputs, seq.inputs...)
+						break
+					}
 				} else {
 					break
 				}
@@ -420,6 +474,7 @@ func (s *Server) processBatch(tokenBatch *llama.Batch, embedBatch *llama.Batch)
 			batch.Add(input.token, input.embed, len(seq.cache.Inputs)+len(seq.pendingInputs), i+1 == len(seq.inputs), seq.cache.Id)
 			seq.pendingInputs = append(seq.pendingInputs, input)
 			seq.iBatch = batch.NumTokens() - 1
+			numPending++
 		}
 
 		seq.inputs = seq.inputs[len(seq.pendingInputs):]
@@ -443,6 +498,14 @@ func (s *Server) processBatch(tokenBatch *llama.Batch, embedBatch *llama.Batch)
 		s.lc.Synchronize()
 	}
 
+	// sequences to sample, with their sampling contexts and the positions of
+	// their logits in the batch
+	var sampled []int
+	var samplers []*llama.SamplingContext
+	var idxs []int
+	var numTop []int
+	var logprobs bool
+
 	for i, seq := range s.seqs {
 		if seq == nil {
 			continue
@@ -476,64 +539,106 @@ func (s *Server) processBatch(tokenBatch *llama.Batch, embedBatch *llama.Batch)
 			continue
 		}
 
-		// sample a token
-		token := seq.samplingCtx.Sample(s.lc, seq.iBatch)
-		seq.samplingCtx.Accept(token, true)
-		piece := s.model.TokenToPiece(token)
-
-		seq.numPredicted++
+		sampled = append(sampled, i)
+		samplers = append(samplers, seq.samplingCtx)
+		idxs = append(idxs, seq.iBatch)
+		if seq.logprobs {
+			numTop = append(numTop, seq.topLogprobs)
+			logprobs = true
+		} else {
+			numTop = append(numTop, -1)
+		}
+	}
 
-		// if it's an end of sequence token, break
-		if s.model.TokenIsEog(token) {
-			// TODO (jmorganca): we should send this back
-			// as it's important for the /api/generate context
-			// seq.responses <- piece
+	if !logprobs {
+		numTop = nil
+	}
 
-			s.removeSequence(i, "stop")
-			continue
+	// sample a token for all sequences at once, the samplers run in parallel
+	sampledTokens, sampledLogprobs := llama.SampleBatch(s.lc, samplers, idxs, numTop)
+
+	for j, i := range sampled {
+		seq := s.seqs[i]
+		token := sampledTokens[j]
+		tokens := []int{token}
+
+		// tokens that the grammar allows as the only continuation, such as the
+		// keys and punctuation of a JSON schema, are evaluated along with the
+		// sampled one instead of being sampled one at a time. they have no
+		// logits, so not when log-probabilities are returned
+		if seq.grammar && !seq.logprobs && !s.model.TokenIsEog(token) {
+			maxForced := s.batchSize - 1
+			if seq.numPredict > 0 {
+				maxForced = min(maxForced, seq.numPredict-seq.numPredicted-1)
+			}
+			for _, t := range seq.samplingCtx.ForcedTokens(maxForced) {
+				seq.samplingCtx.Accept(t, true)
+				tokens = append(tokens, t)
+			}
+			seq.numDecoded += len(tokens) - 1
 		}
 
-		seq.inputs = []input{{token: token}}
-
-		seq.pendingResponses = append(seq.pendingResponses, piece)
-		sequence := strings.Join(seq.pendingResponses, "")
-
-		if ok, stop := findStop(sequence, seq.stop); ok {
-			slog.Debug("hit stop token", "pending", seq.pendingResponses, "stop", stop)
-
-			var tokenTruncated bool
-			origLen := len(seq.pendingResponses)
-			seq.pendingResponses, tokenTruncated = truncateStop(seq.pendingResponses, stop)
-			newLen := len(seq.pendingResponses)
-
-			// Update the cache based on the tokens that will be returned:
-			// - We have 1 token more than is currently in the cache because
-			// the last one generated wasn't submitted to Decode
-			// - Remove any stop sequences that we stripped out
-			// - If truncateStop removed a portion of a token, drop that
-			// - As defense-in-depth, if truncatedToken didn't find a stop token
-			// remove the extra one that we added to the cache len
-			tokenLen := len(seq.cache.Inputs) + 1
-			tokenLen -= origLen - newLen
-			if tokenTruncated || origLen == newLen {
-				tokenLen--
+		seq.inputs = nil
+		for _, token := range tokens {
+			piece := s.model.TokenToPiece(token)
+
+			seq.numPredicted++
+
+			// if it's an end of sequence token, break
+			if s.model.TokenIsEog(token) {
+				// TODO (jmorganca): we should send this back
+				// as it's important for the /api/generate context
+				// seq.responses <- piece
+
+				s.removeSequence(i, "stop")
+				break
 			}
-			seq.cache.Inputs = seq.cache.Inputs[:tokenLen]
 
-			s.removeSequence(i, "stop")
-			continue
-		}
+			seq.inputs = append(seq.inputs, input{token: token})
 
-		if containsStopSuffix(sequence, seq.stop) {
-			continue
-		}
+			seq.pendingResponses = append(seq.pendingResponses, piece)
+			sequence := strings.Join(seq.pendingResponses, "")
 
-		if incompleteUnicode(sequence) {
-			continue
-		}
+			// the sampled token is the only one when log-probabilities are returned
+			if seq.logprobs {
+				lp := api.Logprob{TokenLogprob: tokenLogprob(piece, sampledLogprobs[j].Logprob)}
+				for _, t := range sampledLogprobs[j].Top {
+					lp.TopLogprobs = append(lp.TopLogprobs, tokenLogprob(s.model.TokenToPiece(t.Token), t.Logprob))
+				}
+				seq.pendingLogprobs = append(seq.pendingLogprobs, lp)
+			}
 
-		if !flushPending(seq) {
-			s.removeSequence(i, "connection")
+			if ok, stop := findStop(sequence, seq.stop); ok {
+				slog.Debug("hit stop token", "pending", seq.pendingResponses, "stop", stop)
+
+				var tokenTruncated bool
+				origLen := len(seq.pendingResponses)
+				seq.pendingResponses, tokenTruncated = truncateStop(seq.pendingResponses, stop)
+				newLen := len(seq.pendingResponses)
+				if len(seq.pendingLogprobs) > newLen {
+					seq.pendingLogprobs = seq.pendingLogprobs[:newLen]
+				}
+
+				// Update the cache based on the tokens that will be returned
+				tokenLen := stopCacheLen(len(seq.cache.Inputs), len(seq.inputs), origLen, newLen, tokenTruncated)
+				seq.cache.Inputs = seq.cache.Inputs[:tokenLen]
+
+				s.removeSequence(i, "stop")
+				break
+			}
+
+			if containsStopSuffix(sequence, seq.stop) {
+				continue
+			}
+
+			if incompleteUnicode(sequence) {
+				continue
+			}
+
+			if !flushPending(seq) {
+				s.removeSequence(i, "connection")
+				break
+			}
 		}
 	}
 
@@ -576,6 +681,8 @@ type CompletionRequest struct {
 	Images      []ImageData `json:"image_data"`
 	Grammar     string      `json:"grammar"`
 	CachePrompt bool        `json:"cache_prompt"`
+	Logprobs    bool        `json:"logprobs"`
+	TopLogprobs int         `json:"top_logprobs"`
 
 	Options
 }
@@ -588,8 +695,9 @@ type Timings struct {
 }
 
 type CompletionResponse struct {
-	Content string `json:"content"`
-	Stop    bool   `json:"stop"`
+	Content  string        `json:"content"`
+	Logprobs []api.Logprob `json:"logprobs,omitempty"`
+	Stop     bool          `json:"stop"`
 
 	Model        string  `json:"model,omitempty"`
 	Prompt       string  `json:"prompt,omitempty"`
@@ -643,6 +751,8 @@ func (s *Server) completion(w http.ResponseWriter, r *http.Request) {
 		numKeep:        req.NumKeep,
 		samplingParams: &samplingParams,
 		embedding:      false,
+		logprobs:       req.Logprobs,
+		topLogprobs:    req.TopLogprobs,
 	})
 	if err != nil {
 		http.Error(w, fmt.Sprintf("Failed to create new sequence: %v", err), http.StatusInternalServerError)
@@ -690,11 +800,9 @@ func (s *Server) completion(w http.ResponseWriter, r *http.Request) {
 		case <-r.Context().Done():
 			close(seq.quit)
 			return
-		case content, ok := <-seq.responses:
+		case resp, ok := <-seq.responses:
 			if ok {
-				if err := json.NewEncoder(w).Encode(&CompletionResponse{
-					Content: content,
-				}); err != nil {
+				if err := json.NewEncoder(w).Encode(&resp); err != nil {
 					http.Error(w, fmt.Sprintf("failed to encode response: %v", err), http.StatusInternalServerError)
 					close(seq.quit)
 					return
@@ -845,16 +953,26 @@ func (s *Server) loadModel(
 	flashAttention bool,
 	threads int,
 	multiUserCache bool,
+	kvBlockSize int,
+	numa string,
+	prefixCacheDir string,
+	prefixCacheSize int64,
 ) {
 	llama.BackendInit()
 
+	if numa != "" {
+		if err := llama.NumaInit(numa); err != nil {
+			panic(err)
+		}
+	}
+
 	var err error
 	s.model, err = llama.LoadModelFromFile(mpath, params)
 	if err != nil {
 		panic(err)
 	}
 
-	ctxParams := llama.NewContextParams(kvSize, s.batchSize*s.parallel, s.parallel, threads, flashAttention, kvCacheType)
+	ctxParams := llama.NewContextParams(kvSize, s.batchSize*s.parallel, s.parallel, threads, flashAttention, kvCacheType, kvBlockSize)
 	s.lc, err = llama.NewContextWithModel(s.model, ctxParams)
 	if err != nil {
 		panic(err)
@@ -877,7 +995,16 @@ func (s *Server) loadModel(
 		}
 	}
 
-	s.cache, err = NewInputCache(s.lc, kvSize, s.parallel, multiUserCache)
+	var disk *diskCache
+	if prefixCacheDir != "" {
+		disk, err = newDiskCache(diskCacheDir(prefixCacheDir, mpath, lpath, kvCacheType, flashAttention), prefixCacheSize)
+		if err != nil {
+			slog.Warn("disk cache disabled", "error", err)
+			disk = nil
+		}
+	}
+
+	s.cache, err = NewInputCache(s.lc, kvSize, s.parallel, multiUserCache, kvBlockSize > 0, disk)
 	if err != nil {
 		panic(err)
 	}
@@ -907,6 +1034,13 @@ func Execute(args []string) error {
 	mlock := fs.Bool("mlock", false, "force system to keep model in RAM rather than swapping or compressing")
 	tensorSplit := fs.String("tensor-split", "", "fraction of the model to offload to each GPU, comma-separated list of proportions")
 	multiUserCache := fs.Bool("multiuser-cache", false, "optimize input cache algorithm for multiple users")
+	kvBlockSize := fs.Int("kv-block-size", 0, "share the KV cache between parallel sequences in blocks of this many cells (default: 0, disabled)")
+	numa := fs.String("numa", "", "NUMA strategy: distribute, isolate, numactl or interleave (default: disabled)")
+	prefixCacheDir := fs.String("prefix-cache-dir", "", "directory to store the KV cache of evicted prompt prefixes in (default: disabled)")
+	prefixCacheSize := fs.Int64("prefix-cache-size", 10<<30, "maximum size in bytes of the prompt prefixes stored for the model")
+	layerCacheSize := fs.Uint64("layer-cache-size", 0, "read the layers on the CPU on demand, keeping at most this many bytes of them in memory (default: 0, disabled)")
+	loadThreads := fs.Int("load-threads", 0, "number of threads to read the model weights with (default: 0, up to 8)")
+	directIO := fs.Bool("direct-io", false, "read the model weights past the page cache when not using mmap")
 
 	var lpaths multiLPath
 	fs.Var(&lpaths, "lora", "Path to lora layer file (can be specified multiple times)")
@@ -946,6 +1080,19 @@ func Execute(args []string) error {
 		status:    ServerStatusLoadingModel,
 	}
 
+	server.grammars = newGrammarCache(grammarCacheSize, func(grammar string) (*llama.Grammar, error) {
+		g, err := llama.NewGrammar(server.model, grammar)
+		if err != nil {
+			return nil, err
+		}
+
+		// in the background, so that the first request using the grammar does
+		// not wait for it
+		go g.Precompute()
+
+		return g, nil
+	})
+
 	var tensorSplitFloats []float32
 	if *tensorSplit != "" {
 		stringFloats := regexp.MustCompile(",").Split(*tensorSplit, -1)
@@ -958,18 +1105,21 @@ func Execute(args []string) error {
 	}
 
 	params := llama.ModelParams{
-		NumGpuLayers: *nGpuLayers,
-		MainGpu:      *mainGpu,
-		UseMmap:      !*noMmap && lpaths.String() == "",
-		UseMlock:     *mlock,
-		TensorSplit:  tensorSplitFloats,
+		NumGpuLayers:   *nGpuLayers,
+		MainGpu:        *mainGpu,
+		UseMmap:        !*noMmap && lpaths.String() == "",
+		UseMlock:       *mlock,
+		TensorSplit:    tensorSplitFloats,
+		LayerCacheSize: *layerCacheSize,
+		LoadThreads:    *loadThreads,
+		DirectIO:       *directIO,
 		Progress: func(progress float32) {
 			server.progress = progress
 		},
 	}
 
 	server.ready.Add(1)
-	go server.loadModel(params, *mpath, lpaths, *ppath, *kvSize, *kvCacheType, *flashAttention, *threads, *multiUserCache)
+	go server.loadModel(params, *mpath, lpaths, *ppath, *kvSize, *kvCacheType, *flashAttention, *threads, *multiUserCache, *kvBlockSize, *numa, *prefixCacheDir, *prefixCacheSize)
 
 	server.cond = sync.NewCond(&server.mu)
 
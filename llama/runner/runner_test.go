@@ -0,0 +1,50 @@
+package runner
+
+import (
+	"reflect"
+	"testing"
+	"unicode/utf8"
+
+	"github.com/ollama/ollama/api"
+)
+
+func TestTokenLogprob(t *testing.T) {
+	tests := []struct {
+		name     string
+		piece    string
+		expected api.TokenLogprob
+	}{
+		{
+			name:     "ASCII",
+			piece:    "hi",
+			expected: api.TokenLogprob{Token: "hi", Logprob: -0.5, Bytes: []int{'h', 'i'}},
+		},
+		{
+			name:     "Character",
+			piece:    "é",
+			expected: api.TokenLogprob{Token: "é", Logprob: -0.5, Bytes: []int{0xc3, 0xa9}},
+		},
+		{
+			name:     "Partial character",
+			piece:    "a\xe2\x82",
+			expected: api.TokenLogprob{Token: "a�", Logprob: -0.5, Bytes: []int{'a', 0xe2, 0x82}},
+		},
+		{
+			name:     "Continuation bytes",
+			piece:    "\xac",
+			expected: api.TokenLogprob{Token: "�", Logprob: -0.5, Bytes: []int{0xac}},
+		},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			lp := tokenLogprob(tt.piece, -0.5)
+			if !reflect.DeepEqual(lp, tt.expected) {
+				t.Errorf("tokenLogprob(%q) = %+v, want %+v", tt.piece, lp, tt.expected)
+			}
+			if !utf8.ValidString(lp.Token) {
+				t.Errorf("tokenLogprob(%q) token %q is not valid UTF-8", tt.piece, lp.Token)
+			}
+		})
+	}
+}
@@ -65,6 +65,27 @@ func truncateStop(pieces []string, stop string) ([]string, bool) {
 	return result, tokenTruncated
 }
 
+// stopCacheLen returns how many of the cached inputs to keep after
+// truncateStop reduced origLen pending pieces to newLen, with queued inputs
+// that have not been decoded yet
+func stopCacheLen(cached, queued, origLen, newLen int, tokenTruncated bool) int {
+	// - We have as many tokens more than are currently in the cache
+	// as there are inputs, as they weren't submitted to Decode
+	// - Remove any stop sequences that we stripped out
+	// - If truncateStop removed a portion of a token, drop that
+	// - As defense-in-depth, if truncatedToken didn't find a stop token
+	// remove the extra one that we added to the cache len
+	tokenLen := cached + queued
+	tokenLen -= origLen - newLen
+	if tokenTruncated || origLen == newLen {
+		tokenLen--
+	}
+
+	// - The queued inputs are never in the cache, even if the stop
+	// sequence ends in a forced token after the first one
+	return max(min(tokenLen, cached), 0)
+}
+
 func incompleteUnicode(token string) bool {
 	incomplete := false
 
@@ -60,6 +60,70 @@ func TestTruncateStop(t *testing.T) {
 	}
 }
 
+func TestStopCacheLen(t *testing.T) {
+	tests := []struct {
+		name     string
+		cached   int
+		pieces   []string
+		queued   int
+		stop     string
+		expected int
+	}{
+		{
+			name:     "Sampled token",
+			cached:   5,
+			pieces:   []string{"hello", " world"},
+			queued:   1,
+			stop:     "world",
+			expected: 5,
+		},
+		{
+			name:     "Partial sampled token",
+			cached:   5,
+			pieces:   []string{"hello", " wor"},
+			queued:   1,
+			stop:     "or",
+			expected: 5,
+		},
+		{
+			name:     "Decoded token",
+			cached:   5,
+			pieces:   []string{"hello", " world"},
+			queued:   1,
+			stop:     "llo world",
+			expected: 4,
+		},
+		{
+			// the sampled token and a forced one are queued, the stop ends
+			// inside the forced one
+			name:     "Forced token",
+			cached:   2,
+			pieces:   []string{`{"`, "name"},
+			queued:   2,
+			stop:     "na",
+			expected: 2,
+		},
+		{
+			name:     "Later forced token",
+			cached:   2,
+			pieces:   []string{`{"`, "name", `":`, ` "`},
+			queued:   4,
+			stop:     `": `,
+			expected: 2,
+		},
+	}
+
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			truncated, tokenTruncated := truncateStop(tt.pieces, tt.stop)
+			result := stopCacheLen(tt.cached, tt.queued, len(tt.pieces), len(truncated), tokenTruncated)
+			if result != tt.expected {
+				t.Errorf("stopCacheLen(%d, %d, %v, %s): have %d; want %d", tt.cached, tt.queued, tt.pieces, tt.stop, result, tt.expected)
+			}
+		})
+	}
+}
+
 func TestIncompleteUnicode(t *testing.T) {
 	tests := []struct {
 		name     string
@@ -28,9 +28,16 @@
 
 #include "common.h"
 
+#include <algorithm>
 #include <cmath>
 #include <unordered_map>
 
+// with a larger top-k the heap of candidates is updated for too many tokens, the full array is sorted instead
+#define COMMON_SAMPLER_SPARSE_MAX_K 256
+
+// logits are checked against the k-th highest one in blocks of this many
+#define COMMON_SAMPLER_SPARSE_BLOCK 64
+
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
 template<typename T>
@@ -124,6 +131,68 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+void common_logits_top_k(const float * logits, int n_vocab, int k, const std::vector<llama_token_data> & adjusted, std::vector<llama_token_data> & result) {
+    // min-heap of the k highest logits
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) { return a.logit > b.logit; };
+
+    result.clear();
+    result.reserve(k);
+
+    float threshold = -INFINITY;
+
+    const auto push = [&](llama_token id, float logit) {
+        if ((int) result.size() < k) {
+            result.push_back({ id, logit, 0.0f });
+            std::push_heap(result.begin(), result.end(), cmp);
+        } else if (logit > threshold) {
+            std::pop_heap(result.begin(), result.end(), cmp);
+            result.back() = { id, logit, 0.0f };
+            std::push_heap(result.begin(), result.end(), cmp);
+        } else {
+            return;
+        }
+        if ((int) result.size() == k) {
+            threshold = result.front().logit;
+        }
+    };
+
+    for (const auto & td : adjusted) {
+        push(td.id, td.logit);
+    }
+
+    size_t next_adjusted = 0;
+
+    for (int i0 = 0; i0 < n_vocab; i0 += COMMON_SAMPLER_SPARSE_BLOCK) {
+        const int i1 = std::min(i0 + COMMON_SAMPLER_SPARSE_BLOCK, n_vocab);
+
+        // once the heap is full, most blocks have no logit above the threshold
+        if ((int) result.size() == k) {
+            int n_above = 0;
+            for (int i = i0; i < i1; ++i) {
+                n_above += logits[i] > threshold;
+            }
+            if (n_above == 0) {
+                continue;
+            }
+        }
+
+        for (int i = i0; i < i1; ++i) {
+            if ((int) result.size() == k && !(logits[i] > threshold)) {
+                continue;
+            }
+            while (next_adjusted < adjusted.size() && adjusted[next_adjusted].id < i) {
+                next_adjusted++;
+            }
+            if (next_adjusted < adjusted.size() && adjusted[next_adjusted].id == i) {
+                continue;
+            }
+            push(i, logits[i]);
+        }
+    }
+
+    std::sort_heap(result.begin(), result.end(), cmp);
+}
+
 struct common_sampler {
     common_params_sampling params;
 
@@ -136,10 +205,53 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // if > 0, the top-k candidates are selected directly from the logits and the chain is applied from
+    // sparse_from, see set_logits_top_k
+    int32_t sparse_k    = 0;
+    int32_t sparse_from = 0;
+
+    // tokens whose logits are changed by the samplers before top-k
+    std::vector<llama_token_data> adjusted;
+
+    // keeps only the top-k candidates in cur, without filling an entry for each token of the vocab. the samplers
+    // before top-k (logit bias, penalties) only change the logits of the biased tokens and of the tokens in the
+    // penalty window, so they are applied to those tokens alone, and their logits replace the ones from the model
+    // during the selection
+    void set_logits_top_k(const struct llama_model * model, const float * logits) {
+        const int n_vocab = llama_n_vocab(model);
+        const int k       = sparse_k;
+
+        adjusted.clear();
+        for (const auto & lb : params.logit_bias) {
+            if (lb.token >= 0 && lb.token < n_vocab) {
+                adjusted.push_back({ lb.token, logits[lb.token], 0.0f });
+            }
+        }
+        for (int i = 0; i < std::min<int>(params.penalty_last_n, prev.size()); ++i) {
+            const llama_token id = prev.rat(i);
+            adjusted.push_back({ id, logits[id], 0.0f });
+        }
+        if (params.ignore_eos && llama_token_eos(model) >= 0) {
+            adjusted.push_back({ llama_token_eos(model), logits[llama_token_eos(model)], 0.0f });
+        }
 
-        const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+        std::sort(adjusted.begin(), adjusted.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.id < b.id; });
+        adjusted.erase(std::unique(adjusted.begin(), adjusted.end(), [](const llama_token_data & a, const llama_token_data & b) { return a.id == b.id; }), adjusted.end());
+
+        {
+            llama_token_data_array adjusted_p = { adjusted.data(), adjusted.size(), -1, false };
+            for (int i = 0; i < sparse_from - 1; ++i) {
+                llama_sampler_apply(llama_sampler_chain_get(chain, i), &adjusted_p);
+            }
+        }
+
+        common_logits_top_k(logits, n_vocab, k, adjusted, cur);
+
+        cur_p = { cur.data(), cur.size(), -1, true };
+    }
+
+    void set_logits(const struct llama_model * model, const float * logits) {
+        const int n_vocab = llama_n_vocab(model);
 
         cur.resize(n_vocab);
 
@@ -174,13 +286,22 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
 
     auto * result = new common_sampler {
         /* .params = */ params,
-        /* .grmr   = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
+        /* .grmr   = */ params.grammar_compiled ? llama_sampler_clone(params.grammar_compiled) : llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
         /* .chain  = */ llama_sampler_chain_init(lparams),
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+
+        /* .sparse_k    = */ 0,
+        /* .sparse_from = */ 0,
+        /* .adjusted    = */ {},
     };
 
+    // the ring buffer of the sampler also holds the penalty window, for the top-k selection
+    if (params.penalty_last_n > (int32_t) result->prev.capacity) {
+        result->prev = ring_buffer<llama_token>(params.penalty_last_n);
+    }
+
     llama_sampler_chain_add(result->chain,
             llama_sampler_init_logit_bias(
                 llama_n_vocab(model),
@@ -239,6 +360,21 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
             }
         }
         llama_sampler_chain_add(result->chain, llama_sampler_init_dist(params.seed));
+
+        // the top-k candidates can be selected from the logits if no other sampler needs the whole vocab before
+        const bool dry_disabled = params.dry_multiplier == 0.0f || params.dry_base < 1.0f || params.dry_penalty_last_n == 0;
+        if (params.top_k > 0 && params.top_k <= COMMON_SAMPLER_SPARSE_MAX_K && params.top_k < llama_n_vocab(model)) {
+            for (size_t i = 0; i < params.samplers.size(); i++) {
+                if (params.samplers[i] == COMMON_SAMPLER_TYPE_TOP_K) {
+                    result->sparse_k    = params.top_k;
+                    result->sparse_from = (int32_t) i + 3; // after logit bias, penalties and top-k
+                    break;
+                }
+                if (params.samplers[i] != COMMON_SAMPLER_TYPE_DRY || !dry_disabled) {
+                    break;
+                }
+            }
+        }
     } else if (params.mirostat == 1) {
         llama_sampler_chain_add(result->chain, llama_sampler_init_temp(params.temp));
         llama_sampler_chain_add(result->chain, llama_sampler_init_mirostat(llama_n_vocab(model), params.seed, params.mirostat_tau, params.mirostat_eta, 100));
@@ -286,6 +422,10 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+
+        /* .sparse_k    = */ gsmpl->sparse_k,
+        /* .sparse_from = */ gsmpl->sparse_from,
+        /* .adjusted    = */ {},
     };
 }
 
@@ -301,17 +441,29 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    return common_sampler_sample_logits(gsmpl, llama_get_model(ctx), llama_get_logits_ith(ctx, idx), grammar_first);
+}
 
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const struct llama_model * model, const float * logits, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
     auto & cur_p = gsmpl->cur_p; // initialized by set_logits
 
-    if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
-    }
+    if (gsmpl->sparse_k > 0 && !grammar_first) {
+        gsmpl->set_logits_top_k(model, logits);
 
-    llama_sampler_apply(chain, &cur_p);
+        for (int i = gsmpl->sparse_from; i < llama_sampler_chain_n(chain); i++) {
+            llama_sampler_apply(llama_sampler_chain_get(chain, i), &cur_p);
+        }
+    } else {
+        gsmpl->set_logits(model, logits);
+
+        if (grammar_first) {
+            llama_sampler_apply(grmr, &cur_p);
+        }
+
+        llama_sampler_apply(chain, &cur_p);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
@@ -336,7 +488,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(model, logits);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -399,6 +551,15 @@ llama_token common_sampler_last(const struct common_sampler * gsmpl) {
     return gsmpl->prev.rat(0);
 }
 
+std::vector<llama_token> common_sampler_forced_tokens(const struct common_sampler * gsmpl, int n_max) {
+    std::vector<llama_token> result(std::max(n_max, 0));
+
+    const int32_t n = llama_sampler_grammar_forced_tokens(gsmpl->grmr, result.data(), result.size());
+    result.resize(n);
+
+    return result;
+}
+
 std::string common_sampler_print(const struct common_sampler * gsmpl) {
     std::string result = "logits ";
 
@@ -86,6 +86,10 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// same as common_sampler_sample, with the logits of the output already fetched from the context, so that
+// different samplers can sample the outputs of the same batch concurrently
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, const struct llama_model * model, const float * logits, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -111,12 +115,19 @@ uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
 
+// selects the k highest logits of the vocab in result, in descending order, with the tokens in adjusted (sorted by
+// id) taking their logits from there instead
+void common_logits_top_k(const float * logits, int n_vocab, int k, const std::vector<llama_token_data> & adjusted, std::vector<llama_token_data> & result);
+
 // access the internal list of current candidate tokens
 llama_token_data_array * common_sampler_get_candidates(struct common_sampler * gsmpl);
 
 // get the last accepted token
 llama_token common_sampler_last(const struct common_sampler * gsmpl);
 
+// get the tokens that the grammar (if any) forces next, without accepting them
+std::vector<llama_token> common_sampler_forced_tokens(const struct common_sampler * gsmpl, int n_max);
+
 // print the sampler chain into a string
 std::string common_sampler_print(const struct common_sampler * gsmpl);
 
@@ -2,6 +2,11 @@
 #include "sampling.h"
 #include "sampling_ext.h"
 #include "json-schema-to-grammar.h"
+#include "unicode.h"
+#include "ggml-cpu.h"
+
+#include <atomic>
+#include <thread>
 
 struct common_sampler *common_sampler_cinit(const struct llama_model *model, struct common_sampler_cparams *params) {
     try {
@@ -21,6 +26,7 @@ struct common_sampler *common_sampler_cinit(const struct llama_model *model, str
         sparams.penalize_nl = params->penalize_nl;
         sparams.seed = params->seed;
         sparams.grammar = params->grammar;
+        sparams.grammar_compiled = params->grammar_compiled;
         sparams.xtc_probability = 0.0;
         sparams.xtc_threshold = 0.5;
         return common_sampler_init(model, sparams);
@@ -45,6 +51,86 @@ llama_token common_sampler_csample(struct common_sampler *sampler, struct llama_
     return common_sampler_sample(sampler, ctx, idx);
 }
 
+// smallest number of logits worth sampling on a thread of its own, as starting the thread costs about as much as
+// sampling a few tens of thousands of them
+static const int64_t min_logits_per_thread = 64 * 1024;
+
+void common_sampler_csample_batch(struct common_sampler **samplers, struct llama_context *ctx, const int *idxs, int n, int n_threads, llama_token *tokens,
+                                  const int *n_top, int max_top, float *logprobs, llama_token *top_tokens, float *top_logprobs)
+{
+    const struct llama_model *model = llama_get_model(ctx);
+    const int n_vocab = llama_n_vocab(model);
+
+    // fetched up front, as getting them from the context waits for the computation and updates its stats
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; i++)
+    {
+        logits[i] = llama_get_logits_ith(ctx, idxs[i]);
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]()
+    {
+        std::vector<llama_token_data> top;
+
+        for (int i = next++; i < n; i = next++)
+        {
+            tokens[i] = common_sampler_sample_logits(samplers[i], model, logits[i]);
+            common_sampler_accept(samplers[i], tokens[i], true);
+
+            if (n_top == nullptr || n_top[i] < 0)
+            {
+                continue;
+            }
+
+            // the highest logit comes with the top tokens, so the log-sum-exp only needs one more pass
+            const int k = std::max(std::min(n_top[i], max_top), 1);
+            common_logits_top_k(logits[i], n_vocab, k, {}, top);
+
+            const float max = top[0].logit;
+            const float lse = max + std::log(ggml_cpu_sum_exp_f32(n_vocab, logits[i], max));
+
+            logprobs[i] = logits[i][tokens[i]] - lse;
+            for (int j = 0; j < std::min<int>(n_top[i], top.size()); j++)
+            {
+                top_tokens[i * max_top + j] = top[j].id;
+                top_logprobs[i * max_top + j] = top[j].logit - lse;
+            }
+        }
+    };
+
+    const int64_t n_workers = std::min<int64_t>({n_threads, n, (int64_t)n * n_vocab / min_logits_per_thread});
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n_workers; t++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+}
+
+int common_sampler_cforced_tokens(struct common_sampler *sampler, llama_token *tokens, int max_tokens) {
+    std::vector<llama_token> forced = common_sampler_forced_tokens(sampler, max_tokens);
+    std::copy(forced.begin(), forced.end(), tokens);
+    return forced.size();
+}
+
+struct llama_sampler *grammar_compile(const struct llama_model *model, const char *grammar)
+{
+    try
+    {
+        return llama_sampler_init_grammar(model, grammar, "root");
+    }
+    catch (const std::exception &e)
+    {
+        return nullptr;
+    }
+}
+
 int schema_to_grammar(const char *json_schema, char *grammar, size_t max_len)
 {
     try
@@ -65,3 +151,24 @@ int schema_to_grammar(const char *json_schema, char *grammar, size_t max_len)
         return 0;
     }
 }
+
+int regex_split(const char *text, const char **regex_exprs, int n_regex_exprs, bool use_dfa, int *lens, int max_lens)
+{
+    try
+    {
+        std::vector<std::string> words = unicode_regex_split(text, std::vector<std::string>(regex_exprs, regex_exprs + n_regex_exprs), use_dfa);
+        if (words.size() > (size_t)max_lens)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            lens[i] = words[i].size();
+        }
+        return words.size();
+    }
+    catch (const std::exception &e)
+    {
+        return -1;
+    }
+}
@@ -10,6 +10,7 @@ extern "C"
     // Forward declaration to avoid include of "sampling.h" which has c++
     // includes
     struct common_sampler;
+    struct llama_sampler;
     struct common_sampler_cparams {
         int32_t top_k;
         float top_p;
@@ -26,6 +27,7 @@ extern "C"
         bool penalize_nl;
         uint32_t seed;
         char *grammar;
+        struct llama_sampler *grammar_compiled;
     };
 
     struct common_sampler *common_sampler_cinit(const struct llama_model *model, struct common_sampler_cparams *params);
@@ -34,8 +36,25 @@ extern "C"
     void common_sampler_caccept(struct common_sampler *sampler, llama_token id, bool apply_grammar);
     llama_token common_sampler_csample(struct common_sampler *sampler, struct llama_context *ctx, int idx);
 
+    // samples and accepts a token for each of the n samplers from the output idxs[i] of the last batch, on up to
+    // n_threads threads when there are enough logits to sample. if n_top is not NULL and n_top[i] >= 0, logprobs[i] receives the log-probability of the
+    // token under the model, and top_tokens and top_logprobs, from i * max_top, the n_top[i] most likely tokens
+    void common_sampler_csample_batch(struct common_sampler **samplers, struct llama_context *ctx, const int *idxs, int n, int n_threads, llama_token *tokens,
+                                      const int *n_top, int max_top, float *logprobs, llama_token *top_tokens, float *top_logprobs);
+
+    // writes up to max_tokens tokens forced by the grammar into tokens, returns how many
+    int common_sampler_cforced_tokens(struct common_sampler *sampler, llama_token *tokens, int max_tokens);
+
     int schema_to_grammar(const char *json_schema, char *grammar, size_t max_len);
 
+    // splits text into words with the regexes of a pre-tokenizer, writing the length of each word as encoded
+    // for the tokenizer into lens. the regexes are compiled to a DFA, or run with std::regex if use_dfa is false.
+    // returns the number of words, or -1 on error or if there are more than max_lens
+    int regex_split(const char *text, const char **regex_exprs, int n_regex_exprs, bool use_dfa, int *lens, int max_lens);
+
+    // parses a grammar once for the sampling contexts created with it, free with llama_sampler_free
+    struct llama_sampler *grammar_compile(const struct llama_model *model, const char *grammar);
+
 #ifdef __cplusplus
 }
 #endif
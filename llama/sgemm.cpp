@@ -1030,6 +1030,257 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+#if defined(__AVX2__)
+template <typename TA>
+class tinyBLAS_K_AVX2 {
+  public:
+    tinyBLAS_K_AVX2(int64_t k,
+                    const TA *A, int64_t lda,
+                    const block_q8_K *B, int64_t ldb,
+                    float *C, int64_t ldc,
+                    int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n) {
+        mnpack(0, m, 0, n);
+    }
+
+  private:
+    void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t mc, nc, mp, np;
+        switch ((MIN(m - m0, 4) << 4) | MIN(n - n0, 4)) {
+        case 0x44:
+        case 0x43:
+        case 0x42:
+            mc = 4;
+            nc = 2;
+            gemm<4, 2>(m0, m, n0, n);
+            break;
+        case 0x34:
+        case 0x24:
+            mc = 2;
+            nc = 4;
+            gemm<2, 4>(m0, m, n0, n);
+            break;
+        case 0x33:
+        case 0x32:
+            mc = 3;
+            nc = 2;
+            gemm<3, 2>(m0, m, n0, n);
+            break;
+        case 0x23:
+            mc = 2;
+            nc = 3;
+            gemm<2, 3>(m0, m, n0, n);
+            break;
+        case 0x41:
+            mc = 4;
+            nc = 1;
+            gemm<4, 1>(m0, m, n0, n);
+            break;
+        case 0x22:
+            mc = 2;
+            nc = 2;
+            gemm<2, 2>(m0, m, n0, n);
+            break;
+        case 0x14:
+            mc = 1;
+            nc = 4;
+            gemm<1, 4>(m0, m, n0, n);
+            break;
+        case 0x31:
+            mc = 3;
+            nc = 1;
+            gemm<3, 1>(m0, m, n0, n);
+            break;
+        case 0x13:
+            mc = 1;
+            nc = 3;
+            gemm<1, 3>(m0, m, n0, n);
+            break;
+        case 0x21:
+            mc = 2;
+            nc = 1;
+            gemm<2, 1>(m0, m, n0, n);
+            break;
+        case 0x12:
+            mc = 1;
+            nc = 2;
+            gemm<1, 2>(m0, m, n0, n);
+            break;
+        case 0x11:
+            mc = 1;
+            nc = 1;
+            gemm<1, 1>(m0, m, n0, n);
+            break;
+        default:
+            return;
+        }
+        mp = m0 + (m - m0) / mc * mc;
+        np = n0 + (n - n0) / nc * nc;
+        mnpack(mp, m, n0, np);
+        mnpack(m0, m, np, n);
+    }
+
+    // The integer dot products of a super-block are accumulated with their
+    // sub-block scales applied, so the float accumulators are only touched
+    // once per QK_K values. The mins (or the offset of 32 for Q6_K) are
+    // applied separately through the block sums of B.
+    template <int RM, int RN>
+    NOINLINE void gemm(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        int64_t ytiles = (m - m0) / RM;
+        int64_t xtiles = (n - n0) / RN;
+        int64_t tiles = xtiles * ytiles;
+        int64_t duty = (tiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > tiles)
+            end = tiles;
+        for (int64_t job = start; job < end; ++job) {
+            int64_t ii = m0 + job / xtiles * RM;
+            int64_t jj = n0 + job % xtiles * RN;
+            __m256 Cv[RN][RM] = {};
+            for (int64_t l = 0; l < k; ++l) {
+                uint8_t sc[RM][16];
+                for (int64_t i = 0; i < RM; ++i)
+                    unpack(A + lda * (ii + i) + l, sc[i]);
+                __m256i sumi[RN][RM] = {};
+                for (int c = 0; c < QK_K / 32; ++c) {
+                    __m256i bv[RN];
+                    for (int64_t j = 0; j < RN; ++j)
+                        bv[j] = _mm256_loadu_si256((const __m256i *)(B[ldb * (jj + j) + l].qs + 32 * c));
+                    for (int64_t i = 0; i < RM; ++i) {
+                        const __m256i av = load(A + lda * (ii + i) + l, c);
+                        const __m256i scale = scales(A + lda * (ii + i) + l, sc[i], c);
+                        for (int64_t j = 0; j < RN; ++j)
+                            sumi[j][i] = _mm256_add_epi32(sumi[j][i],
+                                                          _mm256_madd_epi16(scale, _mm256_maddubs_epi16(av, bv[j])));
+                    }
+                }
+                for (int64_t j = 0; j < RN; ++j)
+                    for (int64_t i = 0; i < RM; ++i) {
+                        const TA *a = A + lda * (ii + i) + l;
+                        const block_q8_K *b = B + ldb * (jj + j) + l;
+                        Cv[j][i] = madd(_mm256_set1_ps(unhalf(a->d) * b->d),
+                                        _mm256_cvtepi32_ps(sumi[j][i]), Cv[j][i]);
+                        Cv[j][i] = madd(_mm256_set1_ps(-dmin(a) * b->d),
+                                        _mm256_cvtepi32_ps(bias(a, sc[i], b)), Cv[j][i]);
+                    }
+            }
+            for (int64_t j = 0; j < RN; ++j)
+                for (int64_t i = 0; i < RM; ++i)
+                    C[ldc * (jj + j) + (ii + i)] = hsum(Cv[j][i]);
+        }
+    }
+
+    // 6-bit scales of the sub-blocks in bytes 0-7 and their mins in bytes 8-15
+    static inline void unpack_scales(const uint8_t *q, uint8_t *sc) {
+        const uint32_t kmask1 = 0x3f3f3f3f;
+        const uint32_t kmask2 = 0x0f0f0f0f;
+        const uint32_t kmask3 = 0x03030303;
+        uint32_t utmp[4];
+        memcpy(utmp, q, 12);
+        utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+        const uint32_t uaux = utmp[1] & kmask1;
+        utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+        utmp[2] = uaux;
+        utmp[0] &= kmask1;
+        memcpy(sc, utmp, 16);
+    }
+
+    inline void unpack(const block_q4_K *b, uint8_t *sc) {
+        unpack_scales(b->scales, sc);
+    }
+
+    inline void unpack(const block_q5_K *b, uint8_t *sc) {
+        unpack_scales(b->scales, sc);
+    }
+
+    inline void unpack(const block_q6_K *b, uint8_t *sc) {
+        memcpy(sc, b->scales, 16);
+    }
+
+    // the c-th 32 quants of a super-block, unsigned
+    inline __m256i load(const block_q4_K *b, int c) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(b->qs + 32 * (c / 2)));
+        return _mm256_and_si256(_mm256_srli_epi16(x, 4 * (c % 2)), _mm256_set1_epi8(15));
+    }
+
+    inline __m256i load(const block_q5_K *b, int c) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(b->qs + 32 * (c / 2)));
+        const __m256i h = _mm256_loadu_si256((const __m256i *)b->qh);
+        return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(x, 4 * (c % 2)), _mm256_set1_epi8(15)),
+                               _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(h, c), 4), _mm256_set1_epi8(16)));
+    }
+
+    inline __m256i load(const block_q6_K *b, int c) {
+        const int w = c % 4;
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(b->ql + 64 * (c / 4) + 32 * (w % 2)));
+        const __m256i h = _mm256_loadu_si256((const __m256i *)(b->qh + 32 * (c / 4)));
+        return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(x, 4 * (w / 2)), _mm256_set1_epi8(15)),
+                               _mm256_and_si256(_mm256_slli_epi16(_mm256_srli_epi16(h, 2 * w), 4), _mm256_set1_epi8(48)));
+    }
+
+    // the scales of the c-th 32 quants as 16 words
+    inline __m256i scales(const block_q4_K *, const uint8_t *sc, int c) {
+        return _mm256_set1_epi16(sc[c]);
+    }
+
+    inline __m256i scales(const block_q5_K *, const uint8_t *sc, int c) {
+        return _mm256_set1_epi16(sc[c]);
+    }
+
+    inline __m256i scales(const block_q6_K *, const uint8_t *sc, int c) {
+        return MM256_SET_M128I(_mm_set1_epi16((int8_t)sc[2 * c + 1]), _mm_set1_epi16((int8_t)sc[2 * c]));
+    }
+
+    // what dmin(a) * b->d times the sum of the result is subtracted from the dot product
+    inline __m256i bias(const block_q4_K *, const uint8_t *sc, const block_q8_K *b) {
+        return minsums(sc, b);
+    }
+
+    inline __m256i bias(const block_q5_K *, const uint8_t *sc, const block_q8_K *b) {
+        return minsums(sc, b);
+    }
+
+    inline __m256i bias(const block_q6_K *, const uint8_t *sc, const block_q8_K *b) {
+        const __m256i s = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)sc));
+        const __m256i bsums = _mm256_loadu_si256((const __m256i *)b->bsums);
+        return _mm256_slli_epi32(_mm256_madd_epi16(s, bsums), 5);
+    }
+
+    static inline __m256i minsums(const uint8_t *sc, const block_q8_K *b) {
+        const __m128i mins = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(sc + 8)));
+        const __m128i bsums = _mm_hadd_epi16(_mm_loadu_si128((const __m128i *)b->bsums),
+                                             _mm_loadu_si128((const __m128i *)b->bsums + 1));
+        return MM256_SET_M128I(_mm_setzero_si128(), _mm_madd_epi16(mins, bsums));
+    }
+
+    inline float dmin(const block_q4_K *b) {
+        return unhalf(b->dmin);
+    }
+
+    inline float dmin(const block_q5_K *b) {
+        return unhalf(b->dmin);
+    }
+
+    inline float dmin(const block_q6_K *b) {
+        return unhalf(b->d);
+    }
+
+    const TA *const A;
+    const block_q8_K *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AVX2__
+
 //PPC Implementation
 #if defined(__MMA__)
 
@@ -1863,6 +2114,54 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
 #endif
     }
 
+    case GGML_TYPE_Q4_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_K_AVX2<block_q4_K> tb{
+            k, (const block_q4_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q5_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_K_AVX2<block_q5_K> tb{
+            k, (const block_q5_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    case GGML_TYPE_Q6_K: {
+        if (Btype != GGML_TYPE_Q8_K)
+            return false;
+#if defined(__AVX2__)
+        tinyBLAS_K_AVX2<block_q6_K> tb{
+            k, (const block_q6_K *)A, lda,
+            (const block_q8_K *)B, ldb,
+            (float *)C, ldc,
+            ith, nth};
+        tb.matmul(m, n);
+        return true;
+#else
+        return false;
+#endif
+    }
+
     default:
         return false;
     }
@@ -41,6 +41,8 @@
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -264,22 +266,22 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
 #endif
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
+// appends the UTF-8 bytes of cpts to word, each mapped to the codepoint that
+// represents it in the vocab
+static void unicode_byte_encoding_process(const uint32_t * cpts, size_t n, std::string & word) {
+    static const auto byte_to_utf8 = [] {
+        std::vector<std::string> table(256);
+        for (int ch = 0; ch < 256; ++ch) {
+            table[ch] = unicode_byte_to_utf8(ch);
         }
+        return table;
+    }();
 
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
+    for (size_t i = 0; i < n; ++i) {
+        for (char c : unicode_cpt_to_utf8(cpts[i])) {
+            word += byte_to_utf8[(uint8_t) c];
         }
-        bpe_encoded_words.emplace_back(encoded_token);
     }
-    return bpe_encoded_words;
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
@@ -616,6 +618,754 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string & text,
     return bpe_offsets;
 }
 
+//
+// pre-tokenizer regex engine
+//
+// The patterns without a custom implementation are compiled once into a DFA over
+// classes of codepoints instead of being run through std::regex. The DFA follows
+// the leftmost-first semantics of ECMAScript regexes: a state is the ordered list
+// of NFA threads, and the threads with a lower priority than one that matched
+// are dropped. Lookaheads are limited to a single codepoint, as in \s+(?!\S), and
+// are resolved when that codepoint is read.
+//
+// Codepoints are classified the same way as in the std::regex fallback: \p{..}
+// uses unicode_cpt_flags, \s is ASCII whitespace, and non-ASCII whitespace is
+// treated as \v.
+//
+
+#define UNICODE_REGEX_MAX_SETS   64
+#define UNICODE_REGEX_MAX_INSTS  4096
+#define UNICODE_REGEX_MAX_STATES 4096
+
+// categories of codepoint_flags, and one for codepoints without a category
+#define UNICODE_REGEX_N_CATEGORIES 9
+
+static int unicode_regex_category(uint16_t category_flag) {
+    for (int i = 0; i < 8; ++i) {
+        if (category_flag & (1 << i)) {
+            return i;
+        }
+    }
+    return 8;
+}
+
+static bool unicode_regex_is_space(uint32_t cpt) {
+    return cpt == ' ' || (cpt >= '\t' && cpt <= '\r');
+}
+
+struct unicode_regex_set {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // sorted, inclusive
+    uint16_t categories = 0;
+    bool     whitespace = false;
+    bool     negated    = false;
+
+    bool in_ranges(uint32_t cpt) const {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), cpt,
+            [](uint32_t value, const std::pair<uint32_t, uint32_t> & range) {
+                return value < range.first;
+            });
+        return it != ranges.begin() && cpt <= (it - 1)->second;
+    }
+
+    bool contains(bool in_range, uint16_t category_flag, bool is_space) const {
+        return negated != (in_range || (categories & category_flag) || (whitespace && is_space));
+    }
+
+    bool operator==(const unicode_regex_set & other) const {
+        return ranges == other.ranges && categories == other.categories &&
+               whitespace == other.whitespace && negated == other.negated;
+    }
+};
+
+struct unicode_regex_node {
+    enum type_t { EMPTY, SET, CONCAT, ALT, REPEAT, LOOKAHEAD, END };
+
+    type_t type    = EMPTY;
+    int    set     = -1;    // SET, LOOKAHEAD
+    bool   negated = false; // LOOKAHEAD
+    int    min     = 0;     // REPEAT
+    int    max     = 0;     // REPEAT, -1 if unbounded
+
+    std::vector<unicode_regex_node> children;
+};
+
+struct unicode_regex_inst {
+    enum op_t { MATCH, SET, SPLIT, JMP, ASSERT, ASSERT_NOT, ASSERT_END };
+
+    op_t op;
+    int  set; // SET, ASSERT, ASSERT_NOT
+    int  x;   // SPLIT (preferred), JMP
+    int  y;   // SPLIT
+};
+
+// parses the subset of the ECMAScript syntax used by the pre-tokenizers, throws
+// on anything else
+struct unicode_regex_parser {
+    std::vector<uint32_t> cpts;
+    size_t pos = 0;
+
+    std::vector<unicode_regex_set> sets;
+
+    explicit unicode_regex_parser(const std::string & regex_expr) : cpts(unicode_cpts_from_utf8(regex_expr)) {}
+
+    [[noreturn]] void fail(const char * what) const {
+        throw std::invalid_argument(std::string(what) + " at " + std::to_string(pos));
+    }
+
+    bool at_end() const { return pos >= cpts.size(); }
+
+    uint32_t peek(size_t i = 0) const { return pos + i < cpts.size() ? cpts[pos + i] : 0; }
+
+    int add_set(unicode_regex_set set) {
+        std::sort(set.ranges.begin(), set.ranges.end());
+        std::vector<std::pair<uint32_t, uint32_t>> merged;
+        for (const auto & range : set.ranges) {
+            if (!merged.empty() && range.first <= merged.back().second + 1) {
+                merged.back().second = std::max(merged.back().second, range.second);
+            } else {
+                merged.push_back(range);
+            }
+        }
+        set.ranges = std::move(merged);
+
+        for (size_t i = 0; i < sets.size(); ++i) {
+            if (sets[i] == set) {
+                return i;
+            }
+        }
+        if (sets.size() >= UNICODE_REGEX_MAX_SETS) {
+            fail("too many character classes");
+        }
+        sets.push_back(std::move(set));
+        return sets.size() - 1;
+    }
+
+    unicode_regex_node make_set(unicode_regex_set set) {
+        unicode_regex_node node;
+        node.type = unicode_regex_node::SET;
+        node.set  = add_set(std::move(set));
+        return node;
+    }
+
+    unicode_regex_node parse() {
+        auto node = parse_alt();
+        if (!at_end()) {
+            fail("unexpected character");
+        }
+        return node;
+    }
+
+    unicode_regex_node parse_alt() {
+        unicode_regex_node node;
+        node.type = unicode_regex_node::ALT;
+        node.children.push_back(parse_concat());
+        while (!at_end() && peek() == '|') {
+            ++pos;
+            node.children.push_back(parse_concat());
+        }
+        return node.children.size() == 1 ? std::move(node.children[0]) : node;
+    }
+
+    unicode_regex_node parse_concat() {
+        unicode_regex_node node;
+        node.type = unicode_regex_node::CONCAT;
+        while (!at_end() && peek() != '|' && peek() != ')') {
+            node.children.push_back(parse_repeat());
+        }
+        return node.children.size() == 1 ? std::move(node.children[0]) : node;
+    }
+
+    int parse_int() {
+        if (at_end() || peek() < '0' || peek() > '9') {
+            fail("expected a number");
+        }
+        int n = 0;
+        while (!at_end() && peek() >= '0' && peek() <= '9') {
+            n = n*10 + (cpts[pos++] - '0');
+            if (n > 1000) {
+                fail("repetition too large");
+            }
+        }
+        return n;
+    }
+
+    unicode_regex_node parse_repeat() {
+        auto atom = parse_atom();
+        while (!at_end()) {
+            int min;
+            int max;
+            switch (peek()) {
+                case '*': min = 0; max = -1; ++pos; break;
+                case '+': min = 1; max = -1; ++pos; break;
+                case '?': min = 0; max =  1; ++pos; break;
+                case '{':
+                    ++pos;
+                    min = max = parse_int();
+                    if (peek() == ',') {
+                        ++pos;
+                        max = peek() == '}' ? -1 : parse_int();
+                    }
+                    if (peek() != '}' || (max >= 0 && max < min)) {
+                        fail("invalid repetition");
+                    }
+                    ++pos;
+                    break;
+                default:
+                    return atom;
+            }
+            if (peek() == '?') {
+                fail("lazy quantifiers are not supported");
+            }
+            if (atom.type == unicode_regex_node::LOOKAHEAD || atom.type == unicode_regex_node::END) {
+                fail("quantified assertion");
+            }
+            unicode_regex_node node;
+            node.type = unicode_regex_node::REPEAT;
+            node.min  = min;
+            node.max  = max;
+            node.children.push_back(std::move(atom));
+            atom = std::move(node);
+        }
+        return atom;
+    }
+
+    unicode_regex_node parse_atom() {
+        const uint32_t c = cpts[pos++];
+        switch (c) {
+            case '(':
+                {
+                    bool lookahead = false;
+                    bool negated   = false;
+                    if (peek() == '?') {
+                        if (peek(1) == ':') {
+                            pos += 2;
+                        } else if (peek(1) == '=' || peek(1) == '!') {
+                            lookahead = true;
+                            negated   = peek(1) == '!';
+                            pos += 2;
+                        } else {
+                            fail("unsupported group");
+                        }
+                    }
+                    auto node = parse_alt();
+                    if (peek() != ')') {
+                        fail("missing )");
+                    }
+                    ++pos;
+                    if (lookahead) {
+                        // only lookaheads of a single codepoint
+                        if (node.type != unicode_regex_node::SET) {
+                            fail("unsupported lookahead");
+                        }
+                        node.type    = unicode_regex_node::LOOKAHEAD;
+                        node.negated = negated;
+                    }
+                    return node;
+                }
+            case '[':
+                return make_set(parse_class());
+            case '\\':
+                {
+                    unicode_regex_set set;
+                    uint32_t cpt;
+                    if (parse_escape(set, cpt, false)) {
+                        return make_set(std::move(set));
+                    }
+                    set.ranges.push_back({cpt, cpt});
+                    return make_set(std::move(set));
+                }
+            case '$':
+                {
+                    unicode_regex_node node;
+                    node.type = unicode_regex_node::END;
+                    return node;
+                }
+            case '^':
+            case '.':
+            case ')':
+            case ']':
+            case '}':
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                --pos;
+                fail("unsupported character");
+            default:
+                {
+                    unicode_regex_set set;
+                    set.ranges.push_back({c, c});
+                    return make_set(std::move(set));
+                }
+        }
+    }
+
+    // parses the escape after a backslash, either into a class of codepoints
+    // (returns true) or a single codepoint
+    bool parse_escape(unicode_regex_set & set, uint32_t & cpt, bool in_class) {
+        if (at_end()) {
+            fail("trailing backslash");
+        }
+        const uint32_t c = cpts[pos++];
+        switch (c) {
+            case 's':
+            case 'S':
+                set.whitespace = true;
+                break;
+            case 'd':
+            case 'D':
+                set.ranges.push_back({'0', '9'});
+                break;
+            case 'w':
+            case 'W':
+                set.ranges.push_back({'0', '9'});
+                set.ranges.push_back({'A', 'Z'});
+                set.ranges.push_back({'_', '_'});
+                set.ranges.push_back({'a', 'z'});
+                break;
+            case 'p':
+            case 'P':
+                {
+                    if (peek() != '{' || peek(2) != '}') {
+                        fail("invalid unicode category");
+                    }
+                    static const std::map<uint32_t, uint16_t> k_categories = {
+                        { 'N', codepoint_flags::NUMBER },
+                        { 'L', codepoint_flags::LETTER },
+                        { 'Z', codepoint_flags::SEPARATOR },
+                        { 'M', codepoint_flags::ACCENT_MARK },
+                        { 'P', codepoint_flags::PUNCTUATION },
+                        { 'S', codepoint_flags::SYMBOL },
+                        { 'C', codepoint_flags::CONTROL },
+                    };
+                    const auto it = k_categories.find(peek(1));
+                    if (it == k_categories.end()) {
+                        fail("unsupported unicode category");
+                    }
+                    pos += 3;
+                    set.categories |= it->second;
+                    break;
+                }
+            case 'r': cpt = '\r'; return false;
+            case 'n': cpt = '\n'; return false;
+            case 't': cpt = '\t'; return false;
+            case 'f': cpt = '\f'; return false;
+            case 'v': cpt = '\v'; return false;
+            case '0': cpt = 0;    return false;
+            default:
+                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+                    fail("unsupported escape");
+                }
+                cpt = c;
+                return false;
+        }
+
+        // \S, \D, \W and \P{..} are the complement of their lowercase form
+        if (c >= 'A' && c <= 'Z') {
+            if (in_class) {
+                fail("negated class escape inside a class");
+            }
+            set.negated = true;
+        }
+        return true;
+    }
+
+    unicode_regex_set parse_class() {
+        unicode_regex_set set;
+        if (peek() == '^') {
+            set.negated = true;
+            ++pos;
+        }
+        bool first = true;
+        while (true) {
+            if (at_end()) {
+                fail("missing ]");
+            }
+            uint32_t c = cpts[pos++];
+            if (c == ']' && !first) {
+                break;
+            }
+            first = false;
+            if (c == '[') {
+                fail("nested class");
+            }
+            if (c == '\\') {
+                unicode_regex_set sub;
+                if (parse_escape(sub, c, true)) {
+                    set.ranges.insert(set.ranges.end(), sub.ranges.begin(), sub.ranges.end());
+                    set.categories |= sub.categories;
+                    set.whitespace |= sub.whitespace;
+                    continue;
+                }
+            }
+            uint32_t last = c;
+            if (peek() == '-' && peek(1) != ']' && pos + 1 < cpts.size()) {
+                pos++;
+                last = cpts[pos++];
+                if (last == '\\') {
+                    unicode_regex_set sub;
+                    if (parse_escape(sub, last, true)) {
+                        fail("class escape in a range");
+                    }
+                }
+                if (last < c) {
+                    fail("invalid range");
+                }
+            }
+            set.ranges.push_back({c, last});
+        }
+        return set;
+    }
+};
+
+struct unicode_regex {
+    // class of each ASCII codepoint
+    uint16_t ascii[128];
+
+    // class of the non-ASCII codepoints in [bounds[i], bounds[i + 1]) by category, at
+    // i*UNICODE_REGEX_N_CATEGORIES + category
+    std::vector<uint32_t> bounds;
+    std::vector<uint16_t> classes;
+
+    int n_classes = 0;
+
+    // next[s*n_classes + c] is the state after reading a codepoint of class c in
+    // state s, shifted left by one, with the low bit set if there is a match
+    // before it. state 0 has no threads left.
+    std::vector<int32_t> next;
+
+    // whether there is a match at the end of the text in each state
+    std::vector<uint8_t> match_end;
+
+    uint16_t cpt_class(uint32_t cpt) const {
+        if (cpt < 128) {
+            return ascii[cpt];
+        }
+        const auto flags = unicode_cpt_flags(cpt);
+        if (flags.is_whitespace) {
+            return ascii['\v'];
+        }
+        const size_t i = std::upper_bound(bounds.begin(), bounds.end(), cpt) - bounds.begin() - 1;
+        return classes[i*UNICODE_REGEX_N_CATEGORIES + unicode_regex_category(flags.category_flag())];
+    }
+
+    // returns the length of the leftmost-first match at the start of cpts, 0 if none
+    size_t match(const uint32_t * cpts, size_t n) const {
+        size_t len = 0;
+        int32_t state = 1;
+        size_t i = 0;
+        for (; i < n; ++i) {
+            const int32_t t = next[state*n_classes + cpt_class(cpts[i])];
+            if (t & 1) {
+                len = i;
+            }
+            state = t >> 1;
+            if (state == 0) {
+                break;
+            }
+        }
+        if (i == n && match_end[state]) {
+            len = n;
+        }
+        return len;
+    }
+};
+
+static void unicode_regex_emit(const unicode_regex_node & node, std::vector<unicode_regex_inst> & prog) {
+    if (prog.size() > UNICODE_REGEX_MAX_INSTS) {
+        throw std::invalid_argument("regex too large");
+    }
+    switch (node.type) {
+        case unicode_regex_node::EMPTY:
+            break;
+        case unicode_regex_node::SET:
+            prog.push_back({unicode_regex_inst::SET, node.set, 0, 0});
+            break;
+        case unicode_regex_node::LOOKAHEAD:
+            prog.push_back({node.negated ? unicode_regex_inst::ASSERT_NOT : unicode_regex_inst::ASSERT, node.set, 0, 0});
+            break;
+        case unicode_regex_node::END:
+            prog.push_back({unicode_regex_inst::ASSERT_END, -1, 0, 0});
+            break;
+        case unicode_regex_node::CONCAT:
+            for (const auto & child : node.children) {
+                unicode_regex_emit(child, prog);
+            }
+            break;
+        case unicode_regex_node::ALT:
+            {
+                // each alternative but the last is tried before the ones after it
+                std::vector<size_t> jmps;
+                for (size_t i = 0; i < node.children.size(); ++i) {
+                    const bool last = i + 1 == node.children.size();
+                    const size_t split = prog.size();
+                    if (!last) {
+                        prog.push_back({unicode_regex_inst::SPLIT, -1, (int) split + 1, 0});
+                    }
+                    unicode_regex_emit(node.children[i], prog);
+                    if (!last) {
+                        jmps.push_back(prog.size());
+                        prog.push_back({unicode_regex_inst::JMP, -1, 0, 0});
+                        prog[split].y = prog.size();
+                    }
+                }
+                for (size_t jmp : jmps) {
+                    prog[jmp].x = prog.size();
+                }
+            }
+            break;
+        case unicode_regex_node::REPEAT:
+            {
+                const auto & body = node.children[0];
+                for (int i = 0; i < node.min; ++i) {
+                    unicode_regex_emit(body, prog);
+                }
+                if (node.max < 0) {
+                    // greedy loop
+                    const size_t split = prog.size();
+                    prog.push_back({unicode_regex_inst::SPLIT, -1, (int) split + 1, 0});
+                    unicode_regex_emit(body, prog);
+                    prog.push_back({unicode_regex_inst::JMP, -1, (int) split, 0});
+                    prog[split].y = prog.size();
+                } else {
+                    // nested optional copies: (x(x(x)?)?)?
+                    std::vector<size_t> splits;
+                    for (int i = node.min; i < node.max; ++i) {
+                        splits.push_back(prog.size());
+                        prog.push_back({unicode_regex_inst::SPLIT, -1, (int) prog.size() + 1, 0});
+                        unicode_regex_emit(body, prog);
+                    }
+                    for (size_t split : splits) {
+                        prog[split].y = prog.size();
+                    }
+                }
+            }
+            break;
+    }
+}
+
+// follows the transitions of prog that do not read a codepoint from the threads
+// at pcs, in order of priority, with the next codepoint of class c (-1 at the
+// end of the text). appends the SET instructions reached before the first
+// MATCH to out, returns whether a MATCH was reached.
+static bool unicode_regex_closure(
+        const std::vector<unicode_regex_inst> & prog,
+        const std::vector<uint64_t> & class_sets,
+        const std::vector<int> & pcs,
+        int c,
+        std::vector<int> & out) {
+    std::vector<uint8_t> visited(prog.size(), 0);
+    std::vector<int> stack;
+    bool matched = false;
+
+    for (int start : pcs) {
+        stack.push_back(start);
+        while (!stack.empty() && !matched) {
+            const int pc = stack.back();
+            stack.pop_back();
+            if (visited[pc]) {
+                continue;
+            }
+            visited[pc] = 1;
+
+            const auto & inst = prog[pc];
+            const bool in_set = inst.set >= 0 && c >= 0 && (class_sets[c] >> inst.set) & 1;
+            switch (inst.op) {
+                case unicode_regex_inst::MATCH:
+                    matched = true;
+                    break;
+                case unicode_regex_inst::SET:
+                    out.push_back(pc);
+                    break;
+                case unicode_regex_inst::SPLIT:
+                    stack.push_back(inst.y);
+                    stack.push_back(inst.x);
+                    break;
+                case unicode_regex_inst::JMP:
+                    stack.push_back(inst.x);
+                    break;
+                case unicode_regex_inst::ASSERT:
+                    if (in_set) {
+                        stack.push_back(pc + 1);
+                    }
+                    break;
+                case unicode_regex_inst::ASSERT_NOT:
+                    if (!in_set) {
+                        stack.push_back(pc + 1);
+                    }
+                    break;
+                case unicode_regex_inst::ASSERT_END:
+                    if (c < 0) {
+                        stack.push_back(pc + 1);
+                    }
+                    break;
+            }
+        }
+        stack.clear();
+        if (matched) {
+            break;
+        }
+    }
+
+    return matched;
+}
+
+static std::unique_ptr<unicode_regex> unicode_regex_compile(const std::string & regex_expr) {
+    unicode_regex_parser parser(regex_expr);
+    const auto root = parser.parse();
+
+    std::vector<unicode_regex_inst> prog;
+    unicode_regex_emit(root, prog);
+    prog.push_back({unicode_regex_inst::MATCH, -1, 0, 0});
+
+    const auto & sets = parser.sets;
+
+    auto re = std::make_unique<unicode_regex>();
+
+    // codepoints are in the same class if they belong to the same sets
+    std::map<uint64_t, int> class_ids;
+    std::vector<uint64_t> class_sets;
+    const auto class_of = [&](bool in_range[], uint16_t category_flag, bool is_space) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < sets.size(); ++i) {
+            if (sets[i].contains(in_range[i], category_flag, is_space)) {
+                bits |= uint64_t(1) << i;
+            }
+        }
+        const auto it = class_ids.emplace(bits, class_sets.size());
+        if (it.second) {
+            class_sets.push_back(bits);
+        }
+        return (uint16_t) it.first->second;
+    };
+
+    bool in_range[UNICODE_REGEX_MAX_SETS];
+    for (uint32_t cpt = 0; cpt < 128; ++cpt) {
+        for (size_t i = 0; i < sets.size(); ++i) {
+            in_range[i] = sets[i].in_ranges(cpt);
+        }
+        re->ascii[cpt] = class_of(in_range, unicode_cpt_flags(cpt).category_flag(), unicode_regex_is_space(cpt));
+    }
+
+    // the non-ASCII codepoints are split at the bounds of the ranges of all sets,
+    // the sets of a codepoint then only depend on its category
+    re->bounds.push_back(128);
+    for (const auto & set : sets) {
+        for (const auto & range : set.ranges) {
+            if (range.first > 128) {
+                re->bounds.push_back(range.first);
+            }
+            if (range.second + 1 > 128) {
+                re->bounds.push_back(range.second + 1);
+            }
+        }
+    }
+    std::sort(re->bounds.begin(), re->bounds.end());
+    re->bounds.erase(std::unique(re->bounds.begin(), re->bounds.end()), re->bounds.end());
+
+    for (const uint32_t bound : re->bounds) {
+        for (size_t i = 0; i < sets.size(); ++i) {
+            in_range[i] = sets[i].in_ranges(bound);
+        }
+        for (int category = 0; category < UNICODE_REGEX_N_CATEGORIES; ++category) {
+            re->classes.push_back(class_of(in_range, category < 8 ? 1 << category : 0, false));
+        }
+    }
+
+    re->n_classes = class_sets.size();
+
+    // subset construction, the states are ordered lists of threads
+    std::map<std::vector<int>, int> state_ids;
+    std::vector<std::vector<int>> states = { {}, { 0 } };
+    state_ids[states[0]] = 0;
+    state_ids[states[1]] = 1;
+
+    std::vector<int> reached;
+    for (size_t s = 0; s < states.size(); ++s) {
+        for (int c = 0; c < re->n_classes; ++c) {
+            reached.clear();
+            const bool matched = unicode_regex_closure(prog, class_sets, states[s], c, reached);
+
+            std::vector<int> pcs;
+            for (int pc : reached) {
+                if ((class_sets[c] >> prog[pc].set) & 1) {
+                    pcs.push_back(pc + 1);
+                }
+            }
+
+            const auto it = state_ids.emplace(pcs, states.size());
+            if (it.second) {
+                if (states.size() >= UNICODE_REGEX_MAX_STATES) {
+                    throw std::invalid_argument("regex DFA too large");
+                }
+                states.push_back(pcs);
+            }
+            re->next.push_back((it.first->second << 1) | (matched ? 1 : 0));
+        }
+
+        reached.clear();
+        re->match_end.push_back(unicode_regex_closure(prog, class_sets, states[s], -1, reached));
+    }
+
+    return re;
+}
+
+// returns the compiled form of regex_expr, or nullptr if it is not supported by
+// the engine
+static const unicode_regex * unicode_regex_get(const std::string & regex_expr) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const auto it = cache.find(regex_expr);
+    if (it != cache.end()) {
+        return it->second.get();
+    }
+
+    std::unique_ptr<unicode_regex> re;
+    try {
+        re = unicode_regex_compile(regex_expr);
+    } catch (const std::invalid_argument &) {
+        // fall back to std::regex
+    }
+
+    return cache.emplace(regex_expr, std::move(re)).first->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_dfa(const std::vector<uint32_t> & cpts, const unicode_regex & re, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        // text between matches is kept as a word
+        size_t prev = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t len = re.match(cpts.data() + pos, end - pos);
+            if (len == 0) {
+                ++pos;
+                continue;
+            }
+            if (pos > prev) {
+                bpe_offsets.emplace_back(pos - prev);
+            }
+            bpe_offsets.emplace_back(len);
+            pos += len;
+            prev = pos;
+        }
+
+        if (prev < end) {
+            bpe_offsets.emplace_back(end - prev);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
 //
 // interface
 //
@@ -709,7 +1459,7 @@ uint32_t unicode_tolower(uint32_t cp) {
     return cp;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_dfa) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", codepoint_flags::NUMBER },
@@ -729,24 +1479,17 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
     };
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
-    }
-
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
+    // only computed if needed by a regex that falls back to std::regex
     std::string text_collapsed;
-    if (need_collapse) {
+    const auto collapse = [&]() {
+        if (!text_collapsed.empty() || cpts.empty()) {
+            return;
+        }
+
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -769,7 +1512,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                 text_collapsed[i] = (char) 0xD0; // fallback
             }
         }
-    }
+    };
 
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
@@ -782,6 +1525,12 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
             continue;
         }
 
+        // then the compiled DFA, which supports all the patterns of the pre-tokenizers
+        if (const unicode_regex * re = use_dfa ? unicode_regex_get(regex_expr) : nullptr) {
+            bpe_offsets = unicode_regex_split_dfa(cpts, *re, bpe_offsets);
+            continue;
+        }
+
         // fallback to general-purpose std::regex / std::wregex
         try {
             // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
@@ -843,6 +1592,8 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
                     regex_expr_collapsed += regex_expr[i];
                 }
 
+                collapse();
+
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
                 bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
@@ -875,11 +1626,9 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
     size_t start = 0;
     for (size_t & offset : bpe_offsets) {
         bpe_words.emplace_back();
-        for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
-        }
+        unicode_byte_encoding_process(cpts.data() + start, offset, bpe_words.back());
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
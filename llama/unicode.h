@@ -90,4 +90,5 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8);
 
 uint32_t unicode_tolower(uint32_t cp);
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
+// use_dfa = false runs the patterns otherwise compiled to a DFA with std::regex, to compare the two
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_dfa = true);
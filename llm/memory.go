@@ -128,7 +128,7 @@ func EstimateGPULayers(gpus []discover.GpuInfo, ggml *GGML, projectors []string,
 		ggml.SupportsFlashAttention()
 
 	var kvct string
-	if fa {
+	if fa || gpus[0].Library == "cpu" {
 		requested := strings.ToLower(envconfig.KvCacheType())
 		if requested != "" && ggml.SupportsKVCacheType(requested) {
 			kvct = requested
@@ -339,6 +339,22 @@ func EstimateGPULayers(gpus []discover.GpuInfo, ggml *GGML, projectors []string,
 	return estimate
 }
 
+// pagedLayersSize returns the size of the repeating layers left on the CPU when numGPU layers are offloaded, which a
+// layer cache reads from the model file on demand
+func pagedLayersSize(ggml *GGML, numGPU int) uint64 {
+	blocks := int(ggml.KV().BlockCount())
+	layers := ggml.Tensors().Layers()
+
+	// llama.cpp offloads the last numGPU blocks, then the output layer
+	var size uint64
+	for i := range max(blocks-numGPU, 0) {
+		if blk, ok := layers[fmt.Sprintf("blk.%d", i)]; ok {
+			size += blk.size()
+		}
+	}
+	return size
+}
+
 func (m MemoryEstimate) log() {
 	overhead := envconfig.GpuOverhead()
 
@@ -64,6 +64,16 @@ func TestEstimateGPULayers(t *testing.T) {
 		assert.Equal(t, uint64(0), estimate.Graph)
 	})
 
+	t.Run("paged layers", func(t *testing.T) {
+		blkSize := ggml.Tensors().Layers()["blk.0"].size()
+		// the last blocks are offloaded first, then the output layer
+		assert.Equal(t, 5*blkSize, pagedLayersSize(ggml, 0))
+		assert.Equal(t, 4*blkSize, pagedLayersSize(ggml, 1))
+		assert.Equal(t, 1*blkSize, pagedLayersSize(ggml, 4))
+		assert.Equal(t, uint64(0), pagedLayersSize(ggml, 5))
+		assert.Equal(t, uint64(0), pagedLayersSize(ggml, 6))
+	})
+
 	// derived from the dummy ggml file above
 	graphPartialOffload := uint64(202377216)
 	graphFullOffload := uint64(171968512)
@@ -127,10 +127,23 @@ func NewLlamaServer(gpus discover.GpuInfoList, model string, ggml *GGML, adapter
 		}
 	}
 
+	// The layer cache pages the layers in from the mapped model file
+	layerCacheSize := envconfig.LayerCacheSize()
+	if layerCacheSize > 0 && (opts.UseMLock || len(adapters) > 0 || (opts.UseMMap != nil && !*opts.UseMMap)) {
+		slog.Warn("layer cache requires mmap without mlock or adapters, loading the whole model")
+		layerCacheSize = 0
+	}
+
 	// On linux and windows, over-allocating CPU memory will almost always result in an error
 	// Darwin has fully dynamic swap so has no direct concept of free swap space
 	if runtime.GOOS != "darwin" {
 		systemMemoryRequired := estimate.TotalSize - estimate.VRAMSize
+		if layerCacheSize > 0 {
+			// only the layer cache has to fit of the layers left on the CPU
+			if paged := pagedLayersSize(ggml, estimate.Layers); paged > layerCacheSize {
+				systemMemoryRequired -= min(paged-layerCacheSize, systemMemoryRequired)
+			}
+		}
 		available := systemFreeMemory + systemSwapFreeMemory
 		if systemMemoryRequired > available {
 			slog.Warn("model request too large for system", "requested", format.HumanBytes2(systemMemoryRequired), "available", available, "total", format.HumanBytes2(systemTotalMemory), "free", format.HumanBytes2(systemFreeMemory), "swap", format.HumanBytes2(systemSwapFreeMemory))
@@ -231,7 +244,12 @@ func NewLlamaServer(gpus discover.GpuInfoList, model string, ggml *GGML, adapter
 			slog.Warn("kv cache type not supported by model", "type", kvct)
 		}
 	} else if kvct != "" && kvct != "f16" {
-		slog.Warn("quantized kv cache requested but flash attention disabled", "type", kvct)
+		if gpus[0].Library == "cpu" && ggml.SupportsKVCacheType(kvct) {
+			// the CPU backend reads a quantized K/V cache without flash attention
+			params = append(params, "--kv-cache-type", kvct)
+		} else {
+			slog.Warn("quantized kv cache requested but flash attention disabled", "type", kvct)
+		}
 	}
 
 	// mmap has issues with partial offloading on metal
@@ -241,24 +259,44 @@ func NewLlamaServer(gpus discover.GpuInfoList, model string, ggml *GGML, adapter
 			uint64(opts.NumGPU) < ggml.KV().BlockCount()+1 {
 			opts.UseMMap = new(bool)
 			*opts.UseMMap = false
+			layerCacheSize = 0
 		}
 	}
 
 	// Windows CUDA should not use mmap for best performance
 	// Linux  with a model larger than free space, mmap leads to thrashing
 	// For CPU loads we want the memory to be allocated, not FS cache
-	if (runtime.GOOS == "windows" && gpus[0].Library == "cuda" && opts.UseMMap == nil) ||
-		(runtime.GOOS == "linux" && systemFreeMemory < estimate.TotalSize && opts.UseMMap == nil) ||
-		(gpus[0].Library == "cpu" && opts.UseMMap == nil) ||
+	// The layer cache needs mmap, and bounds what it keeps in memory itself
+	if (layerCacheSize == 0 && runtime.GOOS == "windows" && gpus[0].Library == "cuda" && opts.UseMMap == nil) ||
+		(layerCacheSize == 0 && runtime.GOOS == "linux" && systemFreeMemory < estimate.TotalSize && opts.UseMMap == nil) ||
+		(layerCacheSize == 0 && gpus[0].Library == "cpu" && opts.UseMMap == nil) ||
 		(opts.UseMMap != nil && !*opts.UseMMap) {
 		params = append(params, "--no-mmap")
 	}
 
+	if layerCacheSize > 0 {
+		params = append(params, "--layer-cache-size", strconv.FormatUint(layerCacheSize, 10))
+	}
+
+	if loadThreads := envconfig.LoadThreads(); loadThreads > 0 {
+		params = append(params, "--load-threads", strconv.FormatUint(uint64(loadThreads), 10))
+	}
+
+	if envconfig.DirectIO() {
+		params = append(params, "--direct-io")
+	}
+
 	if opts.UseMLock {
 		params = append(params, "--mlock")
 	}
 
-	// TODO - NUMA support currently doesn't work properly
+	if numa := envconfig.NumaStrategy(); numa != "" {
+		params = append(params, "--numa", numa)
+	}
+
+	if dir := envconfig.PrefixCache(); dir != "" {
+		params = append(params, "--prefix-cache-dir", dir, "--prefix-cache-size", strconv.FormatUint(envconfig.PrefixCacheSize(), 10))
+	}
 
 	params = append(params, "--parallel", strconv.Itoa(numParallel))
 
@@ -270,6 +308,10 @@ func NewLlamaServer(gpus discover.GpuInfoList, model string, ggml *GGML, adapter
 		params = append(params, "--multiuser-cache")
 	}
 
+	if bs := envconfig.KvCacheBlockSize(); bs > 0 {
+		params = append(params, "--kv-block-size", strconv.FormatUint(uint64(bs), 10))
+	}
+
 	for i := range servers {
 		builtin := servers[i] == runners.BuiltinName()
 		server := availableServers[servers[i]]
@@ -648,6 +690,8 @@ type completion struct {
 	Stop         bool   `json:"stop"`
 	StoppedLimit bool   `json:"stopped_limit"`
 
+	Logprobs []api.Logprob `json:"logprobs"`
+
 	Timings struct {
 		PredictedN  int     `json:"predicted_n"`
 		PredictedMS float64 `json:"predicted_ms"`
@@ -661,10 +705,14 @@ type CompletionRequest struct {
 	Format  json.RawMessage
 	Images  []ImageData
 	Options *api.Options
+
+	Logprobs    bool
+	TopLogprobs int
 }
 
 type CompletionResponse struct {
 	Content            string
+	Logprobs           []api.Logprob
 	DoneReason         string
 	Done               bool
 	PromptEvalCount    int
@@ -697,6 +745,8 @@ func (s *llmServer) Completion(ctx context.Context, req CompletionRequest, fn fu
 		"stop":              req.Options.Stop,
 		"image_data":        req.Images,
 		"cache_prompt":      true,
+		"logprobs":          req.Logprobs,
+		"top_logprobs":      req.TopLogprobs,
 	}
 
 	if len(req.Format) > 0 {
@@ -818,9 +868,10 @@ func (s *llmServer) Completion(ctx context.Context, req CompletionRequest, fn fu
 				return ctx.Err()
 			}
 
-			if c.Content != "" {
+			if c.Content != "" || len(c.Logprobs) > 0 {
 				fn(CompletionResponse{
-					Content: c.Content,
+					Content:  c.Content,
+					Logprobs: c.Logprobs,
 				})
 			}
 
@@ -38,21 +38,46 @@ type Message struct {
 }
 
 type Choice struct {
-	Index        int     `json:"index"`
-	Message      Message `json:"message"`
-	FinishReason *string `json:"finish_reason"`
+	Index        int           `json:"index"`
+	Message      Message       `json:"message"`
+	Logprobs     *ChatLogprobs `json:"logprobs,omitempty"`
+	FinishReason *string       `json:"finish_reason"`
 }
 
 type ChunkChoice struct {
-	Index        int     `json:"index"`
-	Delta        Message `json:"delta"`
-	FinishReason *string `json:"finish_reason"`
+	Index        int           `json:"index"`
+	Delta        Message       `json:"delta"`
+	Logprobs     *ChatLogprobs `json:"logprobs,omitempty"`
+	FinishReason *string       `json:"finish_reason"`
 }
 
 type CompleteChunkChoice struct {
-	Text         string  `json:"text"`
-	Index        int     `json:"index"`
-	FinishReason *string `json:"finish_reason"`
+	Text         string              `json:"text"`
+	Index        int                 `json:"index"`
+	Logprobs     *CompletionLogprobs `json:"logprobs,omitempty"`
+	FinishReason *string             `json:"finish_reason"`
+}
+
+type ChatLogprobs struct {
+	Content []ChatLogprob `json:"content"`
+}
+
+type ChatLogprob struct {
+	ChatTopLogprob
+	TopLogprobs []ChatTopLogprob `json:"top_logprobs"`
+}
+
+type ChatTopLogprob struct {
+	Token   string  `json:"token"`
+	Logprob float64 `json:"logprob"`
+	Bytes   []int   `json:"bytes"`
+}
+
+type CompletionLogprobs struct {
+	Tokens        []string             `json:"tokens"`
+	TokenLogprobs []float64            `json:"token_logprobs"`
+	TopLogprobs   []map[string]float64 `json:"top_logprobs"`
+	TextOffset    []int                `json:"text_offset"`
 }
 
 type Usage struct {
@@ -93,6 +118,8 @@ type ChatCompletionRequest struct {
 	TopP             *float64        `json:"top_p"`
 	ResponseFormat   *ResponseFormat `json:"response_format"`
 	Tools            []api.Tool      `json:"tools"`
+	Logprobs         bool            `json:"logprobs"`
+	TopLogprobs      int             `json:"top_logprobs"`
 }
 
 type ChatCompletion struct {
@@ -129,6 +156,7 @@ type CompletionRequest struct {
 	Temperature      *float32       `json:"temperature"`
 	TopP             float32        `json:"top_p"`
 	Suffix           string         `json:"suffix"`
+	Logprobs         *int           `json:"logprobs"`
 }
 
 type Completion struct {
@@ -241,6 +269,66 @@ func toToolCalls(tc []api.ToolCall) []ToolCall {
 	return toolCalls
 }
 
+func toChatLogprobs(logprobs []api.Logprob) *ChatLogprobs {
+	if len(logprobs) == 0 {
+		return nil
+	}
+
+	bytes := func(lp api.TokenLogprob) []int {
+		if lp.Bytes != nil {
+			return lp.Bytes
+		}
+
+		b := make([]int, len(lp.Token))
+		for i := range len(lp.Token) {
+			b[i] = int(lp.Token[i])
+		}
+		return b
+	}
+
+	content := make([]ChatLogprob, len(logprobs))
+	for i, lp := range logprobs {
+		content[i].ChatTopLogprob = ChatTopLogprob{Token: lp.Token, Logprob: lp.Logprob, Bytes: bytes(lp.TokenLogprob)}
+		content[i].TopLogprobs = make([]ChatTopLogprob, len(lp.TopLogprobs))
+		for j, top := range lp.TopLogprobs {
+			content[i].TopLogprobs[j] = ChatTopLogprob{Token: top.Token, Logprob: top.Logprob, Bytes: bytes(top)}
+		}
+	}
+
+	return &ChatLogprobs{Content: content}
+}
+
+// toCompletionLogprobs converts logprobs to the legacy completions format, where
+// offset is the length of the text returned before them
+func toCompletionLogprobs(logprobs []api.Logprob, offset int) *CompletionLogprobs {
+	if len(logprobs) == 0 {
+		return nil
+	}
+
+	c := CompletionLogprobs{
+		Tokens:        make([]string, len(logprobs)),
+		TokenLogprobs: make([]float64, len(logprobs)),
+		TopLogprobs:   make([]map[string]float64, len(logprobs)),
+		TextOffset:    make([]int, len(logprobs)),
+	}
+	for i, lp := range logprobs {
+		c.Tokens[i] = lp.Token
+		c.TokenLogprobs[i] = lp.Logprob
+		c.TopLogprobs[i] = make(map[string]float64, len(lp.TopLogprobs))
+		for _, top := range lp.TopLogprobs {
+			c.TopLogprobs[i][top.Token] = top.Logprob
+		}
+		c.TextOffset[i] = offset
+		if lp.Bytes != nil {
+			offset += len(lp.Bytes)
+		} else {
+			offset += len(lp.Token)
+		}
+	}
+
+	return &c
+}
+
 func toChatCompletion(id string, r api.ChatResponse) ChatCompletion {
 	toolCalls := toToolCalls(r.Message.ToolCalls)
 	return ChatCompletion{
@@ -250,8 +338,9 @@ func toChatCompletion(id string, r api.ChatResponse) ChatCompletion {
 		Model:             r.Model,
 		SystemFingerprint: "fp_ollama",
 		Choices: []Choice{{
-			Index:   0,
-			Message: Message{Role: r.Message.Role, Content: r.Message.Content, ToolCalls: toolCalls},
+			Index:    0,
+			Message:  Message{Role: r.Message.Role, Content: r.Message.Content, ToolCalls: toolCalls},
+			Logprobs: toChatLogprobs(r.Logprobs),
 			FinishReason: func(reason string) *string {
 				if len(toolCalls) > 0 {
 					reason = "tool_calls"
@@ -275,8 +364,9 @@ func toChunk(id string, r api.ChatResponse) ChatCompletionChunk {
 		Model:             r.Model,
 		SystemFingerprint: "fp_ollama",
 		Choices: []ChunkChoice{{
-			Index: 0,
-			Delta: Message{Role: "assistant", Content: r.Message.Content, ToolCalls: toolCalls},
+			Index:    0,
+			Delta:    Message{Role: "assistant", Content: r.Message.Content, ToolCalls: toolCalls},
+			Logprobs: toChatLogprobs(r.Logprobs),
 			FinishReason: func(reason string) *string {
 				if len(reason) > 0 {
 					return &reason
@@ -303,8 +393,9 @@ func toCompletion(id string, r api.GenerateResponse) Completion {
 		Model:             r.Model,
 		SystemFingerprint: "fp_ollama",
 		Choices: []CompleteChunkChoice{{
-			Text:  r.Response,
-			Index: 0,
+			Text:     r.Response,
+			Index:    0,
+			Logprobs: toCompletionLogprobs(r.Logprobs, 0),
 			FinishReason: func(reason string) *string {
 				if len(reason) > 0 {
 					return &reason
@@ -316,7 +407,7 @@ func toCompletion(id string, r api.GenerateResponse) Completion {
 	}
 }
 
-func toCompleteChunk(id string, r api.GenerateResponse) CompletionChunk {
+func toCompleteChunk(id string, r api.GenerateResponse, offset int) CompletionChunk {
 	return CompletionChunk{
 		Id:                id,
 		Object:            "text_completion",
@@ -324,8 +415,9 @@ func toCompleteChunk(id string, r api.GenerateResponse) CompletionChunk {
 		Model:             r.Model,
 		SystemFingerprint: "fp_ollama",
 		Choices: []CompleteChunkChoice{{
-			Text:  r.Response,
-			Index: 0,
+			Text:     r.Response,
+			Index:    0,
+			Logprobs: toCompletionLogprobs(r.Logprobs, offset),
 			FinishReason: func(reason string) *string {
 				if len(reason) > 0 {
 					return &reason
@@ -517,12 +609,14 @@ func fromChatRequest(r ChatCompletionRequest) (*api.ChatRequest, error) {
 	}
 
 	return &api.ChatRequest{
-		Model:    r.Model,
-		Messages: messages,
-		Format:   format,
-		Options:  options,
-		Stream:   &r.Stream,
-		Tools:    r.Tools,
+		Model:       r.Model,
+		Messages:    messages,
+		Format:      format,
+		Options:     options,
+		Stream:      &r.Stream,
+		Tools:       r.Tools,
+		Logprobs:    r.Logprobs,
+		TopLogprobs: r.TopLogprobs,
 	}, nil
 }
 
@@ -568,13 +662,21 @@ func fromCompleteRequest(r CompletionRequest) (api.GenerateRequest, error) {
 		options["top_p"] = 1.0
 	}
 
-	return api.GenerateRequest{
+	req := api.GenerateRequest{
 		Model:   r.Model,
 		Prompt:  r.Prompt,
 		Options: options,
 		Stream:  &r.Stream,
 		Suffix:  r.Suffix,
-	}, nil
+	}
+
+	// logprobs is the number of most likely tokens returned at each position
+	if r.Logprobs != nil {
+		req.Logprobs = true
+		req.TopLogprobs = *r.Logprobs
+	}
+
+	return req, nil
 }
 
 type BaseWriter struct {
@@ -593,6 +695,9 @@ type CompleteWriter struct {
 	streamOptions *StreamOptions
 	id            string
 	BaseWriter
+
+	// length of the text streamed so far
+	offset int
 }
 
 type ListWriter struct {
@@ -697,7 +802,8 @@ func (w *CompleteWriter) writeResponse(data []byte) (int, error) {
 
 	// completion chunk
 	if w.stream {
-		c := toCompleteChunk(w.id, generateResponse)
+		c := toCompleteChunk(w.id, generateResponse, w.offset)
+		w.offset += len(generateResponse.Response)
 		if w.streamOptions != nil && w.streamOptions.IncludeUsage {
 			c.Usage = &Usage{}
 		}
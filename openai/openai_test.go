@@ -74,6 +74,33 @@ func TestChatMiddleware(t *testing.T) {
 				Stream: &False,
 			},
 		},
+		{
+			name: "chat handler with logprobs",
+			body: `{
+				"model": "test-model",
+				"messages": [
+					{"role": "user", "content": "Hello"}
+				],
+				"logprobs": true,
+				"top_logprobs": 2
+			}`,
+			req: api.ChatRequest{
+				Model: "test-model",
+				Messages: []api.Message{
+					{
+						Role:    "user",
+						Content: "Hello",
+					},
+				},
+				Options: map[string]any{
+					"temperature": 1.0,
+					"top_p":       1.0,
+				},
+				Stream:      &False,
+				Logprobs:    true,
+				TopLogprobs: 2,
+			},
+		},
 		{
 			name: "chat handler with options",
 			body: `{
@@ -451,6 +478,27 @@ func TestCompletionsMiddleware(t *testing.T) {
 				Stream: &True,
 			},
 		},
+		{
+			name: "completions handler with logprobs",
+			body: `{
+				"model": "test-model",
+				"prompt": "Hello",
+				"logprobs": 3
+			}`,
+			req: api.GenerateRequest{
+				Model:  "test-model",
+				Prompt: "Hello",
+				Options: map[string]any{
+					"frequency_penalty": 0.0,
+					"presence_penalty":  0.0,
+					"temperature":       1.0,
+					"top_p":             1.0,
+				},
+				Stream:      &False,
+				Logprobs:    true,
+				TopLogprobs: 3,
+			},
+		},
 		{
 			name: "completions handler error forwarding",
 			body: `{
@@ -727,3 +775,38 @@ func TestRetrieveMiddleware(t *testing.T) {
 		}
 	}
 }
+
+func TestLogprobsBytes(t *testing.T) {
+	// "é" split across two tokens, neither of which is valid UTF-8 on its own
+	logprobs := []api.Logprob{
+		{
+			TokenLogprob: api.TokenLogprob{Token: "�", Logprob: -0.5, Bytes: []int{0xc3}},
+			TopLogprobs:  []api.TokenLogprob{{Token: "�", Logprob: -0.5, Bytes: []int{0xc3}}},
+		},
+		{
+			TokenLogprob: api.TokenLogprob{Token: "�", Logprob: -0.25, Bytes: []int{0xa9}},
+		},
+		{
+			TokenLogprob: api.TokenLogprob{Token: "!", Logprob: -0.125},
+		},
+	}
+
+	chat := toChatLogprobs(logprobs)
+	var b []int
+	for _, lp := range chat.Content {
+		b = append(b, lp.Bytes...)
+	}
+
+	if diff := cmp.Diff(b, []int{0xc3, 0xa9, '!'}); diff != "" {
+		t.Errorf("bytes mismatch (-got +want):\n%s", diff)
+	}
+
+	if diff := cmp.Diff(chat.Content[0].TopLogprobs[0].Bytes, []int{0xc3}); diff != "" {
+		t.Errorf("top bytes mismatch (-got +want):\n%s", diff)
+	}
+
+	completion := toCompletionLogprobs(logprobs, 1)
+	if diff := cmp.Diff(completion.TextOffset, []int{1, 2, 3}); diff != "" {
+		t.Errorf("text offset mismatch (-got +want):\n%s", diff)
+	}
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+
+# Measure CPU generation speed of a model under each NUMA configuration.
+#
+# Usage: ./scripts/bench_numa.sh <model> [runs]
+#
+# Starts ./ollama serve once per configuration, runs the same prompt with all
+# layers on the CPU and prints the prompt and generation rates in tokens/s.
+# Requires numactl for the single socket configuration.
+
+set -e
+
+if [ $# -lt 1 ] ; then
+    echo "Usage: ./scripts/bench_numa.sh <model> [runs]"
+    exit 1
+fi
+
+MODEL=$1
+RUNS=${2:-3}
+PORT=${PORT:-11499}
+OLLAMA=${OLLAMA:-./ollama}
+PROMPT=${PROMPT:-"Write a detailed essay about the history of the printing press."}
+NUM_PREDICT=${NUM_PREDICT:-256}
+
+export OLLAMA_HOST=127.0.0.1:$PORT
+
+# name, NUMA strategy, command prefix
+CONFIGS="
+default||
+single-socket|numactl|numactl --cpunodebind=0 --membind=0
+distribute|distribute|
+isolate|isolate|
+interleave|interleave|
+"
+
+rate() {
+    # tokens/s from a count and a duration in nanoseconds
+    awk -v n="$1" -v d="$2" 'BEGIN { if (d > 0) printf "%.2f", n / (d / 1e9); else printf "-" }'
+}
+
+field() {
+    sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p"
+}
+
+printf "%-14s %4s %14s %14s\n" "config" "run" "prompt tok/s" "eval tok/s"
+
+echo "$CONFIGS" | while IFS='|' read -r NAME NUMA PREFIX ; do
+    [ -z "$NAME" ] && continue
+
+    if [ -n "$PREFIX" ] && ! command -v "${PREFIX%% *}" >/dev/null 2>&1 ; then
+        printf "%-14s skipped, %s not found\n" "$NAME" "${PREFIX%% *}"
+        continue
+    fi
+
+    OLLAMA_NUMA=$NUMA $PREFIX $OLLAMA serve >"/tmp/bench_numa_$NAME.log" 2>&1 &
+    SERVER=$!
+    trap 'kill $SERVER 2>/dev/null' EXIT
+
+    until curl -sf "http://$OLLAMA_HOST/api/version" >/dev/null ; do
+        sleep 1
+    done
+
+    # load the model before measuring
+    curl -sf "http://$OLLAMA_HOST/api/generate" \
+        -d "{\"model\":\"$MODEL\",\"prompt\":\"hi\",\"stream\":false,\"options\":{\"num_gpu\":0,\"num_predict\":1}}" >/dev/null
+
+    i=1
+    while [ $i -le "$RUNS" ] ; do
+        RESP=$(curl -sf "http://$OLLAMA_HOST/api/generate" \
+            -d "{\"model\":\"$MODEL\",\"prompt\":\"$PROMPT $i\",\"stream\":false,\"options\":{\"num_gpu\":0,\"num_predict\":$NUM_PREDICT,\"temperature\":0}}")
+        printf "%-14s %4d %14s %14s\n" "$NAME" "$i" \
+            "$(rate "$(echo "$RESP" | field prompt_eval_count)" "$(echo "$RESP" | field prompt_eval_duration)")" \
+            "$(rate "$(echo "$RESP" | field eval_count)" "$(echo "$RESP" | field eval_duration)")"
+        i=$((i + 1))
+    done
+
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+    trap - EXIT
+done
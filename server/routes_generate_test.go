@@ -46,6 +46,60 @@ func (mockRunner) Tokenize(_ context.Context, s string) (tokens []int, err error
 	return
 }
 
+// logprobsCompletion returns two chunks with log-probabilities, the first
+// ending partway through a character
+func logprobsCompletion(_ context.Context, _ llm.CompletionRequest, fn func(llm.CompletionResponse)) error {
+	fn(llm.CompletionResponse{
+		Content: "H",
+		Logprobs: []api.Logprob{
+			{
+				TokenLogprob: api.TokenLogprob{Token: "H", Logprob: -0.25, Bytes: []int{'H'}},
+				TopLogprobs: []api.TokenLogprob{
+					{Token: "H", Logprob: -0.25, Bytes: []int{'H'}},
+					{Token: "\uFFFD", Logprob: -1.5, Bytes: []int{0xc3}},
+				},
+			},
+			{
+				TokenLogprob: api.TokenLogprob{Token: "\uFFFD", Logprob: -0.5, Bytes: []int{0xc3}},
+			},
+		},
+	})
+	fn(llm.CompletionResponse{
+		Content:    "é",
+		Done:       true,
+		DoneReason: "stop",
+		Logprobs: []api.Logprob{
+			{
+				TokenLogprob: api.TokenLogprob{Token: "\uFFFD", Logprob: -0.75, Bytes: []int{0xa9}},
+			},
+		},
+	})
+	return nil
+}
+
+func checkLogprobsResponse(t *testing.T, logprobs []api.Logprob) {
+	t.Helper()
+
+	var tokens []string
+	var b []int
+	for _, lp := range logprobs {
+		tokens = append(tokens, lp.Token)
+		b = append(b, lp.Bytes...)
+	}
+
+	if diff := cmp.Diff(tokens, []string{"H", "\uFFFD", "\uFFFD"}); diff != "" {
+		t.Errorf("tokens mismatch (-got +want):\n%s", diff)
+	}
+
+	if diff := cmp.Diff(b, []int{'H', 0xc3, 0xa9}); diff != "" {
+		t.Errorf("bytes mismatch (-got +want):\n%s", diff)
+	}
+
+	if len(logprobs) > 0 && len(logprobs[0].TopLogprobs) != 2 {
+		t.Errorf("expected 2 top logprobs, got %d", len(logprobs[0].TopLogprobs))
+	}
+}
+
 func newMockServer(mock *mockRunner) func(discover.GpuInfoList, string, *llm.GGML, []string, []string, api.Options, int) (llm.LlamaServer, error) {
 	return func(gpus discover.GpuInfoList, model string, ggml *llm.GGML, projectors, system []string, opts api.Options, numParallel int) (llm.LlamaServer, error) {
 		return mock, nil
@@ -583,6 +637,58 @@ func TestGenerateChat(t *testing.T) {
 			t.Errorf("final tool call mismatch (-got +want):\n%s", diff)
 		}
 	})
+	t.Run("messages with logprobs", func(t *testing.T) {
+		mock.CompletionFn = logprobsCompletion
+		defer func() { mock.CompletionFn = nil }()
+
+		w := createRequest(t, s.ChatHandler, api.ChatRequest{
+			Model: "test",
+			Messages: []api.Message{
+				{Role: "user", Content: "Hello!"},
+			},
+			Logprobs:    true,
+			TopLogprobs: 2,
+			Stream:      &stream,
+		})
+
+		if w.Code != http.StatusOK {
+			t.Fatalf("expected status 200, got %d", w.Code)
+		}
+
+		if !mock.CompletionRequest.Logprobs || mock.CompletionRequest.TopLogprobs != 2 {
+			t.Errorf("expected logprobs with 2 top logprobs, got %v and %d", mock.CompletionRequest.Logprobs, mock.CompletionRequest.TopLogprobs)
+		}
+
+		var resp api.ChatResponse
+		if err := json.NewDecoder(w.Body).Decode(&resp); err != nil {
+			t.Fatal(err)
+		}
+
+		if resp.Message.Content != "Hé" {
+			t.Errorf("expected content %q, got %q", "Hé", resp.Message.Content)
+		}
+
+		checkLogprobsResponse(t, resp.Logprobs)
+	})
+
+	t.Run("messages with top logprobs only", func(t *testing.T) {
+		w := createRequest(t, s.ChatHandler, api.ChatRequest{
+			Model: "test",
+			Messages: []api.Message{
+				{Role: "user", Content: "Hello!"},
+			},
+			TopLogprobs: 2,
+			Stream:      &stream,
+		})
+
+		if w.Code != http.StatusBadRequest {
+			t.Errorf("expected status 400, got %d", w.Code)
+		}
+
+		if diff := cmp.Diff(w.Body.String(), `{"error":"top_logprobs requires logprobs"}`); diff != "" {
+			t.Errorf("mismatch (-got +want):\n%s", diff)
+		}
+	})
 }
 
 func TestGenerate(t *testing.T) {
@@ -951,4 +1057,53 @@ TEMPLATE """{{- if .Suffix }}<PRE> {{ .Prompt }} <SUF>{{ .Suffix }} <MID>
 			t.Errorf("mismatch (-got +want):\n%s", diff)
 		}
 	})
+	t.Run("prompt with logprobs", func(t *testing.T) {
+		mock.CompletionFn = logprobsCompletion
+		defer func() { mock.CompletionFn = nil }()
+
+		w := createRequest(t, s.GenerateHandler, api.GenerateRequest{
+			Model:       "test",
+			Prompt:      "Hello!",
+			Logprobs:    true,
+			TopLogprobs: 2,
+			Stream:      &stream,
+		})
+
+		if w.Code != http.StatusOK {
+			t.Fatalf("expected status 200, got %d", w.Code)
+		}
+
+		if !mock.CompletionRequest.Logprobs || mock.CompletionRequest.TopLogprobs != 2 {
+			t.Errorf("expected logprobs with 2 top logprobs, got %v and %d", mock.CompletionRequest.Logprobs, mock.CompletionRequest.TopLogprobs)
+		}
+
+		var resp api.GenerateResponse
+		if err := json.NewDecoder(w.Body).Decode(&resp); err != nil {
+			t.Fatal(err)
+		}
+
+		if resp.Response != "Hé" {
+			t.Errorf("expected response %q, got %q", "Hé", resp.Response)
+		}
+
+		checkLogprobsResponse(t, resp.Logprobs)
+	})
+
+	t.Run("prompt with too many top logprobs", func(t *testing.T) {
+		w := createRequest(t, s.GenerateHandler, api.GenerateRequest{
+			Model:       "test",
+			Prompt:      "Hello!",
+			Logprobs:    true,
+			TopLogprobs: 21,
+			Stream:      &stream,
+		})
+
+		if w.Code != http.StatusBadRequest {
+			t.Errorf("expected status 400, got %d", w.Code)
+		}
+
+		if diff := cmp.Diff(w.Body.String(), `{"error":"top_logprobs must be between 0 and 20"}`); diff != "" {
+			t.Errorf("mismatch (-got +want):\n%s", diff)
+		}
+	})
 }
@@ -58,6 +58,10 @@ var defaultModelsPerGPU = 3
 // we'll back off down to 1 to try to get it to fit
 var defaultParallel = 4
 
+// Maximum number of parallel requests per model, as llama.cpp tracks at most
+// this many sequences in its K/V cache
+var maxParallel = 64
+
 var ErrMaxQueue = errors.New("server busy, please try again.  maximum pending requests exceeded")
 
 func InitScheduler(ctx context.Context) *Scheduler {
@@ -130,6 +134,10 @@ func (s *Scheduler) processPending(ctx context.Context) {
 				continue
 			}
 			numParallel := int(envconfig.NumParallel())
+			if numParallel > maxParallel {
+				slog.Warn("OLLAMA_NUM_PARALLEL exceeds the maximum, limiting it", "requested", numParallel, "max", maxParallel)
+				numParallel = maxParallel
+			}
 			// TODO (jmorganca): mllama doesn't support parallel yet
 			// see https://github.com/ollama/ollama/issues/4165
 			if checkMllamaModelFamily(pending.model) && numParallel != 1 {
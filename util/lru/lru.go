@@ -0,0 +1,83 @@
+// Package lru provides a small cache that keeps the most recently used values.
+package lru
+
+import "sync"
+
+// Cache holds up to size values, dropping the least recently used one when a
+// new value does not fit. It is safe for concurrent use.
+//
+// Eviction scans all entries, which suits the few dozen values it is meant for.
+type Cache[K comparable, V any] struct {
+	size int
+
+	mu      sync.Mutex
+	entries map[K]*entry[V]
+	clock   uint64
+}
+
+type entry[V any] struct {
+	value    V
+	lastUsed uint64
+}
+
+func New[K comparable, V any](size int) *Cache[K, V] {
+	return &Cache[K, V]{
+		size:    max(size, 1),
+		entries: make(map[K]*entry[V]),
+	}
+}
+
+// Get returns the value cached for key, if any, and marks it as used
+func (c *Cache[K, V]) Get(key K) (V, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	e, ok := c.entries[key]
+	if !ok {
+		var zero V
+		return zero, false
+	}
+
+	c.clock++
+	e.lastUsed = c.clock
+
+	return e.value, true
+}
+
+// Add caches value for key and returns it. If a value is already cached for
+// key, for example because another caller computed it in the meantime, that
+// value is kept and returned instead.
+func (c *Cache[K, V]) Add(key K, value V) V {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	c.clock++
+
+	if e, ok := c.entries[key]; ok {
+		e.lastUsed = c.clock
+		return e.value
+	}
+
+	if len(c.entries) >= c.size {
+		var oldestKey K
+		var oldest *entry[V]
+		for k, e := range c.entries {
+			if oldest == nil || e.lastUsed < oldest.lastUsed {
+				oldestKey, oldest = k, e
+			}
+		}
+		delete(c.entries, oldestKey)
+	}
+
+	c.entries[key] = &entry[V]{value: value, lastUsed: c.clock}
+
+	return value
+}
+
+// Len returns the number of cached values
+func (c *Cache[K, V]) Len() int {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+
+	return len(c.entries)
+}
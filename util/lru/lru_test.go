@@ -0,0 +1,40 @@
+package lru
+
+import "testing"
+
+func TestCache(t *testing.T) {
+	c := New[string, int](2)
+
+	if _, ok := c.Get("a"); ok {
+		t.Errorf("Get: found a in an empty cache")
+	}
+
+	if v := c.Add("a", 1); v != 1 {
+		t.Errorf("Add: have %v; want 1", v)
+	}
+	c.Add("b", 2)
+
+	// the value cached first is kept
+	if v := c.Add("a", 3); v != 1 {
+		t.Errorf("Add: have %v; want 1", v)
+	}
+
+	// using b makes a the least recently used value
+	if v, ok := c.Get("b"); !ok || v != 2 {
+		t.Errorf("Get: have (%v, %v); want (2, true)", v, ok)
+	}
+	c.Add("c", 4)
+
+	if c.Len() != 2 {
+		t.Errorf("Len: have %v; want 2", c.Len())
+	}
+	if _, ok := c.Get("a"); ok {
+		t.Errorf("Get: a not evicted")
+	}
+	if v, ok := c.Get("b"); !ok || v != 2 {
+		t.Errorf("Get: have (%v, %v); want (2, true)", v, ok)
+	}
+	if v, ok := c.Get("c"); !ok || v != 4 {
+		t.Errorf("Get: have (%v, %v); want (4, true)", v, ok)
+	}
+}